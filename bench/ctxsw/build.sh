@@ -0,0 +1,35 @@
+#!/bin/bash
+#
+# Build the context switch benchmarks against linux-stable and copy them
+# to the directory run.sh shares with the guest (mounted on /mnt).
+# Run from the top of the tree after build_linux.sh.
+
+LROOT=$PWD
+BENCH=$LROOT/bench/ctxsw
+
+if [ $# -lt 1 ]; then
+	echo "Usage: $0 [arch]"
+	exit 1
+fi
+
+case $1 in
+	arm32)
+		export ARCH=arm
+		export CROSS_COMPILE=arm-linux-gnueabi-
+		SHARE=$LROOT/share
+		;;
+	arm64)
+		export ARCH=arm64
+		export CROSS_COMPILE=aarch64-linux-gnu-
+		SHARE=$LROOT/kmodules
+		;;
+	*)
+		echo "Usage: $0 [arch]"
+		exit 1
+		;;
+esac
+
+make -C $BENCH KDIR=$LROOT/linux-stable || exit 1
+mkdir -p $SHARE
+cp $BENCH/ctxsw_kmod.ko $BENCH/ctxsw_bench $BENCH/ctxsw_run.sh $SHARE
+echo "in the guest: sh /mnt/ctxsw_run.sh"
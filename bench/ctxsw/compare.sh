@@ -0,0 +1,53 @@
+#!/bin/bash
+#
+# Compare a guest run against the stored baseline, or store it.
+#
+#   compare.sh arm32|arm64 [--save]
+#
+# Reads share/ctxsw-arm32.txt or kmodules/ctxsw-arm64.txt (see run.sh),
+# baselines live in bench/ctxsw/baseline/<arch>.txt.  A test more than
+# THRESHOLD percent (default 10) slower than its baseline fails.
+
+LROOT=$PWD
+BASELINE_DIR=$LROOT/bench/ctxsw/baseline
+THRESHOLD=${THRESHOLD:-10}
+
+case $1 in
+	arm32)	RESULT=$LROOT/share/ctxsw-arm32.txt ;;
+	arm64)	RESULT=$LROOT/kmodules/ctxsw-arm64.txt ;;
+	*)
+		echo "Usage: $0 [arch] [--save]"
+		exit 1
+		;;
+esac
+BASELINE=$BASELINE_DIR/$1.txt
+
+if [ ! -f $RESULT ]; then
+	echo "no results in $RESULT, run ctxsw_run.sh in the guest first"
+	exit 1
+fi
+
+if [ "$2" == "--save" ]; then
+	mkdir -p $BASELINE_DIR
+	cp $RESULT $BASELINE
+	echo "saved $BASELINE"
+	exit 0
+fi
+
+if [ ! -f $BASELINE ]; then
+	echo "no baseline for $1, store one with: $0 $1 --save"
+	exit 1
+fi
+
+awk -v t=$THRESHOLD '
+	NR == FNR { base[$1] = $2; next }
+	$1 == "asid-rollovers" { print; next }
+	($1 in base) && base[$1] > 0 {
+		d = ($2 - base[$1]) * 100 / base[$1]
+		st = d > t ? "REGRESSED" : "ok"
+		if (d > t)
+			bad++
+		printf "%-16s %10.1f %10.1f %+7.1f%% %s\n", $1, base[$1], $2, d, st
+	}
+	END { exit bad ? 1 : 0 }
+' $BASELINE $RESULT
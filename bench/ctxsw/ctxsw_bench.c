@@ -0,0 +1,315 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ctxsw_bench - user space context switch microbenchmarks
+ *
+ *   pipe-thread   one byte ping-pong between two threads over two pipes
+ *   pipe-process  the same between two processes, adds the mm switch
+ *   futex-wake    futex ping-pong between two threads, wake to run cost
+ *   mm-ring       a token passed around a ring of processes; with more
+ *                 processes than hardware ASIDs every lap forces ASID
+ *                 rollovers (ARMv7 has 256 ASIDs, ARMv8 usually 65536)
+ *
+ * Both sides are bound to one CPU by default so the numbers are the cost
+ * of a switch rather than of a cross-CPU wakeup; -c -1 leaves them free.
+ *
+ * Usage: ctxsw_bench [-n loops] [-r ring] [-c cpu] [test...]
+ * Prints one "<test> <ns per switch>" line per test.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static long loops = 100000;
+static int ring = 300;
+static int cpu;
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void bind_cpu(void)
+{
+	cpu_set_t set;
+
+	if (cpu < 0)
+		return;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set))
+		die("sched_setaffinity");
+}
+
+static void xread(int fd)
+{
+	char c;
+
+	if (read(fd, &c, 1) != 1)
+		die("read");
+}
+
+static void xwrite(int fd)
+{
+	char c = 0;
+
+	if (write(fd, &c, 1) != 1)
+		die("write");
+}
+
+/* pipe ping-pong, shared by the thread and process variants */
+static int ping[2], pong[2];
+
+static void *pipe_echo(void *arg)
+{
+	long i;
+
+	bind_cpu();
+	for (i = 0; i < loops; i++) {
+		xread(ping[0]);
+		xwrite(pong[1]);
+	}
+	return NULL;
+}
+
+static uint64_t pipe_pingpong(void)
+{
+	uint64_t start = now_ns();
+	long i;
+
+	for (i = 0; i < loops; i++) {
+		xwrite(ping[1]);
+		xread(pong[0]);
+	}
+	return now_ns() - start;
+}
+
+static double bench_pipe_thread(void)
+{
+	pthread_t t;
+	uint64_t ns;
+
+	if (pipe(ping) || pipe(pong))
+		die("pipe");
+	if (pthread_create(&t, NULL, pipe_echo, NULL))
+		die("pthread_create");
+	ns = pipe_pingpong();
+	pthread_join(t, NULL);
+	close(ping[0]); close(ping[1]);
+	close(pong[0]); close(pong[1]);
+	return (double)ns / (loops * 2);
+}
+
+static double bench_pipe_process(void)
+{
+	uint64_t ns;
+	pid_t pid;
+
+	if (pipe(ping) || pipe(pong))
+		die("pipe");
+	pid = fork();
+	if (pid < 0)
+		die("fork");
+	if (!pid) {
+		pipe_echo(NULL);
+		_exit(0);
+	}
+	ns = pipe_pingpong();
+	waitpid(pid, NULL, 0);
+	close(ping[0]); close(ping[1]);
+	close(pong[0]); close(pong[1]);
+	return (double)ns / (loops * 2);
+}
+
+/* futex ping-pong: each side waits for its word to become 1 */
+static int fwords[2];
+
+static void futex_wait(int *uaddr)
+{
+	while (!__atomic_load_n(uaddr, __ATOMIC_ACQUIRE))
+		if (syscall(SYS_futex, uaddr, FUTEX_WAIT_PRIVATE, 0,
+			    NULL, NULL, 0) && errno != EAGAIN &&
+		    errno != EINTR)
+			die("futex wait");
+	__atomic_store_n(uaddr, 0, __ATOMIC_RELAXED);
+}
+
+static void futex_wake(int *uaddr)
+{
+	__atomic_store_n(uaddr, 1, __ATOMIC_RELEASE);
+	if (syscall(SYS_futex, uaddr, FUTEX_WAKE_PRIVATE, 1,
+		    NULL, NULL, 0) < 0)
+		die("futex wake");
+}
+
+static void *futex_echo(void *arg)
+{
+	long i;
+
+	bind_cpu();
+	for (i = 0; i < loops; i++) {
+		futex_wait(&fwords[0]);
+		futex_wake(&fwords[1]);
+	}
+	return NULL;
+}
+
+static double bench_futex_wake(void)
+{
+	uint64_t start;
+	pthread_t t;
+	long i;
+
+	fwords[0] = fwords[1] = 0;
+	if (pthread_create(&t, NULL, futex_echo, NULL))
+		die("pthread_create");
+	start = now_ns();
+	for (i = 0; i < loops; i++) {
+		futex_wake(&fwords[0]);
+		futex_wait(&fwords[1]);
+	}
+	start = now_ns() - start;
+	pthread_join(t, NULL);
+	return (double)start / (loops * 2);
+}
+
+/* token ring: process i reads pipes[i] and writes pipes[i + 1] */
+static double bench_mm_ring(void)
+{
+	int (*pipes)[2];
+	long laps = loops / ring ? loops / ring : 1;
+	uint64_t start;
+	pid_t *pids;
+	long lap;
+	int i;
+
+	pipes = calloc(ring, sizeof(*pipes));
+	pids = calloc(ring, sizeof(*pids));
+	if (!pipes || !pids)
+		die("calloc");
+	for (i = 0; i < ring; i++)
+		if (pipe(pipes[i]))
+			die("pipe");
+
+	for (i = 1; i < ring; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0)
+			die("fork");
+		if (!pids[i]) {
+			int in = pipes[i][0], out = pipes[(i + 1) % ring][1];
+
+			for (lap = 0; lap < laps; lap++) {
+				xread(in);
+				xwrite(out);
+			}
+			_exit(0);
+		}
+	}
+
+	start = now_ns();
+	for (lap = 0; lap < laps; lap++) {
+		xwrite(pipes[1 % ring][1]);
+		xread(pipes[0][0]);
+	}
+	start = now_ns() - start;
+
+	for (i = 1; i < ring; i++)
+		waitpid(pids[i], NULL, 0);
+	for (i = 0; i < ring; i++) {
+		close(pipes[i][0]);
+		close(pipes[i][1]);
+	}
+	free(pipes);
+	free(pids);
+	return (double)start / (laps * ring);
+}
+
+static const struct bench {
+	const char *name;
+	double (*fn)(void);
+} benches[] = {
+	{ "pipe-thread",	bench_pipe_thread },
+	{ "pipe-process",	bench_pipe_process },
+	{ "futex-wake",		bench_futex_wake },
+	{ "mm-ring",		bench_mm_ring },
+};
+
+#define NR_BENCHES	(sizeof(benches) / sizeof(benches[0]))
+
+static void usage(const char *prog)
+{
+	unsigned int i;
+
+	fprintf(stderr, "Usage: %s [-n loops] [-r ring] [-c cpu] [test...]\n"
+		"tests:", prog);
+	for (i = 0; i < NR_BENCHES; i++)
+		fprintf(stderr, " %s", benches[i].name);
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+static void run(const struct bench *b)
+{
+	printf("%-14s %10.1f\n", b->name, b->fn());
+	fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int i;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:r:c:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			loops = strtol(optarg, NULL, 0);
+			break;
+		case 'r':
+			ring = atoi(optarg);
+			break;
+		case 'c':
+			cpu = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (loops <= 0 || ring < 2)
+		usage(argv[0]);
+
+	bind_cpu();
+
+	if (optind == argc) {
+		for (i = 0; i < NR_BENCHES; i++)
+			run(&benches[i]);
+		return 0;
+	}
+
+	for (; optind < argc; optind++) {
+		for (i = 0; i < NR_BENCHES; i++)
+			if (!strcmp(argv[optind], benches[i].name))
+				break;
+		if (i == NR_BENCHES)
+			usage(argv[0]);
+		run(&benches[i]);
+	}
+	return 0;
+}
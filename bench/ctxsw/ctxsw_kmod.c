@@ -0,0 +1,120 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ctxsw_kmod - in-kernel context switch microbenchmark
+ *
+ * Two kernel threads hand a completion back and forth.  Kernel threads
+ * borrow the previous mm, so a hop is __switch_to() and the scheduler
+ * without any mm or ASID work: compare with the user space pipe-thread
+ * and pipe-process numbers to see what the mm switch adds.
+ *
+ *   kthread-local   both threads on cpu_a, pure switch cost
+ *   kthread-remote  threads on cpu_a and cpu_b, wakeup latency
+ *
+ * Results are printed as "ctxsw: <test> <ns per switch>".
+ */
+#include <linux/module.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/ktime.h>
+#include <linux/cpumask.h>
+
+static int loops = 100000;
+module_param(loops, int, 0444);
+static int cpu_a;
+module_param(cpu_a, int, 0444);
+static int cpu_b = 1;
+module_param(cpu_b, int, 0444);
+
+struct ctxsw_pingpong {
+	struct completion ping;
+	struct completion pong;
+	struct completion done;
+	u64 ns;
+};
+
+static int ctxsw_echo_fn(void *data)
+{
+	struct ctxsw_pingpong *pp = data;
+	int i;
+
+	for (i = 0; i < loops; i++) {
+		wait_for_completion(&pp->ping);
+		complete(&pp->pong);
+	}
+	complete(&pp->done);
+	return 0;
+}
+
+static int ctxsw_drive_fn(void *data)
+{
+	struct ctxsw_pingpong *pp = data;
+	u64 start = ktime_get_ns();
+	int i;
+
+	for (i = 0; i < loops; i++) {
+		complete(&pp->ping);
+		wait_for_completion(&pp->pong);
+	}
+	pp->ns = ktime_get_ns() - start;
+	complete(&pp->done);
+	return 0;
+}
+
+static int ctxsw_run(const char *name, int a, int b)
+{
+	struct ctxsw_pingpong pp;
+	struct task_struct *drive, *echo;
+
+	if (!cpu_online(a) || !cpu_online(b)) {
+		pr_info("ctxsw: %-14s skipped, cpu %d or %d offline\n",
+			name, a, b);
+		return 0;
+	}
+
+	init_completion(&pp.ping);
+	init_completion(&pp.pong);
+	init_completion(&pp.done);
+
+	drive = kthread_create(ctxsw_drive_fn, &pp, "ctxsw_drive");
+	if (IS_ERR(drive))
+		return PTR_ERR(drive);
+	echo = kthread_create(ctxsw_echo_fn, &pp, "ctxsw_echo");
+	if (IS_ERR(echo)) {
+		/* never woken, so ctxsw_drive_fn() does not run */
+		kthread_stop(drive);
+		return PTR_ERR(echo);
+	}
+
+	kthread_bind(echo, b);
+	kthread_bind(drive, a);
+	wake_up_process(echo);
+	wake_up_process(drive);
+	/* both threads use @pp until they complete done */
+	wait_for_completion(&pp.done);
+	wait_for_completion(&pp.done);
+
+	pr_info("ctxsw: %-14s %10llu\n", name, div_u64(pp.ns, loops * 2));
+	return 0;
+}
+
+static int __init ctxsw_init(void)
+{
+	int ret;
+
+	if (loops <= 0)
+		return -EINVAL;
+
+	ret = ctxsw_run("kthread-local", cpu_a, cpu_a);
+	if (!ret)
+		ret = ctxsw_run("kthread-remote", cpu_a, cpu_b);
+	return ret;
+}
+
+static void __exit ctxsw_exit(void)
+{
+}
+
+module_init(ctxsw_init);
+module_exit(ctxsw_exit);
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("In-kernel context switch microbenchmark");
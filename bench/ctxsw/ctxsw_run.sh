@@ -0,0 +1,35 @@
+#!/bin/sh
+#
+# Runs inside the guest started by run.sh, from the 9p share on /mnt.
+# Results go to /mnt/ctxsw-<arch>.txt, compare them on the host with
+# bench/ctxsw/compare.sh.
+
+case $(uname -m) in
+	aarch64)	ARCH=arm64 ;;
+	arm*)		ARCH=arm32 ;;
+	*)		ARCH=$(uname -m) ;;
+esac
+OUT=/mnt/ctxsw-$ARCH.txt
+ASID_STATS=/sys/kernel/debug/asid_stats
+
+rollovers()
+{
+	[ -r $ASID_STATS ] && sed -n 's/^rollovers \([0-9]*\).*/\1/p' $ASID_STATS
+}
+
+mount -t debugfs none /sys/kernel/debug 2>/dev/null
+: > $OUT
+
+insmod /mnt/ctxsw_kmod.ko && rmmod ctxsw_kmod
+dmesg | sed -n 's/.*ctxsw: //p' | tail -n 2 >> $OUT
+
+/mnt/ctxsw_bench pipe-thread pipe-process futex-wake >> $OUT
+
+# a ring of two mms never rolls over, 300 do on 8 bit ASIDs
+before=$(rollovers)
+/mnt/ctxsw_bench -r 2 mm-ring | sed 's/^mm-ring /mm-ring-2  /' >> $OUT
+/mnt/ctxsw_bench -r 300 mm-ring | sed 's/^mm-ring /mm-ring-300/' >> $OUT
+after=$(rollovers)
+[ -n "$before" ] && echo "asid-rollovers $((after - before))" >> $OUT
+
+cat $OUT
@@ -0,0 +1,180 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * gup_bench - pin/unpin microbenchmark, needs gup_kmod.ko loaded
+ *
+ *   fast-read    get_user_pages_fast(), read pins
+ *   fast-write   get_user_pages_fast(), write pins
+ *   slow-read    get_user_pages() under mmap_sem, read pins
+ *   slow-write   get_user_pages() under mmap_sem, write pins
+ *
+ * The buffer (1 GB by default) is populated up front and kept out of THP
+ * unless -H is given, so the pte level is what gets walked.  -m runs a
+ * thread that keeps mapping and unmapping a small region next to it, to
+ * show what mmap_sem contention does to the slow path and that the fast
+ * path does not care.
+ *
+ * Usage: gup_bench [-s MB] [-b batch] [-n loops] [-H] [-m] [test...]
+ * Prints one "<test> <ns per page pinned> <ns per page unpinned>" line
+ * per test, the best of the loops.
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "gup_bench.h"
+
+#define GUP_BENCH_FILE	"/sys/kernel/debug/gup_bench"
+
+static unsigned long size_mb = 1024;
+static unsigned int batch = 512;
+static int loops = 3;
+static int thp;
+static int churn;
+
+static volatile int churn_stop;
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static void *churn_fn(void *arg)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	void *p;
+
+	while (!churn_stop) {
+		p = mmap(NULL, 16 * page, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+			die("mmap");
+		*(volatile char *)p = 1;
+		munmap(p, 16 * page);
+	}
+	return NULL;
+}
+
+static const struct bench {
+	const char *name;
+	unsigned int flags;
+} benches[] = {
+	{ "fast-read",	0 },
+	{ "fast-write",	GUP_BENCH_WRITE },
+	{ "slow-read",	GUP_BENCH_SLOW },
+	{ "slow-write",	GUP_BENCH_SLOW | GUP_BENCH_WRITE },
+};
+
+#define NR_BENCHES	(sizeof(benches) / sizeof(benches[0]))
+
+static void usage(const char *prog)
+{
+	unsigned int i;
+
+	fprintf(stderr, "Usage: %s [-s MB] [-b batch] [-n loops] [-H] [-m] "
+		"[test...]\ntests:", prog);
+	for (i = 0; i < NR_BENCHES; i++)
+		fprintf(stderr, " %s", benches[i].name);
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+static void run(int fd, char *buf, const struct bench *b)
+{
+	struct gup_bench_args args;
+	double get = 0, put = 0;
+	int i;
+
+	for (i = 0; i < loops; i++) {
+		memset(&args, 0, sizeof(args));
+		args.addr = (uintptr_t)buf;
+		args.size = (uint64_t)size_mb << 20;
+		args.batch = batch;
+		args.flags = b->flags;
+		if (ioctl(fd, GUP_BENCH_RUN, &args))
+			die(b->name);
+
+		if (!i || (double)args.get_ns / args.pinned < get) {
+			get = (double)args.get_ns / args.pinned;
+			put = (double)args.put_ns / args.pinned;
+		}
+	}
+	printf("%-14s %10.1f %10.1f\n", b->name, get, put);
+	fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t churn_thread;
+	unsigned int i;
+	size_t size;
+	char *buf;
+	int opt, fd;
+
+	while ((opt = getopt(argc, argv, "s:b:n:Hmh")) != -1) {
+		switch (opt) {
+		case 's':
+			size_mb = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			batch = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			loops = atoi(optarg);
+			break;
+		case 'H':
+			thp = 1;
+			break;
+		case 'm':
+			churn = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (!size_mb || !batch || loops <= 0)
+		usage(argv[0]);
+
+	fd = open(GUP_BENCH_FILE, O_RDWR);
+	if (fd < 0)
+		die(GUP_BENCH_FILE);
+
+	size = size_mb << 20;
+	buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf == MAP_FAILED)
+		die("mmap");
+	madvise(buf, size, thp ? MADV_HUGEPAGE : MADV_NOHUGEPAGE);
+	/* populate, write pins must not take COW faults either */
+	memset(buf, 1, size);
+
+	if (churn && pthread_create(&churn_thread, NULL, churn_fn, NULL))
+		die("pthread_create");
+
+	if (optind == argc) {
+		for (i = 0; i < NR_BENCHES; i++)
+			run(fd, buf, &benches[i]);
+	} else {
+		for (; optind < argc; optind++) {
+			for (i = 0; i < NR_BENCHES; i++)
+				if (!strcmp(argv[optind], benches[i].name))
+					break;
+			if (i == NR_BENCHES)
+				usage(argv[0]);
+			run(fd, buf, &benches[i]);
+		}
+	}
+
+	if (churn) {
+		churn_stop = 1;
+		pthread_join(churn_thread, NULL);
+	}
+	return 0;
+}
@@ -0,0 +1,28 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Interface between gup_kmod.ko and gup_bench, through the debugfs
+ * file /sys/kernel/debug/gup_bench.
+ */
+#ifndef _GUP_BENCH_H
+#define _GUP_BENCH_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define GUP_BENCH_SLOW		0x1	/* get_user_pages() under mmap_sem */
+#define GUP_BENCH_WRITE		0x2	/* pin for write */
+
+struct gup_bench_args {
+	__u64 addr;		/* buffer, page aligned */
+	__u64 size;		/* bytes */
+	__u32 batch;		/* pages per call */
+	__u32 flags;		/* GUP_BENCH_* */
+	/* out */
+	__u64 get_ns;		/* total time in the pin calls */
+	__u64 put_ns;		/* total time in put_page() */
+	__u64 pinned;		/* pages pinned */
+};
+
+#define GUP_BENCH_RUN		_IOWR('g', 1, struct gup_bench_args)
+
+#endif /* _GUP_BENCH_H */
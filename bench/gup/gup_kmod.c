@@ -0,0 +1,138 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * gup_kmod - pin/unpin microbenchmark, driven by gup_bench
+ *
+ * The ioctl pins the caller's buffer @batch pages at a time, either with
+ * get_user_pages_fast() or with get_user_pages() under mmap_sem, and
+ * releases every batch with put_page() before pinning the next one.  The
+ * time spent pinning and the time spent unpinning are returned
+ * separately, so the lockless walk can be compared with the vma walk.
+ */
+#include <linux/module.h>
+#include <linux/debugfs.h>
+#include <linux/fs.h>
+#include <linux/ktime.h>
+#include <linux/mm.h>
+#include <linux/sched/mm.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/version.h>
+
+#include "gup_bench.h"
+
+#define GUP_BENCH_MAX_BATCH	4096
+
+static struct dentry *gup_bench_dentry;
+
+static long gup_bench_pin(unsigned long addr, int nr, unsigned int flags,
+			  struct page **pages)
+{
+	unsigned int gup_flags = (flags & GUP_BENCH_WRITE) ? FOLL_WRITE : 0;
+	struct mm_struct *mm = current->mm;
+	long ret;
+
+	if (!(flags & GUP_BENCH_SLOW))
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 2, 0)
+		return get_user_pages_fast(addr, nr, gup_flags, pages);
+#else
+		return get_user_pages_fast(addr, nr, gup_flags & FOLL_WRITE,
+					   pages);
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+	mmap_read_lock(mm);
+	ret = get_user_pages(addr, nr, gup_flags, pages, NULL);
+	mmap_read_unlock(mm);
+#else
+	down_read(&mm->mmap_sem);
+	ret = get_user_pages(addr, nr, gup_flags, pages, NULL);
+	up_read(&mm->mmap_sem);
+#endif
+	return ret;
+}
+
+static int gup_bench_run(struct gup_bench_args *args)
+{
+	unsigned long addr = args->addr, end = args->addr + args->size;
+	struct page **pages;
+	u64 t0, t1, t2;
+	long nr, i;
+
+	if (!args->batch || args->batch > GUP_BENCH_MAX_BATCH ||
+	    offset_in_page(addr) || !args->size || end < addr)
+		return -EINVAL;
+
+	pages = kvmalloc_array(args->batch, sizeof(*pages), GFP_KERNEL);
+	if (!pages)
+		return -ENOMEM;
+
+	args->get_ns = args->put_ns = args->pinned = 0;
+	while (addr < end) {
+		nr = min_t(unsigned long, args->batch,
+			   (end - addr) >> PAGE_SHIFT);
+		if (!nr)
+			break;
+
+		t0 = ktime_get_ns();
+		nr = gup_bench_pin(addr, nr, args->flags, pages);
+		t1 = ktime_get_ns();
+		if (nr <= 0)
+			break;
+		for (i = 0; i < nr; i++)
+			put_page(pages[i]);
+		t2 = ktime_get_ns();
+
+		args->get_ns += t1 - t0;
+		args->put_ns += t2 - t1;
+		args->pinned += nr;
+		addr += nr << PAGE_SHIFT;
+		cond_resched();
+	}
+
+	kvfree(pages);
+	return addr < end ? -EFAULT : 0;
+}
+
+static long gup_bench_ioctl(struct file *file, unsigned int cmd,
+			    unsigned long arg)
+{
+	struct gup_bench_args args;
+	int ret;
+
+	if (cmd != GUP_BENCH_RUN)
+		return -EINVAL;
+	if (copy_from_user(&args, (void __user *)arg, sizeof(args)))
+		return -EFAULT;
+
+	ret = gup_bench_run(&args);
+	if (ret)
+		return ret;
+
+	if (copy_to_user((void __user *)arg, &args, sizeof(args)))
+		return -EFAULT;
+	return 0;
+}
+
+static const struct file_operations gup_bench_fops = {
+	.owner		= THIS_MODULE,
+	.open		= nonseekable_open,
+	.unlocked_ioctl	= gup_bench_ioctl,
+	.compat_ioctl	= gup_bench_ioctl,
+};
+
+static int __init gup_bench_init(void)
+{
+	gup_bench_dentry = debugfs_create_file("gup_bench", 0600, NULL, NULL,
+					       &gup_bench_fops);
+	return IS_ERR_OR_NULL(gup_bench_dentry) ? -ENODEV : 0;
+}
+
+static void __exit gup_bench_exit(void)
+{
+	debugfs_remove(gup_bench_dentry);
+}
+
+module_init(gup_bench_init);
+module_exit(gup_bench_exit);
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("get_user_pages pin/unpin microbenchmark");
@@ -0,0 +1,30 @@
+#!/bin/sh
+#
+# Runs inside the guest started by run.sh, from the 9p share on /mnt.
+# Results go to /mnt/gup-<arch>.txt.
+#
+# The buffer is 1 GB, which is all of the guest's memory as run.sh starts
+# it; with less available it shrinks to three quarters of MemAvailable.
+
+case $(uname -m) in
+	aarch64)	ARCH=arm64 ;;
+	arm*)		ARCH=arm32 ;;
+	*)		ARCH=$(uname -m) ;;
+esac
+OUT=/mnt/gup-$ARCH.txt
+
+avail=$(sed -n 's/^MemAvailable: *\([0-9]*\) kB/\1/p' /proc/meminfo)
+MB=1024
+[ -n "$avail" ] && [ $((avail * 3 / 4 / 1024)) -lt $MB ] && \
+	MB=$((avail * 3 / 4 / 1024))
+
+mount -t debugfs none /sys/kernel/debug 2>/dev/null
+: > $OUT
+
+insmod /mnt/gup_kmod.ko || exit 1
+echo "buffer ${MB}M" >> $OUT
+/mnt/gup_bench -s $MB >> $OUT
+/mnt/gup_bench -s $MB -m | sed 's/^\([a-z]*-[a-z]*\) /\1-mmap/' >> $OUT
+rmmod gup_kmod
+
+cat $OUT
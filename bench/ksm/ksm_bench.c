@@ -0,0 +1,207 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * ksm_bench - KSM scan throughput, in pages scanned per ksmd CPU-second
+ *
+ * Maps S MB of MADV_MERGEABLE memory: every other page is unique, the
+ * rest are copies of a few patterns, so a pass checksums every page, walks
+ * the unstable tree for the unique ones and merges the copies into the
+ * stable tree.  Then lets ksmd run without sleeping for a number of full
+ * scans and reads
+ *   - scanner_pages_scanned, summed over the ksmd threads
+ *   - utime + stime of every ksmd thread, from /proc/<pid>/stat
+ * before and after.
+ *
+ * Needs root, it sets up /sys/kernel/mm/ksm itself and stops ksmd again
+ * when done.  -c picks the checksum (xxhash, crc32c, jhash2).
+ *
+ * Usage: ksm_bench [-s MB] [-p passes] [-c checksum]
+ * Prints "<checksum> <pages/cpu-s> <pages/s> <pages merged>".
+ */
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define KSM_SYSFS	"/sys/kernel/mm/ksm/"
+#define NR_PATTERNS	16
+
+static unsigned long size_mb = 128;
+static int passes = 3;
+static const char *checksum = "xxhash";
+
+static long page_size;
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void ksm_write(const char *name, const char *val)
+{
+	char path[128];
+	FILE *f;
+
+	snprintf(path, sizeof(path), KSM_SYSFS "%s", name);
+	f = fopen(path, "w");
+	if (!f || fputs(val, f) == EOF || fclose(f) == EOF)
+		die(path);
+}
+
+/* sum of the space separated values, one per ksmd thread */
+static unsigned long ksm_read(const char *name)
+{
+	unsigned long val, sum = 0;
+	char path[128];
+	FILE *f;
+
+	snprintf(path, sizeof(path), KSM_SYSFS "%s", name);
+	f = fopen(path, "r");
+	if (!f)
+		die(path);
+	while (fscanf(f, "%lu", &val) == 1)
+		sum += val;
+	fclose(f);
+	return sum;
+}
+
+/* utime + stime of all ksmd threads, in clock ticks */
+static unsigned long ksmd_ticks(void)
+{
+	unsigned long utime, stime, sum = 0;
+	char path[300], buf[512], *p;
+	struct dirent *de;
+	DIR *proc;
+	FILE *f;
+
+	proc = opendir("/proc");
+	if (!proc)
+		die("/proc");
+	while ((de = readdir(proc))) {
+		if (de->d_name[0] < '0' || de->d_name[0] > '9')
+			continue;
+		snprintf(path, sizeof(path), "/proc/%s/stat", de->d_name);
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+		if (!fgets(buf, sizeof(buf), f)) {
+			fclose(f);
+			continue;
+		}
+		fclose(f);
+		/* "ksmd" or "ksmd/<nid>" */
+		if (strncmp(strchr(buf, '(') + 1, "ksmd", 4))
+			continue;
+		/* fields 14 and 15, counted after the ") " closing comm */
+		p = strrchr(buf, ')') + 2;
+		if (sscanf(p, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+			   &utime, &stime) == 2)
+			sum += utime + stime;
+	}
+	closedir(proc);
+	return sum;
+}
+
+static void fill(char *buf, unsigned long nr_pages)
+{
+	unsigned long i;
+	uint64_t *p;
+
+	srandom(1);
+	for (i = 0; i < nr_pages; i++) {
+		p = (uint64_t *)(buf + i * page_size);
+		if (i & 1) {
+			memset(p, (i / 2) % NR_PATTERNS + 1, page_size);
+		} else {
+			unsigned long j;
+
+			for (j = 0; j < page_size / sizeof(*p); j++)
+				p[j] = ((uint64_t)random() << 32) | random();
+		}
+	}
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-s MB] [-p passes] [-c checksum]\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long nr_pages, scans, scanned, ticks, merged;
+	uint64_t t0, ns;
+	char *buf;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:p:c:h")) != -1) {
+		switch (opt) {
+		case 's':
+			size_mb = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			passes = atoi(optarg);
+			break;
+		case 'c':
+			checksum = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (!size_mb || passes <= 0)
+		usage(argv[0]);
+
+	page_size = sysconf(_SC_PAGESIZE);
+	nr_pages = (size_mb << 20) / page_size;
+	buf = mmap(NULL, size_mb << 20, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf == MAP_FAILED)
+		die("mmap");
+	madvise(buf, size_mb << 20, MADV_NOHUGEPAGE);
+	fill(buf, nr_pages);
+	if (madvise(buf, size_mb << 20, MADV_MERGEABLE))
+		die("madvise(MADV_MERGEABLE)");
+
+	/* start from empty trees */
+	ksm_write("run", "2");
+	ksm_write("checksum", checksum);
+	ksm_write("sleep_millisecs", "0");
+	ksm_write("pages_to_scan", "1000");
+
+	scans = ksm_read("full_scans");
+	scanned = ksm_read("scanner_pages_scanned");
+	ticks = ksmd_ticks();
+	t0 = now_ns();
+	ksm_write("run", "1");
+
+	while (ksm_read("full_scans") < scans + passes)
+		usleep(10000);
+
+	ns = now_ns() - t0;
+	ksm_write("run", "0");
+	scanned = ksm_read("scanner_pages_scanned") - scanned;
+	ticks = ksmd_ticks() - ticks;
+	merged = ksm_read("pages_sharing");
+
+	if (!ticks)
+		ticks = 1;
+	printf("%-8s %12.0f %12.0f %10lu\n", checksum,
+	       scanned * (double)sysconf(_SC_CLK_TCK) / ticks,
+	       scanned * 1e9 / ns, merged);
+	return 0;
+}
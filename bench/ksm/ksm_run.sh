@@ -0,0 +1,23 @@
+#!/bin/sh
+#
+# Runs inside the guest started by run.sh, from the 9p share on /mnt.
+# Results go to /mnt/ksm-<arch>.txt.
+#
+# One run per checksum; compare the pages per CPU-second between them
+# and against a kernel without the per-node ksmd threads.
+
+case $(uname -m) in
+	aarch64)	ARCH=arm64 ;;
+	arm*)		ARCH=arm32 ;;
+	*)		ARCH=$(uname -m) ;;
+esac
+OUT=/mnt/ksm-$ARCH.txt
+
+echo "ksmd threads on nodes: $(cat /sys/kernel/mm/ksm/scanner_nodes)" > $OUT
+echo "checksum pages/cpu-s      pages/s     merged" >> $OUT
+
+for alg in xxhash crc32c jhash2; do
+	/mnt/ksm_bench -c $alg >> $OUT
+done
+
+cat $OUT
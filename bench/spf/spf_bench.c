@@ -0,0 +1,162 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * spf_bench - page fault scalability with a concurrent mmap/munmap loop
+ *
+ * N threads each own a region of anonymous memory.  They touch every page
+ * of it, timing the faults, then drop the pages with MADV_DONTNEED and
+ * start over.  With -m another thread keeps mapping, touching and
+ * unmapping a small region, which takes mmap_sem for write on every
+ * iteration: without speculative faults the faulting threads queue up
+ * behind it.
+ *
+ * The regions are touched once before timing starts, so their vmas have
+ * an anon_vma and later faults can be handled speculatively.
+ *
+ * Usage: spf_bench [-s MB per thread] [-t threads] [-n loops] [-m]
+ * Prints "fault-<N>t[-mmap] <ns per fault> <mmap/munmap loops done>",
+ * the ns are the mean over all threads of their best loop.
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+static unsigned long size_mb = 64;
+static int nr_threads = 1;
+static int loops = 5;
+static int churn;
+
+static long page_size;
+static pthread_barrier_t barrier;
+static volatile int churn_stop;
+static unsigned long churn_loops;
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *churn_fn(void *arg)
+{
+	void *p;
+
+	while (!churn_stop) {
+		p = mmap(NULL, 16 * page_size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+			die("mmap");
+		*(volatile char *)p = 1;
+		munmap(p, 16 * page_size);
+		churn_loops++;
+	}
+	return NULL;
+}
+
+static void *fault_fn(void *arg)
+{
+	double *result = arg;
+	size_t size = size_mb << 20;
+	uint64_t t0, ns, best = 0;
+	char *buf, *p;
+	int i;
+
+	buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf == MAP_FAILED)
+		die("mmap");
+	madvise(buf, size, MADV_NOHUGEPAGE);
+	/* gives the vma its anon_vma */
+	memset(buf, 1, size);
+	madvise(buf, size, MADV_DONTNEED);
+
+	pthread_barrier_wait(&barrier);
+	for (i = 0; i < loops; i++) {
+		t0 = now_ns();
+		for (p = buf; p < buf + size; p += page_size)
+			*(volatile char *)p = 1;
+		ns = now_ns() - t0;
+		if (!best || ns < best)
+			best = ns;
+		madvise(buf, size, MADV_DONTNEED);
+	}
+
+	*result = (double)best / (size / page_size);
+	munmap(buf, size);
+	return NULL;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-s MB] [-t threads] [-n loops] [-m]\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t churn_thread, *threads;
+	double *results, sum = 0;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "s:t:n:mh")) != -1) {
+		switch (opt) {
+		case 's':
+			size_mb = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
+		case 'n':
+			loops = atoi(optarg);
+			break;
+		case 'm':
+			churn = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (!size_mb || nr_threads <= 0 || loops <= 0)
+		usage(argv[0]);
+
+	page_size = sysconf(_SC_PAGESIZE);
+	threads = calloc(nr_threads, sizeof(*threads));
+	results = calloc(nr_threads, sizeof(*results));
+	if (!threads || !results)
+		die("calloc");
+
+	pthread_barrier_init(&barrier, NULL, nr_threads + 1);
+	for (i = 0; i < nr_threads; i++)
+		if (pthread_create(&threads[i], NULL, fault_fn, &results[i]))
+			die("pthread_create");
+	if (churn && pthread_create(&churn_thread, NULL, churn_fn, NULL))
+		die("pthread_create");
+
+	pthread_barrier_wait(&barrier);
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(threads[i], NULL);
+		sum += results[i];
+	}
+	if (churn) {
+		churn_stop = 1;
+		pthread_join(churn_thread, NULL);
+	}
+
+	printf("fault-%dt%s %10.1f %10lu\n", nr_threads, churn ? "-mmap" : "",
+	       sum / nr_threads, churn_loops);
+	return 0;
+}
@@ -0,0 +1,35 @@
+#!/bin/sh
+#
+# Runs inside the guest started by run.sh, from the 9p share on /mnt.
+# Results go to /mnt/spf-<arch>.txt.
+#
+# Each thread count runs once quiet and once with the mmap/munmap loop,
+# followed by how many of its faults went through the speculative path.
+
+case $(uname -m) in
+	aarch64)	ARCH=arm64 ;;
+	arm*)		ARCH=arm32 ;;
+	*)		ARCH=$(uname -m) ;;
+esac
+OUT=/mnt/spf-$ARCH.txt
+SPF=/sys/kernel/debug/speculative_fault
+
+stat()
+{
+	cat $SPF/$1 2>/dev/null || echo 0
+}
+
+mount -t debugfs none /sys/kernel/debug 2>/dev/null
+: > $OUT
+
+for t in 1 2 4; do
+	for m in "" -m; do
+		att=$(stat attempt)
+		ok=$(stat success)
+		/mnt/spf_bench -s 32 -t $t $m >> $OUT
+		echo "  spf attempt $(($(stat attempt) - att))" \
+		     "success $(($(stat success) - ok))" >> $OUT
+	done
+done
+
+cat $OUT
@@ -0,0 +1,160 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * teardown_bench - munmap() and exit latency for a large heap
+ *
+ *   munmap   map and fill S MB of anonymous memory, time the munmap()
+ *   exit     a child fills S MB and exits, time from the go signal to
+ *            waitpid() returning in the parent
+ *
+ * With -a the process opts in with PR_SET_ASYNC_TEARDOWN, so both calls
+ * should return as soon as the vmas are detached and the freeing happens
+ * in the per-node teardown workers.  The buffer is filled with
+ * MADV_NOHUGEPAGE so the teardown has ptes, not pmds, to zap.
+ *
+ * Usage: teardown_bench [-s MB] [-n loops] [-a]
+ * Prints "<test>[-async] <ms>" per test, the best of the loops.
+ */
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef PR_SET_ASYNC_TEARDOWN
+#define PR_SET_ASYNC_TEARDOWN	57
+#endif
+
+static unsigned long size_mb = 256;
+static int loops = 5;
+static int async;
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static char *fill_heap(void)
+{
+	size_t size = size_mb << 20;
+	char *buf;
+
+	buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf == MAP_FAILED)
+		die("mmap");
+	madvise(buf, size, MADV_NOHUGEPAGE);
+	memset(buf, 1, size);
+	return buf;
+}
+
+static uint64_t time_munmap(void)
+{
+	char *buf = fill_heap();
+	uint64_t t0, ns;
+
+	t0 = now_ns();
+	if (munmap(buf, size_mb << 20))
+		die("munmap");
+	ns = now_ns() - t0;
+	return ns;
+}
+
+static uint64_t time_exit(void)
+{
+	int ready[2], go[2];
+	uint64_t t0;
+	pid_t pid;
+	char c;
+
+	if (pipe(ready) || pipe(go))
+		die("pipe");
+
+	pid = fork();
+	if (pid < 0)
+		die("fork");
+	if (!pid) {
+		close(ready[0]);
+		close(go[1]);
+		fill_heap();
+		if (write(ready[1], "r", 1) != 1)
+			_exit(1);
+		/* returns 0 once the parent closes its end */
+		read(go[0], &c, 1);
+		_exit(0);
+	}
+
+	close(ready[1]);
+	close(go[0]);
+	if (read(ready[0], &c, 1) != 1)
+		die("child");
+
+	t0 = now_ns();
+	close(go[1]);
+	if (waitpid(pid, NULL, 0) != pid)
+		die("waitpid");
+	close(ready[0]);
+	return now_ns() - t0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-s MB] [-n loops] [-a]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t ns, best_munmap = 0, best_exit = 0;
+	const char *suffix;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "s:n:ah")) != -1) {
+		switch (opt) {
+		case 's':
+			size_mb = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			loops = atoi(optarg);
+			break;
+		case 'a':
+			async = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (!size_mb || loops <= 0)
+		usage(argv[0]);
+
+	/* inherited by the children forked for the exit test */
+	if (async && prctl(PR_SET_ASYNC_TEARDOWN, 1, 0, 0, 0))
+		die("prctl(PR_SET_ASYNC_TEARDOWN)");
+
+	for (i = 0; i < loops; i++) {
+		ns = time_munmap();
+		if (!best_munmap || ns < best_munmap)
+			best_munmap = ns;
+		ns = time_exit();
+		if (!best_exit || ns < best_exit)
+			best_exit = ns;
+	}
+
+	suffix = async ? "-async" : "";
+	printf("munmap%-6s %10.3f\n", suffix, best_munmap / 1e6);
+	printf("exit%-8s %10.3f\n", suffix, best_exit / 1e6);
+	return 0;
+}
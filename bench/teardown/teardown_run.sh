@@ -0,0 +1,24 @@
+#!/bin/sh
+#
+# Runs inside the guest started by run.sh, from the 9p share on /mnt.
+# Results go to /mnt/teardown-<arch>.txt.
+#
+# Each size is run once synchronously and once with PR_SET_ASYNC_TEARDOWN;
+# the guest has 1G, so the largest heap stays well below that.
+
+case $(uname -m) in
+	aarch64)	ARCH=arm64 ;;
+	arm*)		ARCH=arm32 ;;
+	*)		ARCH=$(uname -m) ;;
+esac
+OUT=/mnt/teardown-$ARCH.txt
+
+: > $OUT
+
+for mb in 64 256 512; do
+	echo "heap ${mb}M" >> $OUT
+	/mnt/teardown_bench -s $mb >> $OUT
+	/mnt/teardown_bench -s $mb -a >> $OUT
+done
+
+cat $OUT
@@ -0,0 +1,32 @@
+#!/bin/bash
+#
+# Build the VMA index benchmark and copy it to the directory run.sh
+# shares with the guest (mounted on /mnt).  Run from the top of the tree.
+
+LROOT=$PWD
+BENCH=$LROOT/bench/vma
+
+if [ $# -lt 1 ]; then
+	echo "Usage: $0 [arch]"
+	exit 1
+fi
+
+case $1 in
+	arm32)
+		export CROSS_COMPILE=arm-linux-gnueabi-
+		SHARE=$LROOT/share
+		;;
+	arm64)
+		export CROSS_COMPILE=aarch64-linux-gnu-
+		SHARE=$LROOT/kmodules
+		;;
+	*)
+		echo "Usage: $0 [arch]"
+		exit 1
+		;;
+esac
+
+make -C $BENCH || exit 1
+mkdir -p $SHARE
+cp $BENCH/vma_bench $BENCH/vma_run.sh $SHARE
+echo "in the guest: sh /mnt/vma_run.sh"
@@ -0,0 +1,158 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * vma_bench - mmap/munmap/lookup cost with many VMAs in one mm
+ *
+ *   mmap     map N single-page regions; alternating protections keep
+ *            neighbours from merging, so the mm ends up with N vmas
+ *   lookup   mincore() on one page of a random region, a find_vma() and
+ *            a one-pte walk under mmap_sem for read
+ *   fault    first touch of a random region, find_vma() on the fault path
+ *   munmap   unmap the regions in random order
+ *
+ * Random order keeps the per-thread vma cache from hiding the index.
+ * The kernel default vm.max_map_count (65530) is below 100k; vma_run.sh
+ * raises it.
+ *
+ * Usage: vma_bench [-n vmas] [-l loops]
+ * Prints "<test> <ns per op>" per test, the best of the loops.
+ */
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+static unsigned long nr_vmas = 100000;
+static int loops = 3;
+
+static long page_size;
+static char **regions;
+static unsigned long *order;
+
+enum { T_MMAP, T_LOOKUP, T_FAULT, T_MUNMAP, NR_TESTS };
+
+static const char * const test_names[NR_TESTS] = {
+	[T_MMAP]	= "mmap",
+	[T_LOOKUP]	= "lookup",
+	[T_FAULT]	= "fault",
+	[T_MUNMAP]	= "munmap",
+};
+
+static double best[NR_TESTS];
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void shuffle(void)
+{
+	unsigned long i, j, t;
+
+	for (i = nr_vmas - 1; i > 0; i--) {
+		j = random() % (i + 1);
+		t = order[i];
+		order[i] = order[j];
+		order[j] = t;
+	}
+}
+
+static void record(int test, uint64_t ns)
+{
+	double per_op = (double)ns / nr_vmas;
+
+	if (!best[test] || per_op < best[test])
+		best[test] = per_op;
+}
+
+static void one_loop(void)
+{
+	unsigned char vec;
+	unsigned long i;
+	uint64_t t0;
+	int prot;
+
+	t0 = now_ns();
+	for (i = 0; i < nr_vmas; i++) {
+		prot = i & 1 ? PROT_READ : PROT_READ | PROT_WRITE;
+		regions[i] = mmap(NULL, page_size, prot,
+				  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (regions[i] == MAP_FAILED)
+			die("mmap (is vm.max_map_count high enough?)");
+	}
+	record(T_MMAP, now_ns() - t0);
+
+	shuffle();
+	t0 = now_ns();
+	for (i = 0; i < nr_vmas; i++)
+		if (mincore(regions[order[i]], page_size, &vec))
+			die("mincore");
+	record(T_LOOKUP, now_ns() - t0);
+
+	shuffle();
+	t0 = now_ns();
+	for (i = 0; i < nr_vmas; i++)
+		(void)*(volatile char *)regions[order[i]];
+	record(T_FAULT, now_ns() - t0);
+
+	shuffle();
+	t0 = now_ns();
+	for (i = 0; i < nr_vmas; i++)
+		if (munmap(regions[order[i]], page_size))
+			die("munmap");
+	record(T_MUNMAP, now_ns() - t0);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-n vmas] [-l loops]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long i;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:l:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			nr_vmas = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			loops = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (nr_vmas < 2 || loops <= 0)
+		usage(argv[0]);
+
+	page_size = sysconf(_SC_PAGESIZE);
+	regions = calloc(nr_vmas, sizeof(*regions));
+	order = calloc(nr_vmas, sizeof(*order));
+	if (!regions || !order)
+		die("calloc");
+	for (i = 0; i < nr_vmas; i++)
+		order[i] = i;
+	srandom(1);
+
+	for (i = 0; i < (unsigned long)loops; i++)
+		one_loop();
+
+	for (i = 0; i < NR_TESTS; i++)
+		printf("%-8s %10.1f\n", test_names[i], best[i]);
+	return 0;
+}
@@ -0,0 +1,24 @@
+#!/bin/sh
+#
+# Runs inside the guest started by run.sh, from the 9p share on /mnt.
+# Results go to /mnt/vma-<arch>.txt.
+#
+# 100k vmas need vm.max_map_count above its default of 65530.  A 1k run
+# is printed first, for how the costs grow with the number of vmas.
+
+case $(uname -m) in
+	aarch64)	ARCH=arm64 ;;
+	arm*)		ARCH=arm32 ;;
+	*)		ARCH=$(uname -m) ;;
+esac
+OUT=/mnt/vma-$ARCH.txt
+
+echo 262144 > /proc/sys/vm/max_map_count
+: > $OUT
+
+for n in 1000 100000; do
+	echo "vmas $n" >> $OUT
+	/mnt/vma_bench -n $n >> $OUT
+done
+
+cat $OUT
@@ -0,0 +1,145 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * zswap_bench - parallel swap-in microbenchmark for zswap
+ *
+ * Fills a buffer with compressible pages, then lets N threads walk their
+ * slices of it reading one word per page.  Run in a memory cgroup smaller
+ * than the buffer (zswap_run.sh does that) every pass faults the pages
+ * back in from zswap while the faults of the other threads push pages
+ * out, so stores and loads hit the zswap index from all CPUs at once.
+ *
+ * Usage: zswap_bench [-s MB] [-t threads] [-n passes]
+ * Prints "swapin-<N>t <MB/s> <ns per page>" for the best pass.
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+static unsigned long size_mb = 256;
+static int nr_threads = 1;
+static int passes = 3;
+
+static char *buf;
+static long page_size;
+static unsigned long nr_pages;
+static pthread_barrier_t barrier;
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* a few distinct words then zeroes: compresses well, not same-filled */
+static void fill(void)
+{
+	unsigned long i;
+	uint64_t *p;
+
+	for (i = 0; i < nr_pages; i++) {
+		p = (uint64_t *)(buf + i * page_size);
+		memset(p, 0, page_size);
+		p[0] = i;
+		p[1] = ~i;
+		p[7] = i * 0x9e3779b97f4a7c15ULL;
+	}
+}
+
+static void *walker(void *arg)
+{
+	unsigned long t = (unsigned long)arg;
+	unsigned long start = nr_pages * t / nr_threads;
+	unsigned long end = nr_pages * (t + 1) / nr_threads;
+	unsigned long i, bad = 0;
+	int pass;
+
+	for (pass = 0; pass < passes; pass++) {
+		pthread_barrier_wait(&barrier);
+		for (i = start; i < end; i++)
+			if (*(volatile uint64_t *)(buf + i * page_size) != i)
+				bad++;
+		pthread_barrier_wait(&barrier);
+	}
+	if (bad)
+		fprintf(stderr, "thread %lu: %lu corrupted pages\n", t, bad);
+	return NULL;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-s MB] [-t threads] [-n passes]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t *threads;
+	uint64_t t0, ns, best = 0;
+	unsigned long i;
+	int opt, pass;
+
+	while ((opt = getopt(argc, argv, "s:t:n:h")) != -1) {
+		switch (opt) {
+		case 's':
+			size_mb = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
+		case 'n':
+			passes = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (!size_mb || nr_threads <= 0 || passes <= 0)
+		usage(argv[0]);
+
+	page_size = sysconf(_SC_PAGESIZE);
+	nr_pages = (size_mb << 20) / page_size;
+	buf = mmap(NULL, size_mb << 20, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf == MAP_FAILED)
+		die("mmap");
+	/* THP would swap in 2M at a time, not what is measured here */
+	madvise(buf, size_mb << 20, MADV_NOHUGEPAGE);
+	fill();
+
+	threads = calloc(nr_threads, sizeof(*threads));
+	if (!threads)
+		die("calloc");
+	pthread_barrier_init(&barrier, NULL, nr_threads + 1);
+	for (i = 0; i < (unsigned long)nr_threads; i++)
+		if (pthread_create(&threads[i], NULL, walker, (void *)i))
+			die("pthread_create");
+
+	for (pass = 0; pass < passes; pass++) {
+		t0 = now_ns();
+		pthread_barrier_wait(&barrier);
+		pthread_barrier_wait(&barrier);
+		ns = now_ns() - t0;
+		if (!best || ns < best)
+			best = ns;
+	}
+	for (i = 0; i < (unsigned long)nr_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	printf("swapin-%dt %12.1f %10.1f\n", nr_threads,
+	       (double)size_mb * 1e9 / best, (double)best / nr_pages);
+	return 0;
+}
@@ -0,0 +1,57 @@
+#!/bin/sh
+#
+# Runs inside the guest started by run.sh, from the 9p share on /mnt.
+# Results go to /mnt/zswap-<arch>.txt.
+#
+# Swap is a brd ramdisk with zswap in front of it, and the benchmark runs
+# in a memory cgroup limited to half its buffer, so every pass swaps the
+# whole buffer in and out again.  The tree lock counters from debugfs are
+# printed per run next to the throughput.
+
+case $(uname -m) in
+	aarch64)	ARCH=arm64 ;;
+	arm*)		ARCH=arm32 ;;
+	*)		ARCH=$(uname -m) ;;
+esac
+OUT=/mnt/zswap-$ARCH.txt
+ZSWAP=/sys/kernel/debug/zswap
+CG=/sys/fs/cgroup/memory
+MB=256
+
+stat()
+{
+	cat $ZSWAP/$1 2>/dev/null || echo 0
+}
+
+mount -t debugfs none /sys/kernel/debug 2>/dev/null
+: > $OUT
+
+modprobe brd rd_nr=1 rd_size=$((MB * 2 * 1024)) 2>/dev/null
+if [ ! -b /dev/ram0 ]; then
+	echo "no /dev/ram0, build brd in or as a module"
+	exit 1
+fi
+mkswap /dev/ram0 > /dev/null && swapon /dev/ram0 || exit 1
+echo 1 > /sys/module/zswap/parameters/enabled
+
+mkdir -p $CG
+mount -t cgroup -o memory none $CG 2>/dev/null
+mkdir -p $CG/zswap_bench
+echo $((MB / 2))M > $CG/zswap_bench/memory.limit_in_bytes
+echo $$ > $CG/zswap_bench/tasks
+
+for t in 1 2 4 8; do
+	acq=$(stat tree_lock_acquired)
+	con=$(stat tree_lock_contended)
+	race=$(stat load_lookup_race)
+	/mnt/zswap_bench -s $MB -t $t >> $OUT
+	echo "lock-acquired-${t}t  $(($(stat tree_lock_acquired) - acq))" >> $OUT
+	echo "lock-contended-${t}t $(($(stat tree_lock_contended) - con))" >> $OUT
+	echo "lookup-race-${t}t    $(($(stat load_lookup_race) - race))" >> $OUT
+done
+
+echo $$ > $CG/tasks
+rmdir $CG/zswap_bench
+swapoff /dev/ram0
+
+cat $OUT
@@ -63,6 +63,23 @@ static inline void *kmap_high_get(struct page *page)
 }
 #endif
 
+/*
+ * kmap_local_page(), see mm/highmem.c.  A slot is flushed from the local
+ * TLB of every CPU it is used on; only a slot whose task moved between
+ * CPUs needs the broadcast on unmap.  Reusing a live pkmap mapping keeps
+ * VIVT caches free of a second alias, as kmap_atomic() does.
+ */
+#define ARCH_HAS_KMAP_LOCAL
+#define arch_kmap_local_flush(vaddr)	local_flush_tlb_kernel_page(vaddr)
+#define arch_kmap_local_flush_all(vaddr)	flush_tlb_kernel_page(vaddr)
+#define arch_kmap_local_high_get(page)	kmap_high_get(page)
+#define arch_kmap_local_pre_unmap(vaddr)				\
+	do {								\
+		if (cache_is_vivt())					\
+			__cpuc_flush_dcache_area((void *)(vaddr),	\
+						 PAGE_SIZE);		\
+	} while (0)
+
 /*
  * The following functions are already defined by <linux/highmem.h>
  * when CONFIG_HIGHMEM is not set.
@@ -15,6 +15,9 @@
 #include <linux/mm.h>
 #include <linux/smp.h>
 #include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/sched/clock.h>
 
 #include <asm/mmu_context.h>
 #include <asm/smp_plat.h>
@@ -55,6 +58,37 @@ static DECLARE_BITMAP(asid_map, NUM_USER_ASIDS);
 static DEFINE_PER_CPU(atomic64_t, active_asids);
 static DEFINE_PER_CPU(u64, reserved_asids);
 static cpumask_t tlb_flush_pending;
+static u32 asid_cur_idx = 1;
+
+/*
+ * Each CPU takes a few ASIDs out of asid_map at a time, under
+ * cpu_asid_lock, and hands them to new mms without the lock.  A batch
+ * is only good for the generation it was taken in: a rollover clears
+ * asid_map, so whatever is left in a stale batch is free again.
+ *
+ * Batches are only refilled by their own CPU under cpu_asid_lock, but
+ * once asid_map runs dry new_context() takes what other CPUs still hold
+ * before it rolls over, so ASIDs are popped with a cmpxchg on nr.  No
+ * batch holds more than its share of the ASID space, or a handful of
+ * CPUs could force rollovers with most ASIDs sitting unused.
+ */
+#define ASID_BATCH		8
+
+struct asid_batch {
+	u64 generation;		/* written under cpu_asid_lock */
+	atomic_t nr;
+	u16 asids[ASID_BATCH];
+};
+static DEFINE_PER_CPU(struct asid_batch, asid_batches);
+
+struct asid_stats {
+	unsigned long batch_allocs;	/* new mms served without the lock */
+	unsigned long locked_allocs;	/* new_context() under the lock */
+	unsigned long lock_acquires;
+	u64 lock_wait_ns;
+};
+static DEFINE_PER_CPU(struct asid_stats, asid_stats);
+static unsigned long asid_rollovers;	/* under cpu_asid_lock */
 
 #ifdef CONFIG_ARM_ERRATA_798181
 void a15_erratum_get_cpumask(int this_cpu, struct mm_struct *mm,
@@ -201,9 +235,65 @@ static bool check_update_reserved_asid(u64 asid, u64 newasid)
 	return hit;
 }
 
+static void asid_batch_refill(struct asid_batch *batch, u64 generation)
+{
+	unsigned int nr, size;
+	unsigned long asid;
+
+	size = clamp_t(unsigned int, NUM_USER_ASIDS / num_possible_cpus(),
+		       1, ASID_BATCH);
+
+	nr = batch->generation == generation ? atomic_read(&batch->nr) : 0;
+	batch->generation = generation;
+
+	while (nr < size) {
+		asid = find_next_zero_bit(asid_map, NUM_USER_ASIDS,
+					  asid_cur_idx);
+		if (asid == NUM_USER_ASIDS)
+			break;
+		__set_bit(asid, asid_map);
+		asid_cur_idx = asid;
+		batch->asids[nr++] = asid;
+	}
+	atomic_set(&batch->nr, nr);
+}
+
+/* Returns an ASID off @batch, or 0 (which is never handed out) if empty */
+static u64 asid_batch_pop(struct asid_batch *batch)
+{
+	int nr = atomic_read(&batch->nr);
+	int old;
+
+	while (nr > 0) {
+		old = atomic_cmpxchg(&batch->nr, nr, nr - 1);
+		if (old == nr)
+			return batch->asids[nr - 1];
+		nr = old;
+	}
+	return 0;
+}
+
+/* asid_map is full: take an ASID another CPU has not handed out yet */
+static u64 asid_batch_steal(unsigned int this_cpu, u64 generation)
+{
+	struct asid_batch *batch;
+	unsigned int cpu;
+	u64 asid;
+
+	for_each_possible_cpu(cpu) {
+		batch = &per_cpu(asid_batches, cpu);
+		if (cpu == this_cpu || batch->generation != generation)
+			continue;
+		asid = asid_batch_pop(batch);
+		if (asid)
+			return asid;
+	}
+	return 0;
+}
+
 static u64 new_context(struct mm_struct *mm, unsigned int cpu)
 {
-	static u32 cur_idx = 1;
+	struct asid_batch *batch = &per_cpu(asid_batches, cpu);
 	u64 asid = atomic64_read(&mm->context.id);
 	u64 generation = atomic64_read(&asid_generation);
 
@@ -241,9 +331,15 @@ static u64 new_context(struct mm_struct *mm, unsigned int cpu)
 	 */
 /*
     如果asid等于0，说明我们的确是需要分配一个新的HW asid，
+    从本cpu的batch中取, batch空了先从asid_map补充一批,
+    asid_map也空了再从其他cpu的batch中拿
 */
-	asid = find_next_zero_bit(asid_map, NUM_USER_ASIDS, cur_idx);
-	if (asid == NUM_USER_ASIDS) {
+	if (!atomic_read(&batch->nr) || batch->generation != generation)
+		asid_batch_refill(batch, generation);
+	asid = asid_batch_pop(batch);
+	if (!asid)
+		asid = asid_batch_steal(cpu, generation);
+	if (!asid) {
 /*
         如果找不到一个空闲的HW asid，说明HW asid已经用光了，这是只能提升generation了。
 */
@@ -254,16 +350,17 @@ static u64 new_context(struct mm_struct *mm, unsigned int cpu)
         顺便一提的是这里 generation 变量已经被赋值为 new generation了   
 */
 		flush_context(cpu);
+		asid_rollovers++;
 /*
         new generation中HW asid的分配		
 */
-		asid = find_next_zero_bit(asid_map, NUM_USER_ASIDS, 1);
-	}
+		asid_cur_idx = 1;
+		asid_batch_refill(batch, generation);
 /*
-    找到一个空闲的HW asid
+        找到一个空闲的HW asid
 */
-	__set_bit(asid, asid_map);
-	cur_idx = asid;
+		asid = asid_batch_pop(batch);
+	}
 	cpumask_clear(mm_cpumask(mm));
 /*
     返回 software asid（当前generation＋新分配的hw asid）  
@@ -271,11 +368,49 @@ static u64 new_context(struct mm_struct *mm, unsigned int cpu)
 	return asid | generation;
 }
 
+/*
+ * Give a brand new mm an ASID from this CPU's batch without taking
+ * cpu_asid_lock.  A rollover zeroes every active_asids under the lock
+ * before anyone can use the new generation, so if ours is still what we
+ * read, the rollover either hasn't started (and will see and reserve
+ * the ASID we publish) or the cmpxchg fails and we take the slow path,
+ * where the mm's now stale ASID is handled like any other.  A new mm
+ * starts with an empty mm_cpumask, so there is nothing to clear.
+ */
+static bool asid_batch_alloc(struct mm_struct *mm, unsigned int cpu)
+{
+	struct asid_batch *batch = &per_cpu(asid_batches, cpu);
+	u64 old, asid, generation;
+
+	old = atomic64_read(&per_cpu(active_asids, cpu));
+	generation = atomic64_read(&asid_generation);
+	if (!old || batch->generation != generation)
+		return false;
+
+	asid = asid_batch_pop(batch);
+	if (!asid)
+		return false;
+	asid |= generation;
+	/*
+	 * Another thread of the mm got an ASID first, use that one.  Ours
+	 * stays allocated in asid_map until the next rollover.
+	 */
+	if (atomic64_cmpxchg(&mm->context.id, 0, asid) != 0)
+		return false;
+
+	if (atomic64_cmpxchg(&per_cpu(active_asids, cpu), old, asid) != old)
+		return false;
+
+	cpumask_set_cpu(cpu, mm_cpumask(mm));
+	__this_cpu_inc(asid_stats.batch_allocs);
+	return true;
+}
+
 void check_and_switch_context(struct mm_struct *mm, struct task_struct *tsk)
 {
 	unsigned long flags;
 	unsigned int cpu = smp_processor_id();
-	u64 asid;
+	u64 asid, wait;
 
 	if (unlikely(mm->context.vmalloc_seq != init_mm.context.vmalloc_seq))
 		__check_vmalloc_seq(mm);
@@ -299,7 +434,14 @@ void check_and_switch_context(struct mm_struct *mm, struct task_struct *tsk)
 	    && atomic64_xchg(&per_cpu(active_asids, cpu), asid))
 		goto switch_mm_fastpath;
 
+	/* 新的mm, 尝试不加锁从本cpu的batch中分配 */
+	if (!asid && asid_batch_alloc(mm, cpu))
+		goto switch_mm_fastpath;
+
+	wait = sched_clock();
 	raw_spin_lock_irqsave(&cpu_asid_lock, flags);
+	__this_cpu_add(asid_stats.lock_wait_ns, sched_clock() - wait);
+	__this_cpu_inc(asid_stats.lock_acquires);
 	/* Check that our ASID belongs to the current generation. */
 	asid = atomic64_read(&mm->context.id);
 /*
@@ -312,6 +454,7 @@ void check_and_switch_context(struct mm_struct *mm, struct task_struct *tsk)
         分配一个新的context ID
 */
 		asid = new_context(mm, cpu);
+		__this_cpu_inc(asid_stats.locked_allocs);
 /*
         设定到mm->context.id中		
 */
@@ -332,3 +475,38 @@ void check_and_switch_context(struct mm_struct *mm, struct task_struct *tsk)
 switch_mm_fastpath:
 	cpu_switch_mm(mm->pgd, mm);
 }
+
+#ifdef CONFIG_DEBUG_FS
+static int asid_stats_show(struct seq_file *m, void *v)
+{
+	struct asid_stats sum = { 0 };
+	int cpu;
+
+	seq_puts(m, "cpu   batch_allocs  locked_allocs  lock_acquires  lock_wait_us\n");
+	for_each_possible_cpu(cpu) {
+		struct asid_stats *s = &per_cpu(asid_stats, cpu);
+
+		seq_printf(m, "%-4d %13lu %14lu %14lu %13llu\n", cpu,
+			   s->batch_allocs, s->locked_allocs,
+			   s->lock_acquires, div_u64(s->lock_wait_ns, 1000));
+		sum.batch_allocs += s->batch_allocs;
+		sum.locked_allocs += s->locked_allocs;
+		sum.lock_acquires += s->lock_acquires;
+		sum.lock_wait_ns += s->lock_wait_ns;
+	}
+	seq_printf(m, "all  %13lu %14lu %14lu %13llu\n",
+		   sum.batch_allocs, sum.locked_allocs, sum.lock_acquires,
+		   div_u64(sum.lock_wait_ns, 1000));
+	seq_printf(m, "rollovers %lu generation %llu\n", READ_ONCE(asid_rollovers),
+		   atomic64_read(&asid_generation) >> ASID_BITS);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(asid_stats);
+
+static int __init asid_debugfs_init(void)
+{
+	debugfs_create_file("asid_stats", 0400, NULL, NULL, &asid_stats_fops);
+	return 0;
+}
+late_initcall(asid_debugfs_init);
+#endif
@@ -209,20 +209,28 @@ void do_bad_area(unsigned long addr, unsigned int fsr, struct pt_regs *regs)
 #define VM_FAULT_BADACCESS	0x020000
 
 /*
- * Check that the permissions on the VMA allow for the fault which occurred.
+ * The vm_flags one of which the VMA needs for the fault which occurred.
  * If we encountered a write fault, we must have write permission, otherwise
  * we allow any permission.
  */
-static inline bool access_error(unsigned int fsr, struct vm_area_struct *vma)
+static inline unsigned long access_mask(unsigned int fsr)
 {
-	unsigned int mask = VM_READ | VM_WRITE | VM_EXEC;
+	unsigned long mask = VM_READ | VM_WRITE | VM_EXEC;
 
 	if (fsr & FSR_WRITE)
 		mask = VM_WRITE;
 	if (fsr & FSR_LNX_PF)
 		mask = VM_EXEC;
 
-	return vma->vm_flags & mask ? false : true;
+	return mask;
+}
+
+/*
+ * Check that the permissions on the VMA allow for the fault which occurred.
+ */
+static inline bool access_error(unsigned int fsr, struct vm_area_struct *vma)
+{
+	return vma->vm_flags & access_mask(fsr) ? false : true;
 }
 
 static vm_fault_t __kprobes
@@ -313,6 +321,26 @@ do_page_fault(unsigned long addr, unsigned int fsr, struct pt_regs *regs)
 	if (fsr & FSR_WRITE)
 		flags |= FAULT_FLAG_WRITE;
 
+#ifdef CONFIG_ARCH_SUPPORTS_SPECULATIVE_PAGE_FAULT
+	/*
+	 * Try the fault without mmap_sem first.  Those handled this way
+	 * never need io, so they are minor faults.
+	 */
+	if (user_mode(regs)) {
+		fault = handle_speculative_fault(mm, addr, flags,
+						 access_mask(fsr));
+		if (fault != VM_FAULT_RETRY) {
+			perf_sw_event(PERF_COUNT_SW_PAGE_FAULTS, 1, regs, addr);
+			if (!(fault & VM_FAULT_ERROR)) {
+				tsk->min_flt++;
+				perf_sw_event(PERF_COUNT_SW_PAGE_FAULTS_MIN, 1,
+					      regs, addr);
+			}
+			goto done;
+		}
+	}
+#endif
+
 	/*
 	 * As per x86, we may deadlock here.  However, since the kernel only
 	 * validly references user space from well defined areas of the code,
@@ -396,6 +424,9 @@ retry:
 
 	up_read(&mm->mmap_sem);
 
+#ifdef CONFIG_ARCH_SUPPORTS_SPECULATIVE_PAGE_FAULT
+done:
+#endif
 	/*
 	 * Handle the "normal" case first - VM_FAULT_MAJOR
 	 */
@@ -0,0 +1,19 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Changing the permissions of the kernel linear map in place, splitting
+ * block and contiguous mappings only where a range ends inside them.
+ * See arch/arm64/mm/mmu.c.
+ */
+#ifndef __ASM_LINEAR_MAP_H
+#define __ASM_LINEAR_MAP_H
+
+#ifndef __ASSEMBLY__
+
+#include <asm/pgtable-prot.h>
+
+extern int linear_map_change_prot(unsigned long start, unsigned long end,
+				  pgprot_t set_mask, pgprot_t clear_mask);
+
+#endif	/* !__ASSEMBLY__ */
+
+#endif	/* __ASM_LINEAR_MAP_H */
@@ -0,0 +1,61 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Batched user TLB invalidation.
+ *
+ * Callers that tear down or change many PTEs under one mm (munmap,
+ * mprotect) collect the affected ranges in a struct tlb_batch and issue
+ * them with one DSB at the end, using range TLBI (ARMv8.4-TLBI) where the
+ * CPUs implement it, per-page TLBI for short ranges otherwise, and a
+ * single by-ASID flush once that would be cheaper.
+ */
+#ifndef __ASM_TLBBATCH_H
+#define __ASM_TLBBATCH_H
+
+#ifndef __ASSEMBLY__
+
+#include <linux/types.h>
+
+struct mm_struct;
+
+/* ranges kept apart before the closest two are merged */
+#define TLB_BATCH_NR	16
+
+struct tlb_batch_range {
+	unsigned long start;
+	unsigned long end;
+};
+
+struct tlb_batch {
+	struct mm_struct *mm;
+	unsigned int nr;
+	/* smallest stride seen, a smaller stride still hits larger blocks */
+	unsigned int stride_shift;
+	/* only leaf entries changed, the walk cache can stay */
+	bool last_level;
+	struct tlb_batch_range range[TLB_BATCH_NR];
+};
+
+static inline void tlb_batch_init(struct tlb_batch *b, struct mm_struct *mm)
+{
+	b->mm = mm;
+	b->nr = 0;
+	b->stride_shift = 0;
+	b->last_level = true;
+}
+
+static inline bool tlb_batch_empty(struct tlb_batch *b)
+{
+	return !b->nr;
+}
+
+extern void tlb_batch_add(struct tlb_batch *b, unsigned long start,
+			  unsigned long end, unsigned long stride,
+			  bool last_level);
+extern void tlb_batch_flush(struct tlb_batch *b);
+extern void __flush_tlb_range_batched(struct mm_struct *mm,
+				      unsigned long start, unsigned long end,
+				      unsigned long stride, bool last_level);
+
+#endif /* !__ASSEMBLY__ */
+
+#endif /* __ASM_TLBBATCH_H */
@@ -490,6 +490,24 @@ static int __kprobes do_page_fault(unsigned long addr, unsigned int esr,
 
 	perf_sw_event(PERF_COUNT_SW_PAGE_FAULTS, 1, regs, addr);
 
+#ifdef CONFIG_ARCH_SUPPORTS_SPECULATIVE_PAGE_FAULT
+	/*
+	 * Try the fault without mmap_sem first, see handle_speculative_fault().
+	 * Those handled this way never need io, so they are minor faults.
+	 */
+	if (user_mode(regs)) {
+		fault = handle_speculative_fault(mm, addr, mm_flags, vm_flags);
+		if (fault != VM_FAULT_RETRY) {
+			if (fault & VM_FAULT_ERROR)
+				goto done;
+			tsk->min_flt++;
+			perf_sw_event(PERF_COUNT_SW_PAGE_FAULTS_MIN, 1, regs,
+				      addr);
+			return 0;
+		}
+	}
+#endif
+
 	/*
 	 * As per x86, we may deadlock here. However, since the kernel only
 	 * validly references user space from well defined areas of the code,
@@ -540,6 +558,9 @@ retry:
 	}
 	up_read(&mm->mmap_sem);
 
+#ifdef CONFIG_ARCH_SUPPORTS_SPECULATIVE_PAGE_FAULT
+done:
+#endif
 	/*
 	 * Handle the "normal" (no error) case first.
 	 */
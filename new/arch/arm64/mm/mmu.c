@@ -32,12 +32,16 @@
 #include <linux/io.h>
 #include <linux/mm.h>
 #include <linux/vmalloc.h>
+#include <linux/stop_machine.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
 #include <asm/barrier.h>
 #include <asm/cputype.h>
 #include <asm/fixmap.h>
 #include <asm/kasan.h>
 #include <asm/kernel-pgtable.h>
+#include <asm/linear_map.h>
 #include <asm/sections.h>
 #include <asm/setup.h>
 #include <asm/sizes.h>
@@ -472,15 +476,428 @@ void __init mark_linear_text_alias_ro(void)
 			    PAGE_KERNEL_RO);
 }
 
+/*
+ * Lazy splitting of the linear map.
+ *
+ * rodata=full maps all of memory with pages so that the linear alias of
+ * any page can later change permissions.  linear_map_change_prot() does
+ * not need that: it only breaks up what straddles the edge of a range
+ * whose permissions change, blocks and contiguous runs entirely inside it
+ * are updated as a whole.
+ *
+ * Replacing a live block with a table, or rewriting a contiguous run,
+ * needs break-before-make, and any CPU may be using the entry being
+ * broken.  So it is done from stop_machine(), with the other CPUs parked
+ * on a flag in the kernel image and the entries written through the
+ * fixmap: nobody touches the linear map while it has a hole.  That also
+ * requires stacks outside the linear map, hence CONFIG_VMAP_STACK.
+ *
+ * The linear map can only keep its blocks under rodata=full once every
+ * permission change goes through here; see linear_map_flags().
+ */
+#define LINEAR_BBM_MAX		(CONT_PTES > CONT_PMDS ? CONT_PTES : CONT_PMDS)
+
+struct linear_bbm {
+	unsigned long va;		/* first address mapped by the entries */
+	unsigned long size;		/* and how much they map */
+	int level;			/* 1: pud, 2: pmd, 3: pte */
+	int nr;
+	u64 vals[LINEAR_BBM_MAX];
+};
+
+static DEFINE_MUTEX(linear_map_lock);
+static struct linear_bbm linear_bbm;	/* under linear_map_lock */
+static atomic_t linear_bbm_arrived;
+static int linear_bbm_done;
+static unsigned long linear_map_splits[4];
+
+static bool linear_map_can_split(void)
+{
+	return IS_ENABLED(CONFIG_VMAP_STACK);
+}
+
+/*
+ * change_memory_common() changes the linear alias of vmalloc pages under
+ * rodata=full through linear_map_change_prot(), so blocks can stay unless
+ * that cannot split them.  set_memory_valid() for debug_pagealloc still
+ * works on single ptes.
+ */
+static int linear_map_flags(void)
+{
+	if (debug_pagealloc_enabled() ||
+	    (rodata_full && !linear_map_can_split()))
+		return NO_BLOCK_MAPPINGS | NO_CONT_MAPPINGS;
+	return 0;
+}
+
+static const struct {
+	unsigned long size;
+	unsigned long cont_size;
+} linear_level[4] = {
+	[1] = { PUD_SIZE,	PUD_SIZE },
+	[2] = { PMD_SIZE,	CONT_PMD_SIZE },
+	[3] = { PAGE_SIZE,	CONT_PTE_SIZE },
+};
+
+/* map the table holding the @level entry for @addr, see linear_unmap() */
+static u64 *linear_map_entry(unsigned long addr, int level)
+{
+	pud_t *pudp = pud_set_fixmap_offset(pgd_offset_k(addr), addr);
+	pmd_t *pmdp;
+
+	if (level == 1)
+		return (u64 *)pudp;
+	pmdp = pmd_set_fixmap_offset(pudp, addr);
+	if (level == 2)
+		return (u64 *)pmdp;
+	return (u64 *)pte_set_fixmap_offset(pmdp, addr);
+}
+
+static void linear_unmap(void)
+{
+	pte_clear_fixmap();
+	pmd_clear_fixmap();
+	pud_clear_fixmap();
+}
+
+/* level of the entry mapping @addr and its value, 0 if unmapped */
+static int linear_map_leaf(unsigned long addr, u64 *val)
+{
+	pgd_t *pgdp = pgd_offset_k(addr);
+	pud_t *pudp, pud;
+	pmd_t *pmdp, pmd;
+	pte_t *ptep, pte;
+	int level = 0;
+
+	if (pgd_none(READ_ONCE(*pgdp)))
+		return 0;
+
+	pudp = pud_set_fixmap_offset(pgdp, addr);
+	pud = READ_ONCE(*pudp);
+	if (pud_none(pud))
+		goto out;
+	if (pud_sect(pud)) {
+		*val = pud_val(pud);
+		level = 1;
+		goto out;
+	}
+
+	pmdp = pmd_set_fixmap_offset(pudp, addr);
+	pmd = READ_ONCE(*pmdp);
+	if (pmd_none(pmd))
+		goto out;
+	if (pmd_sect(pmd)) {
+		*val = pmd_val(pmd);
+		level = 2;
+		goto out;
+	}
+
+	ptep = pte_set_fixmap_offset(pmdp, addr);
+	pte = READ_ONCE(*ptep);
+	if (pte_valid(pte)) {
+		*val = pte_val(pte);
+		level = 3;
+	}
+out:
+	linear_unmap();
+	return level;
+}
+
+static int linear_bbm_fn(void *unused)
+{
+	struct linear_bbm *op = &linear_bbm;
+	u64 *p;
+	int i;
+
+	if (smp_processor_id() != cpumask_first(cpu_online_mask)) {
+		atomic_inc(&linear_bbm_arrived);
+		while (!READ_ONCE(linear_bbm_done))
+			cpu_relax();
+		isb();
+		return 0;
+	}
+
+	/* nobody may be on the way through the entries we break */
+	while (atomic_read(&linear_bbm_arrived) != num_online_cpus() - 1)
+		cpu_relax();
+
+	p = linear_map_entry(op->va, op->level);
+	for (i = 0; i < op->nr; i++)
+		WRITE_ONCE(p[i], 0);
+	dsb(ishst);
+	flush_tlb_kernel_range(op->va, op->va + op->size);
+	for (i = 0; i < op->nr; i++)
+		WRITE_ONCE(p[i], op->vals[i]);
+	dsb(ishst);
+	isb();
+	linear_unmap();
+
+	WRITE_ONCE(linear_bbm_done, 1);
+	return 0;
+}
+
+/* replace the linear_bbm entries, filled in by the caller */
+static void linear_bbm_run(void)
+{
+	atomic_set(&linear_bbm_arrived, 0);
+	linear_bbm_done = 0;
+	stop_machine(linear_bbm_fn, NULL, cpu_online_mask);
+	linear_map_splits[linear_bbm.level]++;
+}
+
+static u64 linear_apply_prot(u64 val, pgprot_t set_mask, pgprot_t clear_mask)
+{
+	return (val & ~pgprot_val(clear_mask)) | pgprot_val(set_mask);
+}
+
+/* does [@va, @va + @size) cross either end of [@start, @end) */
+static bool linear_straddles(unsigned long va, unsigned long size,
+			     unsigned long start, unsigned long end)
+{
+	return (va < start && start < va + size) ||
+	       (va < end && end < va + size);
+}
+
+/*
+ * Split the @level block @val at @va into a table of the next level.
+ * The new entries already have their final permissions where they lie
+ * inside [@start, @end), and are contiguous where the run around them
+ * doesn't cross its ends.  Returns how far from @addr on that left
+ * nothing more to do.
+ */
+static unsigned long linear_split_block(unsigned long va, int level, u64 val,
+			       unsigned long addr,
+			       unsigned long start, unsigned long end,
+			       pgprot_t set_mask, pgprot_t clear_mask)
+{
+	unsigned long size = linear_level[level + 1].size;
+	unsigned long cont = linear_level[level + 1].cont_size;
+	phys_addr_t phys = __pte_to_phys(__pte(val));
+	phys_addr_t table = pgd_pgtable_alloc();
+	u64 attr = val & ~(PTE_ADDR_MASK | PTE_CONT);
+	u64 *tbl = __va(table);
+	unsigned long done = addr;
+	int i;
+
+	if (level + 1 == 3)
+		attr = (attr & ~PTE_TYPE_MASK) | PTE_TYPE_PAGE;
+
+	/* all levels below the pgd have tables of the same size */
+	for (i = 0; i < PTRS_PER_PTE; i++) {
+		unsigned long cva = va + i * size;
+		u64 v = __phys_to_pte_val(phys + i * size) | attr;
+
+		if (start <= cva && cva + size <= end) {
+			v = linear_apply_prot(v, set_mask, clear_mask);
+			if (cva == done)
+				done += size;
+		}
+		if (!linear_straddles(cva & ~(cont - 1), cont, start, end))
+			v |= PTE_CONT;
+		tbl[i] = v;
+	}
+	dsb(ishst);
+
+	linear_bbm.va = va;
+	linear_bbm.size = linear_level[level].size;
+	linear_bbm.level = level;
+	linear_bbm.nr = 1;
+	linear_bbm.vals[0] = __phys_to_pte_val(table) |
+			     (level == 1 ? PUD_TYPE_TABLE : PMD_TYPE_TABLE);
+	linear_bbm_run();
+	return done;
+}
+
+/*
+ * Rewrite the contiguous run at @va: with the new permissions and still
+ * contiguous if it lies inside [@start, @end), as separate entries with
+ * their old permissions otherwise.
+ */
+static void linear_rewrite_cont(unsigned long va, int level, bool inside,
+				pgprot_t set_mask, pgprot_t clear_mask)
+{
+	unsigned long size = linear_level[level].size;
+	int i, nr = linear_level[level].cont_size / size;
+	u64 *p;
+
+	p = linear_map_entry(va, level);
+	for (i = 0; i < nr; i++) {
+		u64 v = READ_ONCE(p[i]);
+
+		linear_bbm.vals[i] = inside ?
+			linear_apply_prot(v, set_mask, clear_mask) :
+			v & ~PTE_CONT;
+	}
+	linear_unmap();
+
+	linear_bbm.va = va;
+	linear_bbm.size = nr * size;
+	linear_bbm.level = level;
+	linear_bbm.nr = nr;
+	linear_bbm_run();
+}
+
+/**
+ * linear_map_change_prot - change the permissions of part of the linear map
+ * @start: first address, page aligned
+ * @end: end address, page aligned
+ * @set_mask: attribute bits to set
+ * @clear_mask: attribute bits to clear
+ *
+ * Only attribute changes that are safe on live mappings (see
+ * pgattr_change_is_safe()) may be requested.  Blocks and contiguous runs
+ * straddling @start or @end are split, the rest keep their size.
+ *
+ * Return: 0 on success, -EINVAL if part of the range is not mapped,
+ * -EOPNOTSUPP if it would need a split and the linear map can't be split.
+ */
+int linear_map_change_prot(unsigned long start, unsigned long end,
+			   pgprot_t set_mask, pgprot_t clear_mask)
+{
+	unsigned long addr = start;
+	int level, ret = 0;
+	u64 val;
+
+	mutex_lock(&linear_map_lock);
+	while (addr < end) {
+		unsigned long size, run;
+		u64 *p;
+
+		level = linear_map_leaf(addr, &val);
+		if (!level) {
+			ret = -EINVAL;
+			break;
+		}
+		size = linear_level[level].size;
+		run = addr & ~(size - 1);
+
+		/* in place, if it is a whole block or page without PTE_CONT */
+		if (!(val & PTE_CONT) && start <= run && run + size <= end) {
+			p = linear_map_entry(addr, level);
+			WRITE_ONCE(*p, linear_apply_prot(val, set_mask,
+							 clear_mask));
+			linear_unmap();
+			addr = run + size;
+			continue;
+		}
+
+		if (!linear_map_can_split()) {
+			ret = -EOPNOTSUPP;
+			break;
+		}
+
+		if (val & PTE_CONT) {
+			unsigned long cont = linear_level[level].cont_size;
+			bool inside;
+
+			run = addr & ~(cont - 1);
+			inside = start <= run && run + cont <= end;
+			linear_rewrite_cont(run, level, inside,
+					    set_mask, clear_mask);
+			if (inside)
+				addr = run + cont;
+			continue;
+		}
+
+		/* a block crossing @start or @end, ptes never do */
+		addr = linear_split_block(run, level, val, addr, start, end,
+					  set_mask, clear_mask);
+	}
+	flush_tlb_kernel_range(start, addr);
+	mutex_unlock(&linear_map_lock);
+	return ret;
+}
+
+#ifdef CONFIG_DEBUG_FS
+/* like linear_map_leaf(), but also sizes the holes: -level if unmapped */
+static int linear_map_walk(unsigned long addr, u64 *val)
+{
+	pgd_t *pgdp = pgd_offset_k(addr);
+	pud_t *pudp, pud;
+	pmd_t *pmdp, pmd;
+	pte_t pte;
+
+	if (pgd_none(READ_ONCE(*pgdp)))
+		return -1;
+	pudp = pud_offset(pgdp, addr);
+	pud = READ_ONCE(*pudp);
+	if (pud_none(pud))
+		return -1;
+	if (pud_sect(pud)) {
+		*val = pud_val(pud);
+		return 1;
+	}
+	pmdp = pmd_offset(pudp, addr);
+	pmd = READ_ONCE(*pmdp);
+	if (pmd_none(pmd))
+		return -2;
+	if (pmd_sect(pmd)) {
+		*val = pmd_val(pmd);
+		return 2;
+	}
+	pte = READ_ONCE(*pte_offset_kernel(pmdp, addr));
+	if (!pte_valid(pte))
+		return -3;
+	*val = pte_val(pte);
+	return 3;
+}
+
+static int linear_map_show(struct seq_file *m, void *v)
+{
+	static const char * const names[] = {
+		"pud", "cont pmd", "pmd", "cont pte", "pte",
+	};
+	unsigned long count[ARRAY_SIZE(names)] = { 0 };
+	unsigned long bytes[ARRAY_SIZE(names)] = { 0 };
+	unsigned long addr = PAGE_OFFSET, end = (unsigned long)high_memory;
+	int i;
+
+	mutex_lock(&linear_map_lock);
+	while (addr < end) {
+		int level, idx;
+		u64 val;
+
+		level = linear_map_walk(addr, &val);
+		if (level < 0) {
+			level = -level;
+			addr = (addr & ~(linear_level[level].size - 1)) +
+			       linear_level[level].size;
+			continue;
+		}
+		idx = level == 1 ? 0 : (level - 2) * 2 + 1 + !(val & PTE_CONT);
+		count[idx]++;
+		bytes[idx] += linear_level[level].size;
+		addr = (addr & ~(linear_level[level].size - 1)) +
+		       linear_level[level].size;
+		cond_resched();
+	}
+	mutex_unlock(&linear_map_lock);
+
+	seq_puts(m, "size        entries          KiB\n");
+	for (i = 0; i < ARRAY_SIZE(names); i++)
+		seq_printf(m, "%-10s %8lu %12lu\n", names[i], count[i],
+			   bytes[i] >> 10);
+	seq_printf(m, "splits: pud %lu pmd %lu pte %lu\n",
+		   linear_map_splits[1], linear_map_splits[2],
+		   linear_map_splits[3]);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(linear_map);
+
+static int __init linear_map_debugfs_init(void)
+{
+	debugfs_create_file("linear_map", 0400, NULL, NULL, &linear_map_fops);
+	return 0;
+}
+late_initcall(linear_map_debugfs_init);
+#endif
+
 static void __init map_mem(pgd_t *pgdp)
 {
 	phys_addr_t kernel_start = __pa_symbol(_text);
 	phys_addr_t kernel_end = __pa_symbol(__init_begin);
 	struct memblock_region *reg;
-	int flags = 0;
-
-	if (rodata_full || debug_pagealloc_enabled())
-		flags = NO_BLOCK_MAPPINGS | NO_CONT_MAPPINGS;
+	int flags = linear_map_flags();
 
 	/*
 	 * Take care not to create a writable alias for the
@@ -1087,14 +1504,25 @@ int p4d_free_pud_page(p4d_t *p4d, unsigned long addr)
 	return 0;	/* Don't attempt a block mapping */
 }
 
+/*
+ * Huge vmalloc areas too small for a PMD block are still mapped from
+ * CONT_PTE_SIZE chunks of contiguous memory, one TLB entry per chunk.
+ */
+unsigned int arch_vmap_pte_cont_shift(void)
+{
+	return CONT_PTE_SHIFT;
+}
+
+pgprot_t arch_vmap_pte_cont_prot(pgprot_t prot)
+{
+	return __pgprot(pgprot_val(prot) | PTE_CONT);
+}
+
 #ifdef CONFIG_MEMORY_HOTPLUG
 int arch_add_memory(int nid, u64 start, u64 size, struct vmem_altmap *altmap,
 		    bool want_memblock)
 {
-	int flags = 0;
-
-	if (rodata_full || debug_pagealloc_enabled())
-		flags = NO_BLOCK_MAPPINGS | NO_CONT_MAPPINGS;
+	int flags = linear_map_flags();
 
 	__create_pgd_mapping(swapper_pg_dir, start, __phys_to_virt(start),
 			     size, PAGE_KERNEL, pgd_pgtable_alloc, flags);
@@ -0,0 +1,333 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Batched user TLB invalidation, see asm/tlbbatch.h.
+ *
+ * __flush_tlb_range() issues one TLBI per stride and gives up for a full
+ * ASID flush at MAX_TLBI_OPS, and every caller pays its own DSB.  Here the
+ * ranges of one operation are coalesced first and then issued together:
+ *
+ *   - with ARMv8.4-TLBI one RVA(L)E1IS covers up to 2^(5 * scale + 1)
+ *     pages, so even a multi-GB range costs a handful of instructions;
+ *   - without it short ranges still go page by page, and the batch falls
+ *     back to a single ASIDE1IS once the sum of all ranges needs more
+ *     than MAX_TLBI_OPS;
+ *   - one DSB ISHST in front and one DSB ISH at the end for the lot.
+ */
+#include <linux/cpu.h>
+#include <linux/cpuhotplug.h>
+#include <linux/debugfs.h>
+#include <linux/export.h>
+#include <linux/init.h>
+#include <linux/jump_label.h>
+#include <linux/mm_types.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/smp.h>
+
+#include <asm/barrier.h>
+#include <asm/mmu.h>
+#include <asm/sysreg.h>
+#include <asm/tlbbatch.h>
+#include <asm/tlbflush.h>
+
+/*
+ * ID_AA64ISAR0_EL1.TLB, 0b0010 means range and outer-shareable TLBI.  The
+ * cpufeature code does not know the field yet, so it is read per CPU
+ * here rather than through a cpucap.
+ */
+#define ID_AA64ISAR0_TLB_SHIFT		56
+#define ID_AA64ISAR0_TLB_RANGE		2
+
+/* TLBI RVA(L)E1IS operand: Xt[63:48] ASID, TG, SCALE, NUM, TTL, BaseADDR */
+#define TLBI_RANGE_MASK			GENMASK_ULL(4, 0)
+#define TLBI_RANGE_TG			((PAGE_SHIFT - 12) / 2 + 1)
+#define TLBI_RANGE_PAGES(num, scale)	\
+	((unsigned long)((num) + 1) << (5 * (scale) + 1))
+#define MAX_TLBI_RANGE_PAGES		TLBI_RANGE_PAGES(31, 3)
+#define TLBI_RANGE_NUM(pages, scale)	\
+	((int)(((pages) >> (5 * (scale) + 1)) & TLBI_RANGE_MASK) - 1)
+
+static inline unsigned long tlbi_range_arg(unsigned long addr,
+					   unsigned long asid,
+					   int scale, int num)
+{
+	unsigned long arg = (addr >> PAGE_SHIFT) & GENMASK_ULL(36, 0);
+
+	/* TTL stays 0, the level of the entries is not known here */
+	arg |= (unsigned long)num << 39;
+	arg |= (unsigned long)scale << 44;
+	arg |= (unsigned long)TLBI_RANGE_TG << 46;
+	arg |= asid << 48;
+	return arg;
+}
+
+/*
+ * Spelled as SYS so older assemblers take them.  No REPEAT_TLBI
+ * workaround: the parts with that erratum predate range TLBI.
+ */
+static inline void tlbi_rvae1is(unsigned long arg)
+{
+	asm volatile("sys #0, c8, c2, #1, %0" : : "r" (arg));
+	if (arm64_kernel_unmapped_at_el0())
+		asm volatile("sys #0, c8, c2, #1, %0"
+			     : : "r" (arg | USER_ASID_FLAG));
+}
+
+static inline void tlbi_rvale1is(unsigned long arg)
+{
+	asm volatile("sys #0, c8, c2, #5, %0" : : "r" (arg));
+	if (arm64_kernel_unmapped_at_el0())
+		asm volatile("sys #0, c8, c2, #5, %0"
+			     : : "r" (arg | USER_ASID_FLAG));
+}
+
+static DEFINE_STATIC_KEY_FALSE(tlb_range_key);
+
+static inline bool system_supports_tlb_range(void)
+{
+	return static_branch_likely(&tlb_range_key);
+}
+
+enum tlb_batch_stat {
+	TLB_STAT_FLUSH,		/* batches issued, one DSB each */
+	TLB_STAT_RANGE,		/* ranges in those batches */
+	TLB_STAT_MERGE,		/* ranges folded into another on add */
+	TLB_STAT_PAGE,		/* TLBI VA(L)E1IS */
+	TLB_STAT_RANGE_OP,	/* TLBI RVA(L)E1IS */
+	TLB_STAT_ASID,		/* TLBI ASIDE1IS */
+	TLB_STAT_NR,
+};
+
+static const char * const tlb_stat_names[TLB_STAT_NR] = {
+	[TLB_STAT_FLUSH]	= "flush",
+	[TLB_STAT_RANGE]	= "ranges",
+	[TLB_STAT_MERGE]	= "merged",
+	[TLB_STAT_PAGE]		= "tlbi_page",
+	[TLB_STAT_RANGE_OP]	= "tlbi_range",
+	[TLB_STAT_ASID]		= "tlbi_asid",
+};
+
+static DEFINE_PER_CPU(unsigned long [TLB_STAT_NR], tlb_batch_stats);
+
+static inline void tlb_stat_add(enum tlb_batch_stat item, unsigned long nr)
+{
+	this_cpu_add(tlb_batch_stats[item], nr);
+}
+
+void tlb_batch_add(struct tlb_batch *b, unsigned long start,
+		   unsigned long end, unsigned long stride, bool last_level)
+{
+	struct tlb_batch_range *r, *near = NULL;
+	unsigned long gap, best = ULONG_MAX;
+	int i;
+
+	start = round_down(start, stride);
+	end = round_up(end, stride);
+	if (start >= end)
+		return;
+
+	if (!b->stride_shift || __ffs(stride) < b->stride_shift)
+		b->stride_shift = __ffs(stride);
+	b->last_level &= last_level;
+
+	/* newest first, page table walks usually continue the last range */
+	for (i = b->nr - 1; i >= 0; i--) {
+		r = &b->range[i];
+		if (start <= r->end && end >= r->start)
+			goto merge;
+	}
+
+	if (b->nr < TLB_BATCH_NR) {
+		b->range[b->nr].start = start;
+		b->range[b->nr].end = end;
+		b->nr++;
+		return;
+	}
+
+	/* full: over-invalidating the hole to the closest range is safe */
+	for (i = 0; i < b->nr; i++) {
+		gap = start > b->range[i].end ? start - b->range[i].end :
+						b->range[i].start - end;
+		if (gap < best) {
+			best = gap;
+			near = &b->range[i];
+		}
+	}
+	r = near;
+merge:
+	r->start = min(r->start, start);
+	r->end = max(r->end, end);
+	tlb_stat_add(TLB_STAT_MERGE, 1);
+}
+EXPORT_SYMBOL_GPL(tlb_batch_add);
+
+/* per-page ops, what one range costs without range TLBI */
+static inline unsigned long tlb_range_ops(struct tlb_batch_range *r,
+					  unsigned int stride_shift)
+{
+	return (r->end - r->start) >> stride_shift;
+}
+
+static void tlb_flush_one_range(struct tlb_batch_range *r, unsigned long asid,
+				unsigned long stride, bool last_level)
+{
+	unsigned long start = r->start;
+	unsigned long pages = (r->end - r->start) >> PAGE_SHIFT;
+	unsigned long nr_page = 0, nr_range = 0, arg;
+	int scale = 0, num;
+
+	/*
+	 * Same walk as upstream __flush_tlb_range_op(): an odd page count
+	 * is trimmed with one per-page op, then the remainder is covered
+	 * by at most one range op per scale, smallest scale first.
+	 */
+	while (pages > 0) {
+		if (!system_supports_tlb_range() || pages % 2 == 1) {
+			arg = __TLBI_VADDR(start, asid);
+			if (last_level) {
+				__tlbi(vale1is, arg);
+				__tlbi_user(vale1is, arg);
+			} else {
+				__tlbi(vae1is, arg);
+				__tlbi_user(vae1is, arg);
+			}
+			start += stride;
+			pages -= stride >> PAGE_SHIFT;
+			nr_page++;
+			continue;
+		}
+
+		num = TLBI_RANGE_NUM(pages, scale);
+		if (num >= 0) {
+			arg = tlbi_range_arg(start, asid, scale, num);
+			if (last_level)
+				tlbi_rvale1is(arg);
+			else
+				tlbi_rvae1is(arg);
+			start += TLBI_RANGE_PAGES(num, scale) << PAGE_SHIFT;
+			pages -= TLBI_RANGE_PAGES(num, scale);
+			nr_range++;
+		}
+		scale++;
+	}
+
+	tlb_stat_add(TLB_STAT_PAGE, nr_page);
+	tlb_stat_add(TLB_STAT_RANGE_OP, nr_range);
+}
+
+void tlb_batch_flush(struct tlb_batch *b)
+{
+	unsigned long asid = ASID(b->mm);
+	unsigned long stride, ops = 0;
+	bool whole_asid = false;
+	int i;
+
+	if (!b->nr)
+		return;
+
+	for (i = 0; i < b->nr; i++) {
+		if (system_supports_tlb_range()) {
+			if ((b->range[i].end - b->range[i].start) >>
+			    PAGE_SHIFT >= MAX_TLBI_RANGE_PAGES)
+				whole_asid = true;
+		} else {
+			ops += tlb_range_ops(&b->range[i], b->stride_shift);
+		}
+	}
+	if (ops >= MAX_TLBI_OPS)
+		whole_asid = true;
+
+	/* make the PTE updates visible to the walker before invalidating */
+	dsb(ishst);
+	if (whole_asid) {
+		__tlbi(aside1is, __TLBI_VADDR(0, asid));
+		__tlbi_user(aside1is, __TLBI_VADDR(0, asid));
+		tlb_stat_add(TLB_STAT_ASID, 1);
+	} else {
+		stride = 1UL << b->stride_shift;
+		for (i = 0; i < b->nr; i++)
+			tlb_flush_one_range(&b->range[i], asid, stride,
+					    b->last_level);
+	}
+	dsb(ish);
+
+	tlb_stat_add(TLB_STAT_FLUSH, 1);
+	tlb_stat_add(TLB_STAT_RANGE, b->nr);
+	tlb_batch_init(b, b->mm);
+}
+EXPORT_SYMBOL_GPL(tlb_batch_flush);
+
+/* single range through the same path, for __flush_tlb_range() callers */
+void __flush_tlb_range_batched(struct mm_struct *mm, unsigned long start,
+			       unsigned long end, unsigned long stride,
+			       bool last_level)
+{
+	struct tlb_batch b;
+
+	tlb_batch_init(&b, mm);
+	tlb_batch_add(&b, start, end, stride, last_level);
+	tlb_batch_flush(&b);
+}
+
+static void tlb_range_check_cpu(void *info)
+{
+	u64 isar0 = read_sysreg(id_aa64isar0_el1);
+
+	if (((isar0 >> ID_AA64ISAR0_TLB_SHIFT) & 0xf) < ID_AA64ISAR0_TLB_RANGE)
+		*(bool *)info = false;
+}
+
+/* a late CPU without range TLBI turns the fast path off for everyone */
+static int tlb_range_cpu_online(unsigned int cpu)
+{
+	bool ok = true;
+
+	tlb_range_check_cpu(&ok);
+	if (!ok && system_supports_tlb_range()) {
+		pr_warn("CPU%u: no range TLBI, using per-page invalidation\n",
+			cpu);
+		static_branch_disable(&tlb_range_key);
+	}
+	return 0;
+}
+
+static int __init tlb_range_init(void)
+{
+	bool ok = true;
+
+	on_each_cpu(tlb_range_check_cpu, &ok, 1);
+	if (ok) {
+		static_branch_enable(&tlb_range_key);
+		pr_info("TLB: using range TLBI for batched invalidation\n");
+	}
+	cpuhp_setup_state_nocalls(CPUHP_AP_ONLINE_DYN, "arm64/tlbbatch:online",
+				  tlb_range_cpu_online, NULL);
+	return 0;
+}
+arch_initcall(tlb_range_init);
+
+#ifdef CONFIG_DEBUG_FS
+static int tlb_batch_show(struct seq_file *m, void *v)
+{
+	unsigned long sum[TLB_STAT_NR] = { };
+	int cpu, i;
+
+	for_each_possible_cpu(cpu)
+		for (i = 0; i < TLB_STAT_NR; i++)
+			sum[i] += per_cpu(tlb_batch_stats, cpu)[i];
+
+	seq_printf(m, "range_tlbi: %s\n",
+		   system_supports_tlb_range() ? "yes" : "no");
+	for (i = 0; i < TLB_STAT_NR; i++)
+		seq_printf(m, "%-12s %lu\n", tlb_stat_names[i], sum[i]);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(tlb_batch);
+
+static int __init tlb_batch_debugfs_init(void)
+{
+	debugfs_create_file("tlb_batch", 0400, NULL, NULL, &tlb_batch_fops);
+	return 0;
+}
+late_initcall(tlb_batch_debugfs_init);
+#endif
@@ -21,6 +21,9 @@
 #include <linux/fs.h>
 #include <linux/slab.h>
 #include <linux/backing-dev.h>
+#include <linux/crypto.h>
+#include <linux/percpu.h>
+#include <linux/zsmalloc.h>
 
 #include <linux/uaccess.h>
 
@@ -58,6 +61,24 @@ struct brd_device {
 	 */
 	spinlock_t		brd_lock;
 	struct radix_tree_root	brd_pages;
+
+	/*
+	 * Compressed mode only: pool holding the compressed blocks, and
+	 * per-cpu compressor transforms.
+	 */
+	struct zs_pool		*brd_zpool;
+	struct crypto_comp * __percpu *brd_tfm;
+	struct brd_zstats {
+		atomic64_t	compr_data_size;	/* bytes in brd_zpool */
+		atomic64_t	pages_stored;	/* blocks holding data */
+		atomic64_t	same_pages;	/* same-filled blocks */
+		atomic64_t	huge_pages;	/* incompressible blocks */
+		atomic64_t	num_reads;
+		atomic64_t	num_writes;
+		atomic64_t	failed_writes;
+		atomic64_t	notify_free;	/* freed by swap slot notify */
+		atomic64_t	miss_free;	/* notify found the slot busy */
+	} brd_zstats;
 };
 
 /*
@@ -291,6 +312,407 @@ static void copy_from_brd(void *dst, struct brd_device *brd,
 	}
 }
 
+/*
+ * Compressed mode, enabled by the rd_compressor parameter.
+ *
+ * brd_pages then holds a struct brd_zslot per page index instead of a
+ * page.  Each PAGE_SIZE block is compressed with the crypto compressor
+ * and stored in the device's zsmalloc pool; blocks filled with a single
+ * repeated word are only recorded by that value, like zswap does.  A slot
+ * is never freed while the device exists, only its data, so readers can
+ * use it after a lockless lookup and serialize on slot->lock.
+ */
+struct brd_zslot {
+	spinlock_t	lock;
+	bool		used;
+	unsigned int	size;	/* 0: same-filled, PAGE_SIZE: stored raw */
+	union {
+		unsigned long handle;
+		unsigned long value;
+	};
+};
+
+/* stored blocks that do not compress below this are kept uncompressed */
+#define BRD_HUGE_SIZE		(PAGE_SIZE / 4 * 3)
+
+static DEFINE_PER_CPU(u8 *, brd_zbuf);
+
+static struct brd_zslot *brd_lookup_zslot(struct brd_device *brd, pgoff_t idx)
+{
+	struct brd_zslot *slot;
+
+	rcu_read_lock();
+	slot = radix_tree_lookup(&brd->brd_pages, idx);
+	rcu_read_unlock();
+
+	return slot;
+}
+
+static struct brd_zslot *brd_insert_zslot(struct brd_device *brd, pgoff_t idx)
+{
+	struct brd_zslot *slot;
+
+	slot = brd_lookup_zslot(brd, idx);
+	if (slot)
+		return slot;
+
+	slot = kzalloc(sizeof(*slot), GFP_NOIO);
+	if (!slot)
+		return NULL;
+	spin_lock_init(&slot->lock);
+
+	if (radix_tree_preload(GFP_NOIO)) {
+		kfree(slot);
+		return NULL;
+	}
+
+	spin_lock(&brd->brd_lock);
+	if (radix_tree_insert(&brd->brd_pages, idx, slot)) {
+		kfree(slot);
+		slot = radix_tree_lookup(&brd->brd_pages, idx);
+		BUG_ON(!slot);
+	}
+	spin_unlock(&brd->brd_lock);
+
+	radix_tree_preload_end();
+
+	return slot;
+}
+
+/* caller must hold slot->lock */
+static void brd_zslot_free_data(struct brd_device *brd, struct brd_zslot *slot)
+{
+	struct brd_zstats *stats = &brd->brd_zstats;
+
+	if (!slot->used)
+		return;
+
+	if (!slot->size) {
+		atomic64_dec(&stats->same_pages);
+	} else {
+		if (slot->size == PAGE_SIZE)
+			atomic64_dec(&stats->huge_pages);
+		atomic64_sub(slot->size, &stats->compr_data_size);
+		zs_free(brd->brd_zpool, slot->handle);
+	}
+	atomic64_dec(&stats->pages_stored);
+	slot->used = false;
+	slot->size = 0;
+	slot->value = 0;
+}
+
+static bool brd_page_same_filled(const void *ptr, unsigned long *value)
+{
+	const unsigned long *page = ptr;
+	unsigned int pos;
+
+	for (pos = 1; pos < PAGE_SIZE / sizeof(*page); pos++) {
+		if (page[pos] != page[0])
+			return false;
+	}
+	*value = page[0];
+	return true;
+}
+
+/*
+ * Read one whole block into dst.  Blocks never written read as zeroes.
+ * Does not sleep.
+ */
+static int brd_zread(struct brd_device *brd, pgoff_t idx, void *dst)
+{
+	struct brd_zslot *slot;
+	struct crypto_comp *tfm;
+	unsigned int dlen = PAGE_SIZE;
+	void *src;
+	int ret = 0;
+
+	atomic64_inc(&brd->brd_zstats.num_reads);
+
+	slot = brd_lookup_zslot(brd, idx);
+	if (!slot) {
+		memset(dst, 0, PAGE_SIZE);
+		return 0;
+	}
+
+	spin_lock(&slot->lock);
+	if (!slot->used || !slot->size) {
+		memset_l(dst, slot->value, PAGE_SIZE / sizeof(unsigned long));
+		goto out;
+	}
+
+	src = zs_map_object(brd->brd_zpool, slot->handle, ZS_MM_RO);
+	if (slot->size == PAGE_SIZE) {
+		memcpy(dst, src, PAGE_SIZE);
+	} else {
+		tfm = *get_cpu_ptr(brd->brd_tfm);
+		ret = crypto_comp_decompress(tfm, src, slot->size, dst, &dlen);
+		put_cpu_ptr(brd->brd_tfm);
+	}
+	zs_unmap_object(brd->brd_zpool, slot->handle);
+out:
+	spin_unlock(&slot->lock);
+
+	if (unlikely(ret)) {
+		pr_err("brd: decompression failed at page %lu\n", idx);
+		return -EIO;
+	}
+	return 0;
+}
+
+/*
+ * Compress and store one whole block from src.  May sleep.
+ */
+static int brd_zwrite(struct brd_device *brd, pgoff_t idx, const void *src)
+{
+	struct brd_zstats *stats = &brd->brd_zstats;
+	struct brd_zslot *slot;
+	struct crypto_comp *tfm;
+	unsigned long handle = 0, value;
+	unsigned int dlen;
+	u8 *dst;
+	void *obj;
+	int ret;
+
+	atomic64_inc(&stats->num_writes);
+
+	slot = brd_insert_zslot(brd, idx);
+	if (!slot)
+		goto fail;
+
+	if (brd_page_same_filled(src, &value)) {
+		spin_lock(&slot->lock);
+		brd_zslot_free_data(brd, slot);
+		slot->used = true;
+		slot->value = value;
+		spin_unlock(&slot->lock);
+		atomic64_inc(&stats->same_pages);
+		atomic64_inc(&stats->pages_stored);
+		return 0;
+	}
+
+compress_again:
+	tfm = *get_cpu_ptr(brd->brd_tfm);
+	dst = this_cpu_read(brd_zbuf);
+	dlen = PAGE_SIZE * 2;
+	ret = crypto_comp_compress(tfm, src, PAGE_SIZE, dst, &dlen);
+	if (unlikely(ret)) {
+		put_cpu_ptr(brd->brd_tfm);
+		if (handle)
+			zs_free(brd->brd_zpool, handle);
+		goto fail;
+	}
+	if (dlen >= BRD_HUGE_SIZE)
+		dlen = PAGE_SIZE;
+
+	/*
+	 * Try the allocation without reclaim first, while this cpu's
+	 * compression buffer is held.  If that fails, allocate with NOIO
+	 * reclaim outside of it and compress once more.
+	 */
+	if (!handle)
+		handle = zs_malloc(brd->brd_zpool, dlen,
+				   __GFP_KSWAPD_RECLAIM | __GFP_NOWARN |
+				   __GFP_HIGHMEM | __GFP_MOVABLE);
+	if (!handle) {
+		put_cpu_ptr(brd->brd_tfm);
+		handle = zs_malloc(brd->brd_zpool, dlen,
+				   GFP_NOIO | __GFP_HIGHMEM | __GFP_MOVABLE);
+		if (handle)
+			goto compress_again;
+		goto fail;
+	}
+
+	obj = zs_map_object(brd->brd_zpool, handle, ZS_MM_WO);
+	memcpy(obj, dlen == PAGE_SIZE ? src : dst, dlen);
+	zs_unmap_object(brd->brd_zpool, handle);
+	put_cpu_ptr(brd->brd_tfm);
+
+	spin_lock(&slot->lock);
+	brd_zslot_free_data(brd, slot);
+	slot->used = true;
+	slot->size = dlen;
+	slot->handle = handle;
+	spin_unlock(&slot->lock);
+
+	if (dlen == PAGE_SIZE)
+		atomic64_inc(&stats->huge_pages);
+	atomic64_add(dlen, &stats->compr_data_size);
+	atomic64_inc(&stats->pages_stored);
+	return 0;
+
+fail:
+	atomic64_inc(&stats->failed_writes);
+	return -ENOMEM;
+}
+
+/* drop the data of every block wholly inside [sector, sector + n) */
+static void brd_zdiscard(struct brd_device *brd, sector_t sector, size_t n)
+{
+	sector_t end = sector + (n >> SECTOR_SHIFT);
+	pgoff_t idx = DIV_ROUND_UP(sector, PAGE_SECTORS);
+	struct brd_zslot *slot;
+
+	for (; ((sector_t)(idx + 1) << PAGE_SECTORS_SHIFT) <= end; idx++) {
+		slot = brd_lookup_zslot(brd, idx);
+		if (!slot)
+			continue;
+		spin_lock(&slot->lock);
+		brd_zslot_free_data(brd, slot);
+		spin_unlock(&slot->lock);
+	}
+}
+
+/*
+ * Process a single bvec of a bio in compressed mode.  Partial blocks go
+ * through a bounce page: read the whole block, then modify and store it.
+ */
+static int brd_do_bvec_comp(struct brd_device *brd, struct page *page,
+			unsigned int len, unsigned int off, unsigned int op,
+			sector_t sector)
+{
+	struct page *bounce = NULL;
+	void *mem, *buf;
+	int err = 0;
+
+	mem = kmap(page);
+	if (op_is_write(op))
+		flush_dcache_page(page);
+
+	while (len && !err) {
+		pgoff_t idx = sector >> PAGE_SECTORS_SHIFT;
+		unsigned int offset = (sector & (PAGE_SECTORS-1)) << SECTOR_SHIFT;
+		unsigned int n = min_t(unsigned int, len, PAGE_SIZE - offset);
+
+		if (n == PAGE_SIZE) {
+			if (op_is_write(op))
+				err = brd_zwrite(brd, idx, mem + off);
+			else
+				err = brd_zread(brd, idx, mem + off);
+			goto next;
+		}
+
+		if (!bounce) {
+			bounce = alloc_page(GFP_NOIO);
+			if (!bounce) {
+				err = -ENOMEM;
+				break;
+			}
+		}
+		buf = page_address(bounce);
+		err = brd_zread(brd, idx, buf);
+		if (err)
+			break;
+		if (op_is_write(op)) {
+			memcpy(buf + offset, mem + off, n);
+			err = brd_zwrite(brd, idx, buf);
+		} else {
+			memcpy(mem + off, buf + offset, n);
+		}
+next:
+		len -= n;
+		off += n;
+		sector += n >> SECTOR_SHIFT;
+	}
+
+	if (!op_is_write(op))
+		flush_dcache_page(page);
+	kunmap(page);
+	if (bounce)
+		__free_page(bounce);
+
+	return err;
+}
+
+/*
+ * Called by swap when a slot on this device is freed, possibly under
+ * the swap_info lock, so it must not sleep and skips busy slots.
+ */
+static void brd_swap_slot_free_notify(struct block_device *bdev,
+				      unsigned long offset)
+{
+	struct brd_device *brd = bdev->bd_disk->private_data;
+	struct brd_zslot *slot;
+	pgoff_t idx;
+
+	if (!brd->brd_zpool)
+		return;
+
+	idx = offset + (get_start_sect(bdev) >> PAGE_SECTORS_SHIFT);
+	slot = brd_lookup_zslot(brd, idx);
+	if (!slot)
+		return;
+
+	if (!spin_trylock(&slot->lock)) {
+		atomic64_inc(&brd->brd_zstats.miss_free);
+		return;
+	}
+	brd_zslot_free_data(brd, slot);
+	spin_unlock(&slot->lock);
+	atomic64_inc(&brd->brd_zstats.notify_free);
+}
+
+static void brd_free_zslots(struct brd_device *brd)
+{
+	struct radix_tree_iter iter;
+	struct brd_zslot *slot;
+	void __rcu **rslot;
+
+	radix_tree_for_each_slot(rslot, &brd->brd_pages, &iter, 0) {
+		slot = radix_tree_deref_slot(rslot);
+		radix_tree_iter_delete(&brd->brd_pages, &iter, rslot);
+		brd_zslot_free_data(brd, slot);
+		kfree(slot);
+	}
+}
+
+static void brd_zfini(struct brd_device *brd)
+{
+	int cpu;
+
+	if (brd->brd_tfm) {
+		for_each_possible_cpu(cpu) {
+			struct crypto_comp *tfm = *per_cpu_ptr(brd->brd_tfm, cpu);
+
+			if (!IS_ERR_OR_NULL(tfm))
+				crypto_free_comp(tfm);
+		}
+		free_percpu(brd->brd_tfm);
+		brd->brd_tfm = NULL;
+	}
+	if (brd->brd_zpool) {
+		zs_destroy_pool(brd->brd_zpool);
+		brd->brd_zpool = NULL;
+	}
+}
+
+static int brd_zinit(struct brd_device *brd, const char *compressor)
+{
+	struct crypto_comp *tfm;
+	char name[16];
+	int cpu;
+
+	snprintf(name, sizeof(name), "brd%d", brd->brd_number);
+	brd->brd_zpool = zs_create_pool(name);
+	if (!brd->brd_zpool)
+		return -ENOMEM;
+
+	brd->brd_tfm = alloc_percpu(struct crypto_comp *);
+	if (!brd->brd_tfm)
+		goto fail;
+
+	for_each_possible_cpu(cpu) {
+		tfm = crypto_alloc_comp(compressor, 0, 0);
+		if (IS_ERR_OR_NULL(tfm))
+			goto fail;
+		*per_cpu_ptr(brd->brd_tfm, cpu) = tfm;
+	}
+	return 0;
+
+fail:
+	brd_zfini(brd);
+	return -ENOMEM;
+}
+
 /*
  * Process a single bvec of a bio.
  */
@@ -301,6 +723,9 @@ static int brd_do_bvec(struct brd_device *brd, struct page *page,
 	void *mem;
 	int err = 0;
 
+	if (brd->brd_zpool)
+		return brd_do_bvec_comp(brd, page, len, off, op, sector);
+
     /*这里如果是写的话, 需要提前准备一下. 为什么? 
         假设预设置brd的容量是1G, 而实际使用了1M, 那么只会分配1M的大小,
         采取这种延迟分配的方式可以节省内存. 那如果是读取呢? 如果读取到未曾写
@@ -337,6 +762,13 @@ static blk_qc_t brd_make_request(struct request_queue *q, struct bio *bio)
 	if (bio_end_sector(bio) > get_capacity(bio->bi_disk))
 		goto io_error;
 
+	if (bio_op(bio) == REQ_OP_DISCARD) {
+		if (brd->brd_zpool)
+			brd_zdiscard(brd, sector, bio->bi_iter.bi_size);
+		bio_endio(bio);
+		return BLK_QC_T_NONE;
+	}
+
 	bio_for_each_segment(bvec, bio, iter) {
 		unsigned int len = bvec.bv_len;
 		int err;
@@ -378,8 +810,69 @@ static int brd_rw_page(struct block_device *bdev, sector_t sector,
 static const struct block_device_operations brd_fops = {
 	.owner =		THIS_MODULE,
 	.rw_page =		brd_rw_page,
+	.swap_slot_free_notify =	brd_swap_slot_free_notify,
 };
 
+/*
+ * Compressed mode statistics, in /sys/block/ramX/.
+ *
+ * mm_stat: orig_data_size compr_data_size mem_used_total same_pages
+ *          huge_pages
+ * io_stat: num_reads num_writes failed_writes notify_free miss_free
+ */
+static ssize_t mm_stat_show(struct device *dev,
+			    struct device_attribute *attr, char *buf)
+{
+	struct brd_device *brd = dev_to_disk(dev)->private_data;
+	struct brd_zstats *stats = &brd->brd_zstats;
+
+	return scnprintf(buf, PAGE_SIZE, "%8llu %8llu %8llu %8llu %8llu\n",
+			(u64)atomic64_read(&stats->pages_stored) << PAGE_SHIFT,
+			(u64)atomic64_read(&stats->compr_data_size),
+			(u64)zs_get_total_pages(brd->brd_zpool) << PAGE_SHIFT,
+			(u64)atomic64_read(&stats->same_pages),
+			(u64)atomic64_read(&stats->huge_pages));
+}
+
+static ssize_t io_stat_show(struct device *dev,
+			    struct device_attribute *attr, char *buf)
+{
+	struct brd_device *brd = dev_to_disk(dev)->private_data;
+	struct brd_zstats *stats = &brd->brd_zstats;
+
+	return scnprintf(buf, PAGE_SIZE, "%8llu %8llu %8llu %8llu %8llu\n",
+			(u64)atomic64_read(&stats->num_reads),
+			(u64)atomic64_read(&stats->num_writes),
+			(u64)atomic64_read(&stats->failed_writes),
+			(u64)atomic64_read(&stats->notify_free),
+			(u64)atomic64_read(&stats->miss_free));
+}
+
+static DEVICE_ATTR_RO(mm_stat);
+static DEVICE_ATTR_RO(io_stat);
+
+static struct attribute *brd_comp_attrs[] = {
+	&dev_attr_mm_stat.attr,
+	&dev_attr_io_stat.attr,
+	NULL,
+};
+
+static const struct attribute_group brd_comp_group = {
+	.attrs = brd_comp_attrs,
+};
+
+static const struct attribute_group *brd_comp_groups[] = {
+	&brd_comp_group,
+	NULL,
+};
+
+static void brd_add_disk(struct brd_device *brd)
+{
+	brd->brd_disk->queue = brd->brd_queue;
+	device_add_disk(NULL, brd->brd_disk,
+			brd->brd_zpool ? brd_comp_groups : NULL);
+}
+
 /*
  * And now the modules code and kernel interface.
  */
@@ -395,6 +888,11 @@ static int max_part = 1;
 module_param(max_part, int, 0444);
 MODULE_PARM_DESC(max_part, "Num Minors to reserve between devices");
 
+static char *rd_compressor;
+module_param(rd_compressor, charp, 0444);
+MODULE_PARM_DESC(rd_compressor,
+		 "Crypto compressor to store RAM disk contents with (e.g. lzo), unset for uncompressed");
+
 MODULE_LICENSE("GPL");
 MODULE_ALIAS_BLOCKDEV_MAJOR(RAMDISK_MAJOR);
 MODULE_ALIAS("rd");
@@ -428,9 +926,12 @@ static struct brd_device *brd_alloc(int i)
 	spin_lock_init(&brd->brd_lock);
 	INIT_RADIX_TREE(&brd->brd_pages, GFP_ATOMIC);
 
+	if (rd_compressor && brd_zinit(brd, rd_compressor))
+		goto out_free_dev;
+
 	brd->brd_queue = blk_alloc_queue(GFP_KERNEL);
 	if (!brd->brd_queue)
-		goto out_free_dev;
+		goto out_free_comp;
 /*
     给brd_queue设置处理请求队列的回调brd_make_request
 */
@@ -465,10 +966,19 @@ static struct brd_device *brd_alloc(int i)
 	blk_queue_flag_set(QUEUE_FLAG_NONROT, brd->brd_queue);
 	blk_queue_flag_clear(QUEUE_FLAG_ADD_RANDOM, brd->brd_queue);
 
+	/* swap discards freed slots, which releases their compressed data */
+	if (brd->brd_zpool) {
+		brd->brd_queue->limits.discard_granularity = PAGE_SIZE;
+		blk_queue_max_discard_sectors(brd->brd_queue, UINT_MAX);
+		blk_queue_flag_set(QUEUE_FLAG_DISCARD, brd->brd_queue);
+	}
+
 	return brd;
 
 out_free_queue:
 	blk_cleanup_queue(brd->brd_queue);
+out_free_comp:
+	brd_zfini(brd);
 out_free_dev:
 	kfree(brd);
 out:
@@ -479,7 +989,11 @@ static void brd_free(struct brd_device *brd)
 {
 	put_disk(brd->brd_disk);
 	blk_cleanup_queue(brd->brd_queue);
-	brd_free_pages(brd);
+	if (brd->brd_zpool) {
+		brd_free_zslots(brd);
+		brd_zfini(brd);
+	} else
+		brd_free_pages(brd);
 	kfree(brd);
 }
 
@@ -495,8 +1009,7 @@ static struct brd_device *brd_init_one(int i, bool *new)
 
 	brd = brd_alloc(i);
 	if (brd) {
-		brd->brd_disk->queue = brd->brd_queue;
-		add_disk(brd->brd_disk);
+		brd_add_disk(brd);
 		list_add_tail(&brd->brd_list, &brd_devices);
 	}
 	*new = true;
@@ -528,6 +1041,39 @@ static struct kobject *brd_probe(dev_t dev, int *part, void *data)
 	return kobj;
 }
 
+static void brd_zbuf_fini(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		kfree(per_cpu(brd_zbuf, cpu));
+		per_cpu(brd_zbuf, cpu) = NULL;
+	}
+}
+
+/* per-cpu compression buffers, shared by all compressed devices */
+static int __init brd_zbuf_init(void)
+{
+	int cpu;
+
+	if (!crypto_has_comp(rd_compressor, 0, 0)) {
+		pr_err("brd: compressor %s not available\n", rd_compressor);
+		return -ENOENT;
+	}
+
+	for_each_possible_cpu(cpu) {
+		u8 *buf = kmalloc_node(PAGE_SIZE * 2, GFP_KERNEL,
+				       cpu_to_node(cpu));
+
+		if (!buf) {
+			brd_zbuf_fini();
+			return -ENOMEM;
+		}
+		per_cpu(brd_zbuf, cpu) = buf;
+	}
+	return 0;
+}
+
 static int __init brd_init(void)
 {
 	struct brd_device *brd, *next;
@@ -557,6 +1103,15 @@ static int __init brd_init(void)
 	if (unlikely(!max_part))
 		max_part = 1;
 
+	if (rd_compressor) {
+		int err = brd_zbuf_init();
+
+		if (err) {
+			unregister_blkdev(RAMDISK_MAJOR, "ramdisk");
+			return err;
+		}
+	}
+
 	for (i = 0; i < rd_nr; i++) {
 		brd = brd_alloc(i);
 		if (!brd)
@@ -573,8 +1128,7 @@ static int __init brd_init(void)
 		 * associate with queue just before adding disk for
 		 * avoiding to mess up failure path
 		 */
-		brd->brd_disk->queue = brd->brd_queue;
-		add_disk(brd->brd_disk);
+		brd_add_disk(brd);
 	}
 /*
      这里注册整个RAMDISK_MAJOR的区域, 根据上下文的注释来看, 
@@ -594,6 +1148,7 @@ out_free:
 		brd_free(brd);
 	}
 	unregister_blkdev(RAMDISK_MAJOR, "ramdisk");
+	brd_zbuf_fini();
 
 	pr_info("brd: module NOT loaded !!!\n");
 	return -ENOMEM;
@@ -608,6 +1163,7 @@ static void __exit brd_exit(void)
 
 	blk_unregister_region(MKDEV(RAMDISK_MAJOR, 0), 1UL << MINORBITS);
 	unregister_blkdev(RAMDISK_MAJOR, "ramdisk");
+	brd_zbuf_fini();
 
 	pr_info("brd: module unloaded\n");
 }
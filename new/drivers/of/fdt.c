@@ -546,6 +546,38 @@ void *initial_boot_params;
 
 static u32 of_fdt_crc32;
 
+/*
+ * /memreserve/ entries and reserved-memory 'reg' ranges are collected here
+ * and handed to memblock together; reserving them one by one searches and
+ * shifts the reserved array for each of them.  no-map ranges are removed
+ * from memory right away.
+ */
+static struct memblock_region fdt_reserve_batch[64] __initdata;
+static int fdt_reserve_nr __initdata;
+
+static void __init fdt_reserve_flush(void)
+{
+	if (fdt_reserve_nr &&
+	    memblock_reserve_bulk(fdt_reserve_batch, fdt_reserve_nr))
+		pr_err("Reserved memory: failed to reserve %d regions\n",
+		       fdt_reserve_nr);
+	fdt_reserve_nr = 0;
+}
+
+static int __init fdt_reserve_queue(phys_addr_t base, phys_addr_t size,
+				    bool nomap)
+{
+	if (nomap)
+		return early_init_dt_reserve_memory_arch(base, size, nomap);
+
+	if (fdt_reserve_nr == ARRAY_SIZE(fdt_reserve_batch))
+		fdt_reserve_flush();
+	fdt_reserve_batch[fdt_reserve_nr].base = base;
+	fdt_reserve_batch[fdt_reserve_nr].size = size;
+	fdt_reserve_nr++;
+	return 0;
+}
+
 /**
  * res_mem_reserve_reg() - reserve all memory described in 'reg' property
  */
@@ -574,8 +606,7 @@ static int __init __reserved_mem_reserve_reg(unsigned long node,
 		base = dt_mem_next_cell(dt_root_addr_cells, &prop);
 		size = dt_mem_next_cell(dt_root_size_cells, &prop);
 
-		if (size &&
-		    early_init_dt_reserve_memory_arch(base, size, nomap) == 0)
+		if (size && fdt_reserve_queue(base, size, nomap) == 0)
 			pr_debug("Reserved memory: reserved region for node '%s': base %pa, size %ld MiB\n",
 				uname, &base, (unsigned long)size / SZ_1M);
 		else
@@ -698,7 +729,7 @@ void __init early_init_fdt_scan_reserved_mem(void)
 		if (!size)
 			break;
 		/* 保留相应的内存 */
-		early_init_dt_reserve_memory_arch(base, size, 0);
+		fdt_reserve_queue(base, size, false);
 	}
 
 	/**
@@ -706,6 +737,8 @@ void __init early_init_fdt_scan_reserved_mem(void)
 	 * 之后调用fdt_init_reserved_mem函数进行内存预留的动作
 	 */
 	of_scan_flat_dt(__fdt_scan_reserved_mem, NULL);
+	/* 动态分配之前, 先把收集到的静态保留区域一次性交给memblock */
+	fdt_reserve_flush();
 	/* 处理动态保留内存 */
 	fdt_init_reserved_mem();
 }
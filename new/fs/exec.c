@@ -1000,6 +1000,7 @@ static int exec_mmap(struct mm_struct *mm)
 
 	if (old_mm) {
 		sync_mm_rss(old_mm);
+		vmacache_sync_stats(tsk, old_mm);
 		/*
 		 * Make sure that if there is a core dump in progress
 		 * for the old mm, we get out and die instead of going
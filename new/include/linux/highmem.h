@@ -66,6 +66,22 @@ void kmap_flush_unused(void);
 
 struct page *kmap_to_page(void *addr);
 
+#ifdef ARCH_HAS_KMAP_LOCAL
+void *kmap_local_page(struct page *page);
+void kunmap_local(void *vaddr);
+void __kmap_local_sched_in(void);
+#else
+static inline void *kmap_local_page(struct page *page)
+{
+	return kmap(page);
+}
+
+static inline void kunmap_local(void *vaddr)
+{
+	kunmap(kmap_to_page(vaddr));
+}
+#endif
+
 #else /* CONFIG_HIGHMEM */
 
 static inline unsigned int nr_free_highpages(void) { return 0; }
@@ -115,6 +131,16 @@ static inline void __kunmap_atomic(void *addr)
 #define kmap_flush_unused()	do {} while(0)
 #endif
 
+static inline void *kmap_local_page(struct page *page)
+{
+	might_sleep();
+	return page_address(page);
+}
+
+static inline void kunmap_local(void *vaddr)
+{
+}
+
 #endif /* CONFIG_HIGHMEM */
 
 #if defined(CONFIG_HIGHMEM) || defined(CONFIG_X86_32)
@@ -0,0 +1,67 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Memory pool with per-CPU element caches in front of the shared reserve.
+ *
+ * mempool_alloc() pops reserved elements under pool->lock, so when the
+ * backing allocator starts failing every user of a busy pool serializes
+ * on that one lock.  A struct mempool_pcp spreads up to half of its
+ * reserve over small per-CPU caches which are only touched with local
+ * interrupts off.  The elements in the caches still count against
+ * min_nr, and a task about to sleep for an element pulls them back into
+ * the shared reserve first, so the forward-progress guarantee of a
+ * plain mempool is kept.
+ */
+#ifndef _LINUX_MEMPOOL_PCP_H
+#define _LINUX_MEMPOOL_PCP_H
+
+#include <linux/atomic.h>
+#include <linux/list.h>
+#include <linux/mempool.h>
+#include <linux/percpu.h>
+
+/* elements a single CPU may hold back */
+#define MEMPOOL_PCP_BATCH	4
+
+enum mempool_pcp_stat {
+	MEMPOOL_PCP_ALLOC,		/* served by alloc_fn() */
+	MEMPOOL_PCP_CACHE_HIT,		/* reserve element from this CPU */
+	MEMPOOL_PCP_RESERVE_HIT,	/* reserve element from pool->lock */
+	MEMPOOL_PCP_FAIL,		/* !__GFP_DIRECT_RECLAIM and empty */
+	MEMPOOL_PCP_WAIT,		/* slept for an element */
+	MEMPOOL_PCP_WAIT_NS,		/* time spent asleep */
+	MEMPOOL_PCP_DRAIN,		/* elements pulled back from caches */
+	MEMPOOL_PCP_NR_STATS,
+};
+
+struct mempool_pcp_cpu {
+	unsigned int nr;
+	void *elements[MEMPOOL_PCP_BATCH];
+	u64 stat[MEMPOOL_PCP_NR_STATS];
+};
+
+struct mempool_pcp {
+	mempool_t pool;			/* shared reserve */
+	struct mempool_pcp_cpu __percpu *pcp;
+	atomic_t cached;		/* reserve elements in pcp caches */
+	int max_cached;
+	const char *name;
+	struct list_head list;		/* mempool_pcp_list, for debugfs */
+};
+
+extern int mempool_pcp_init(struct mempool_pcp *pp, const char *name,
+			    int min_nr, mempool_alloc_t *alloc_fn,
+			    mempool_free_t *free_fn, void *pool_data);
+extern void mempool_pcp_exit(struct mempool_pcp *pp);
+extern void *mempool_pcp_alloc(struct mempool_pcp *pp, gfp_t gfp_mask)
+	__malloc;
+extern void mempool_pcp_free(void *element, struct mempool_pcp *pp);
+
+static inline int mempool_pcp_init_slab_pool(struct mempool_pcp *pp,
+					     const char *name, int min_nr,
+					     struct kmem_cache *kc)
+{
+	return mempool_pcp_init(pp, name, min_nr, mempool_alloc_slab,
+				mempool_free_slab, (void *)kc);
+}
+
+#endif /* _LINUX_MEMPOOL_PCP_H */
@@ -349,6 +349,7 @@ extern pgprot_t protection_map[16];
 #define FAULT_FLAG_USER		0x40	/* The fault originated in userspace */
 #define FAULT_FLAG_REMOTE	0x80	/* faulting for non current tsk/mm */
 #define FAULT_FLAG_INSTRUCTION  0x100	/* The fault was during an instruction fetch */
+#define FAULT_FLAG_SPECULATIVE	0x200	/* Speculative fault, not holding mmap_sem */
 
 #define FAULT_FLAG_TRACE \
 	{ FAULT_FLAG_WRITE,		"WRITE" }, \
@@ -407,6 +408,10 @@ struct vm_fault {
 					 * page table to avoid allocation from
 					 * atomic context.
 					 */
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+	unsigned int sequence;		/* vma->vm_sequence at fault start */
+	pmd_t orig_pmd;			/* value of *pmd at fault start */
+#endif
 };
 
 /* page entry size for vm->huge_fault() */
@@ -491,8 +496,32 @@ static inline void vma_init(struct vm_area_struct *vma, struct mm_struct *mm)
 	vma->vm_mm = mm;
 	vma->vm_ops = &dummy_vm_ops;
 	INIT_LIST_HEAD(&vma->anon_vma_chain);
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+	seqcount_init(&vma->vm_sequence);
+	atomic_set(&vma->vm_ref_count, 1);
+#endif
+}
+
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+/*
+ * Every change to a vma that is linked in its mm must be bracketed with
+ * vm_write_begin()/vm_write_end(), under mmap_sem held for write (or
+ * page_table_lock for stack expansion), so speculative faults notice it.
+ */
+static inline void vm_write_begin(struct vm_area_struct *vma)
+{
+	write_seqcount_begin(&vma->vm_sequence);
 }
 
+static inline void vm_write_end(struct vm_area_struct *vma)
+{
+	write_seqcount_end(&vma->vm_sequence);
+}
+#else
+static inline void vm_write_begin(struct vm_area_struct *vma) { }
+static inline void vm_write_end(struct vm_area_struct *vma) { }
+#endif
+
 static inline void vma_set_anonymous(struct vm_area_struct *vma)
 {
 	vma->vm_ops = NULL;
@@ -1485,8 +1514,35 @@ int generic_error_remove_page(struct address_space *mapping, struct page *page);
 int invalidate_inode_page(struct page *page);
 
 #ifdef CONFIG_MMU
+extern int set_fork_share_pte(struct mm_struct *mm, bool enable);
+extern int unshare_pte_table(struct vm_area_struct *vma, pmd_t *pmd,
+			     unsigned long addr);
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+struct iovec;
+extern int madvise_collapse(struct mm_struct *mm, unsigned long start,
+			    unsigned long end);
+extern int madvise_collapse_vec(struct mm_struct *mm, const struct iovec *vec,
+				unsigned long vlen, int *status);
+#else
+static inline int madvise_collapse(struct mm_struct *mm, unsigned long start,
+				   unsigned long end)
+{
+	return -EINVAL;
+}
+static inline int madvise_collapse_vec(struct mm_struct *mm,
+				       const struct iovec *vec,
+				       unsigned long vlen, int *status)
+{
+	return -EINVAL;
+}
+#endif
 extern vm_fault_t handle_mm_fault(struct vm_area_struct *vma,
 			unsigned long address, unsigned int flags);
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+extern vm_fault_t handle_speculative_fault(struct mm_struct *mm,
+			unsigned long address, unsigned int flags,
+			unsigned long access);
+#endif
 extern int fixup_user_fault(struct task_struct *tsk, struct mm_struct *mm,
 			    unsigned long address, unsigned int fault_flags,
 			    bool *unlocked);
@@ -1987,6 +2043,7 @@ static inline bool pgtable_page_ctor(struct page *page)
 {
 	if (!ptlock_init(page))
 		return false;
+	atomic_set(&page->pt_share_count, 0);
 	__SetPageTable(page);
 	inc_zone_page_state(page, NR_PAGETABLE);
 	return true;
@@ -1995,10 +2052,23 @@ static inline bool pgtable_page_ctor(struct page *page)
 static inline void pgtable_page_dtor(struct page *page)
 {
 	ptlock_free(page);
+	/* overlays page->mapping, which must be NULL when freed */
+	page->pt_share_owner = NULL;
 	__ClearPageTable(page);
 	dec_zone_page_state(page, NR_PAGETABLE);
 }
 
+#ifdef CONFIG_MMU
+/*
+ * Whether the PTE table @pmd points to is shared with other mms, see
+ * unshare_pte_table().  @pmd must point to a PTE table.
+ */
+static inline bool pte_table_shared(pmd_t pmd)
+{
+	return atomic_read(&pmd_page(pmd)->pt_share_count) != 0;
+}
+#endif
+
 /*
 通过PMD 和地址addr 获取pte 页表项，
 */
@@ -2326,8 +2396,7 @@ extern int __split_vma(struct mm_struct *, struct vm_area_struct *,
 extern int split_vma(struct mm_struct *, struct vm_area_struct *,
 	unsigned long addr, int new_below);
 extern int insert_vm_struct(struct mm_struct *, struct vm_area_struct *);
-extern void __vma_link_rb(struct mm_struct *, struct vm_area_struct *,
-	struct rb_node **, struct rb_node *);
+extern void __vma_link_tree(struct mm_struct *, struct vm_area_struct *);
 extern void unlink_file_vma(struct vm_area_struct *);
 extern struct vm_area_struct *copy_vma(struct vm_area_struct **,
 	unsigned long addr, unsigned long len, pgoff_t pgoff,
@@ -2380,6 +2449,9 @@ extern unsigned long do_mmap(struct file *file, unsigned long addr,
 	struct list_head *uf);
 extern int __do_munmap(struct mm_struct *, unsigned long, size_t,
 		       struct list_head *uf, bool downgrade);
+extern int set_async_teardown(struct mm_struct *mm, bool enable);
+extern unsigned long async_teardown_pending(void);
+extern bool wait_for_async_teardown(void);
 extern int do_munmap(struct mm_struct *, unsigned long, size_t,
 		     struct list_head *uf);
 
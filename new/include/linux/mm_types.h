@@ -9,6 +9,8 @@
 #include <linux/spinlock.h>
 #include <linux/rbtree.h>
 #include <linux/rwsem.h>
+#include <linux/seqlock.h>
+#include <linux/vma_tree.h>
 #include <linux/completion.h>
 #include <linux/cpumask.h>
 #include <linux/uprobes.h>
@@ -200,10 +202,12 @@ struct page {
 		struct {	/* Page table pages */
 			unsigned long _pt_pad_1;	/* compound_head */
 			pgtable_t pmd_huge_pte; /* protected by page->ptl */
-			unsigned long _pt_pad_2;	/* mapping */
+			/* mapping: rss owner of a PTE table shared by fork */
+			struct mm_struct *pt_share_owner;
 			union {
 				struct mm_struct *pt_mm; /* x86 pgds only */
 				atomic_t pt_frag_refcount; /* powerpc */
+				atomic_t pt_share_count; /* PTE tables */
 			};
 #if ALLOC_SPLIT_PTLOCKS
 			spinlock_t *ptl;
@@ -377,16 +381,8 @@ struct vm_area_struct {
 	/* 该vma的在一个进程的vma链表中的前驱vma和后驱vma指针，
           链表中的vma都是按地址来排序的*/
 	struct vm_area_struct *vm_next, *vm_prev;
-    /* 红黑树中对应的节点 */ 
-	struct rb_node vm_rb;
-
-	/*
-	 * Largest free memory gap in bytes to the left of this VMA.
-	 * Either between this VMA and vma->vm_prev, or between one of the
-	 * VMAs below us in the VMA rbtree and its ->vm_prev. This helps
-	 * get_unmapped_area find a free area of the right size.
-	 */
-	unsigned long rb_subtree_gap;
+    /* B树中保存该vma的叶子节点 */
+	struct vmt_node *vm_tree_node;	/* leaf of mm->mm_vt holding us */
 
 	/* Second cache line starts here. */
     /* 所属的内存描述符 */
@@ -433,6 +429,19 @@ struct vm_area_struct {
 	void * vm_private_data;		/* was vm_pte (shared mem) */
 
 	atomic_long_t swap_readahead_info;
+	atomic_long_t anon_fault_around_info;	/* see do_anon_fault_around() */
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+	/*
+	 * vm_sequence is bumped around every change of the fields above
+	 * (vm_write_begin/end), so a fault handled without mmap_sem can
+	 * tell the vma changed under it.  vm_ref_count keeps the vma and
+	 * its file alive while such a fault uses it, see get_vma(), and
+	 * the memory itself is freed after a grace period.
+	 */
+	seqcount_t vm_sequence;
+	atomic_t vm_ref_count;
+	struct rcu_head vm_rcu;
+#endif
 #ifndef CONFIG_MMU
 	struct vm_region *vm_region;	/* NOMMU mapping region */
 #endif
@@ -474,10 +483,17 @@ mmap区的基地址就越小。
 */
 		struct vm_area_struct *mmap;		/* list of VMAs */
 /*
-	指向进程所有虚存区域构成的红黑树的根节点
+	进程所有虚存区域构成的B树，叶子节点按地址保存vma
 */
-		struct rb_root mm_rb;
+		struct vma_tree mm_vt;
 		u64 vmacache_seqnum;                   /* per-thread vmacache */
+		/* vmacache lookups of all threads, see vmacache_sync_stats() */
+		atomic_long_t vmacache_hits;
+		atomic_long_t vmacache_misses;
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+		/* lets lockless mm_vt lookups detect a concurrent update */
+		seqcount_t mm_vt_seq;
+#endif
 #ifdef CONFIG_MMU
 		unsigned long (*get_unmapped_area) (struct file *filp,
 				unsigned long addr, unsigned long len,
@@ -566,6 +582,12 @@ mmap区的基地址就越小。
     // 任务在用户态的栈的大小
 		unsigned long stack_vm;	   /* VM_STACK */
 		unsigned long def_flags;
+		/* unmap in the background, PR_SET_ASYNC_TEARDOWN */
+		bool async_teardown;
+		/* share PTE tables on fork, PR_SET_FORK_SHARE_PTE */
+		bool fork_share_pte;
+		/* serializes unsharing of the PTE tables shared by fork */
+		struct mutex pte_share_mutex;
 /*
 可执行代码占用的虚拟地址空间区域, 其开始和结束分别通过 start_code和end_code标记.
 
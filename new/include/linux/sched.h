@@ -732,6 +732,19 @@ enum perf_event_task_context {
 struct wake_q_node {
 	struct wake_q_node *next;
 };
+
+#ifdef CONFIG_HIGHMEM
+/* kmap_local_page() mappings one task may hold at a time */
+#define KM_LOCAL_MAX		16
+
+/* The kmap_local_page() slots of a task, innermost last; see mm/highmem.c. */
+struct kmap_ctrl {
+	int			nr;
+	/* CPU whose TLB is known to be current for the slots */
+	int			cpu;
+	unsigned short		slot[KM_LOCAL_MAX];
+};
+#endif
 /*
 进程控制块包括:
 	进程的运行状态
@@ -907,6 +920,9 @@ struct task_struct {
 
 	/* Per-thread vma caching: */
 	struct vmacache			vmacache;
+	/* vmacache hits/misses not yet folded into mm, like rss_stat: */
+	unsigned int			vmacache_hits;
+	unsigned int			vmacache_misses;
 
 #ifdef SPLIT_RSS_COUNTING
     /* 用来记录缓冲信息 */
@@ -1502,6 +1518,9 @@ struct task_struct {
 	unsigned long			task_state_change;
 #endif
 	int				pagefault_disabled;
+#ifdef CONFIG_HIGHMEM
+	struct kmap_ctrl		kmap_ctrl;
+#endif
 #ifdef CONFIG_MMU
 	struct task_struct		*oom_reaper_list;
 #endif
@@ -0,0 +1,58 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _LINUX_VMA_TREE_H
+#define _LINUX_VMA_TREE_H
+
+/*
+ * B-tree index of the vmas of an mm, see mm/vma_tree.c.
+ */
+#include <linux/types.h>
+#include <linux/compiler.h>
+#include <linux/init.h>
+
+struct vm_area_struct;
+struct vmt_node;
+
+struct vma_tree {
+	struct vmt_node *root;
+	unsigned int height;		/* 0 when empty, 1 for a single leaf */
+	struct vmt_node *reserve;	/* nodes set aside by vma_tree_preload() */
+	unsigned int nr_reserve;
+};
+
+static inline void vma_tree_init(struct vma_tree *vt)
+{
+	vt->root = NULL;
+	vt->height = 0;
+	vt->reserve = NULL;
+	vt->nr_reserve = 0;
+}
+
+static inline bool vma_tree_empty(struct vma_tree *vt)
+{
+	return !READ_ONCE(vt->root);
+}
+
+extern void __init vma_tree_cache_init(void);
+extern int vma_tree_preload(struct vma_tree *vt, gfp_t gfp);
+extern void vma_tree_destroy(struct vma_tree *vt);
+
+extern void vma_tree_insert(struct vma_tree *vt, struct vm_area_struct *vma,
+			    struct vm_area_struct *prev);
+extern void vma_tree_erase(struct vma_tree *vt, struct vm_area_struct *vma);
+extern void vma_tree_update(struct vm_area_struct *vma);
+
+extern struct vm_area_struct *vma_tree_find(struct vma_tree *vt,
+					    unsigned long addr);
+extern struct vm_area_struct *vma_tree_last(struct vma_tree *vt);
+extern struct vm_area_struct *vma_tree_gap_up(struct vma_tree *vt,
+		unsigned long length, unsigned long low_limit,
+		unsigned long high_limit);
+extern struct vm_area_struct *vma_tree_gap_down(struct vma_tree *vt,
+		unsigned long length, unsigned long low_limit,
+		unsigned long high_limit);
+
+#ifdef CONFIG_DEBUG_VM_RB
+extern int vma_tree_validate(struct vma_tree *vt);
+#endif
+
+#endif /* _LINUX_VMA_TREE_H */
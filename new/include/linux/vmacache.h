@@ -0,0 +1,39 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __LINUX_VMACACHE_H
+#define __LINUX_VMACACHE_H
+
+#include <linux/sched.h>
+#include <linux/mm.h>
+
+struct seq_file;
+
+static inline void vmacache_flush(struct task_struct *tsk)
+{
+	memset(tsk->vmacache.vmas, 0, sizeof(tsk->vmacache.vmas));
+}
+
+extern void vmacache_update(unsigned long addr, struct vm_area_struct *newvma);
+extern struct vm_area_struct *vmacache_find(struct mm_struct *mm,
+						    unsigned long addr);
+
+#ifndef CONFIG_MMU
+extern struct vm_area_struct *vmacache_find_exact(struct mm_struct *mm,
+						  unsigned long start,
+						  unsigned long end);
+#endif
+
+extern void vmacache_sync_stats(struct task_struct *tsk, struct mm_struct *mm);
+#ifdef CONFIG_PROC_FS
+extern void vmacache_report_usage(struct seq_file *m, struct mm_struct *mm);
+#endif
+
+/*
+ * Only removing a vma can leave a stale pointer in a cache: lookups check
+ * the bounds of what they find, so a newly linked vma cannot be shadowed.
+ */
+static inline void vmacache_invalidate(struct mm_struct *mm)
+{
+	mm->vmacache_seqnum++;
+}
+
+#endif /* __LINUX_VMACACHE_H */
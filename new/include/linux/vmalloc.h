@@ -21,6 +21,7 @@ struct notifier_block;		/* in notifier.h */
 #define VM_UNINITIALIZED	0x00000020	/* vm_struct is not fully initialized */
 #define VM_NO_GUARD		0x00000040      /* don't add guard page */
 #define VM_KASAN		0x00000080      /* has allocated kasan shadow memory */
+#define VM_ALLOW_HUGE_VMAP	0x00000100      /* may be mapped with huge pages */
 /* bits [20..32] reserved for arch specific ioremap internals */
 
 /*
@@ -44,6 +45,7 @@ struct vm_struct {
 				       * VM_ALLOC标志表示当前虚拟内存块是给vmalloc函数使用，映射的是实际物理内存(RAM);VM_IOREMAP表示当前虚拟内存块是给ioremap相关函数使用，映射的是I/O空间地址，也就是设备内存*/
 	struct page		**pages;/*是被映射的物理内存页面所形成的数组收地址*/
 	unsigned int		nr_pages;/*映射的物理页数量*/
+	unsigned int		page_order;/*映射粒度，物理上连续的2^page_order个页面一块*/
 /*
 	phys_addr仅当用ioremap映射了由物理地址描述的物理内存区域时才需要
 */
@@ -62,7 +64,12 @@ struct vmap_area {
 	struct list_head list;          /* address sorted list */
 	struct llist_node purge_list;    /* "lazy purge" list */
 	struct vm_struct *vm;
-	struct rcu_head rcu_head;
+	union {
+		/* largest free range below this one in the free tree */
+		unsigned long subtree_max_size;
+		/* CPU that lazily freed the area, see __purge_vmap_area_lazy() */
+		int free_cpu;
+	};
 };
 
 /*
@@ -91,6 +98,7 @@ extern void *vmalloc_exec(unsigned long size);
 extern void *vmalloc_32(unsigned long size);
 extern void *vmalloc_32_user(unsigned long size);
 extern void *__vmalloc(unsigned long size, gfp_t gfp_mask, pgprot_t prot);
+extern void *vmalloc_huge(unsigned long size, gfp_t gfp_mask);
 extern void *__vmalloc_node_range(unsigned long size, unsigned long align,
 			unsigned long start, unsigned long end, gfp_t gfp_mask,
 			pgprot_t prot, unsigned long vm_flags, int node,
@@ -121,6 +129,10 @@ extern int remap_vmalloc_range_partial(struct vm_area_struct *vma,
 extern int remap_vmalloc_range(struct vm_area_struct *vma, void *addr,
 							unsigned long pgoff);
 void vmalloc_sync_all(void);
+
+/* contiguous-pte mappings of huge vmalloc areas, see mm/vmalloc.c */
+extern unsigned int arch_vmap_pte_cont_shift(void);
+extern pgprot_t arch_vmap_pte_cont_prot(pgprot_t prot);
  
 /*
  *	Lowlevel-APIs (not for driver use!)
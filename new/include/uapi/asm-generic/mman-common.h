@@ -103,6 +103,8 @@ MADV_WILLNEED 适合内核很难预测接下来要预读哪些内容的场景，
 #define MADV_WIPEONFORK 18		/* Zero memory on fork, child only */
 #define MADV_KEEPONFORK 19		/* Undo MADV_WIPEONFORK */
 
+#define MADV_COLLAPSE	22		/* Synchronous huge page collapse */
+
 /* compatibility flags */
 #define MAP_FILE	0
 
@@ -232,4 +232,12 @@ struct prctl_mm_map {
 # define PR_PAC_APDBKEY			(1UL << 3)
 # define PR_PAC_APGAKEY			(1UL << 4)
 
+/* Tear down large unmaps and the exiting address space in a kworker */
+#define PR_SET_ASYNC_TEARDOWN		57
+#define PR_GET_ASYNC_TEARDOWN		58
+
+/* Share PTE tables with the child on fork, copy them on first write */
+#define PR_SET_FORK_SHARE_PTE		59
+#define PR_GET_FORK_SHARE_PTE		60
+
 #endif /* _LINUX_PRCTL_H */
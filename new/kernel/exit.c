@@ -5,6 +5,7 @@
  */
 
 #include <linux/mm.h>
+#include <linux/vmacache.h>
 #include <linux/slab.h>
 #include <linux/sched/autogroup.h>
 #include <linux/sched/mm.h>
@@ -526,6 +527,7 @@ static void exit_mm(void)
 	if (!mm)
 		return;
 	sync_mm_rss(mm);
+	vmacache_sync_stats(current, mm);
 	/*
 	 * Serialize with any possible pending coredump.
 	 * We must hold mmap_sem around checking core_state
@@ -343,6 +343,10 @@ struct vm_area_struct *vm_area_dup(struct vm_area_struct *orig)
 	if (new) {
 		*new = *orig;
 		INIT_LIST_HEAD(&new->anon_vma_chain);
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+		seqcount_init(&new->vm_sequence);
+		atomic_set(&new->vm_ref_count, 1);
+#endif
 	}
 	return new;
 }
@@ -469,7 +473,6 @@ static __latent_entropy int dup_mmap(struct mm_struct *mm,
 					struct mm_struct *oldmm)
 {
 	struct vm_area_struct *mpnt, *tmp, *prev, **pprev;
-	struct rb_node **rb_link, *rb_parent;
 	int retval;
 	unsigned long charge;
 	LIST_HEAD(uf);
@@ -494,8 +497,6 @@ static __latent_entropy int dup_mmap(struct mm_struct *mm,
 	mm->exec_vm = oldmm->exec_vm;
 	mm->stack_vm = oldmm->stack_vm;
 
-	rb_link = &mm->mm_rb.rb_node;
-	rb_parent = NULL;
 	pprev = &mm->mmap;
 	retval = ksm_fork(mm, oldmm);
 	if (retval)
@@ -524,6 +525,10 @@ static __latent_entropy int dup_mmap(struct mm_struct *mm,
 			retval = -EINTR;
 			goto out;
 		}
+		if (vma_tree_preload(&mm->mm_vt, GFP_KERNEL)) {
+			retval = -ENOMEM;
+			goto out;
+		}
 		if (mpnt->vm_flags & VM_ACCOUNT) {
 			unsigned long len = vma_pages(mpnt);
 
@@ -588,9 +593,7 @@ static __latent_entropy int dup_mmap(struct mm_struct *mm,
 		tmp->vm_prev = prev;
 		prev = tmp;
 
-		__vma_link_rb(mm, tmp, rb_link, rb_parent);
-		rb_link = &tmp->vm_rb.rb_right;
-		rb_parent = &tmp->vm_rb;
+		__vma_link_tree(mm, tmp);
 
 		mm->map_count++;
 		if (!(tmp->vm_flags & VM_WIPEONFORK))
@@ -1019,11 +1022,17 @@ static struct mm_struct *mm_init(struct mm_struct *mm, struct task_struct *p,
 	struct user_namespace *user_ns)
 {
 	mm->mmap = NULL;
-	mm->mm_rb = RB_ROOT;
+	vma_tree_init(&mm->mm_vt);
 	mm->vmacache_seqnum = 0;
+	atomic_long_set(&mm->vmacache_hits, 0);
+	atomic_long_set(&mm->vmacache_misses, 0);
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+	seqcount_init(&mm->mm_vt_seq);
+#endif
 	atomic_set(&mm->mm_users, 1);
 	atomic_set(&mm->mm_count, 1);
 	init_rwsem(&mm->mmap_sem);
+	mutex_init(&mm->pte_share_mutex);
 	INIT_LIST_HEAD(&mm->mmlist);
 	mm->core_state = NULL;
 	mm_pgtables_bytes_init(mm);
@@ -1422,6 +1431,7 @@ static int copy_mm(unsigned long clone_flags, struct task_struct *tsk)
 
 	/* initialize the new vmacache entries */
 	vmacache_flush(tsk);
+	tsk->vmacache_hits = tsk->vmacache_misses = 0;
 
 /*
     如果子进程和父进程共享内存空间，直接mm = oldmm即可
@@ -1982,6 +1992,9 @@ static __latent_entropy struct task_struct *copy_process(
 #endif
 
 	p->pagefault_disabled = 0;
+#ifdef CONFIG_HIGHMEM
+	p->kmap_ctrl.nr = 0;
+#endif
 
 #ifdef CONFIG_LOCKDEP
 	p->lockdep_depth = 0; /* no locks held yet */
@@ -2648,6 +2661,7 @@ void __init proc_caches_init(void)
 			sizeof_field(struct mm_struct, saved_auxv),
 			NULL);
 	vm_area_cachep = KMEM_CACHE(vm_area_struct, SLAB_PANIC|SLAB_ACCOUNT);
+	vma_tree_cache_init();
 	//初始化vm_committed_as，用于记录进程虚拟地址空间
 	mmap_init();
 	nsproxy_cache_init();
@@ -10,6 +10,7 @@
 #include <linux/nospec.h>
 
 #include <linux/kcov.h>
+#include <linux/highmem.h>
 
 #include <asm/switch_to.h>
 #include <asm/tlb.h>
@@ -2671,6 +2672,14 @@ prepare_task_switch(struct rq *rq, struct task_struct *prev,
 	prepare_arch_switch(next);
 }
 
+static inline void kmap_local_sched_in(void)
+{
+#if defined(CONFIG_HIGHMEM) && defined(ARCH_HAS_KMAP_LOCAL)
+	if (unlikely(current->kmap_ctrl.nr))
+		__kmap_local_sched_in();
+#endif
+}
+
 /**
  * finish_task_switch - clean up after a task-switch
  * @prev: the thread we just switched away from.
@@ -2738,6 +2747,7 @@ static struct rq *finish_task_switch(struct task_struct *prev)
 	finish_lock_switch(rq);
 	finish_arch_post_lock_switch();
 	kcov_finish_switch(current);
+	kmap_local_sched_in();
 
 	fire_sched_in_preempt_notifiers(current);
 	/*
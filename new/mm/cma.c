@@ -44,9 +44,13 @@
 #include <linux/highmem.h>
 #include <linux/io.h>
 #include <linux/kmemleak.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 #include <trace/events/cma.h>
 
 #include "cma.h"
+#include "internal.h"
 /*
 每一个struct cma抽象了一个CMA area，标识了一个物理地址连续的memory area。
 调用cma_alloc分配的连续内存就是从CMA area中获得的。
@@ -98,6 +102,42 @@ static unsigned long cma_bitmap_pages_to_bits(const struct cma *cma,
 	return ALIGN(pages, 1UL << cma->order_per_bit) >> cma->order_per_bit;
 }
 
+/*
+ * Bring the avail_map and empty_map bits of the bitmap words holding
+ * [bitmap_no, bitmap_no + bitmap_count) up to date.  Under cma->lock.
+ */
+static void cma_update_summary(struct cma *cma, unsigned long bitmap_no,
+			       unsigned long bitmap_count)
+{
+	unsigned long maxno = cma_bitmap_maxno(cma);
+	unsigned long w = BIT_WORD(bitmap_no);
+	unsigned long last = BIT_WORD(bitmap_no + bitmap_count - 1);
+	unsigned long word;
+
+	for (; w <= last; w++) {
+		word = cma->bitmap[w];
+		/* bits past the end of the area count as allocated */
+		if (w == BIT_WORD(maxno - 1))
+			word |= ~BITMAP_LAST_WORD_MASK(maxno);
+
+		if (word != ~0UL)
+			__set_bit(w, cma->avail_map);
+		else
+			__clear_bit(w, cma->avail_map);
+		if (!word)
+			__set_bit(w, cma->empty_map);
+		else
+			__clear_bit(w, cma->empty_map);
+	}
+}
+
+static void cma_bitmap_set(struct cma *cma, unsigned long bitmap_no,
+			   unsigned long bitmap_count)
+{
+	bitmap_set(cma->bitmap, bitmap_no, bitmap_count);
+	cma_update_summary(cma, bitmap_no, bitmap_count);
+}
+
 static void cma_clear_bitmap(struct cma *cma, unsigned long pfn,
 			     unsigned int count)
 {
@@ -108,9 +148,55 @@ static void cma_clear_bitmap(struct cma *cma, unsigned long pfn,
 
 	mutex_lock(&cma->lock);
 	bitmap_clear(cma->bitmap, bitmap_no, bitmap_count);
+	cma_update_summary(cma, bitmap_no, bitmap_count);
 	mutex_unlock(&cma->lock);
 }
 
+/*
+ * bitmap_find_next_zero_area_off() with the summaries in front of it.
+ * Small requests skip the words that are used up.  A free run of
+ * bitmap_count bits covers at least bitmap_count / BITS_PER_LONG - 1
+ * whole free words, so large requests only look around runs of set bits
+ * in empty_map that long, instead of at every hole in the bitmap.
+ * Returns a value >= cma_bitmap_maxno() when there is no such run.
+ */
+static unsigned long cma_find_area(struct cma *cma, unsigned long start,
+				   unsigned long bitmap_count,
+				   unsigned long mask, unsigned long offset)
+{
+	unsigned long maxno = cma_bitmap_maxno(cma);
+	unsigned long nwords = BITS_TO_LONGS(maxno);
+	unsigned long need, w, e, lo, hi, no;
+
+	w = BIT_WORD(start);
+	if (bitmap_count < 2 * BITS_PER_LONG) {
+		w = find_next_bit(cma->avail_map, nwords, w);
+		if (w >= nwords)
+			return maxno;
+		return bitmap_find_next_zero_area_off(cma->bitmap, maxno,
+				max(start, w * BITS_PER_LONG), bitmap_count,
+				mask, offset);
+	}
+
+	need = bitmap_count / BITS_PER_LONG - 1;
+	for (;;) {
+		w = find_next_bit(cma->empty_map, nwords, w);
+		if (w >= nwords)
+			return maxno;
+		e = find_next_zero_bit(cma->empty_map, nwords, w);
+		if (e - w >= need) {
+			/* the run may start and end in the words around */
+			lo = max(start, w ? (w - 1) * BITS_PER_LONG : 0);
+			hi = min(maxno, (e + 1) * BITS_PER_LONG);
+			no = bitmap_find_next_zero_area_off(cma->bitmap, hi,
+					lo, bitmap_count, mask, offset);
+			if (no < hi)
+				return no;
+		}
+		w = e;
+	}
+}
+
 static int __init cma_activate_area(struct cma *cma)
 {
 /*
@@ -118,6 +204,8 @@ static int __init cma_activate_area(struct cma *cma)
     bitmap_size给出了bitmap需要多少的内存。
 */
 	int bitmap_size = BITS_TO_LONGS(cma_bitmap_maxno(cma)) * sizeof(long);
+	int summary_size = BITS_TO_LONGS(BITS_TO_LONGS(cma_bitmap_maxno(cma))) *
+			   sizeof(long);
 	unsigned long base_pfn = cma->base_pfn, pfn = base_pfn;
 /*
     该CMA area有多少个pageblock
@@ -130,6 +218,16 @@ static int __init cma_activate_area(struct cma *cma)
 	if (!cma->bitmap)
 		return -ENOMEM;
 
+	cma->avail_map = kzalloc(summary_size, GFP_KERNEL);
+	cma->empty_map = kzalloc(summary_size, GFP_KERNEL);
+	if (!cma->avail_map || !cma->empty_map) {
+		kfree(cma->avail_map);
+		kfree(cma->empty_map);
+		kfree(cma->bitmap);
+		return -ENOMEM;
+	}
+	cma_update_summary(cma, 0, cma_bitmap_maxno(cma));
+
 	WARN_ON_ONCE(!pfn_valid(pfn));
 	zone = page_zone(pfn_to_page(pfn));
 
@@ -172,6 +270,8 @@ static int __init cma_activate_area(struct cma *cma)
 
 not_in_zone:
 	pr_err("CMA area %s could not be activated\n", cma->name);
+	kfree(cma->avail_map);
+	kfree(cma->empty_map);
 	kfree(cma->bitmap);
 	cma->count = 0;
 	return -EINVAL;
@@ -421,6 +521,38 @@ static void cma_debug_show_areas(struct cma *cma)
 static inline void cma_debug_show_areas(struct cma *cma) { }
 #endif
 
+static void cma_account_alloc(struct cma *cma, struct page *page,
+			      size_t count, int ret, u64 ns)
+{
+	struct cma_stat *st = &cma->stat;
+	int bucket;
+
+	if (ns < NSEC_PER_MSEC)
+		bucket = 0;
+	else if (ns < 10 * NSEC_PER_MSEC)
+		bucket = 1;
+	else if (ns < 100 * NSEC_PER_MSEC)
+		bucket = 2;
+	else
+		bucket = 3;
+
+	mutex_lock(&cma->lock);
+	if (page) {
+		st->nr_alloc++;
+		st->pages += count;
+	} else if (ret == -ENOMEM) {
+		st->nr_fail_nospace++;
+	} else if (ret == -EBUSY) {
+		st->nr_fail_busy++;
+	} else {
+		st->nr_fail_other++;
+	}
+	st->total_ns += ns;
+	st->max_ns = max(st->max_ns, ns);
+	st->lat[bucket]++;
+	mutex_unlock(&cma->lock);
+}
+
 /**
  * cma_alloc() - allocate pages from contiguous area
  * @cma:   Contiguous memory region for which the allocation is performed.
@@ -441,6 +573,7 @@ struct page *cma_alloc(struct cma *cma, size_t count, unsigned int align,
 	size_t i;
 	struct page *page = NULL;
 	int ret = -ENOMEM;
+	u64 t0;
 
 	if (!cma || !cma->count)
 		return NULL;
@@ -459,16 +592,16 @@ struct page *cma_alloc(struct cma *cma, size_t count, unsigned int align,
 	if (bitmap_count > bitmap_maxno)
 		return NULL;
 
+	t0 = ktime_get_ns();
 	for (;;) {
 		mutex_lock(&cma->lock);
-		bitmap_no = bitmap_find_next_zero_area_off(cma->bitmap,
-				bitmap_maxno, start, bitmap_count, mask,
-				offset);
+		bitmap_no = cma_find_area(cma, start, bitmap_count, mask,
+					  offset);
 		if (bitmap_no >= bitmap_maxno) {
 			mutex_unlock(&cma->lock);
 			break;
 		}
-		bitmap_set(cma->bitmap, bitmap_no, bitmap_count);
+		cma_bitmap_set(cma, bitmap_no, bitmap_count);
 		/*
 		 * It's safe to drop the lock here. We've marked this region for
 		 * our exclusive use. If the migration fails we will take the
@@ -492,10 +625,14 @@ struct page *cma_alloc(struct cma *cma, size_t count, unsigned int align,
 
 		pr_debug("%s(): memory range at %p is busy, retrying\n",
 			 __func__, pfn_to_page(pfn));
+		mutex_lock(&cma->lock);
+		cma->stat.nr_busy++;
+		mutex_unlock(&cma->lock);
 		/* try again with a bit different memory target */
 		start = bitmap_no + mask + 1;
 	}
 
+	cma_account_alloc(cma, page, count, ret, ktime_get_ns() - t0);
 	trace_cma_alloc(pfn, page, count, align);
 
 	/*
@@ -564,3 +701,46 @@ int cma_for_each_area(int (*it)(struct cma *cma, void *data), void *data)
 
 	return 0;
 }
+
+#ifdef CONFIG_DEBUG_FS
+static int cma_stats_show(struct seq_file *m, void *v)
+{
+	struct cma_stat st;
+	int i;
+
+	seq_puts(m, "# area alloc pages busy fail_nospace fail_busy "
+		 "fail_other avg_us max_us <1ms <10ms <100ms >=100ms\n");
+	for (i = 0; i < cma_area_count; i++) {
+		struct cma *cma = &cma_areas[i];
+		unsigned long nr;
+
+		if (!cma->count)
+			continue;
+		mutex_lock(&cma->lock);
+		st = cma->stat;
+		mutex_unlock(&cma->lock);
+
+		nr = st.nr_alloc + st.nr_fail_nospace + st.nr_fail_busy +
+		     st.nr_fail_other;
+		seq_printf(m, "%s %lu %lu %lu %lu %lu %lu %llu %llu "
+			   "%lu %lu %lu %lu\n",
+			   cma_get_name(cma), st.nr_alloc, st.pages,
+			   st.nr_busy, st.nr_fail_nospace, st.nr_fail_busy,
+			   st.nr_fail_other,
+			   nr ? div64_u64(st.total_ns, nr * NSEC_PER_USEC) : 0,
+			   div_u64(st.max_ns, NSEC_PER_USEC),
+			   st.lat[0], st.lat[1], st.lat[2], st.lat[3]);
+	}
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(cma_stats);
+
+static int __init cma_stats_debugfs_init(void)
+{
+	debugfs_create_file("cma_stats", 0400, NULL, NULL, &cma_stats_fops);
+	debugfs_create_u32("contig_migrate_workers", 0644, NULL,
+			   &contig_migrate_workers);
+	return 0;
+}
+late_initcall(cma_stats_debugfs_init);
+#endif
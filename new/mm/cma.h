@@ -2,6 +2,21 @@
 #ifndef __MM_CMA_H__
 #define __MM_CMA_H__
 
+/* cma_alloc() latency buckets: < 1ms, < 10ms, < 100ms, the rest */
+#define CMA_LAT_BUCKETS		4
+
+struct cma_stat {
+	unsigned long	nr_alloc;	/* cma_alloc() that succeeded */
+	unsigned long	nr_busy;	/* ranges given up after -EBUSY */
+	unsigned long	nr_fail_nospace;/* no free run large enough */
+	unsigned long	nr_fail_busy;	/* every candidate range was busy */
+	unsigned long	nr_fail_other;	/* signal, isolation failure, ... */
+	unsigned long	pages;		/* pages handed out */
+	u64		total_ns;	/* time spent in cma_alloc() */
+	u64		max_ns;
+	unsigned long	lat[CMA_LAT_BUCKETS];
+};
+
 struct cma {
 /*
     CMA area的其实page frame number，base_pfn和count一起定义了该CMA area在内存在的位置
@@ -21,7 +36,14 @@ struct cma {
 	如果order_per_bit等于1，表示按照2个page组成的block来分配和释放，以此类推
 */
 	unsigned int order_per_bit; /* Order of pages represented by one bit */
+	/*
+	 * Summaries of bitmap, one bit per bitmap word: set in avail_map
+	 * when the word has a free bit, in empty_map when all of it is free.
+	 */
+	unsigned long	*avail_map;
+	unsigned long	*empty_map;
 	struct mutex    lock;
+	struct cma_stat	stat;		/* under lock */
 #ifdef CONFIG_CMA_DEBUGFS
 	struct hlist_head mem_head;
 	spinlock_t mem_head_lock;
@@ -0,0 +1,686 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ *  linux/mm/collapse.c
+ *
+ *  Synchronous huge page collapse, MADV_COLLAPSE.
+ *
+ *  khugepaged reaches a range only when its scan comes around to it, which
+ *  on a big machine can be long after a heap has been warmed up with 4K
+ *  pages by do_anonymous_page().  Here the caller collapses the PMD aligned
+ *  parts of a range itself, using the same steps as khugepaged:
+ *
+ *    anonymous  scan the ptes under mmap_sem for read (swapping entries
+ *               back in), allocate and charge the huge page, then under
+ *               mmap_sem for write clear the pmd, isolate and copy the
+ *               small pages, and map the copy with a PMD.
+ *    file       if the page cache already holds a huge page for the range
+ *               (shmem huge=), retract the PTE table mapping it piecewise
+ *               and fault it back in, which maps it with a PMD.  A page
+ *               cache of small pages is not rebuilt here.
+ *
+ *  The THP sysfs "enabled" policy is not consulted, the caller asked for
+ *  it explicitly; VM_NOHUGEPAGE and PR_SET_THP_DISABLE still win.
+ *
+ *  Every PMD reports 0, -EINVAL if it cannot be collapsed at all, -ENOMEM
+ *  if no huge page could be allocated or charged and -EAGAIN if some page
+ *  was busy and a retry may succeed.  A range reports its first failure.
+ */
+
+#include <linux/mm.h>
+#include <linux/mman.h>
+#include <linux/sched/coredump.h>
+#include <linux/sched/signal.h>
+#include <linux/highmem.h>
+#include <linux/pagemap.h>
+#include <linux/rmap.h>
+#include <linux/swap.h>
+#include <linux/swapops.h>
+#include <linux/memcontrol.h>
+#include <linux/mmu_notifier.h>
+#include <linux/uio.h>
+
+#include <asm/pgalloc.h>
+#include <asm/tlbflush.h>
+
+#include "internal.h"
+
+static int collapse_vma_check(struct vm_area_struct *vma, unsigned long haddr)
+{
+	if (haddr < vma->vm_start || haddr + HPAGE_PMD_SIZE > vma->vm_end)
+		return -EINVAL;
+	if (vma->vm_flags & (VM_NOHUGEPAGE | VM_HUGETLB | VM_SPECIAL))
+		return -EINVAL;
+	if (test_bit(MMF_DISABLE_THP, &vma->vm_mm->flags))
+		return -EINVAL;
+	if (vma_is_dax(vma))
+		return -EINVAL;
+	if (vma->vm_file) {
+		/* the huge page must sit at a huge page aligned file offset */
+		if (((vma->vm_start >> PAGE_SHIFT) - vma->vm_pgoff) &
+		    (HPAGE_PMD_NR - 1))
+			return -EINVAL;
+		return 0;
+	}
+	return vma_is_anonymous(vma) ? 0 : -EINVAL;
+}
+
+/* find the vma again after mmap_sem was dropped */
+static struct vm_area_struct *collapse_revalidate(struct mm_struct *mm,
+						  unsigned long haddr)
+{
+	struct vm_area_struct *vma = find_vma(mm, haddr);
+
+	if (!vma || vma->vm_start > haddr)
+		return NULL;
+	if (collapse_vma_check(vma, haddr))
+		return NULL;
+	return vma;
+}
+
+/* the pmd covering @addr, NULL if no pmd table is there */
+static pmd_t *collapse_find_pmd(struct mm_struct *mm, unsigned long addr)
+{
+	pgd_t *pgd;
+	p4d_t *p4d;
+	pud_t *pud;
+
+	pgd = pgd_offset(mm, addr);
+	if (!pgd_present(*pgd))
+		return NULL;
+	p4d = p4d_offset(pgd, addr);
+	if (!p4d_present(*p4d))
+		return NULL;
+	pud = pud_offset(p4d, addr);
+	if (!pud_present(*pud))
+		return NULL;
+	return pmd_offset(pud, addr);
+}
+
+/*
+ * Check the ptes of an anonymous PMD range.  Returns the number of
+ * swapped out entries, or an error if the range cannot be collapsed.
+ */
+static int collapse_scan_anon(struct vm_area_struct *vma, pmd_t *pmd,
+			      unsigned long haddr)
+{
+	unsigned long addr = haddr;
+	struct page *page;
+	pte_t *pte, *_pte;
+	spinlock_t *ptl;
+	int nr_swap = 0, ret = 0;
+
+	pte = pte_offset_map_lock(vma->vm_mm, pmd, haddr, &ptl);
+	for (_pte = pte; _pte < pte + HPAGE_PMD_NR;
+	     _pte++, addr += PAGE_SIZE) {
+		pte_t pteval = *_pte;
+
+		if (pte_none(pteval))
+			continue;
+		if (!pte_present(pteval)) {
+			if (non_swap_entry(pte_to_swp_entry(pteval)) &&
+			    !is_migration_entry(pte_to_swp_entry(pteval))) {
+				ret = -EINVAL;
+				break;
+			}
+			nr_swap++;
+			continue;
+		}
+		if (is_zero_pfn(pte_pfn(pteval)))
+			continue;
+
+		page = vm_normal_page(vma, addr, pteval);
+		if (!page || !PageAnon(page)) {
+			ret = -EINVAL;
+			break;
+		}
+		/* PTE-mapped huge page, or pinned or shared after fork */
+		if (PageCompound(page) || page_mapcount(page) != 1 ||
+		    page_count(page) != 1 + PageSwapCache(page)) {
+			ret = -EAGAIN;
+			break;
+		}
+	}
+	pte_unmap_unlock(pte, ptl);
+
+	return ret ? ret : nr_swap;
+}
+
+/* fault swapped out ptes back in, mmap_sem is held and not dropped */
+static int collapse_swapin(struct vm_area_struct *vma, pmd_t *pmd,
+			   unsigned long haddr)
+{
+	unsigned long addr;
+	vm_fault_t fault;
+	pte_t *pte, pteval;
+
+	for (addr = haddr; addr < haddr + HPAGE_PMD_SIZE; addr += PAGE_SIZE) {
+		pte = pte_offset_map(pmd, addr);
+		pteval = *pte;
+		pte_unmap(pte);
+		if (!is_swap_pte(pteval))
+			continue;
+
+		fault = handle_mm_fault(vma, addr, 0);
+		if (fault & VM_FAULT_OOM)
+			return -ENOMEM;
+		if (fault & VM_FAULT_ERROR)
+			return -EAGAIN;
+	}
+	return 0;
+}
+
+static void collapse_release_page(struct page *page)
+{
+	dec_node_page_state(page, NR_ISOLATED_ANON + page_is_file_cache(page));
+	unlock_page(page);
+	putback_lru_page(page);
+}
+
+static void collapse_release_ptes(pte_t *pte, pte_t *end)
+{
+	for (; pte < end; pte++) {
+		pte_t pteval = *pte;
+
+		if (!pte_none(pteval) && !is_zero_pfn(pte_pfn(pteval)))
+			collapse_release_page(pte_page(pteval));
+	}
+}
+
+/*
+ * Lock and isolate the small pages, with the pmd already cleared and the
+ * pte lock held.  Nothing may have changed since the scan but pages can
+ * have been pinned or locked meanwhile.
+ */
+static int collapse_isolate_anon(struct vm_area_struct *vma,
+				 unsigned long addr, pte_t *pte)
+{
+	struct page *page;
+	pte_t *_pte;
+	int ret;
+
+	for (_pte = pte; _pte < pte + HPAGE_PMD_NR;
+	     _pte++, addr += PAGE_SIZE) {
+		pte_t pteval = *_pte;
+
+		if (pte_none(pteval))
+			continue;
+		ret = -EAGAIN;
+		/* swapped out or migrating since the scan */
+		if (!pte_present(pteval))
+			goto out;
+		if (is_zero_pfn(pte_pfn(pteval)))
+			continue;
+
+		page = vm_normal_page(vma, addr, pteval);
+		if (!page || !PageAnon(page)) {
+			ret = -EINVAL;
+			goto out;
+		}
+		if (PageCompound(page) || page_mapcount(page) != 1)
+			goto out;
+		if (!trylock_page(page))
+			goto out;
+		/* no gup pin: only our pte and the swap cache hold it */
+		if (page_count(page) != 1 + PageSwapCache(page) ||
+		    isolate_lru_page(page)) {
+			unlock_page(page);
+			goto out;
+		}
+		inc_node_page_state(page,
+				NR_ISOLATED_ANON + page_is_file_cache(page));
+	}
+	return 0;
+
+out:
+	collapse_release_ptes(pte, _pte);
+	return ret;
+}
+
+static void collapse_copy_anon(struct vm_area_struct *vma, unsigned long addr,
+			       pte_t *pte, spinlock_t *ptl, struct page *new)
+{
+	struct page *src;
+	pte_t *_pte;
+
+	for (_pte = pte; _pte < pte + HPAGE_PMD_NR;
+	     _pte++, new++, addr += PAGE_SIZE) {
+		pte_t pteval = *_pte;
+
+		if (pte_none(pteval) || is_zero_pfn(pte_pfn(pteval))) {
+			clear_user_highpage(new, addr);
+			add_mm_counter(vma->vm_mm, MM_ANONPAGES, 1);
+			if (!pte_none(pteval)) {
+				spin_lock(ptl);
+				pte_clear(vma->vm_mm, addr, _pte);
+				spin_unlock(ptl);
+			}
+			continue;
+		}
+
+		src = pte_page(pteval);
+		copy_user_highpage(new, src, addr, vma);
+		collapse_release_page(src);
+		spin_lock(ptl);
+		pte_clear(vma->vm_mm, addr, _pte);
+		page_remove_rmap(src, false);
+		spin_unlock(ptl);
+		free_page_and_swap_cache(src);
+	}
+}
+
+/* mmap_sem is held for write, @new is allocated and charged */
+static int __collapse_anon_pmd(struct vm_area_struct *vma, pmd_t *pmd,
+			       unsigned long haddr, struct page *new,
+			       struct mem_cgroup *memcg)
+{
+	struct mm_struct *mm = vma->vm_mm;
+	struct mmu_notifier_range range;
+	spinlock_t *pmd_ptl, *pte_ptl;
+	pgtable_t pgtable;
+	pmd_t _pmd;
+	pte_t *pte;
+	int ret;
+
+	anon_vma_lock_write(vma->anon_vma);
+	/* speculative faults must not map into the table we take away */
+	vm_write_begin(vma);
+
+	mmu_notifier_range_init(&range, mm, haddr, haddr + HPAGE_PMD_SIZE);
+	mmu_notifier_invalidate_range_start(&range);
+	pte = pte_offset_map(pmd, haddr);
+	pte_ptl = pte_lockptr(mm, pmd);
+	pmd_ptl = pmd_lock(mm, pmd);
+	_pmd = pmdp_collapse_flush(vma, haddr, pmd);
+	spin_unlock(pmd_ptl);
+	/*
+	 * gup_fast walks the table with interrupts off and no locks.  Where
+	 * the TLB flush is broadcast in hardware (arm, arm64) it sends no
+	 * IPI, so wait for every walker that may still have the old pmd;
+	 * the refcounts checked by collapse_isolate_anon() below then show
+	 * any pin it took, and nobody can reach the ptes but us.
+	 */
+	kick_all_cpus_sync();
+	mmu_notifier_invalidate_range_end(&range);
+
+	spin_lock(pte_ptl);
+	ret = collapse_isolate_anon(vma, haddr, pte);
+	spin_unlock(pte_ptl);
+	if (ret) {
+		pte_unmap(pte);
+		spin_lock(pmd_ptl);
+		BUG_ON(!pmd_none(*pmd));
+		pmd_populate(mm, pmd, pmd_pgtable(_pmd));
+		spin_unlock(pmd_ptl);
+		vm_write_end(vma);
+		anon_vma_unlock_write(vma->anon_vma);
+		return ret;
+	}
+	/* the pages are isolated, rmap walks cannot find them any more */
+	anon_vma_unlock_write(vma->anon_vma);
+
+	collapse_copy_anon(vma, haddr, pte, pte_ptl, new);
+	pte_unmap(pte);
+	__SetPageUptodate(new);
+	pgtable = pmd_pgtable(_pmd);
+
+	_pmd = mk_huge_pmd(new, vma->vm_page_prot);
+	_pmd = maybe_pmd_mkwrite(pmd_mkdirty(_pmd), vma);
+
+	/* make the copied contents visible before the pmd, as in __pte_alloc() */
+	smp_wmb();
+
+	spin_lock(pmd_ptl);
+	BUG_ON(!pmd_none(*pmd));
+	page_add_new_anon_rmap(new, vma, haddr, true);
+	mem_cgroup_commit_charge(new, memcg, false, true);
+	lru_cache_add_active_or_unevictable(new, vma);
+	pgtable_trans_huge_deposit(mm, pmd, pgtable);
+	set_pmd_at(mm, haddr, pmd, _pmd);
+	update_mmu_cache_pmd(vma, haddr, pmd);
+	spin_unlock(pmd_ptl);
+	vm_write_end(vma);
+
+	return 0;
+}
+
+/* called with mmap_sem held for read, returns with it released */
+static int collapse_anon_pmd(struct vm_area_struct *vma, pmd_t *pmd,
+			     unsigned long haddr)
+{
+	struct mm_struct *mm = vma->vm_mm;
+	struct mem_cgroup *memcg;
+	bool swapped_in = false;
+	struct page *new;
+	int ret;
+
+	/* a table shared with a forked child must become ours first */
+	if (pte_table_shared(*pmd)) {
+		ret = unshare_pte_table(vma, pmd, haddr);
+		if (ret)
+			goto out_up;
+	}
+	if (unlikely(anon_vma_prepare(vma))) {
+		ret = -ENOMEM;
+		goto out_up;
+	}
+
+again:
+	ret = collapse_scan_anon(vma, pmd, haddr);
+	if (ret > 0 && !swapped_in) {
+		ret = collapse_swapin(vma, pmd, haddr);
+		if (ret)
+			goto out_up;
+		swapped_in = true;
+		goto again;
+	}
+	/* swapped out again right away, leave it to the next try */
+	if (ret) {
+		if (ret > 0)
+			ret = -EAGAIN;
+		goto out_up;
+	}
+
+	new = alloc_hugepage_vma(GFP_TRANSHUGE, vma, haddr, HPAGE_PMD_ORDER);
+	if (!new) {
+		count_vm_event(THP_COLLAPSE_ALLOC_FAILED);
+		ret = -ENOMEM;
+		goto out_up;
+	}
+	prep_transhuge_page(new);
+	count_vm_event(THP_COLLAPSE_ALLOC);
+	if (mem_cgroup_try_charge(new, mm, GFP_TRANSHUGE, &memcg, true)) {
+		put_page(new);
+		ret = -ENOMEM;
+		goto out_up;
+	}
+	up_read(&mm->mmap_sem);
+
+	down_write(&mm->mmap_sem);
+	ret = -EAGAIN;
+	vma = collapse_revalidate(mm, haddr);
+	if (!vma || !vma->anon_vma || !vma_is_anonymous(vma))
+		goto out_cancel;
+	pmd = collapse_find_pmd(mm, haddr);
+	if (!pmd || !pmd_present(*pmd) || pmd_trans_huge(*pmd) ||
+	    pte_table_shared(*pmd))
+		goto out_cancel;
+
+	ret = __collapse_anon_pmd(vma, pmd, haddr, new, memcg);
+out_cancel:
+	if (ret) {
+		mem_cgroup_cancel_charge(new, memcg, true);
+		put_page(new);
+	}
+	up_write(&mm->mmap_sem);
+	return ret;
+
+out_up:
+	up_read(&mm->mmap_sem);
+	return ret;
+}
+
+#ifdef CONFIG_TRANSPARENT_HUGE_PAGECACHE
+/*
+ * Take away the PTE table that maps the huge page cache page @hpage piece
+ * by piece.  mmap_sem is held for write and @hpage is locked, so neither
+ * faults nor truncation can race with us.
+ *
+ * The ptes are live mappings of the file: like zap_pte_range(), pass
+ * their dirty and young bits on to the page and flush the TLB before the
+ * ptl is dropped, and only then give up the rmap and the references.
+ */
+static int collapse_retract_file(struct vm_area_struct *vma, pmd_t *pmd,
+				 unsigned long haddr, struct page *hpage)
+{
+	struct mm_struct *mm = vma->vm_mm;
+	struct mmu_notifier_range range;
+	DECLARE_BITMAP(mapped, HPAGE_PMD_NR);
+	unsigned long addr;
+	spinlock_t *ptl;
+	pte_t *pte, *_pte, pteval;
+	pmd_t _pmd;
+	int i, count = 0;
+
+	bitmap_zero(mapped, HPAGE_PMD_NR);
+	mmu_notifier_range_init(&range, mm, haddr, haddr + HPAGE_PMD_SIZE);
+	mmu_notifier_invalidate_range_start(&range);
+	pte = pte_offset_map_lock(mm, pmd, haddr, &ptl);
+	for (i = 0, _pte = pte; i < HPAGE_PMD_NR; i++, _pte++) {
+		if (pte_none(*_pte))
+			continue;
+		/* a COWed private page or anything else: keep the table */
+		if (!pte_present(*_pte) ||
+		    vm_normal_page(vma, haddr + i * PAGE_SIZE, *_pte) != hpage + i) {
+			pte_unmap_unlock(pte, ptl);
+			mmu_notifier_invalidate_range_end(&range);
+			return -EINVAL;
+		}
+	}
+
+	vm_write_begin(vma);
+	for (i = 0, _pte = pte, addr = haddr; i < HPAGE_PMD_NR;
+	     i++, _pte++, addr += PAGE_SIZE) {
+		if (pte_none(*_pte))
+			continue;
+		pteval = ptep_get_and_clear(mm, addr, _pte);
+		if (pte_dirty(pteval))
+			set_page_dirty(hpage + i);
+		if (pte_young(pteval) &&
+		    likely(!(vma->vm_flags & VM_SEQ_READ)))
+			mark_page_accessed(hpage + i);
+		__set_bit(i, mapped);
+		count++;
+	}
+	/* no CPU may dirty the page through a stale entry from here on */
+	if (count)
+		flush_tlb_range(vma, haddr, haddr + HPAGE_PMD_SIZE);
+	for_each_set_bit(i, mapped, HPAGE_PMD_NR)
+		page_remove_rmap(hpage + i, false);
+	pte_unmap_unlock(pte, ptl);
+
+	/* every pte held a reference on the head page */
+	page_ref_sub(hpage, count);
+	add_mm_counter(mm, mm_counter_file(hpage), -count);
+
+	ptl = pmd_lock(mm, pmd);
+	_pmd = pmdp_collapse_flush(vma, haddr, pmd);
+	spin_unlock(ptl);
+	mmu_notifier_invalidate_range_end(&range);
+	/* lockless walkers, gup_fast and speculative faults, run with irqs off */
+	kick_all_cpus_sync();
+	vm_write_end(vma);
+
+	mm_dec_nr_ptes(mm);
+	pte_free(mm, pmd_pgtable(_pmd));
+	return 0;
+}
+
+/* map the range with a PMD by faulting it, the pmd must be none */
+static int collapse_fault_file(struct vm_area_struct *vma,
+			       unsigned long haddr)
+{
+	vm_fault_t fault;
+	pmd_t *pmd;
+
+	fault = handle_mm_fault(vma, haddr, 0);
+	if (fault & VM_FAULT_OOM)
+		return -ENOMEM;
+	if (fault & VM_FAULT_ERROR)
+		return -EINVAL;
+	pmd = collapse_find_pmd(vma->vm_mm, haddr);
+	return pmd && pmd_trans_huge(*pmd) ? 0 : -EAGAIN;
+}
+
+/* called with mmap_sem held for read, returns with it released */
+static int collapse_file_pmd(struct vm_area_struct *vma, pmd_t *pmd,
+			     unsigned long haddr)
+{
+	struct mm_struct *mm = vma->vm_mm;
+	struct address_space *mapping = vma->vm_file->f_mapping;
+	pgoff_t pgoff = linear_page_index(vma, haddr);
+	struct page *hpage;
+	int ret;
+
+	/* nothing mapped yet: the fault maps a huge page cache page whole */
+	if (!pmd || pmd_none(*pmd)) {
+		ret = collapse_fault_file(vma, haddr);
+		if (ret != -EAGAIN)
+			goto out_up;
+		pmd = collapse_find_pmd(mm, haddr);
+		if (!pmd || pmd_none(*pmd))
+			goto out_up;
+	}
+	/* a PMD mapping needs the page cache to hold one huge page here */
+	hpage = find_get_page(mapping, pgoff);
+	if (!hpage || !PageTransHuge(hpage) || hpage->index != pgoff) {
+		ret = -EINVAL;
+		goto out_put;
+	}
+	up_read(&mm->mmap_sem);
+
+	down_write(&mm->mmap_sem);
+	lock_page(hpage);
+	ret = -EAGAIN;
+	vma = collapse_revalidate(mm, haddr);
+	if (!vma || !vma->vm_file || vma->vm_file->f_mapping != mapping ||
+	    linear_page_index(vma, haddr) != pgoff)
+		goto out_unlock;
+	/* truncated or split meanwhile */
+	if (hpage->mapping != mapping || !PageTransHuge(hpage))
+		goto out_unlock;
+	pmd = collapse_find_pmd(mm, haddr);
+	if (!pmd || !pmd_present(*pmd) || pmd_trans_huge(*pmd) ||
+	    pte_table_shared(*pmd))
+		goto out_unlock;
+
+	ret = collapse_retract_file(vma, pmd, haddr, hpage);
+out_unlock:
+	unlock_page(hpage);
+	put_page(hpage);
+	downgrade_write(&mm->mmap_sem);
+	if (!ret) {
+		vma = collapse_revalidate(mm, haddr);
+		ret = vma ? collapse_fault_file(vma, haddr) : -EAGAIN;
+	}
+	up_read(&mm->mmap_sem);
+	return ret;
+
+out_put:
+	if (hpage)
+		put_page(hpage);
+out_up:
+	up_read(&mm->mmap_sem);
+	return ret;
+}
+#else
+static int collapse_file_pmd(struct vm_area_struct *vma, pmd_t *pmd,
+			     unsigned long haddr)
+{
+	up_read(&vma->vm_mm->mmap_sem);
+	return -EINVAL;
+}
+#endif /* CONFIG_TRANSPARENT_HUGE_PAGECACHE */
+
+static int collapse_pmd(struct mm_struct *mm, unsigned long haddr)
+{
+	struct vm_area_struct *vma;
+	pmd_t *pmd;
+	int ret;
+
+	down_read(&mm->mmap_sem);
+	vma = find_vma(mm, haddr);
+	if (!vma || vma->vm_start > haddr) {
+		/* like madvise() on a hole */
+		ret = -ENOMEM;
+		goto out_up;
+	}
+	ret = collapse_vma_check(vma, haddr);
+	if (ret)
+		goto out_up;
+
+	pmd = collapse_find_pmd(mm, haddr);
+	if (pmd) {
+		pmd_t pmdval = READ_ONCE(*pmd);
+
+		/* already huge */
+		if (pmd_trans_huge(pmdval) || pmd_devmap(pmdval))
+			goto out_up;
+		/* a huge page being migrated */
+		if (!pmd_none(pmdval) && !pmd_present(pmdval)) {
+			ret = -EAGAIN;
+			goto out_up;
+		}
+	}
+
+	if (vma->vm_file)
+		return collapse_file_pmd(vma, pmd, haddr);
+	/* nothing mapped, leave it to the first fault */
+	if (!pmd || pmd_none(*pmd))
+		goto out_up;
+	return collapse_anon_pmd(vma, pmd, haddr);
+
+out_up:
+	up_read(&mm->mmap_sem);
+	return ret;
+}
+
+/**
+ * madvise_collapse - collapse a range to PMD mappings right now
+ * @mm: the mm, mmap_sem must not be held
+ * @start: page aligned start of the range
+ * @end: end of the range
+ *
+ * Only the huge page aligned parts of the range are collapsed.  All of
+ * them are tried even after a failure.  Returns 0 when every one of them
+ * is PMD mapped afterwards, otherwise the first error.
+ */
+int madvise_collapse(struct mm_struct *mm, unsigned long start,
+		     unsigned long end)
+{
+	unsigned long haddr;
+	int err, ret = 0;
+
+	if (start & ~PAGE_MASK || end < start)
+		return -EINVAL;
+
+	for (haddr = round_up(start, HPAGE_PMD_SIZE);
+	     haddr + HPAGE_PMD_SIZE <= end && haddr >= start;
+	     haddr += HPAGE_PMD_SIZE) {
+		if (fatal_signal_pending(current))
+			return -EINTR;
+		err = collapse_pmd(mm, haddr);
+		if (err && !ret)
+			ret = err;
+		cond_resched();
+	}
+	return ret;
+}
+
+/**
+ * madvise_collapse_vec - MADV_COLLAPSE for a vector of ranges
+ * @mm: the mm, mmap_sem must not be held
+ * @vec: the ranges, as passed to process_madvise()
+ * @vlen: number of ranges
+ * @status: result of madvise_collapse() for each range
+ *
+ * Returns the number of ranges fully collapsed.  Ranges not reached
+ * because of a fatal signal report -EINTR.
+ */
+int madvise_collapse_vec(struct mm_struct *mm, const struct iovec *vec,
+			 unsigned long vlen, int *status)
+{
+	unsigned long i, start;
+	int done = 0;
+
+	for (i = 0; i < vlen; i++) {
+		start = (unsigned long)vec[i].iov_base;
+		if (fatal_signal_pending(current)) {
+			status[i] = -EINTR;
+			continue;
+		}
+		status[i] = madvise_collapse(mm, start, start + vec[i].iov_len);
+		if (!status[i])
+			done++;
+	}
+	return done;
+}
@@ -1526,6 +1526,11 @@ struct page *get_dump_page(unsigned long addr)
  *
  *  *) access_ok is sufficient to validate userspace address ranges.
  *
+ * Architectures without pte_special() (classic ARM) get the pte walk too:
+ * the vmas of the range are checked locklessly instead, see
+ * gup_fast_range().  On SMP that still needs HAVE_RCU_TABLE_FREE, as
+ * their TLB maintenance is broadcast in hardware and sends no IPI.
+ *
  * The last two assumptions can be relaxed by the addition of helper functions.
  *
  * This code is based heavily on the PowerPC implementation by Nick Piggin.
@@ -1554,6 +1559,16 @@ static void undo_dev_pagemap(int *nr, int nr_start, struct page **pages)
 }
 
 #ifdef CONFIG_ARCH_HAS_PTE_SPECIAL
+#define gup_pte_special(pte)	pte_special(pte)
+#else
+/*
+ * Without a special bit (classic ARM) gup_fast_range() has already made
+ * sure no VM_PFNMAP or VM_MIXEDMAP vma overlaps the range, so a pte is
+ * special only when there is no struct page behind it.
+ */
+#define gup_pte_special(pte)	(!pfn_valid(pte_pfn(pte)))
+#endif
+
 static int gup_pte_range(pmd_t pmd, unsigned long addr, unsigned long end,
 			 int write, struct page **pages, int *nr)
 {
@@ -1582,7 +1597,7 @@ static int gup_pte_range(pmd_t pmd, unsigned long addr, unsigned long end,
 				undo_dev_pagemap(nr, nr_start, pages);
 				goto pte_unmap;
 			}
-		} else if (pte_special(pte))
+		} else if (gup_pte_special(pte))
 			goto pte_unmap;
 
 		VM_BUG_ON(!pfn_valid(pte_pfn(pte)));
@@ -1613,23 +1628,6 @@ pte_unmap:
 	pte_unmap(ptem);
 	return ret;
 }
-#else
-
-/*
- * If we can't determine whether or not a pte is special, then fail immediately
- * for ptes. Note, we can still pin HugeTLB and THP as these are guaranteed not
- * to be special.
- *
- * For a futex to be placed on a THP tail page, get_futex_key requires a
- * __get_user_pages_fast implementation that can pin pages. Thus it's still
- * useful to have gup_huge_pmd even if we can't operate on ptes.
- */
-static int gup_pte_range(pmd_t pmd, unsigned long addr, unsigned long end,
-			 int write, struct page **pages, int *nr)
-{
-	return 0;
-}
-#endif /* CONFIG_ARCH_HAS_PTE_SPECIAL */
 
 #if defined(__HAVE_ARCH_PTE_DEVMAP) && defined(CONFIG_TRANSPARENT_HUGEPAGE)
 static int __gup_device_huge(unsigned long pfn, unsigned long addr,
@@ -1942,6 +1940,112 @@ static void gup_pgd_range(unsigned long addr, unsigned long end,
 	} while (pgdp++, addr = next, addr != end);
 }
 
+#ifdef CONFIG_ARCH_HAS_PTE_SPECIAL
+static inline void gup_fast_range(unsigned long start, unsigned long end,
+		int write, struct page **pages, int *nr)
+{
+	gup_pgd_range(start, end, write, pages, nr);
+}
+#elif defined(CONFIG_SPECULATIVE_PAGE_FAULT)
+/* vmas one gup_fast range may span before the slow path is cheaper */
+#define GUP_FAST_MAX_VMAS	4
+
+struct gup_fast_vmas {
+	int nr;
+	struct vm_area_struct *vma[GUP_FAST_MAX_VMAS];
+	unsigned int seq[GUP_FAST_MAX_VMAS];
+};
+
+static bool gup_fast_vmas_ok(struct mm_struct *mm, unsigned long start,
+		unsigned long end, struct gup_fast_vmas *v)
+{
+	struct vm_area_struct *vma;
+	unsigned long addr = start, vm_end;
+	unsigned int seq;
+
+	v->nr = 0;
+	while (addr < end) {
+		if (v->nr == GUP_FAST_MAX_VMAS)
+			return false;
+		vma = vma_tree_find(&mm->mm_vt, addr);
+		if (!vma)
+			return false;
+		/* vm_flags and the bounds are changed under vm_write_begin() */
+		seq = raw_read_seqcount(&vma->vm_sequence);
+		if (seq & 1)
+			return false;
+		smp_rmb();
+		if (addr < READ_ONCE(vma->vm_start))
+			return false;
+		if (READ_ONCE(vma->vm_flags) & (VM_IO | VM_PFNMAP | VM_MIXEDMAP))
+			return false;
+		/* a tree caught mid-update must not make us spin */
+		vm_end = READ_ONCE(vma->vm_end);
+		if (vm_end <= addr)
+			return false;
+		v->vma[v->nr] = vma;
+		v->seq[v->nr++] = seq;
+		addr = vm_end;
+	}
+	return true;
+}
+
+static bool gup_fast_vmas_changed(struct gup_fast_vmas *v)
+{
+	int i;
+
+	for (i = 0; i < v->nr; i++)
+		if (read_seqcount_retry(&v->vma[i]->vm_sequence, v->seq[i]))
+			return true;
+	return false;
+}
+
+/*
+ * The pte alone cannot tell a page we may pin from a raw pfn mapping, so
+ * look at the vmas.  Interrupts are off, which holds off the RCU grace
+ * period that frees vmas and tree nodes (speculative page faults free
+ * them that way).  mm_vt_seq catches a vma being replaced (say munmap +
+ * mmap of a device) and each vma's vm_sequence a change of its flags or
+ * bounds while we walk.  In either case drop whatever was pinned and let
+ * the slow path sort it out.
+ */
+static void gup_fast_range(unsigned long start, unsigned long end,
+		int write, struct page **pages, int *nr)
+{
+	struct mm_struct *mm = current->mm;
+	struct gup_fast_vmas v;
+	int nr_start = *nr;
+	unsigned int seq;
+
+	/* don't spin with interrupts off on a writer that may be preempted */
+	seq = raw_read_seqcount(&mm->mm_vt_seq);
+	if (seq & 1)
+		return;
+	smp_rmb();
+
+	if (!gup_fast_vmas_ok(mm, start, end, &v))
+		return;
+
+	gup_pgd_range(start, end, write, pages, nr);
+
+	if (read_seqcount_retry(&mm->mm_vt_seq, seq) ||
+	    gup_fast_vmas_changed(&v)) {
+		while (*nr > nr_start)
+			put_page(pages[--(*nr)]);
+	}
+}
+#else
+/*
+ * Without pte_special() only the vmas can tell pinnable pages from pfn
+ * mappings, and without speculative page faults nothing keeps a vma
+ * alive outside mmap_sem: leave it all to the slow path.
+ */
+static inline void gup_fast_range(unsigned long start, unsigned long end,
+		int write, struct page **pages, int *nr)
+{
+}
+#endif /* CONFIG_ARCH_HAS_PTE_SPECIAL */
+
 #ifndef gup_fast_permitted
 /*
  * Check if it's allowed to use __get_user_pages_fast() for the range, or
@@ -1991,7 +2095,7 @@ int __get_user_pages_fast(unsigned long start, int nr_pages, int write,
 
 	if (gup_fast_permitted(start, nr_pages, write)) {
 		local_irq_save(flags);
-		gup_pgd_range(start, end, write, pages, &nr);
+		gup_fast_range(start, end, write, pages, &nr);
 		local_irq_restore(flags);
 	}
 
@@ -2033,7 +2137,7 @@ int get_user_pages_fast(unsigned long start, int nr_pages, int write,
 
 	if (gup_fast_permitted(start, nr_pages, write)) {
 		local_irq_disable();
-		gup_pgd_range(addr, end, write, pages, &nr);
+		gup_fast_range(addr, end, write, pages, &nr);
 		local_irq_enable();
 		ret = nr;
 	}
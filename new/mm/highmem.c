@@ -27,6 +27,9 @@
 #include <linux/hash.h>
 #include <linux/highmem.h>
 #include <linux/kgdb.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/vmalloc.h>
 #include <asm/tlbflush.h>
 
 
@@ -161,10 +164,69 @@ pte_t * pkmap_page_table;
 		do { spin_unlock(&kmap_lock); (void)(flags); } while (0)
 #endif
 
+enum kmap_stat_item {
+	KMAP_PKMAP_FLUSH,	/* pkmap pool wrapped, global TLB flush */
+	KMAP_PKMAP_WAIT,	/* kmap_high() slept for a free entry */
+	KMAP_LOCAL_MAP,		/* kmap_local_page() of a highmem page */
+	KMAP_LOCAL_STEAL,	/* slot taken from another CPU's share */
+	KMAP_LOCAL_FALLBACK,	/* no slot free, kmap_high() instead */
+	KMAP_LOCAL_MIGRATE,	/* held slots flushed on a new CPU */
+	KMAP_LOCAL_REMOTE,	/* slot unmapped away from its CPU, broadcast */
+	NR_KMAP_STATS
+};
+
+static const char * const kmap_stat_names[NR_KMAP_STATS] = {
+	[KMAP_PKMAP_FLUSH]	= "pkmap_flush",
+	[KMAP_PKMAP_WAIT]	= "pkmap_wait",
+	[KMAP_LOCAL_MAP]	= "local_map",
+	[KMAP_LOCAL_STEAL]	= "local_steal",
+	[KMAP_LOCAL_FALLBACK]	= "local_fallback",
+	[KMAP_LOCAL_MIGRATE]	= "local_migrate",
+	[KMAP_LOCAL_REMOTE]	= "local_remote",
+};
+
+static DEFINE_PER_CPU(unsigned long [NR_KMAP_STATS], kmap_stats);
+
+static inline void count_kmap_event(enum kmap_stat_item item)
+{
+	this_cpu_inc(kmap_stats[item]);
+}
+
+#ifdef ARCH_HAS_KMAP_LOCAL
+/* slots each CPU starts out with, one bit each in kmap_local_free */
+#define KM_LOCAL_PER_CPU	16
+
+static unsigned long kmap_local_start, kmap_local_end;
+static pte_t **kmap_local_ptes;
+/* CPU the slot was mapped on, -1 once its task has run elsewhere */
+static int *kmap_local_cpu;
+static DEFINE_PER_CPU(unsigned long, kmap_local_free);
+
+static inline bool is_kmap_local_addr(unsigned long addr)
+{
+	return addr >= kmap_local_start && addr < kmap_local_end;
+}
+
+static inline unsigned int kmap_local_slot(unsigned long addr)
+{
+	return (addr - kmap_local_start) >> PAGE_SHIFT;
+}
+
+static inline unsigned long kmap_local_vaddr(unsigned int slot)
+{
+	return kmap_local_start + ((unsigned long)slot << PAGE_SHIFT);
+}
+#endif
+
 struct page *kmap_to_page(void *vaddr)
 {
 	unsigned long addr = (unsigned long)vaddr;
 
+#ifdef ARCH_HAS_KMAP_LOCAL
+	if (is_kmap_local_addr(addr))
+		return pte_page(*kmap_local_ptes[kmap_local_slot(addr)]);
+#endif
+
 	if (addr >= PKMAP_ADDR(0) && addr < PKMAP_ADDR(LAST_PKMAP)) {
 		int i = PKMAP_NR(addr);
 		return pte_page(pkmap_page_table[i]);
@@ -210,8 +272,10 @@ static void flush_all_zero_pkmaps(void)
 		set_page_address(page, NULL);
 		need_flush = 1;
 	}
-	if (need_flush)
+	if (need_flush) {
 		flush_tlb_kernel_range(PKMAP_ADDR(0), PKMAP_ADDR(LAST_PKMAP));
+		count_kmap_event(KMAP_PKMAP_FLUSH);
+	}
 }
 
 /**
@@ -284,6 +348,7 @@ start:
 			 * 将当前线程挂到pkmap_map_wait等待队列上.
 			 */
 			add_wait_queue(pkmap_map_wait, &wait);
+			count_kmap_event(KMAP_PKMAP_WAIT);
 			/* 释放全局锁并睡眠。该锁由调用者获取 */
 			unlock_kmap();
 			schedule();
@@ -489,7 +554,264 @@ void kunmap_high(struct page *page)
 }
 
 EXPORT_SYMBOL(kunmap_high);
+
+#ifdef ARCH_HAS_KMAP_LOCAL
+/*
+ * kmap_local_page() hands out slots of a virtual range set aside at boot,
+ * KM_LOCAL_PER_CPU per possible CPU.  A CPU takes from its own share
+ * first, with one atomic bit op and no lock, and only looks at the other
+ * shares when its own is used up.  A slot goes back to the share it came
+ * from, wherever it is unmapped.
+ *
+ * The pte of a slot stays in init_mm until kunmap_local(), so the address
+ * stays good while the task is preempted or migrated; that is what sets
+ * this apart from kmap_atomic().  A CPU flushes a slot from its own TLB
+ * when it maps it, and when a task holding slots is switched in on a CPU
+ * other than the one its slots were last flushed on
+ * (__kmap_local_sched_in()).
+ *
+ * kunmap_local() flushes locally as long as the slot never left the CPU
+ * that mapped it.  Once its task has run elsewhere, other TLBs may still
+ * hold the old page after the slot is back in a share, so the unmap is
+ * broadcast with arch_kmap_local_flush_all().  Tasks that stay put pay
+ * no global TLB flush and nobody waits, unlike kmap_high(); that is only
+ * used when every slot is taken.
+ */
+#ifndef arch_kmap_local_flush
+#define arch_kmap_local_flush(vaddr)	\
+	flush_tlb_kernel_range(vaddr, (vaddr) + PAGE_SIZE)
+#endif
+#ifndef arch_kmap_local_flush_all
+#define arch_kmap_local_flush_all(vaddr)	\
+	flush_tlb_kernel_range(vaddr, (vaddr) + PAGE_SIZE)
+#endif
+#ifndef arch_kmap_local_high_get
+#define arch_kmap_local_high_get(page)	NULL
 #endif
+#ifndef arch_kmap_local_pre_unmap
+#define arch_kmap_local_pre_unmap(vaddr)	do { } while (0)
+#endif
+
+static int kmap_local_take(int cpu)
+{
+	unsigned long *free = per_cpu_ptr(&kmap_local_free, cpu);
+	int bit;
+
+	while ((bit = find_first_bit(free, KM_LOCAL_PER_CPU)) <
+	       KM_LOCAL_PER_CPU) {
+		if (test_and_clear_bit(bit, free))
+			return cpu * KM_LOCAL_PER_CPU + bit;
+	}
+	return -1;
+}
+
+/* called with preemption disabled */
+static int kmap_local_get_slot(void)
+{
+	int this = smp_processor_id(), cpu, slot;
+
+	slot = kmap_local_take(this);
+	if (slot >= 0)
+		return slot;
+
+	for_each_possible_cpu(cpu) {
+		if (cpu == this)
+			continue;
+		slot = kmap_local_take(cpu);
+		if (slot >= 0) {
+			count_kmap_event(KMAP_LOCAL_STEAL);
+			return slot;
+		}
+	}
+	return -1;
+}
+
+static void kmap_local_put_slot(unsigned int slot)
+{
+	set_bit(slot % KM_LOCAL_PER_CPU,
+		per_cpu_ptr(&kmap_local_free, slot / KM_LOCAL_PER_CPU));
+}
+
+/**
+ * kmap_local_page - map a page for use by the current task
+ * @page: &struct page to map
+ *
+ * Returns the page's virtual address, valid in this task only until
+ * the matching kunmap_local().  The task may be preempted, migrated or
+ * take page faults meanwhile.  Mappings should be released in reverse
+ * order; at most KM_LOCAL_MAX may be held at once, beyond that this
+ * falls back to kmap().
+ *
+ * May sleep when all slots are taken, so like kmap() this must not be
+ * called from interrupts.
+ */
+void *kmap_local_page(struct page *page)
+{
+	struct kmap_ctrl *kc = &current->kmap_ctrl;
+	unsigned long vaddr;
+	int slot;
+
+	might_sleep();
+
+	if (!PageHighMem(page))
+		return page_address(page);
+
+	vaddr = (unsigned long)arch_kmap_local_high_get(page);
+	if (vaddr)
+		return (void *)vaddr;
+
+	preempt_disable();
+	slot = kc->nr < KM_LOCAL_MAX ? kmap_local_get_slot() : -1;
+	if (slot < 0) {
+		preempt_enable();
+		count_kmap_event(KMAP_LOCAL_FALLBACK);
+		return kmap_high(page);
+	}
+
+	vaddr = kmap_local_vaddr(slot);
+	set_pte_at(&init_mm, vaddr, kmap_local_ptes[slot],
+		   mk_pte(page, kmap_prot));
+	arch_kmap_local_flush(vaddr);
+	kmap_local_cpu[slot] = smp_processor_id();
+
+	if (!kc->nr)
+		kc->cpu = smp_processor_id();
+	kc->slot[kc->nr++] = slot;
+	preempt_enable();
+
+	count_kmap_event(KMAP_LOCAL_MAP);
+	return (void *)vaddr;
+}
+EXPORT_SYMBOL(kmap_local_page);
+
+/**
+ * kunmap_local - release a mapping made by kmap_local_page()
+ * @vaddr: address returned by kmap_local_page(), or inside that page
+ */
+void kunmap_local(void *vaddr)
+{
+	unsigned long addr = (unsigned long)vaddr & PAGE_MASK;
+	struct kmap_ctrl *kc = &current->kmap_ctrl;
+	unsigned int slot;
+	int i;
+
+	if (!is_kmap_local_addr(addr)) {
+		/* a lowmem page needs nothing, pkmap came from kmap_high() */
+		if (addr >= PKMAP_ADDR(0) && addr < PKMAP_ADDR(LAST_PKMAP))
+			kunmap_high(kmap_to_page(vaddr));
+		return;
+	}
+
+	slot = kmap_local_slot(addr);
+	preempt_disable();
+	for (i = kc->nr - 1; i >= 0; i--)
+		if (kc->slot[i] == slot)
+			break;
+	if (WARN_ON_ONCE(i < 0)) {
+		preempt_enable();
+		return;
+	}
+	/* usually the innermost one, otherwise close the gap */
+	kc->nr--;
+	memmove(&kc->slot[i], &kc->slot[i + 1],
+		(kc->nr - i) * sizeof(kc->slot[0]));
+
+	arch_kmap_local_pre_unmap(addr);
+	pte_clear(&init_mm, addr, kmap_local_ptes[slot]);
+	if (likely(kmap_local_cpu[slot] == smp_processor_id())) {
+		arch_kmap_local_flush(addr);
+	} else {
+		arch_kmap_local_flush_all(addr);
+		count_kmap_event(KMAP_LOCAL_REMOTE);
+	}
+	kmap_local_put_slot(slot);
+	preempt_enable();
+}
+EXPORT_SYMBOL(kunmap_local);
+
+/*
+ * From finish_task_switch(), for a task holding slots: the TLB of this
+ * CPU may have a stale entry for any of them if the task last ran, and
+ * mapped them, somewhere else.  The CPUs it ran on before may keep the
+ * entries too, so their unmap has to be broadcast.
+ */
+void __kmap_local_sched_in(void)
+{
+	struct kmap_ctrl *kc = &current->kmap_ctrl;
+	int cpu = smp_processor_id();
+	int i;
+
+	if (kc->cpu == cpu)
+		return;
+
+	for (i = 0; i < kc->nr; i++) {
+		arch_kmap_local_flush(kmap_local_vaddr(kc->slot[i]));
+		kmap_local_cpu[kc->slot[i]] = -1;
+	}
+	kc->cpu = cpu;
+	count_kmap_event(KMAP_LOCAL_MIGRATE);
+}
+
+/*
+ * Until this has run every share is empty and kmap_local_page() simply
+ * uses kmap_high(), so early callers are fine.
+ */
+static int __init kmap_local_init(void)
+{
+	unsigned int nr = nr_cpu_ids * KM_LOCAL_PER_CPU;
+	struct vm_struct *area;
+	int cpu;
+
+	kmap_local_ptes = kmalloc_array(nr, sizeof(pte_t *), GFP_KERNEL);
+	kmap_local_cpu = kmalloc_array(nr, sizeof(int), GFP_KERNEL);
+	if (!kmap_local_ptes || !kmap_local_cpu)
+		goto fail_free;
+	area = alloc_vm_area(nr * PAGE_SIZE, kmap_local_ptes);
+	if (!area)
+		goto fail_free;
+
+	kmap_local_start = (unsigned long)area->addr;
+	kmap_local_end = kmap_local_start + nr * PAGE_SIZE;
+	/* the range and the ptes before any slot can be taken */
+	smp_wmb();
+	for_each_possible_cpu(cpu)
+		per_cpu(kmap_local_free, cpu) =
+			GENMASK(KM_LOCAL_PER_CPU - 1, 0);
+	return 0;
+
+fail_free:
+	kfree(kmap_local_cpu);
+	kfree(kmap_local_ptes);
+	pr_warn("kmap_local: no slots, falling back to kmap()\n");
+	return 0;
+}
+core_initcall(kmap_local_init);
+#endif /* ARCH_HAS_KMAP_LOCAL */
+
+#ifdef CONFIG_DEBUG_FS
+static int kmap_stats_show(struct seq_file *m, void *v)
+{
+	unsigned long sum[NR_KMAP_STATS] = { };
+	int cpu, i;
+
+	for_each_possible_cpu(cpu)
+		for (i = 0; i < NR_KMAP_STATS; i++)
+			sum[i] += per_cpu(kmap_stats, cpu)[i];
+
+	for (i = 0; i < NR_KMAP_STATS; i++)
+		seq_printf(m, "%-16s %lu\n", kmap_stat_names[i], sum[i]);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(kmap_stats);
+
+static int __init kmap_stats_debugfs_init(void)
+{
+	debugfs_create_file("kmap_stats", 0400, NULL, NULL, &kmap_stats_fops);
+	return 0;
+}
+late_initcall(kmap_stats_debugfs_init);
+#endif /* CONFIG_DEBUG_FS */
+#endif /* CONFIG_HIGHMEM */
 
 #if defined(HASHED_PAGE_VIRTUAL)
 
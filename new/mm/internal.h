@@ -43,6 +43,17 @@ vm_fault_t do_swap_page(struct vm_fault *vmf);
 void free_pgtables(struct mmu_gather *tlb, struct vm_area_struct *start_vma,
 		unsigned long floor, unsigned long ceiling);
 
+/* A PTE table taken out of an mm for an asynchronous munmap */
+struct detached_pte_table {
+	unsigned long addr;		/* PMD aligned */
+	pgtable_t table;
+};
+
+unsigned long detach_pte_tables(struct mm_struct *mm, unsigned long start,
+		unsigned long end, struct detached_pte_table *tables);
+void zap_detached_pte_table(struct mmu_gather *tlb,
+		struct vm_area_struct *vma, struct detached_pte_table *dt);
+
 static inline bool can_madv_dontneed_vma(struct vm_area_struct *vma)
 {
 	return !(vma->vm_flags & (VM_LOCKED|VM_HUGETLB|VM_PFNMAP));
@@ -218,8 +229,11 @@ struct compact_control {
 	bool whole_zone;		/* Whole zone should/has been scanned */
 	bool contended;			/* Signal lock or sched contention */
 	bool finishing_block;		/* Finishing current pageblock */
+	atomic_t *contig_stop;		/* alloc_contig_range() gave up */
 };
 
+extern unsigned int contig_migrate_workers;
+
 unsigned long
 isolate_freepages_range(struct compact_control *cc,
 			unsigned long start_pfn, unsigned long end_pfn);
@@ -294,9 +308,12 @@ static inline bool is_data_mapping(vm_flags_t flags)
 	return (flags & (VM_WRITE | VM_SHARED | VM_STACK)) == VM_WRITE;
 }
 
+/* mm/mmap.c */
+void put_vma(struct vm_area_struct *vma);
+
 /* mm/util.c */
 void __vma_link_list(struct mm_struct *mm, struct vm_area_struct *vma,
-		struct vm_area_struct *prev, struct rb_node *rb_parent);
+		struct vm_area_struct *prev);
 
 #ifdef CONFIG_MMU
 extern long populate_vma_page_range(struct vm_area_struct *vma,
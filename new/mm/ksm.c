@@ -70,6 +70,8 @@
 #include <linux/rmap.h>
 #include <linux/spinlock.h>
 #include <linux/xxhash.h>
+#include <linux/crc32c.h>
+#include <linux/jhash.h>
 #include <linux/delay.h>
 #include <linux/kthread.h>
 #include <linux/wait.h>
@@ -153,6 +155,12 @@
  *
  * If the merge_across_nodes tunable is unset, then KSM maintains multiple
  * stable trees and multiple unstable trees: one of each for each NUMA node.
+ *
+ * There is one ksmd thread per NUMA node with memory.  The threads share the
+ * mm_slots list between them, each taking a whole mm at a time, and a pass
+ * only completes (flushing the unstable trees) once all of them are done
+ * with it.  Each unstable tree has its own mutex, the stable trees share
+ * ksm_stable_mutex: see "Locking" below.
  */
 
 /**
@@ -161,28 +169,47 @@
  * @mm_list: link into the mm_slots list, rooted in ksm_mm_head
  * @rmap_list: head for this mm_slot's singly-linked list of rmap_items
  * @mm: the mm that this information is valid for
+ * @scanner: the ksmd thread scanning this mm_slot, NULL when none is
  */
 struct mm_slot {
 	struct hlist_node link;
 	struct list_head mm_list;
 	struct rmap_item *rmap_list;
 	struct mm_struct *mm;
+	struct ksm_scanner *scanner;
 };
 
 /**
  * struct ksm_scan - cursor for scanning
- * @mm_slot: the current mm_slot we are scanning
+ * @mm_slot: the current mm_slot we are scanning, NULL between mm_slots
  * @address: the next address inside that to be scanned
  * @rmap_list: link to the next rmap to be scanned in the rmap_list
- * @seqnr: count of completed full scans (needed when removing unstable node)
+ * @stale: rmap_items unlinked from rmap_list under mmap_sem, to be taken
+ *	out of the trees and freed once mmap_sem has been dropped
  *
- * There is only the one ksm_scan instance of this cursor structure.
+ * Each ksmd thread has its own ksm_scan cursor.
  */
 struct ksm_scan {
 	struct mm_slot *mm_slot;
 	unsigned long address;
 	struct rmap_item **rmap_list;
-	unsigned long seqnr;
+	struct rmap_item *stale;
+};
+
+/**
+ * struct ksm_scanner - one ksmd thread
+ * @scan: this thread's scanning cursor
+ * @thread: the ksmd kthread
+ * @nid: NUMA node whose cpus the thread runs on
+ * @pages_scanned: pages this thread has passed to cmp_and_merge_page()
+ * @pages_merged: pages this thread has merged into a ksm page or zero page
+ */
+struct ksm_scanner {
+	struct ksm_scan scan;
+	struct task_struct *thread;
+	int nid;
+	unsigned long pages_scanned;
+	unsigned long pages_merged;
 };
 
 /**
@@ -229,25 +256,25 @@ struct stable_node {
  * struct rmap_item - reverse mapping item for virtual addresses
  * @rmap_list: next rmap_item in mm_slot's singly-linked rmap_list
  * @anon_vma: pointer to anon_vma for this mm,address, when in stable tree
- * @nid: NUMA node id of unstable tree in which linked (may not match page)
  * @mm: the memory structure this rmap_item is pointing into
  * @address: the virtual address this rmap_item tracks (+ flags in low bits)
  * @oldchecksum: previous checksum of the page at that virtual address
+ * @nid: NUMA node id of unstable tree in which last linked (may not match
+ *	page); kept out of the anon_vma union so that it always names a valid
+ *	unstable tree lock
  * @node: rb node of this rmap_item in the unstable tree
  * @head: pointer to stable_node heading this list in the stable tree
  * @hlist: link into hlist of rmap_items hanging off that stable_node
  */
 struct rmap_item {
 	struct rmap_item *rmap_list;
-	union {
-		struct anon_vma *anon_vma;	/* when stable */
-#ifdef CONFIG_NUMA
-		int nid;		/* when node of unstable tree */
-#endif
-	};
+	struct anon_vma *anon_vma;	/* when stable */
 	struct mm_struct *mm;
 	unsigned long address;		/* + low bits used for flags below */
 	unsigned int oldchecksum;	/* when unstable */
+#ifdef CONFIG_NUMA
+	int nid;			/* when node of unstable tree */
+#endif
 	union {
 		struct rb_node node;	/* when node of unstable tree */
 		struct {		/* when listed from stable tree */
@@ -279,9 +306,24 @@ static DEFINE_HASHTABLE(mm_slots_hash, MM_SLOTS_HASH_BITS);
 static struct mm_slot ksm_mm_head = {
 	.mm_list = LIST_HEAD_INIT(ksm_mm_head.mm_list),
 };
-static struct ksm_scan ksm_scan = {
-	.mm_slot = &ksm_mm_head,
-};
+
+/*
+ * The mm_slot last handed out to a ksmd thread in this pass, or
+ * &ksm_mm_head before the first: mm_slots after it are still to be scanned.
+ */
+static struct mm_slot *ksm_mm_cursor = &ksm_mm_head;
+
+/* Number of ksmd threads holding an mm_slot of this pass */
+static unsigned int ksm_scan_busy;
+
+/* Set while a ksmd thread flushes the unstable trees for the next pass */
+static bool ksm_scan_starting;
+
+/* Count of completed full scans (needed when removing unstable node) */
+static unsigned long ksm_seqnr;
+
+static struct ksm_scanner *ksm_scanners;
+static int ksm_nr_scanners;
 
 static struct kmem_cache *rmap_item_cache;
 static struct kmem_cache *stable_node_cache;
@@ -294,10 +336,10 @@ static unsigned long ksm_pages_shared;
 static unsigned long ksm_pages_sharing;
 
 /* The number of nodes in the unstable tree */
-static unsigned long ksm_pages_unshared;
+static atomic_long_t ksm_pages_unshared;
 
 /* The number of rmap_items in use: to calculate pages_volatile */
-static unsigned long ksm_rmap_items;
+static atomic_long_t ksm_rmap_items;
 
 /* The number of stable_node chains */
 static unsigned long ksm_stable_node_chains;
@@ -311,12 +353,31 @@ static int ksm_stable_node_chains_prune_millisecs = 2000;
 /* Maximum number of page slots sharing a stable node */
 static int ksm_max_page_sharing = 256;
 
-/* Number of pages ksmd should scan in one batch */
+/* Number of pages each ksmd thread should scan in one batch */
 static unsigned int ksm_thread_pages_to_scan = 100;
 
-/* Milliseconds ksmd should sleep between batches */
+/* Milliseconds each ksmd thread should sleep between batches */
 static unsigned int ksm_thread_sleep_millisecs = 20;
 
+/*
+ * Hash used to tell whether a page changed between two scans.  crc32c goes
+ * through the crypto API, which picks the CPU's crc32 instructions (ARMv8
+ * CRC32, SSE4.2) when it has them.
+ */
+enum ksm_checksum_alg {
+	KSM_CHECKSUM_XXHASH,
+	KSM_CHECKSUM_CRC32C,
+	KSM_CHECKSUM_JHASH2,
+};
+
+static const char * const ksm_checksum_names[] = {
+	[KSM_CHECKSUM_XXHASH]	= "xxhash",
+	[KSM_CHECKSUM_CRC32C]	= "crc32c",
+	[KSM_CHECKSUM_JHASH2]	= "jhash2",
+};
+
+static int ksm_checksum_alg __read_mostly = KSM_CHECKSUM_XXHASH;
+
 /* Checksum of an empty (zeroed) page */
 static unsigned int zero_checksum __read_mostly;
 
@@ -341,9 +402,39 @@ static void wait_while_offlining(void);
 
 static DECLARE_WAIT_QUEUE_HEAD(ksm_thread_wait);
 static DECLARE_WAIT_QUEUE_HEAD(ksm_iter_wait);
-static DEFINE_MUTEX(ksm_thread_mutex);
+static DECLARE_RWSEM(ksm_thread_sem);
 static DEFINE_SPINLOCK(ksm_mmlist_lock);
 
+/*
+ * Locking:
+ *
+ * ksm_thread_sem is held for read by each ksmd thread while it scans a
+ * batch, and for write by everything that reconfigures or empties the trees.
+ *
+ * ksm_unstable_mutex[nid] protects root_unstable_tree[nid] and the
+ * UNSTABLE_FLAG of the rmap_items on it.  An rmap_item is only taken out
+ * of the trees under the lock of its ->nid, since another thread may have
+ * found it in that unstable tree and be busy merging it.
+ *
+ * ksm_stable_mutex protects all the stable trees, migrate_nodes, the
+ * stable_node hlists (together with the ksm page lock) and the STABLE_FLAG
+ * of the rmap_items on them.  It is only held to walk and change the trees:
+ * the walks drop it while they compare page contents, and a page is merged
+ * into the ksm page that was found without it.  ksm_stable_tree_seq counts
+ * the changes to the trees, so that a walk can tell whether the node it
+ * stood on is still there when it takes the mutex back.
+ *
+ * Lock order: ksm_unstable_mutex, ksm_stable_mutex, mmap_sem, page lock.
+ * So no tree lock may be taken while holding mmap_sem: the scan collects
+ * the rmap_items it drops on ksm_scan.stale, and frees them afterwards.
+ */
+static struct mutex *ksm_unstable_mutex;
+static DEFINE_MUTEX(ksm_stable_mutex);
+static unsigned long ksm_stable_tree_seq;
+
+/* stable tree walks restarted this many times compare under the mutex */
+#define STABLE_TREE_MAX_RETRIES	4
+
 #define KSM_KMEM_CACHE(__struct, __flags) kmem_cache_create("ksm_"#__struct,\
 		sizeof(struct __struct), __alignof__(struct __struct),\
 		(__flags), NULL)
@@ -414,6 +505,7 @@ static inline void stable_node_dup_del(struct stable_node *dup)
 		__stable_node_dup_del(dup);
 	else
 		rb_erase(&dup->node, root_stable_tree + NUMA(dup->nid));
+	ksm_stable_tree_seq++;
 #ifdef CONFIG_DEBUG_VM
 	dup->head = NULL;
 #endif
@@ -426,13 +518,13 @@ static inline struct rmap_item *alloc_rmap_item(void)
 	rmap_item = kmem_cache_zalloc(rmap_item_cache, GFP_KERNEL |
 						__GFP_NORETRY | __GFP_NOWARN);
 	if (rmap_item)
-		ksm_rmap_items++;
+		atomic_long_inc(&ksm_rmap_items);
 	return rmap_item;
 }
 
 static inline void free_rmap_item(struct rmap_item *rmap_item)
 {
-	ksm_rmap_items--;
+	atomic_long_dec(&ksm_rmap_items);
 	rmap_item->mm = NULL;	/* debug safety */
 	kmem_cache_free(rmap_item_cache, rmap_item);
 }
@@ -451,6 +543,7 @@ static inline void free_stable_node(struct stable_node *stable_node)
 {
 	VM_BUG_ON(stable_node->rmap_hlist_len &&
 		  !is_stable_node_chain(stable_node));
+	ksm_stable_tree_seq++;
 	kmem_cache_free(stable_node_cache, stable_node);
 }
 
@@ -652,6 +745,7 @@ static struct stable_node *alloc_stable_node_chain(struct stable_node *dup,
 		 * stable node.
 		 */
 		rb_replace_node(&dup->node, &chain->node, root);
+		ksm_stable_tree_seq++;
 
 		/*
 		 * Move the old stable node to the second dimension
@@ -799,8 +893,10 @@ stale:
 /*
  * Removing rmap_item from stable or unstable tree.
  * This function will clean the information from the stable/unstable tree.
+ * The caller holds the unstable tree lock of rmap_item->nid, and
+ * ksm_stable_mutex too if rmap_item may be in the stable tree.
  */
-static void remove_rmap_item_from_tree(struct rmap_item *rmap_item)
+static void __remove_rmap_item_from_tree(struct rmap_item *rmap_item)
 {
 	if (rmap_item->address & STABLE_FLAG) {
 		struct stable_node *stable_node;
@@ -834,26 +930,64 @@ static void remove_rmap_item_from_tree(struct rmap_item *rmap_item)
 		 * if this rmap_item was inserted by this scan, rather
 		 * than left over from before.
 		 */
-		age = (unsigned char)(ksm_scan.seqnr - rmap_item->address);
+		age = (unsigned char)(ksm_seqnr - rmap_item->address);
 		BUG_ON(age > 1);
 		if (!age)
 			rb_erase(&rmap_item->node,
 				 root_unstable_tree + NUMA(rmap_item->nid));
-		ksm_pages_unshared--;
+		atomic_long_dec(&ksm_pages_unshared);
 		rmap_item->address &= PAGE_MASK;
 	}
 out:
 	cond_resched();		/* we're called from many long loops */
 }
 
-static void remove_trailing_rmap_items(struct mm_slot *mm_slot,
-				       struct rmap_item **rmap_list)
+static void remove_rmap_item_from_tree(struct rmap_item *rmap_item)
+{
+	struct mutex *lock = ksm_unstable_mutex + NUMA(rmap_item->nid);
+
+	mutex_lock(lock);
+	/*
+	 * Nobody else sets STABLE_FLAG on an rmap_item of ours without
+	 * holding the lock we now hold; but it may be cleared under us.
+	 */
+	if (rmap_item->address & STABLE_FLAG) {
+		mutex_lock(&ksm_stable_mutex);
+		__remove_rmap_item_from_tree(rmap_item);
+		mutex_unlock(&ksm_stable_mutex);
+	} else
+		__remove_rmap_item_from_tree(rmap_item);
+	mutex_unlock(lock);
+}
+
+/*
+ * Queue an rmap_item, already unlinked from its rmap_list, to be taken out
+ * of the trees by free_stale_rmap_items() when mmap_sem is no longer held.
+ */
+static inline void add_stale_rmap_item(struct rmap_item *rmap_item,
+				       struct rmap_item **stale)
+{
+	rmap_item->rmap_list = *stale;
+	*stale = rmap_item;
+}
+
+static void free_stale_rmap_items(struct rmap_item **stale)
+{
+	while (*stale) {
+		struct rmap_item *rmap_item = *stale;
+		*stale = rmap_item->rmap_list;
+		remove_rmap_item_from_tree(rmap_item);
+		free_rmap_item(rmap_item);
+	}
+}
+
+static void remove_trailing_rmap_items(struct rmap_item **rmap_list,
+				       struct rmap_item **stale)
 {
 	while (*rmap_list) {
 		struct rmap_item *rmap_item = *rmap_list;
 		*rmap_list = rmap_item->rmap_list;
-		remove_rmap_item_from_tree(rmap_item);
-		free_rmap_item(rmap_item);
+		add_stale_rmap_item(rmap_item, stale);
 	}
 }
 
@@ -991,20 +1125,45 @@ static int remove_all_stable_nodes(void)
 	return err;
 }
 
+/*
+ * Take the mm_slots back from the ksmd threads, which keep their place in
+ * an mm between batches: called with ksm_thread_sem held for write.
+ */
+static void ksm_reset_scanners(void)
+{
+	int i;
+
+	spin_lock(&ksm_mmlist_lock);
+	for (i = 0; i < ksm_nr_scanners; i++) {
+		struct ksm_scan *scan = &ksm_scanners[i].scan;
+
+		if (scan->mm_slot) {
+			scan->mm_slot->scanner = NULL;
+			scan->mm_slot = NULL;
+		}
+	}
+	ksm_scan_busy = 0;
+	ksm_mm_cursor = &ksm_mm_head;
+	spin_unlock(&ksm_mmlist_lock);
+}
+
 static int unmerge_and_remove_all_rmap_items(void)
 {
 	struct mm_slot *mm_slot;
 	struct mm_struct *mm;
 	struct vm_area_struct *vma;
+	struct rmap_item *stale = NULL;
 	int err = 0;
 
+	ksm_reset_scanners();
+
 	spin_lock(&ksm_mmlist_lock);
-	ksm_scan.mm_slot = list_entry(ksm_mm_head.mm_list.next,
+	ksm_mm_cursor = list_entry(ksm_mm_head.mm_list.next,
 						struct mm_slot, mm_list);
 	spin_unlock(&ksm_mmlist_lock);
 
-	for (mm_slot = ksm_scan.mm_slot;
-			mm_slot != &ksm_mm_head; mm_slot = ksm_scan.mm_slot) {
+	for (mm_slot = ksm_mm_cursor;
+			mm_slot != &ksm_mm_head; mm_slot = ksm_mm_cursor) {
 		mm = mm_slot->mm;
 		down_read(&mm->mmap_sem);
 		for (vma = mm->mmap; vma; vma = vma->vm_next) {
@@ -1018,11 +1177,12 @@ static int unmerge_and_remove_all_rmap_items(void)
 				goto error;
 		}
 
-		remove_trailing_rmap_items(mm_slot, &mm_slot->rmap_list);
+		remove_trailing_rmap_items(&mm_slot->rmap_list, &stale);
 		up_read(&mm->mmap_sem);
+		free_stale_rmap_items(&stale);
 
 		spin_lock(&ksm_mmlist_lock);
-		ksm_scan.mm_slot = list_entry(mm_slot->mm_list.next,
+		ksm_mm_cursor = list_entry(mm_slot->mm_list.next,
 						struct mm_slot, mm_list);
 		if (ksm_test_exit(mm)) {
 			hash_del(&mm_slot->link);
@@ -1038,13 +1198,13 @@ static int unmerge_and_remove_all_rmap_items(void)
 
 	/* Clean up stable nodes, but don't worry if some are still busy */
 	remove_all_stable_nodes();
-	ksm_scan.seqnr = 0;
+	ksm_seqnr = 0;
 	return 0;
 
 error:
 	up_read(&mm->mmap_sem);
 	spin_lock(&ksm_mmlist_lock);
-	ksm_scan.mm_slot = &ksm_mm_head;
+	ksm_mm_cursor = &ksm_mm_head;
 	spin_unlock(&ksm_mmlist_lock);
 	return err;
 }
@@ -1054,11 +1214,47 @@ static u32 calc_checksum(struct page *page)
 {
 	u32 checksum;
 	void *addr = kmap_atomic(page);
-	checksum = xxhash(addr, PAGE_SIZE, 0);
+
+	switch (READ_ONCE(ksm_checksum_alg)) {
+	case KSM_CHECKSUM_CRC32C:
+		checksum = crc32c(0, addr, PAGE_SIZE);
+		break;
+	case KSM_CHECKSUM_JHASH2:
+		checksum = jhash2(addr, PAGE_SIZE / 4, 17);
+		break;
+	default:
+		checksum = xxhash(addr, PAGE_SIZE, 0);
+		break;
+	}
 	kunmap_atomic(addr);
 	return checksum;
 }
 
+#ifdef __HAVE_ARCH_MEMCMP
+static inline int memcmp_page(const void *addr1, const void *addr2)
+{
+	return memcmp(addr1, addr2, PAGE_SIZE);
+}
+#else
+/*
+ * The generic memcmp() goes a byte at a time.  Look for the first block of
+ * four words that differs instead, which the compiler can unroll or
+ * vectorize, and only leave ordering that block to memcmp().
+ */
+static int memcmp_page(const void *addr1, const void *addr2)
+{
+	const unsigned long *a = addr1, *b = addr2;
+	unsigned int i;
+
+	for (i = 0; i < PAGE_SIZE / sizeof(long); i += 4) {
+		if ((a[i] ^ b[i]) | (a[i + 1] ^ b[i + 1]) |
+		    (a[i + 2] ^ b[i + 2]) | (a[i + 3] ^ b[i + 3]))
+			return memcmp(a + i, b + i, 4 * sizeof(long));
+	}
+	return 0;
+}
+#endif
+
 static int memcmp_pages(struct page *page1, struct page *page2)
 {
 	char *addr1, *addr2;
@@ -1066,7 +1262,7 @@ static int memcmp_pages(struct page *page1, struct page *page2)
 
 	addr1 = kmap_atomic(page1);
 	addr2 = kmap_atomic(page2);
-	ret = memcmp(addr1, addr2, PAGE_SIZE);
+	ret = memcmp_page(addr1, addr2);
 	kunmap_atomic(addr2);
 	kunmap_atomic(addr1);
 	return ret;
@@ -1103,6 +1299,9 @@ static int write_protect_page(struct vm_area_struct *vma, struct page *page,
 		goto out_mn;
 	if (WARN_ONCE(!pvmw.pte, "Unexpected PMD mapping?"))
 		goto out_unlock;
+	/* other mms map the page through this table too */
+	if (pte_table_shared(*pvmw.pmd))
+		goto out_unlock;
 
 	if (pte_write(*pvmw.pte) || pte_dirty(*pvmw.pte) ||
 	    (pte_protnone(*pvmw.pte) && pte_savedwrite(*pvmw.pte)) ||
@@ -1335,8 +1534,8 @@ static int try_to_merge_with_ksm_page(struct rmap_item *rmap_item,
 	if (err)
 		goto out;
 
-	/* Unstable nid is in union with stable anon_vma: remove first */
-	remove_rmap_item_from_tree(rmap_item);
+	/* Take it out of the unstable tree before it joins the stable */
+	__remove_rmap_item_from_tree(rmap_item);
 
 	/* Must get reference to anon_vma while still holding mmap_sem */
 	rmap_item->anon_vma = vma->anon_vma;
@@ -1585,6 +1784,35 @@ static __always_inline struct page *chain(struct stable_node **s_n_d,
 	return tree_page;
 }
 
+/*
+ * Compare @page with @tree_page, which the caller found on a stable tree
+ * and holds a reference to, then drop that reference.  The compare is done
+ * without ksm_stable_mutex, unless the walk had to start over too often
+ * already.  Returns false if the trees changed meanwhile: the node the
+ * walk stood on may be gone, so it has to start over.
+ */
+static bool stable_tree_memcmp(struct page *page, struct page *tree_page,
+			       int *ret, int *retries)
+{
+	unsigned long seq = ksm_stable_tree_seq;
+
+	if (*retries >= STABLE_TREE_MAX_RETRIES) {
+		*ret = memcmp_pages(page, tree_page);
+		put_page(tree_page);
+		return true;
+	}
+
+	mutex_unlock(&ksm_stable_mutex);
+	*ret = memcmp_pages(page, tree_page);
+	put_page(tree_page);
+	mutex_lock(&ksm_stable_mutex);
+
+	if (seq == ksm_stable_tree_seq)
+		return true;
+	(*retries)++;
+	return false;
+}
+
 /*
  * stable_tree_search - search for page inside the stable tree
  *
@@ -1593,6 +1821,8 @@ static __always_inline struct page *chain(struct stable_node **s_n_d,
  *
  * This function returns the stable tree node of identical content if found,
  * NULL otherwise.
+ *
+ * Called with ksm_stable_mutex held, which it drops while comparing pages.
  */
 static struct page *stable_tree_search(struct page *page)
 {
@@ -1602,7 +1832,10 @@ static struct page *stable_tree_search(struct page *page)
 	struct rb_node *parent;
 	struct stable_node *stable_node, *stable_node_dup, *stable_node_any;
 	struct stable_node *page_node;
+	int retries = 0;
 
+again:
+	/* another thread may have put a migrated page_node back meanwhile */
 	page_node = page_stable_node(page);
 	if (page_node && page_node->head != &migrate_nodes) {
 		/* ksm page forked */
@@ -1612,7 +1845,6 @@ static struct page *stable_tree_search(struct page *page)
 
 	nid = get_kpfn_nid(page_to_pfn(page));
 	root = root_stable_tree + nid;
-again:
 	new = &root->rb_node;
 	parent = NULL;
 
@@ -1673,8 +1905,8 @@ again:
 			goto again;
 		}
 
-		ret = memcmp_pages(page, tree_page);
-		put_page(tree_page);
+		if (!stable_tree_memcmp(page, tree_page, &ret, &retries))
+			goto again;
 
 		parent = *new;
 		if (ret < 0)
@@ -1742,6 +1974,7 @@ again:
 	DO_NUMA(page_node->nid = nid);
 	rb_link_node(&page_node->node, parent, new);
 	rb_insert_color(&page_node->node, root);
+	ksm_stable_tree_seq++;
 out:
 	if (is_page_sharing_candidate(page_node)) {
 		get_page(page);
@@ -1777,6 +2010,7 @@ replace:
 			rb_erase(&stable_node_dup->node, root);
 			page = NULL;
 		}
+		ksm_stable_tree_seq++;
 	} else {
 		VM_BUG_ON(!is_stable_node_chain(stable_node));
 		__stable_node_dup_del(stable_node_dup);
@@ -1838,7 +2072,9 @@ chain_append:
  * into the stable tree.
  *
  * This function returns the stable tree node just allocated on success,
- * NULL otherwise.
+ * with kpage locked, NULL otherwise.
+ *
+ * Called with ksm_stable_mutex held, which it drops while comparing pages.
  */
 static struct stable_node *stable_tree_insert(struct page *kpage)
 {
@@ -1849,6 +2085,7 @@ static struct stable_node *stable_tree_insert(struct page *kpage)
 	struct rb_node *parent;
 	struct stable_node *stable_node, *stable_node_dup, *stable_node_any;
 	bool need_chain = false;
+	int retries = 0;
 
 	kpfn = page_to_pfn(kpage);
 	nid = get_kpfn_nid(kpfn);
@@ -1902,8 +2139,8 @@ again:
 			goto again;
 		}
 
-		ret = memcmp_pages(kpage, tree_page);
-		put_page(tree_page);
+		if (!stable_tree_memcmp(kpage, tree_page, &ret, &retries))
+			goto again;
 
 		parent = *new;
 		if (ret < 0)
@@ -1922,12 +2159,12 @@ again:
 
 	INIT_HLIST_HEAD(&stable_node_dup->hlist);
 	stable_node_dup->kpfn = kpfn;
-	set_page_stable_node(kpage, stable_node_dup);
 	stable_node_dup->rmap_hlist_len = 0;
 	DO_NUMA(stable_node_dup->nid = nid);
 	if (!need_chain) {
 		rb_link_node(&stable_node_dup->node, parent, new);
 		rb_insert_color(&stable_node_dup->node, root);
+		ksm_stable_tree_seq++;
 	} else {
 		if (!is_stable_node_chain(stable_node)) {
 			struct stable_node *orig = stable_node;
@@ -1941,6 +2178,9 @@ again:
 		stable_node_chain_add_dup(stable_node_dup, stable_node);
 	}
 
+	/* rmap_walk_ksm() gets from kpage to the node under its lock */
+	lock_page(kpage);
+	set_page_stable_node(kpage, stable_node_dup);
 	return stable_node_dup;
 }
 
@@ -1957,6 +2197,9 @@ again:
  *
  * This function does both searching and inserting, because they share
  * the same walking algorithm in an rbtree.
+ *
+ * Called with the unstable tree lock of the page's node held, which keeps
+ * the returned tree rmap_item from being freed by the thread scanning its mm.
  */
 static
 struct rmap_item *unstable_tree_search_insert(struct rmap_item *rmap_item,
@@ -2016,12 +2259,12 @@ struct rmap_item *unstable_tree_search_insert(struct rmap_item *rmap_item,
 	}
 
 	rmap_item->address |= UNSTABLE_FLAG;
-	rmap_item->address |= (ksm_scan.seqnr & SEQNR_MASK);
+	rmap_item->address |= (ksm_seqnr & SEQNR_MASK);
 	DO_NUMA(rmap_item->nid = nid);
 	rb_link_node(&rmap_item->node, parent, new);
 	rb_insert_color(&rmap_item->node, root);
 
-	ksm_pages_unshared++;
+	atomic_long_inc(&ksm_pages_unshared);
 	return NULL;
 }
 
@@ -2068,20 +2311,31 @@ static void stable_tree_append(struct rmap_item *rmap_item,
  * be inserted into the unstable tree, or merged with a page already there and
  * both transferred to the stable tree.
  *
+ * @ks: the ksmd thread doing it.
  * @page: the page that we are searching identical page to.
  * @rmap_item: the reverse mapping into the virtual address of this page
  */
-static void cmp_and_merge_page(struct page *page, struct rmap_item *rmap_item)
+static void cmp_and_merge_page(struct ksm_scanner *ks, struct page *page,
+			       struct rmap_item *rmap_item)
 {
 	struct mm_struct *mm = rmap_item->mm;
 	struct rmap_item *tree_rmap_item;
 	struct page *tree_page = NULL;
 	struct stable_node *stable_node;
 	struct page *kpage;
+	struct mutex *unstable_lock;
 	unsigned int checksum;
 	int err;
 	bool max_page_sharing_bypass = false;
 
+	/*
+	 * Whatever happens below, rmap_item leaves the unstable tree: do that
+	 * now, as the unstable tree lock nests outside ksm_stable_mutex.
+	 */
+	if (!(rmap_item->address & STABLE_FLAG))
+		remove_rmap_item_from_tree(rmap_item);
+
+	mutex_lock(&ksm_stable_mutex);
 	stable_node = page_stable_node(page);
 	if (stable_node) {
 		if (stable_node->head != &migrate_nodes &&
@@ -2092,8 +2346,10 @@ static void cmp_and_merge_page(struct page *page, struct rmap_item *rmap_item)
 			list_add(&stable_node->list, stable_node->head);
 		}
 		if (stable_node->head != &migrate_nodes &&
-		    rmap_item->head == stable_node)
+		    rmap_item->head == stable_node) {
+			mutex_unlock(&ksm_stable_mutex);
 			return;
+		}
 		/*
 		 * If it's a KSM fork, allow it to go over the sharing limit
 		 * without warnings.
@@ -2105,23 +2361,36 @@ static void cmp_and_merge_page(struct page *page, struct rmap_item *rmap_item)
 	/* We first start with searching the page inside the stable tree */
 	kpage = stable_tree_search(page);
 	if (kpage == page && rmap_item->head == stable_node) {
+		mutex_unlock(&ksm_stable_mutex);
 		put_page(kpage);
 		return;
 	}
 
-	remove_rmap_item_from_tree(rmap_item);
+	__remove_rmap_item_from_tree(rmap_item);
+	mutex_unlock(&ksm_stable_mutex);
 
 	if (kpage) {
+		/*
+		 * Our reference keeps kpage a ksm page, and so its stable
+		 * node on the tree, while we merge without the mutex.
+		 */
 		err = try_to_merge_with_ksm_page(rmap_item, page, kpage);
 		if (!err) {
 			/*
 			 * The page was successfully merged:
 			 * add its rmap_item to the stable tree.
 			 */
+			mutex_lock(&ksm_stable_mutex);
 			lock_page(kpage);
-			stable_tree_append(rmap_item, page_stable_node(kpage),
+			stable_node = page_stable_node(kpage);
+			/* other threads may have filled it up since */
+			if (!is_page_sharing_candidate(stable_node))
+				max_page_sharing_bypass = true;
+			stable_tree_append(rmap_item, stable_node,
 					   max_page_sharing_bypass);
 			unlock_page(kpage);
+			mutex_unlock(&ksm_stable_mutex);
+			ks->pages_merged++;
 		}
 		put_page(kpage);
 		return;
@@ -2164,9 +2433,14 @@ static void cmp_and_merge_page(struct page *page, struct rmap_item *rmap_item)
 		 * In case of failure, the page was not really empty, so we
 		 * need to continue. Otherwise we're done.
 		 */
-		if (!err)
+		if (!err) {
+			ks->pages_merged++;
 			return;
+		}
 	}
+
+	unstable_lock = ksm_unstable_mutex + get_kpfn_nid(page_to_pfn(page));
+	mutex_lock(unstable_lock);
 	tree_rmap_item =
 		unstable_tree_search_insert(rmap_item, page, &tree_page);
 	if (tree_rmap_item) {
@@ -2192,15 +2466,17 @@ static void cmp_and_merge_page(struct page *page, struct rmap_item *rmap_item)
 			 * The pages were successfully merged: insert new
 			 * node in the stable tree and add both rmap_items.
 			 */
-			lock_page(kpage);
+			mutex_lock(&ksm_stable_mutex);
 			stable_node = stable_tree_insert(kpage);
 			if (stable_node) {
 				stable_tree_append(tree_rmap_item, stable_node,
 						   false);
 				stable_tree_append(rmap_item, stable_node,
 						   false);
+				unlock_page(kpage);
+				ks->pages_merged += 2;
 			}
-			unlock_page(kpage);
+			mutex_unlock(&ksm_stable_mutex);
 
 			/*
 			 * If we fail to insert the page into the stable tree,
@@ -2222,18 +2498,20 @@ static void cmp_and_merge_page(struct page *page, struct rmap_item *rmap_item)
 			 * the page is locked, it is better to skip it and
 			 * perhaps try again later.
 			 */
-			if (!trylock_page(page))
-				return;
-			split_huge_page(page);
-			unlock_page(page);
+			if (trylock_page(page)) {
+				split_huge_page(page);
+				unlock_page(page);
+			}
 		}
 	}
+	mutex_unlock(unstable_lock);
 }
 
 static struct rmap_item *get_next_rmap_item(struct mm_slot *mm_slot,
-					    struct rmap_item **rmap_list,
+					    struct ksm_scan *scan,
 					    unsigned long addr)
 {
+	struct rmap_item **rmap_list = scan->rmap_list;
 	struct rmap_item *rmap_item;
 
 	while (*rmap_list) {
@@ -2243,8 +2521,7 @@ static struct rmap_item *get_next_rmap_item(struct mm_slot *mm_slot,
 		if (rmap_item->address > addr)
 			break;
 		*rmap_list = rmap_item->rmap_list;
-		remove_rmap_item_from_tree(rmap_item);
-		free_rmap_item(rmap_item);
+		add_stale_rmap_item(rmap_item, &scan->stale);
 	}
 
 	rmap_item = alloc_rmap_item();
@@ -2258,66 +2535,132 @@ static struct rmap_item *get_next_rmap_item(struct mm_slot *mm_slot,
 	return rmap_item;
 }
 
-static struct rmap_item *scan_get_next_rmap_item(struct page **page)
+/*
+ * Called between passes, when no ksmd thread holds an mm_slot: so nothing
+ * can be looking at the unstable trees while they are flushed.
+ */
+static void ksm_start_pass(void)
 {
-	struct mm_struct *mm;
-	struct mm_slot *slot;
-	struct vm_area_struct *vma;
-	struct rmap_item *rmap_item;
 	int nid;
 
-	if (list_empty(&ksm_mm_head.mm_list))
-		return NULL;
+	ksm_seqnr++;
 
-	slot = ksm_scan.mm_slot;
-	if (slot == &ksm_mm_head) {
-		/*
-		 * A number of pages can hang around indefinitely on per-cpu
-		 * pagevecs, raised page count preventing write_protect_page
-		 * from merging them.  Though it doesn't really matter much,
-		 * it is puzzling to see some stuck in pages_volatile until
-		 * other activity jostles them out, and they also prevented
-		 * LTP's KSM test from succeeding deterministically; so drain
-		 * them here (here rather than on entry to ksm_do_scan(),
-		 * so we don't IPI too often when pages_to_scan is set low).
-		 */
-		lru_add_drain_all();
+	/*
+	 * A number of pages can hang around indefinitely on per-cpu
+	 * pagevecs, raised page count preventing write_protect_page
+	 * from merging them.  Though it doesn't really matter much,
+	 * it is puzzling to see some stuck in pages_volatile until
+	 * other activity jostles them out, and they also prevented
+	 * LTP's KSM test from succeeding deterministically; so drain
+	 * them here (here rather than on entry to ksm_do_scan(),
+	 * so we don't IPI too often when pages_to_scan is set low).
+	 */
+	lru_add_drain_all();
 
-		/*
-		 * Whereas stale stable_nodes on the stable_tree itself
-		 * get pruned in the regular course of stable_tree_search(),
-		 * those moved out to the migrate_nodes list can accumulate:
-		 * so prune them once before each full scan.
-		 */
-		if (!ksm_merge_across_nodes) {
-			struct stable_node *stable_node, *next;
-			struct page *page;
-
-			list_for_each_entry_safe(stable_node, next,
-						 &migrate_nodes, list) {
-				page = get_ksm_page(stable_node, false);
-				if (page)
-					put_page(page);
-				cond_resched();
-			}
+	/*
+	 * Whereas stale stable_nodes on the stable_tree itself
+	 * get pruned in the regular course of stable_tree_search(),
+	 * those moved out to the migrate_nodes list can accumulate:
+	 * so prune them once before each full scan.
+	 */
+	if (!ksm_merge_across_nodes) {
+		struct stable_node *stable_node, *next;
+		struct page *page;
+
+		mutex_lock(&ksm_stable_mutex);
+		list_for_each_entry_safe(stable_node, next,
+					 &migrate_nodes, list) {
+			page = get_ksm_page(stable_node, false);
+			if (page)
+				put_page(page);
+			cond_resched();
 		}
+		mutex_unlock(&ksm_stable_mutex);
+	}
+
+	for (nid = 0; nid < ksm_nr_node_ids; nid++) {
+		mutex_lock(ksm_unstable_mutex + nid);
+		root_unstable_tree[nid] = RB_ROOT;
+		mutex_unlock(ksm_unstable_mutex + nid);
+	}
+}
 
-		for (nid = 0; nid < ksm_nr_node_ids; nid++)
-			root_unstable_tree[nid] = RB_ROOT;
+/*
+ * ksm_claim_mm_slot - hand the next mm_slot of this pass to a ksmd thread.
+ *
+ * mm_slots are given out one at a time from ksm_mm_cursor, so each thread
+ * scans whole mms, and no mm is scanned by two threads at once.  When all
+ * have been given out and given back, the next thread to ask starts a new
+ * pass.  Returns NULL when there is nothing to hand out for now.
+ */
+static struct mm_slot *ksm_claim_mm_slot(struct ksm_scanner *ks)
+{
+	struct mm_slot *slot = NULL;
 
-		spin_lock(&ksm_mmlist_lock);
-		slot = list_entry(slot->mm_list.next, struct mm_slot, mm_list);
-		ksm_scan.mm_slot = slot;
+	spin_lock(&ksm_mmlist_lock);
+	if (ksm_scan_starting)
+		goto out;
+	if (ksm_mm_cursor->mm_list.next == &ksm_mm_head.mm_list) {
+		/* Wait for the other threads to finish this pass */
+		if (ksm_scan_busy || list_empty(&ksm_mm_head.mm_list))
+			goto out;
+		ksm_scan_starting = true;
 		spin_unlock(&ksm_mmlist_lock);
-		/*
-		 * Although we tested list_empty() above, a racing __ksm_exit
-		 * of the last mm on the list may have removed it since then.
-		 */
-		if (slot == &ksm_mm_head)
-			return NULL;
+
+		ksm_start_pass();
+
+		spin_lock(&ksm_mmlist_lock);
+		ksm_scan_starting = false;
+		ksm_mm_cursor = &ksm_mm_head;
+	}
+	slot = list_entry(ksm_mm_cursor->mm_list.next, struct mm_slot, mm_list);
+	/*
+	 * Although we tested list_empty() above, a racing __ksm_exit
+	 * of the last mm on the list may have removed it since then.
+	 */
+	if (slot == &ksm_mm_head) {
+		slot = NULL;
+		goto out;
+	}
+	ksm_mm_cursor = slot;
+	slot->scanner = ks;
+	ksm_scan_busy++;
+out:
+	spin_unlock(&ksm_mmlist_lock);
+	return slot;
+}
+
+/* Unlink an mm_slot from the lists, stepping ksm_mm_cursor back off it */
+static void ksm_unlink_mm_slot(struct mm_slot *mm_slot)
+{
+	if (ksm_mm_cursor == mm_slot)
+		ksm_mm_cursor = list_entry(mm_slot->mm_list.prev,
+					   struct mm_slot, mm_list);
+	hash_del(&mm_slot->link);
+	list_del(&mm_slot->mm_list);
+}
+
+static struct rmap_item *scan_get_next_rmap_item(struct ksm_scanner *ks,
+						 struct page **page)
+{
+	struct ksm_scan *scan = &ks->scan;
+	struct mm_struct *mm;
+	struct mm_slot *slot;
+	struct vm_area_struct *vma;
+	struct rmap_item *rmap_item;
+
+	if (list_empty(&ksm_mm_head.mm_list))
+		return NULL;
+
+	slot = scan->mm_slot;
+	if (!slot) {
 next_mm:
-		ksm_scan.address = 0;
-		ksm_scan.rmap_list = &slot->rmap_list;
+		slot = ksm_claim_mm_slot(ks);
+		if (!slot)
+			return NULL;
+		scan->mm_slot = slot;
+		scan->address = 0;
+		scan->rmap_list = &slot->rmap_list;
 	}
 
 	mm = slot->mm;
@@ -2325,59 +2668,57 @@ next_mm:
 	if (ksm_test_exit(mm))
 		vma = NULL;
 	else
-		vma = find_vma(mm, ksm_scan.address);
+		vma = find_vma(mm, scan->address);
 
 	for (; vma; vma = vma->vm_next) {
 		if (!(vma->vm_flags & VM_MERGEABLE))
 			continue;
-		if (ksm_scan.address < vma->vm_start)
-			ksm_scan.address = vma->vm_start;
+		if (scan->address < vma->vm_start)
+			scan->address = vma->vm_start;
 		if (!vma->anon_vma)
-			ksm_scan.address = vma->vm_end;
+			scan->address = vma->vm_end;
 
-		while (ksm_scan.address < vma->vm_end) {
+		while (scan->address < vma->vm_end) {
 			if (ksm_test_exit(mm))
 				break;
-			*page = follow_page(vma, ksm_scan.address, FOLL_GET);
+			*page = follow_page(vma, scan->address, FOLL_GET);
 			if (IS_ERR_OR_NULL(*page)) {
-				ksm_scan.address += PAGE_SIZE;
+				scan->address += PAGE_SIZE;
 				cond_resched();
 				continue;
 			}
 			if (PageAnon(*page)) {
-				flush_anon_page(vma, *page, ksm_scan.address);
+				flush_anon_page(vma, *page, scan->address);
 				flush_dcache_page(*page);
-				rmap_item = get_next_rmap_item(slot,
-					ksm_scan.rmap_list, ksm_scan.address);
+				rmap_item = get_next_rmap_item(slot, scan,
+							       scan->address);
 				if (rmap_item) {
-					ksm_scan.rmap_list =
+					scan->rmap_list =
 							&rmap_item->rmap_list;
-					ksm_scan.address += PAGE_SIZE;
+					scan->address += PAGE_SIZE;
 				} else
 					put_page(*page);
 				up_read(&mm->mmap_sem);
+				free_stale_rmap_items(&scan->stale);
 				return rmap_item;
 			}
 			put_page(*page);
-			ksm_scan.address += PAGE_SIZE;
+			scan->address += PAGE_SIZE;
 			cond_resched();
 		}
 	}
 
 	if (ksm_test_exit(mm)) {
-		ksm_scan.address = 0;
-		ksm_scan.rmap_list = &slot->rmap_list;
+		scan->address = 0;
+		scan->rmap_list = &slot->rmap_list;
 	}
 	/*
 	 * Nuke all the rmap_items that are above this current rmap:
 	 * because there were no VM_MERGEABLE vmas with such addresses.
 	 */
-	remove_trailing_rmap_items(slot, ksm_scan.rmap_list);
+	remove_trailing_rmap_items(scan->rmap_list, &scan->stale);
 
-	spin_lock(&ksm_mmlist_lock);
-	ksm_scan.mm_slot = list_entry(slot->mm_list.next,
-						struct mm_slot, mm_list);
-	if (ksm_scan.address == 0) {
+	if (scan->address == 0) {
 		/*
 		 * We've completed a full scan of all vmas, holding mmap_sem
 		 * throughout, and found no VM_MERGEABLE: so do the same as
@@ -2387,51 +2728,64 @@ next_mm:
 		 * or when all VM_MERGEABLE areas have been unmapped (and
 		 * mmap_sem then protects against race with MADV_MERGEABLE).
 		 */
-		hash_del(&slot->link);
-		list_del(&slot->mm_list);
+		spin_lock(&ksm_mmlist_lock);
+		slot->scanner = NULL;
+		scan->mm_slot = NULL;
+		ksm_unlink_mm_slot(slot);
 		spin_unlock(&ksm_mmlist_lock);
 
 		free_mm_slot(slot);
 		clear_bit(MMF_VM_MERGEABLE, &mm->flags);
 		up_read(&mm->mmap_sem);
+		/*
+		 * Out of the trees before the mm they point to can go, and
+		 * before ksm_scan_busy lets the next pass start: the unstable
+		 * ones among them must not be older than the previous pass.
+		 */
+		free_stale_rmap_items(&scan->stale);
+		spin_lock(&ksm_mmlist_lock);
+		ksm_scan_busy--;
+		spin_unlock(&ksm_mmlist_lock);
 		mmdrop(mm);
 	} else {
 		up_read(&mm->mmap_sem);
 		/*
-		 * up_read(&mm->mmap_sem) first because after
-		 * spin_unlock(&ksm_mmlist_lock) run, the "mm" may
-		 * already have been freed under us by __ksm_exit()
-		 * because the "mm_slot" is still hashed and
-		 * ksm_scan.mm_slot doesn't point to it anymore.
+		 * up_read(&mm->mmap_sem) and free the stale rmap_items
+		 * first because after the mm_slot is given back, the "mm"
+		 * may already have been freed under us by __ksm_exit()
+		 * because the "mm_slot" is still hashed and no ksmd
+		 * thread is scanning it anymore.
 		 */
+		free_stale_rmap_items(&scan->stale);
+		spin_lock(&ksm_mmlist_lock);
+		slot->scanner = NULL;
+		scan->mm_slot = NULL;
+		ksm_scan_busy--;
 		spin_unlock(&ksm_mmlist_lock);
 	}
 
 	/* Repeat until we've completed scanning the whole list */
-	slot = ksm_scan.mm_slot;
-	if (slot != &ksm_mm_head)
-		goto next_mm;
-
-	ksm_scan.seqnr++;
-	return NULL;
+	goto next_mm;
 }
 
 /**
  * ksm_do_scan  - the ksm scanner main worker function.
+ * @ks:  the ksmd thread scanning.
  * @scan_npages:  number of pages we want to scan before we return.
  */
-static void ksm_do_scan(unsigned int scan_npages)
+static void ksm_do_scan(struct ksm_scanner *ks, unsigned int scan_npages)
 {
 	struct rmap_item *rmap_item;
 	struct page *uninitialized_var(page);
 
 	while (scan_npages-- && likely(!freezing(current))) {
 		cond_resched();
-		rmap_item = scan_get_next_rmap_item(&page);
+		rmap_item = scan_get_next_rmap_item(ks, &page);
 		if (!rmap_item)
 			return;
-		cmp_and_merge_page(page, rmap_item);
+		cmp_and_merge_page(ks, page, rmap_item);
 		put_page(page);
+		ks->pages_scanned++;
 	}
 }
 
@@ -2440,19 +2794,23 @@ static int ksmd_should_run(void)
 	return (ksm_run & KSM_RUN_MERGE) && !list_empty(&ksm_mm_head.mm_list);
 }
 
-static int ksm_scan_thread(void *nothing)
+static int ksm_scan_thread(void *data)
 {
+	struct ksm_scanner *ks = data;
+	const struct cpumask *cpumask = cpumask_of_node(ks->nid);
 	unsigned int sleep_ms;
 
+	if (!cpumask_empty(cpumask))
+		set_cpus_allowed_ptr(current, cpumask);
 	set_freezable();
 	set_user_nice(current, 5);
 
 	while (!kthread_should_stop()) {
-		mutex_lock(&ksm_thread_mutex);
-		wait_while_offlining();
-		if (ksmd_should_run())
-			ksm_do_scan(ksm_thread_pages_to_scan);
-		mutex_unlock(&ksm_thread_mutex);
+		down_read(&ksm_thread_sem);
+		/* Memory hotremove holds off the scan, see wait_while_offlining */
+		if (ksmd_should_run() && !(ksm_run & KSM_RUN_OFFLINE))
+			ksm_do_scan(ks, ksm_thread_pages_to_scan);
+		up_read(&ksm_thread_sem);
 
 		try_to_freeze();
 
@@ -2550,7 +2908,7 @@ int __ksm_enter(struct mm_struct *mm)
 	if (ksm_run & KSM_RUN_UNMERGE)
 		list_add_tail(&mm_slot->mm_list, &ksm_mm_head.mm_list);
 	else
-		list_add_tail(&mm_slot->mm_list, &ksm_scan.mm_slot->mm_list);
+		list_add_tail(&mm_slot->mm_list, &ksm_mm_cursor->mm_list);
 	spin_unlock(&ksm_mmlist_lock);
 
 	set_bit(MMF_VM_MERGEABLE, &mm->flags);
@@ -2570,22 +2928,23 @@ void __ksm_exit(struct mm_struct *mm)
 	/*
 	 * This process is exiting: if it's straightforward (as is the
 	 * case when ksmd was never running), free mm_slot immediately.
-	 * But if it's at the cursor or has rmap_items linked to it, use
-	 * mmap_sem to synchronize with any break_cows before pagetables
-	 * are freed, and leave the mm_slot on the list for ksmd to free.
+	 * But if it's being scanned, at the cursor or has rmap_items linked
+	 * to it, use mmap_sem to synchronize with any break_cows before
+	 * pagetables are freed, and leave the mm_slot on the list for ksmd
+	 * to free.
 	 * Beware: ksm may already have noticed it exiting and freed the slot.
 	 */
 
 	spin_lock(&ksm_mmlist_lock);
 	mm_slot = get_mm_slot(mm);
-	if (mm_slot && ksm_scan.mm_slot != mm_slot) {
+	if (mm_slot && !mm_slot->scanner && ksm_mm_cursor != mm_slot) {
 		if (!mm_slot->rmap_list) {
 			hash_del(&mm_slot->link);
 			list_del(&mm_slot->mm_list);
 			easy_to_free = 1;
 		} else {
 			list_move(&mm_slot->mm_list,
-				  &ksm_scan.mm_slot->mm_list);
+				  &ksm_mm_cursor->mm_list);
 		}
 	}
 	spin_unlock(&ksm_mmlist_lock);
@@ -2724,10 +3083,10 @@ void ksm_migrate_page(struct page *newpage, struct page *oldpage)
 static void wait_while_offlining(void)
 {
 	while (ksm_run & KSM_RUN_OFFLINE) {
-		mutex_unlock(&ksm_thread_mutex);
+		up_write(&ksm_thread_sem);
 		wait_on_bit(&ksm_run, ilog2(KSM_RUN_OFFLINE),
 			    TASK_UNINTERRUPTIBLE);
-		mutex_lock(&ksm_thread_mutex);
+		down_write(&ksm_thread_sem);
 	}
 }
 
@@ -2814,11 +3173,11 @@ static int ksm_memory_callback(struct notifier_block *self,
 		 * and remove_all_stable_nodes() while memory is going offline:
 		 * it is unsafe for them to touch the stable tree at this time.
 		 * But unmerge_ksm_pages(), rmap lookups and other entry points
-		 * which do not need the ksm_thread_mutex are all safe.
+		 * which do not need the ksm_thread_sem are all safe.
 		 */
-		mutex_lock(&ksm_thread_mutex);
+		down_write(&ksm_thread_sem);
 		ksm_run |= KSM_RUN_OFFLINE;
-		mutex_unlock(&ksm_thread_mutex);
+		up_write(&ksm_thread_sem);
 		break;
 
 	case MEM_OFFLINE:
@@ -2834,9 +3193,9 @@ static int ksm_memory_callback(struct notifier_block *self,
 		/* fallthrough */
 
 	case MEM_CANCEL_OFFLINE:
-		mutex_lock(&ksm_thread_mutex);
+		down_write(&ksm_thread_sem);
 		ksm_run &= ~KSM_RUN_OFFLINE;
-		mutex_unlock(&ksm_thread_mutex);
+		up_write(&ksm_thread_sem);
 
 		smp_mb();	/* wake_up_bit advises this */
 		wake_up_bit(&ksm_run, ilog2(KSM_RUN_OFFLINE));
@@ -2933,7 +3292,7 @@ static ssize_t run_store(struct kobject *kobj, struct kobj_attribute *attr,
 	 * on the list for when ksmd may be set running again).
 	 */
 
-	mutex_lock(&ksm_thread_mutex);
+	down_write(&ksm_thread_sem);
 	wait_while_offlining();
 	if (ksm_run != flags) {
 		ksm_run = flags;
@@ -2947,7 +3306,7 @@ static ssize_t run_store(struct kobject *kobj, struct kobj_attribute *attr,
 			}
 		}
 	}
-	mutex_unlock(&ksm_thread_mutex);
+	up_write(&ksm_thread_sem);
 
 	if (flags & KSM_RUN_MERGE)
 		wake_up_interruptible(&ksm_thread_wait);
@@ -2976,7 +3335,7 @@ static ssize_t merge_across_nodes_store(struct kobject *kobj,
 	if (knob > 1)
 		return -EINVAL;
 
-	mutex_lock(&ksm_thread_mutex);
+	down_write(&ksm_thread_sem);
 	wait_while_offlining();
 	if (ksm_merge_across_nodes != knob) {
 		if (ksm_pages_shared || remove_all_stable_nodes())
@@ -3007,7 +3366,7 @@ static ssize_t merge_across_nodes_store(struct kobject *kobj,
 			ksm_nr_node_ids = knob ? 1 : nr_node_ids;
 		}
 	}
-	mutex_unlock(&ksm_thread_mutex);
+	up_write(&ksm_thread_sem);
 
 	return err ? err : count;
 }
@@ -3036,6 +3395,44 @@ static ssize_t use_zero_pages_store(struct kobject *kobj,
 }
 KSM_ATTR(use_zero_pages);
 
+static ssize_t checksum_show(struct kobject *kobj,
+			     struct kobj_attribute *attr, char *buf)
+{
+	int i, len = 0;
+
+	for (i = 0; i < ARRAY_SIZE(ksm_checksum_names); i++)
+		len += sprintf(buf + len, i == ksm_checksum_alg ? "[%s]%c" :
+			       "%s%c", ksm_checksum_names[i],
+			       i == ARRAY_SIZE(ksm_checksum_names) - 1 ?
+			       '\n' : ' ');
+	return len;
+}
+
+static ssize_t checksum_store(struct kobject *kobj,
+			      struct kobj_attribute *attr,
+			      const char *buf, size_t count)
+{
+	int alg;
+
+	alg = sysfs_match_string(ksm_checksum_names, buf);
+	if (alg < 0)
+		return -EINVAL;
+
+	/*
+	 * Checksums kept from the last scan no longer match, so every page
+	 * looks volatile for one pass: that is all a switch costs.
+	 */
+	down_write(&ksm_thread_sem);
+	if (ksm_checksum_alg != alg) {
+		WRITE_ONCE(ksm_checksum_alg, alg);
+		zero_checksum = calc_checksum(ZERO_PAGE(0));
+	}
+	up_write(&ksm_thread_sem);
+
+	return count;
+}
+KSM_ATTR(checksum);
+
 static ssize_t max_page_sharing_show(struct kobject *kobj,
 				     struct kobj_attribute *attr, char *buf)
 {
@@ -3063,7 +3460,7 @@ static ssize_t max_page_sharing_store(struct kobject *kobj,
 	if (READ_ONCE(ksm_max_page_sharing) == knob)
 		return count;
 
-	mutex_lock(&ksm_thread_mutex);
+	down_write(&ksm_thread_sem);
 	wait_while_offlining();
 	if (ksm_max_page_sharing != knob) {
 		if (ksm_pages_shared || remove_all_stable_nodes())
@@ -3071,7 +3468,7 @@ static ssize_t max_page_sharing_store(struct kobject *kobj,
 		else
 			ksm_max_page_sharing = knob;
 	}
-	mutex_unlock(&ksm_thread_mutex);
+	up_write(&ksm_thread_sem);
 
 	return err ? err : count;
 }
@@ -3094,7 +3491,7 @@ KSM_ATTR_RO(pages_sharing);
 static ssize_t pages_unshared_show(struct kobject *kobj,
 				   struct kobj_attribute *attr, char *buf)
 {
-	return sprintf(buf, "%lu\n", ksm_pages_unshared);
+	return sprintf(buf, "%ld\n", atomic_long_read(&ksm_pages_unshared));
 }
 KSM_ATTR_RO(pages_unshared);
 
@@ -3103,8 +3500,9 @@ static ssize_t pages_volatile_show(struct kobject *kobj,
 {
 	long ksm_pages_volatile;
 
-	ksm_pages_volatile = ksm_rmap_items - ksm_pages_shared
-				- ksm_pages_sharing - ksm_pages_unshared;
+	ksm_pages_volatile = atomic_long_read(&ksm_rmap_items)
+				- ksm_pages_shared - ksm_pages_sharing
+				- atomic_long_read(&ksm_pages_unshared);
 	/*
 	 * It was not worth any locking to calculate that statistic,
 	 * but it might therefore sometimes be negative: conceal that.
@@ -3158,10 +3556,55 @@ KSM_ATTR(stable_node_chains_prune_millisecs);
 static ssize_t full_scans_show(struct kobject *kobj,
 			       struct kobj_attribute *attr, char *buf)
 {
-	return sprintf(buf, "%lu\n", ksm_scan.seqnr);
+	return sprintf(buf, "%lu\n", ksm_seqnr);
 }
 KSM_ATTR_RO(full_scans);
 
+/*
+ * Per-thread counters: one value for each ksmd thread, in the order of
+ * scanner_nodes, which gives the NUMA node each thread runs on.
+ */
+static ssize_t scanner_nodes_show(struct kobject *kobj,
+				  struct kobj_attribute *attr, char *buf)
+{
+	int i, len = 0;
+
+	for (i = 0; i < ksm_nr_scanners; i++)
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%d%c",
+				 ksm_scanners[i].nid,
+				 i == ksm_nr_scanners - 1 ? '\n' : ' ');
+	return len;
+}
+KSM_ATTR_RO(scanner_nodes);
+
+static ssize_t scanner_pages_scanned_show(struct kobject *kobj,
+					  struct kobj_attribute *attr,
+					  char *buf)
+{
+	int i, len = 0;
+
+	for (i = 0; i < ksm_nr_scanners; i++)
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%lu%c",
+				 READ_ONCE(ksm_scanners[i].pages_scanned),
+				 i == ksm_nr_scanners - 1 ? '\n' : ' ');
+	return len;
+}
+KSM_ATTR_RO(scanner_pages_scanned);
+
+static ssize_t scanner_pages_merged_show(struct kobject *kobj,
+					 struct kobj_attribute *attr,
+					 char *buf)
+{
+	int i, len = 0;
+
+	for (i = 0; i < ksm_nr_scanners; i++)
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%lu%c",
+				 READ_ONCE(ksm_scanners[i].pages_merged),
+				 i == ksm_nr_scanners - 1 ? '\n' : ' ');
+	return len;
+}
+KSM_ATTR_RO(scanner_pages_merged);
+
 static struct attribute *ksm_attrs[] = {
 	&sleep_millisecs_attr.attr,
 	&pages_to_scan_attr.attr,
@@ -3171,6 +3614,9 @@ static struct attribute *ksm_attrs[] = {
 	&pages_unshared_attr.attr,
 	&pages_volatile_attr.attr,
 	&full_scans_attr.attr,
+	&scanner_nodes_attr.attr,
+	&scanner_pages_scanned_attr.attr,
+	&scanner_pages_merged_attr.attr,
 #ifdef CONFIG_NUMA
 	&merge_across_nodes_attr.attr,
 #endif
@@ -3179,6 +3625,7 @@ static struct attribute *ksm_attrs[] = {
 	&stable_node_dups_attr.attr,
 	&stable_node_chains_prune_millisecs_attr.attr,
 	&use_zero_pages_attr.attr,
+	&checksum_attr.attr,
 	NULL,
 };
 
@@ -3188,9 +3635,56 @@ static const struct attribute_group ksm_attr_group = {
 };
 #endif /* CONFIG_SYSFS */
 
+static void __init ksm_stop_scanners(void)
+{
+	while (ksm_nr_scanners)
+		kthread_stop(ksm_scanners[--ksm_nr_scanners].thread);
+	kfree(ksm_scanners);
+}
+
+/*
+ * One ksmd thread per node with memory: a single node keeps the old name.
+ */
+static int __init ksm_start_scanners(void)
+{
+	struct ksm_scanner *ks;
+	int nr_nodes = num_node_state(N_MEMORY);
+	int nid, i;
+
+	ksm_scanners = kcalloc(max(nr_nodes, 1), sizeof(*ks), GFP_KERNEL);
+	if (!ksm_scanners)
+		return -ENOMEM;
+
+	for_each_node_state(nid, N_MEMORY) {
+		ks = &ksm_scanners[ksm_nr_scanners];
+		ks->nid = nid;
+		if (nr_nodes > 1)
+			ks->thread = kthread_create_on_node(ksm_scan_thread,
+						ks, nid, "ksmd/%d", nid);
+		else
+			ks->thread = kthread_create_on_node(ksm_scan_thread,
+						ks, nid, "ksmd");
+		if (IS_ERR(ks->thread)) {
+			int err = PTR_ERR(ks->thread);
+
+			ksm_stop_scanners();
+			return err;
+		}
+		ksm_nr_scanners++;
+	}
+	if (!ksm_nr_scanners) {
+		kfree(ksm_scanners);
+		return -ENODEV;
+	}
+
+	for (i = 0; i < ksm_nr_scanners; i++)
+		wake_up_process(ksm_scanners[i].thread);
+	return 0;
+}
+
 static int __init ksm_init(void)
 {
-	struct task_struct *ksm_thread;
+	int nid;
 	int err;
 
 	/* The correct value depends on page size and endianness */
@@ -3202,19 +3696,28 @@ static int __init ksm_init(void)
 	if (err)
 		goto out;
 
-	ksm_thread = kthread_run(ksm_scan_thread, NULL, "ksmd");
-	if (IS_ERR(ksm_thread)) {
-		pr_err("ksm: creating kthread failed\n");
-		err = PTR_ERR(ksm_thread);
+	ksm_unstable_mutex = kmalloc_array(nr_node_ids,
+					   sizeof(*ksm_unstable_mutex),
+					   GFP_KERNEL);
+	if (!ksm_unstable_mutex) {
+		err = -ENOMEM;
 		goto out_free;
 	}
+	for (nid = 0; nid < nr_node_ids; nid++)
+		mutex_init(ksm_unstable_mutex + nid);
+
+	err = ksm_start_scanners();
+	if (err) {
+		pr_err("ksm: creating kthread failed\n");
+		goto out_free_locks;
+	}
 
 #ifdef CONFIG_SYSFS
 	err = sysfs_create_group(mm_kobj, &ksm_attr_group);
 	if (err) {
 		pr_err("ksm: register sysfs failed\n");
-		kthread_stop(ksm_thread);
-		goto out_free;
+		ksm_stop_scanners();
+		goto out_free_locks;
 	}
 #else
 	ksm_run = KSM_RUN_MERGE;	/* no way for user to start it */
@@ -3227,6 +3730,8 @@ static int __init ksm_init(void)
 #endif
 	return 0;
 
+out_free_locks:
+	kfree(ksm_unstable_mutex);
 out_free:
 	ksm_slab_free();
 out:
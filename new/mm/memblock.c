@@ -20,6 +20,8 @@
 #include <linux/kmemleak.h>
 #include <linux/seq_file.h>
 #include <linux/memblock.h>
+#include <linux/sort.h>
+#include <linux/sched/clock.h>
 
 #include <asm/sections.h>
 #include <linux/io.h>
@@ -148,6 +150,37 @@ static int memblock_can_resize __initdata_memblock;
 static int memblock_memory_in_slab __initdata_memblock = 0;
 static int memblock_reserved_in_slab __initdata_memblock = 0;
 
+/*
+ * Time spent in memblock during boot, reported once at late_initcall.
+ * Nested calls (a find from memblock_double_array() under an add) are
+ * charged to the outermost one.  local_clock() reads zero until the
+ * architecture registers its sched_clock, so early work may only show
+ * up in the call counts.
+ */
+enum {
+	MEMBLOCK_T_FIND,
+	MEMBLOCK_T_ADD,
+	MEMBLOCK_T_ISOLATE,
+	MEMBLOCK_T_BULK,
+	MEMBLOCK_T_NR,
+};
+
+static u64 memblock_time_ns[MEMBLOCK_T_NR] __initdata_memblock;
+static unsigned long memblock_time_calls[MEMBLOCK_T_NR] __initdata_memblock;
+static int memblock_time_depth __initdata_memblock;
+
+static u64 __init_memblock memblock_time_start(void)
+{
+	return memblock_time_depth++ ? 0 : local_clock();
+}
+
+static void __init_memblock memblock_time_end(int what, u64 start)
+{
+	memblock_time_calls[what]++;
+	if (!--memblock_time_depth)
+		memblock_time_ns[what] += local_clock() - start;
+}
+
 enum memblock_flags __init_memblock choose_memblock_flags(void)
 {
 	return system_has_some_mirror ? MEMBLOCK_MIRROR : MEMBLOCK_NONE;
@@ -178,21 +211,97 @@ static unsigned long __init_memblock memblock_addrs_overlap(phys_addr_t base1, p
 	return ((base1 < (base2 + size2)) && (base2 < (base1 + size1)));
 }
 
+/*
+ * Regions of a type are sorted and never overlap, so both their bases and
+ * their ends are increasing and can be binary searched.
+ */
+
+/* index of the first region of @type based at or above @addr, or cnt */
+static int __init_memblock memblock_search_base(struct memblock_type *type,
+						phys_addr_t addr)
+{
+	unsigned int left = 0, right = type->cnt;
+
+	while (left < right) {
+		unsigned int mid = (left + right) / 2;
+
+		if (type->regions[mid].base < addr)
+			left = mid + 1;
+		else
+			right = mid;
+	}
+	return left;
+}
+
+/* index of the first region of @type ending above @addr, or cnt */
+static int __init_memblock memblock_search_end(struct memblock_type *type,
+					       phys_addr_t addr)
+{
+	unsigned int left = 0, right = type->cnt;
+
+	while (left < right) {
+		unsigned int mid = (left + right) / 2;
+
+		if (type->regions[mid].base + type->regions[mid].size <= addr)
+			left = mid + 1;
+		else
+			right = mid;
+	}
+	return left;
+}
+
 /**
  * 在type查找与[base, base+size)重叠的区域, 返回idx.
  */
 bool __init_memblock memblock_overlaps_region(struct memblock_type *type,
 					phys_addr_t base, phys_addr_t size)
 {
-	unsigned long i;
+	unsigned long i = memblock_search_end(type, base);
 
-	for (i = 0; i < type->cnt; i++)
-		if (memblock_addrs_overlap(base, size, type->regions[i].base,
-					   type->regions[i].size))
-			break;
-	return i < type->cnt;
+	return i < type->cnt &&
+	       memblock_addrs_overlap(base, size, type->regions[i].base,
+				      type->regions[i].size);
+}
+
+/*
+ * Starting points for __next_mem_range() and __next_mem_range_rev() over
+ * the free areas above @start or below @end.  Memory regions and gaps
+ * between reservations entirely on the other side are skipped instead of
+ * being walked from the start (or end) of both arrays.
+ */
+static u64 __init_memblock memblock_free_range_idx(phys_addr_t start)
+{
+	u64 idx_a = memblock_search_end(&memblock.memory, start);
+	u64 idx_b = memblock_search_base(&memblock.reserved, start);
+
+	return idx_a | idx_b << 32;
+}
+
+static u64 __init_memblock memblock_free_range_rev_idx(phys_addr_t end)
+{
+	int idx_a = memblock_search_base(&memblock.memory, end) - 1;
+	u64 idx_b = memblock_search_base(&memblock.reserved, end);
+
+	return (u32)idx_a | idx_b << 32;
 }
 
+#define for_each_free_mem_range_from(i, start, nid, flags, p_start, p_end) \
+	for (i = memblock_free_range_idx(start),			\
+	     __next_mem_range(&i, nid, flags, &memblock.memory,		\
+			      &memblock.reserved, p_start, p_end, NULL);	\
+	     i != (u64)ULLONG_MAX;					\
+	     __next_mem_range(&i, nid, flags, &memblock.memory,		\
+			      &memblock.reserved, p_start, p_end, NULL))
+
+#define for_each_free_mem_range_reverse_from(i, end, nid, flags,	\
+					     p_start, p_end)		\
+	for (i = memblock_free_range_rev_idx(end),			\
+	     __next_mem_range_rev(&i, nid, flags, &memblock.memory,	\
+				  &memblock.reserved, p_start, p_end, NULL); \
+	     i != (u64)ULLONG_MAX;					\
+	     __next_mem_range_rev(&i, nid, flags, &memblock.memory,	\
+				  &memblock.reserved, p_start, p_end, NULL))
+
 /**
  * __memblock_find_range_bottom_up - find free area utility in bottom-up
  * @start: start of candidate range
@@ -216,7 +325,8 @@ __memblock_find_range_bottom_up(phys_addr_t start, phys_addr_t end,
 	phys_addr_t this_start, this_end, cand;
 	u64 i;
 
-	for_each_free_mem_range(i, nid, flags, &this_start, &this_end, NULL) {
+	for_each_free_mem_range_from(i, start, nid, flags,
+				     &this_start, &this_end) {
 		this_start = clamp(this_start, start, end);
 		this_end = clamp(this_end, start, end);
 
@@ -259,8 +369,8 @@ __memblock_find_range_top_down(phys_addr_t start, phys_addr_t end,
 	phys_addr_t this_start, this_end, cand;
 	u64 i;
 
-	for_each_free_mem_range_reverse(i, nid, flags, &this_start, &this_end,
-					NULL) {
+	for_each_free_mem_range_reverse_from(i, end, nid, flags,
+					     &this_start, &this_end) {
 		this_start = clamp(this_start, start, end);
 		this_end = clamp(this_end, start, end);
 
@@ -308,10 +418,10 @@ memblock_bottom_up返回的是memblock.bottom_up，
 前面初始化的时候也知道这个值是false（在numa初始化时会设置为true），
 所以初始化前期应该调用的是__memblock_find_range_top_down函数去查找内存:
 */
-phys_addr_t __init_memblock memblock_find_in_range_node(phys_addr_t size,
-					phys_addr_t align, phys_addr_t start,
-					phys_addr_t end, int nid,
-					enum memblock_flags flags)
+static phys_addr_t __init_memblock
+__memblock_find_in_range_node(phys_addr_t size, phys_addr_t align,
+			      phys_addr_t start, phys_addr_t end, int nid,
+			      enum memblock_flags flags)
 {
 	phys_addr_t kernel_end, ret;
 
@@ -358,6 +468,20 @@ phys_addr_t __init_memblock memblock_find_in_range_node(phys_addr_t size,
 					      flags);
 }
 
+phys_addr_t __init_memblock memblock_find_in_range_node(phys_addr_t size,
+					phys_addr_t align, phys_addr_t start,
+					phys_addr_t end, int nid,
+					enum memblock_flags flags)
+{
+	u64 t = memblock_time_start();
+	phys_addr_t ret;
+
+	ret = __memblock_find_in_range_node(size, align, start, end, nid,
+					    flags);
+	memblock_time_end(MEMBLOCK_T_FIND, t);
+	return ret;
+}
+
 /**
  * memblock_find_in_range - find free area in given range
  * @start: start of candidate range
@@ -557,15 +681,19 @@ static int __init_memblock memblock_double_array(struct memblock_type *type,
 /**
  * memblock_merge_regions - merge neighboring compatible regions
  * @type: memblock type to scan
+ * @start_rgn: first region that changed
+ * @end_rgn: end of the regions that changed
  *
- * Scan @type and merge neighboring compatible regions.
+ * Scan @type[@start_rgn - 1, @end_rgn] and merge neighboring compatible
+ * regions.  Everything outside was already merged.
  */
-static void __init_memblock memblock_merge_regions(struct memblock_type *type)
+static void __init_memblock memblock_merge_regions(struct memblock_type *type,
+						   int start_rgn, int end_rgn)
 {
-	int i = 0;
+	int i = start_rgn > 0 ? start_rgn - 1 : 0;
 
 	/* cnt never goes below 1 */
-	while (i < type->cnt - 1) {
+	while (i < end_rgn && i < type->cnt - 1) {
 		struct memblock_region *this = &type->regions[i];
 		struct memblock_region *next = &type->regions[i + 1];
 
@@ -582,6 +710,7 @@ static void __init_memblock memblock_merge_regions(struct memblock_type *type)
 		/* move forward from next + 1, index of which is i + 2 */
 		memmove(next, next + 1, (type->cnt - (i + 2)) * sizeof(*next));
 		type->cnt--;
+		end_rgn--;
 	}
 }
 
@@ -643,7 +772,7 @@ static void __init_memblock memblock_insert_region(struct memblock_type *type,
 如果出现region[]数组空间不够的情况，则通过memblock_double_array()添加新的region[]空间
 最后通过memblock_merge_regions()把紧挨着的内存合并了
  */
-int __init_memblock memblock_add_range(struct memblock_type *type,
+static int __init_memblock __memblock_add_range(struct memblock_type *type,
 				phys_addr_t base, phys_addr_t size,
 				int nid, enum memblock_flags flags)
 {
@@ -654,7 +783,7 @@ int __init_memblock memblock_add_range(struct memblock_type *type,
  memblock_cap_size函数会设置size大小确保base + size不会溢出  
 */
 	phys_addr_t end = base + memblock_cap_size(base, &size);
-	int idx, nr_new;
+	int idx, nr_new, start_rgn = -1, end_rgn = 0;
 	struct memblock_region *rgn;
 
 	if (!size)
@@ -683,10 +812,14 @@ repeat:
 	/*
 	 *不为空的情况下，则先检查是否存在内存重叠的情况，
 	 *如果有的话，则剔除重叠部分，然后将其余非重叠的部分添加进去
+	 * 二分查找第一个可能重叠的区域, 不必从头扫描
 	 */
-	for_each_memblock_type(idx, type, rgn) {
-		phys_addr_t rbase = rgn->base;
-		phys_addr_t rend = rbase + rgn->size;
+	for (idx = memblock_search_end(type, base); idx < type->cnt; idx++) {
+		phys_addr_t rbase, rend;
+
+		rgn = &type->regions[idx];
+		rbase = rgn->base;
+		rend = rbase + rgn->size;
 
 		if (rbase >= end)
 			break;
@@ -702,10 +835,14 @@ repeat:
 #endif
 			WARN_ON(flags != rgn->flags);
 			nr_new++;
-			if (insert)
+			if (insert) {
+				if (start_rgn == -1)
+					start_rgn = idx;
+				end_rgn = idx + 1;
 				memblock_insert_region(type, idx++, base,
 						       rbase - base, nid,
 						       flags);
+			}
 		}
 		/* area below @rend is dealt with, forget about it */
 /*
@@ -735,9 +872,13 @@ repeat:
 	/* insert the remaining portion */
 	if (base < end) {
 		nr_new++;
-		if (insert)
+		if (insert) {
+			if (start_rgn == -1)
+				start_rgn = idx;
+			end_rgn = idx + 1;
 			memblock_insert_region(type, idx, base, end - base,
 					       nid, flags);
+		}
 	}
 
 	if (!nr_new)
@@ -758,12 +899,24 @@ repeat:
 		insert = true;
 		goto repeat;
 	} else {
-		/* 把紧挨着的内存合并 */
-		memblock_merge_regions(type);
+		/* 把紧挨着的内存合并, 只需看新插入的区域及其两侧 */
+		memblock_merge_regions(type, start_rgn, end_rgn);
 		return 0;
 	}
 }
 
+int __init_memblock memblock_add_range(struct memblock_type *type,
+				phys_addr_t base, phys_addr_t size,
+				int nid, enum memblock_flags flags)
+{
+	u64 t = memblock_time_start();
+	int ret;
+
+	ret = __memblock_add_range(type, base, size, nid, flags);
+	memblock_time_end(MEMBLOCK_T_ADD, t);
+	return ret;
+}
+
 /**
  * memblock_add_node - add new memblock region within a NUMA node
  * @base: base address of the new region
@@ -819,7 +972,7 @@ int __init_memblock memblock_add(phys_addr_t base, phys_addr_t size)
  * Return:
  * 0 on success, -errno on failure.
  */
-static int __init_memblock memblock_isolate_range(struct memblock_type *type,
+static int __init_memblock __memblock_isolate_range(struct memblock_type *type,
 					phys_addr_t base, phys_addr_t size,
 					int *start_rgn, int *end_rgn)
 {
@@ -837,9 +990,12 @@ static int __init_memblock memblock_isolate_range(struct memblock_type *type,
 		if (memblock_double_array(type, base, size) < 0)
 			return -ENOMEM;
 
-	for_each_memblock_type(idx, type, rgn) {
-		phys_addr_t rbase = rgn->base;
-		phys_addr_t rend = rbase + rgn->size;
+	for (idx = memblock_search_end(type, base); idx < type->cnt; idx++) {
+		phys_addr_t rbase, rend;
+
+		rgn = &type->regions[idx];
+		rbase = rgn->base;
+		rend = rbase + rgn->size;
 
 		if (rbase >= end)
 			break;
@@ -879,6 +1035,18 @@ static int __init_memblock memblock_isolate_range(struct memblock_type *type,
 	return 0;
 }
 
+static int __init_memblock memblock_isolate_range(struct memblock_type *type,
+					phys_addr_t base, phys_addr_t size,
+					int *start_rgn, int *end_rgn)
+{
+	u64 t = memblock_time_start();
+	int ret;
+
+	ret = __memblock_isolate_range(type, base, size, start_rgn, end_rgn);
+	memblock_time_end(MEMBLOCK_T_ISOLATE, t);
+	return ret;
+}
+
 /**
  * 从指定的memblock中移除指定物理地址所指定的memory region.
  * 如果所指定的区域是存在区域的一部分，则涉及到调整region大小，
@@ -949,6 +1117,146 @@ int __init_memblock memblock_reserve(phys_addr_t base, phys_addr_t size)
 	return memblock_add_range(&memblock.reserved, base, size, MAX_NUMNODES, 0);
 }
 
+static int __init memblock_region_cmp(const void *a, const void *b)
+{
+	const struct memblock_region *ra = a, *rb = b;
+
+	if (ra->base < rb->base)
+		return -1;
+	return ra->base > rb->base;
+}
+
+/*
+ * Pieces of the sorted, disjoint @rgns not yet covered by @type.  Like the
+ * two rounds of memblock_add_range(), the first call with %NULL @out only
+ * counts them and the second stores them.
+ */
+static int __init memblock_subtract(struct memblock_type *type,
+				    struct memblock_region *rgns, int cnt,
+				    struct memblock_region *out)
+{
+	int i, idx, nr = 0;
+
+	for (i = 0; i < cnt; i++) {
+		phys_addr_t base = rgns[i].base;
+		phys_addr_t end = base + rgns[i].size;
+
+		for (idx = memblock_search_end(type, base);
+		     idx < type->cnt && base < end; idx++) {
+			struct memblock_region *rgn = &type->regions[idx];
+
+			if (rgn->base >= end)
+				break;
+			if (rgn->base > base) {
+				if (out) {
+					out[nr].base = base;
+					out[nr].size = rgn->base - base;
+				}
+				nr++;
+			}
+			base = min(rgn->base + rgn->size, end);
+		}
+		if (base < end) {
+			if (out) {
+				out[nr].base = base;
+				out[nr].size = end - base;
+			}
+			nr++;
+		}
+	}
+	return nr;
+}
+
+/**
+ * memblock_reserve_bulk - reserve many regions at once
+ * @rgns: regions to reserve, only base and size are used
+ * @cnt: number of entries in @rgns
+ *
+ * Same as calling memblock_reserve() on every entry, but the reserved array
+ * is grown and merged once instead of being searched and shifted for each
+ * of them.  @rgns is sorted and coalesced in place.
+ *
+ * Return:
+ * 0 on success, -errno on failure.
+ */
+int __init memblock_reserve_bulk(struct memblock_region *rgns, int cnt)
+{
+	struct memblock_type *type = &memblock.reserved;
+	struct memblock_region *stage;
+	phys_addr_t span_base, span_end;
+	int i, n, d, e, p, old, nr_new, ret = 0;
+	u64 t;
+
+	memblock_dbg("memblock_reserve_bulk: %d regions %pF\n",
+		     cnt, (void *)_RET_IP_);
+
+	t = memblock_time_start();
+
+	for (i = 0; i < cnt; i++)
+		memblock_cap_size(rgns[i].base, &rgns[i].size);
+	sort(rgns, cnt, sizeof(*rgns), memblock_region_cmp, NULL);
+
+	for (i = 0, n = 0; i < cnt; i++) {
+		phys_addr_t end = rgns[i].base + rgns[i].size;
+
+		if (!rgns[i].size)
+			continue;
+		if (n && rgns[i].base <= rgns[n - 1].base + rgns[n - 1].size) {
+			span_end = rgns[n - 1].base + rgns[n - 1].size;
+			rgns[n - 1].size = max(end, span_end) - rgns[n - 1].base;
+			continue;
+		}
+		rgns[n++] = rgns[i];
+	}
+	if (!n)
+		goto out;
+
+	nr_new = memblock_subtract(type, rgns, n, NULL);
+	if (!nr_new)
+		goto out;
+
+	/*
+	 * The new pieces are staged past cnt + nr_new so that merging them
+	 * in from the back never overwrites one not yet consumed.  A grown
+	 * array must not land in any of them; if memblock can't place it
+	 * outside the whole batch, fall back to one region at a time.
+	 */
+	span_base = rgns[0].base;
+	span_end = rgns[n - 1].base + rgns[n - 1].size;
+	while (type->cnt + 2 * nr_new > type->max) {
+		if (memblock_double_array(type, span_base,
+					  span_end - span_base) < 0)
+			goto one_by_one;
+	}
+
+	/* the empty array still holds its zero sized placeholder */
+	old = type->regions[0].size ? type->cnt : 0;
+	stage = type->regions + old + nr_new;
+	memblock_subtract(type, rgns, n, stage);
+
+	for (d = old + nr_new, e = old, p = nr_new; p; ) {
+		if (e && type->regions[e - 1].base > stage[p - 1].base) {
+			type->regions[--d] = type->regions[--e];
+		} else {
+			stage[--p].flags = 0;
+			memblock_set_region_node(&stage[p], MAX_NUMNODES);
+			type->total_size += stage[p].size;
+			type->regions[--d] = stage[p];
+		}
+	}
+	type->cnt = old + nr_new;
+	memblock_merge_regions(type, 0, type->cnt);
+	goto out;
+
+one_by_one:
+	for (i = 0; i < n && !ret; i++)
+		ret = memblock_add_range(type, rgns[i].base, rgns[i].size,
+					 MAX_NUMNODES, 0);
+out:
+	memblock_time_end(MEMBLOCK_T_BULK, t);
+	return ret;
+}
+
 /**
  * memblock_setclr_flag - set or clear flag for a memory region
  * @base: base address of the region
@@ -976,7 +1284,7 @@ static int __init_memblock memblock_setclr_flag(phys_addr_t base,
 		else
 			memblock_clear_region_flags(&type->regions[i], flag);
 
-	memblock_merge_regions(type);
+	memblock_merge_regions(type, start_rgn, end_rgn);
 	return 0;
 }
 
@@ -1362,7 +1670,7 @@ int __init_memblock memblock_set_node(phys_addr_t base, phys_addr_t size,
 	for (i = start_rgn; i < end_rgn; i++)
 		memblock_set_region_node(&type->regions[i], nid);
 
-	memblock_merge_regions(type);
+	memblock_merge_regions(type, start_rgn, end_rgn);
 	return 0;
 }
 #endif /* CONFIG_HAVE_MEMBLOCK_NODE_MAP */
@@ -2031,6 +2339,30 @@ static int __init early_memblock(char *p)
 }
 early_param("memblock", early_memblock);
 
+static int __init memblock_report_time(void)
+{
+	static const char * const names[MEMBLOCK_T_NR] __initconst = {
+		[MEMBLOCK_T_FIND]	= "find",
+		[MEMBLOCK_T_ADD]	= "add",
+		[MEMBLOCK_T_ISOLATE]	= "isolate",
+		[MEMBLOCK_T_BULK]	= "bulk",
+	};
+	u64 total = 0;
+	int i;
+
+	for (i = 0; i < MEMBLOCK_T_NR; i++)
+		total += memblock_time_ns[i];
+
+	pr_info("memblock: %llu ms spent during boot\n",
+		div_u64(total, NSEC_PER_MSEC));
+	for (i = 0; i < MEMBLOCK_T_NR; i++)
+		pr_info("memblock: %-8s %8lu calls %8llu us\n", names[i],
+			memblock_time_calls[i],
+			div_u64(memblock_time_ns[i], NSEC_PER_USEC));
+	return 0;
+}
+late_initcall(memblock_report_time);
+
 #if defined(CONFIG_DEBUG_FS) && !defined(CONFIG_ARCH_DISCARD_MEMBLOCK)
 
 static int memblock_debug_show(struct seq_file *m, void *private)
@@ -57,6 +57,7 @@
 #include <linux/init.h>
 #include <linux/pfn_t.h>
 #include <linux/writeback.h>
+#include <linux/backing-dev.h>
 #include <linux/memcontrol.h>
 #include <linux/mmu_notifier.h>
 #include <linux/swapops.h>
@@ -77,6 +78,16 @@
 #include <asm/tlb.h>
 #include <asm/tlbflush.h>
 #include <asm/pgtable.h>
+#ifdef CONFIG_ARM64
+#include <asm/tlbbatch.h>
+#else
+struct tlb_batch { };
+static inline void tlb_batch_init(struct tlb_batch *b, struct mm_struct *mm) { }
+static inline void tlb_batch_add(struct tlb_batch *b, unsigned long start,
+				 unsigned long end, unsigned long stride,
+				 bool last_level) { }
+static inline void tlb_batch_flush(struct tlb_batch *b) { }
+#endif
 
 #include "internal.h"
 
@@ -949,6 +960,370 @@ again:
 	return 0;
 }
 
+/*
+ * Sharing PTE tables on fork.
+ *
+ * Copying a large address space on fork means visiting every pte and taking
+ * a reference and a mapcount on every page.  An mm that opted in with
+ * PR_SET_FORK_SHARE_PTE instead has the child's pmds point at the parent's
+ * PTE tables for private anonymous memory, once those are write protected.
+ * The first mm that needs to change a shared table, usually on a write
+ * fault, gets its own copy, so fork only pays for the tables that are
+ * actually written to afterwards.
+ *
+ * A shared table holds a single reference and mapcount on its pages, and
+ * page->pt_share_count counts the pmds pointing at it.  Its pages stay in
+ * the rss of page->pt_share_owner, the mm that first shared it, until that
+ * mm lets go of the table; the other sharers account them when they get
+ * their own copy.  Anything that changes a pte has to unshare the table
+ * first.  That includes the rmap walks of reclaim and migration, which
+ * unshare the tables they find the page in; KSM and page_referenced()
+ * skip them.
+ *
+ * The sharing state is protected by the table's split ptlock, and each mm
+ * replaces or drops its shared tables under mm->pte_share_mutex.
+ *
+ * Not every pte writer unshares yet: mprotect_fixup(), move_page_tables(),
+ * MADV_DONTNEED/MADV_FREE and khugepaged would rewrite a table another mm
+ * still maps.  Until they do, sharing cannot be switched on.
+ */
+int set_fork_share_pte(struct mm_struct *mm, bool enable)
+{
+	/* sharers of a table must agree on its lock */
+	if (!USE_SPLIT_PTE_PTLOCKS)
+		return -EINVAL;
+	if (enable)
+		return -EOPNOTSUPP;
+	WRITE_ONCE(mm->fork_share_pte, enable);
+	return 0;
+}
+
+static inline bool can_share_pte_table(struct mm_struct *src_mm,
+		struct vm_area_struct *vma, unsigned long addr,
+		unsigned long end)
+{
+	return USE_SPLIT_PTE_PTLOCKS && READ_ONCE(src_mm->fork_share_pte) &&
+	       vma_is_anonymous(vma) && !(vma->vm_flags & VM_SHARED) &&
+	       end - addr == PMD_SIZE;
+}
+
+/* Count the pages a PTE table maps, the way copy_one_pte() accounts them */
+static void pte_table_rss(struct vm_area_struct *vma, pte_t *pte,
+			  unsigned long addr, int *rss)
+{
+	int i;
+
+	for (i = 0; i < PTRS_PER_PTE; i++, pte++, addr += PAGE_SIZE) {
+		pte_t ptent = *pte;
+		struct page *page = NULL;
+		swp_entry_t entry;
+
+		if (pte_none(ptent))
+			continue;
+		if (pte_present(ptent)) {
+			page = vm_normal_page(vma, addr, ptent);
+		} else {
+			entry = pte_to_swp_entry(ptent);
+			if (!non_swap_entry(entry))
+				rss[MM_SWAPENTS]++;
+			else if (is_migration_entry(entry))
+				page = migration_entry_to_page(entry);
+			else if (is_device_private_entry(entry))
+				page = device_private_entry_to_page(entry);
+		}
+		if (page)
+			rss[mm_counter(page)]++;
+	}
+}
+
+static void sub_pte_table_rss(struct vm_area_struct *vma, pte_t *pte,
+			      unsigned long addr)
+{
+	int rss[NR_MM_COUNTERS];
+	int i;
+
+	init_rss_vec(rss);
+	pte_table_rss(vma, pte, addr, rss);
+	for (i = 0; i < NR_MM_COUNTERS; i++)
+		rss[i] = -rss[i];
+	add_mm_rss_vec(vma->vm_mm, rss);
+}
+
+/*
+ * The other sharers of the table are gone: make it private to the mm of
+ * @vma again.  Called with the table's ptl held.
+ */
+static void adopt_pte_table(struct vm_area_struct *vma, struct page *table,
+			    pte_t *pte, unsigned long addr)
+{
+	int rss[NR_MM_COUNTERS];
+
+	if (table->pt_share_owner != vma->vm_mm) {
+		init_rss_vec(rss);
+		pte_table_rss(vma, pte, addr, rss);
+		add_mm_rss_vec(vma->vm_mm, rss);
+	}
+	table->pt_share_owner = NULL;
+	atomic_set(&table->pt_share_count, 0);
+}
+
+/* Write protect everything a table about to be shared maps. */
+static void wrprotect_pte_table(struct mm_struct *mm, pte_t *pte,
+				unsigned long addr)
+{
+	int i;
+
+	for (i = 0; i < PTRS_PER_PTE; i++, pte++, addr += PAGE_SIZE) {
+		pte_t ptent = *pte;
+		swp_entry_t entry;
+
+		if (pte_none(ptent))
+			continue;
+		if (pte_present(ptent)) {
+			if (pte_write(ptent))
+				ptep_set_wrprotect(mm, addr, pte);
+			continue;
+		}
+		entry = pte_to_swp_entry(ptent);
+		if (is_write_migration_entry(entry)) {
+			make_migration_entry_read(&entry);
+			ptent = swp_entry_to_pte(entry);
+			if (pte_swp_soft_dirty(*pte))
+				ptent = pte_swp_mksoft_dirty(ptent);
+			set_pte_at(mm, addr, pte, ptent);
+		} else if (is_write_device_private_entry(entry)) {
+			make_device_private_entry_read(&entry);
+			ptent = swp_entry_to_pte(entry);
+			set_pte_at(mm, addr, pte, ptent);
+		}
+	}
+}
+
+static void share_pte_table(struct mm_struct *dst_mm, struct mm_struct *src_mm,
+			    pmd_t *dst_pmd, pmd_t *src_pmd, unsigned long addr)
+{
+	struct page *table = pmd_page(*src_pmd);
+	spinlock_t *ptl;
+	pte_t *pte;
+
+	/* swapoff has to find the child for the swap entries it now maps */
+	if (unlikely(!list_empty(&src_mm->mmlist) &&
+		     list_empty(&dst_mm->mmlist))) {
+		spin_lock(&mmlist_lock);
+		if (list_empty(&dst_mm->mmlist))
+			list_add(&dst_mm->mmlist, &src_mm->mmlist);
+		spin_unlock(&mmlist_lock);
+	}
+
+	pte = pte_offset_map_lock(src_mm, src_pmd, addr, &ptl);
+	if (!atomic_read(&table->pt_share_count)) {
+		wrprotect_pte_table(src_mm, pte, addr);
+		table->pt_share_owner = src_mm;
+		atomic_set(&table->pt_share_count, 1);
+	}
+	atomic_inc(&table->pt_share_count);
+	pte_unmap_unlock(pte, ptl);
+
+	/* the parent's TLB is flushed at the end of dup_mmap() */
+	mm_inc_nr_ptes(dst_mm);
+	pmd_populate(dst_mm, dst_pmd, table);
+}
+
+/* Drop what copy_one_pte() took for the first @nr entries of @new. */
+static void unshare_undo_copy(struct vm_area_struct *vma, pgtable_t new,
+			      unsigned long addr, int nr)
+{
+	pte_t *pte = (pte_t *)kmap_atomic(new);
+	int i;
+
+	for (i = 0; i < nr; i++, addr += PAGE_SIZE) {
+		pte_t ptent = pte[i];
+		struct page *page = NULL;
+		swp_entry_t entry;
+
+		if (pte_none(ptent))
+			continue;
+		if (pte_present(ptent)) {
+			page = vm_normal_page(vma, addr, ptent);
+		} else {
+			entry = pte_to_swp_entry(ptent);
+			if (!non_swap_entry(entry))
+				swap_free(entry);
+			else if (is_device_private_entry(entry))
+				page = device_private_entry_to_page(entry);
+		}
+		if (page) {
+			page_remove_rmap(page, false);
+			put_page(page);
+		}
+		pte_clear(vma->vm_mm, addr, pte + i);
+	}
+	kunmap_atomic(pte);
+}
+
+/**
+ * unshare_pte_table - give an mm its own copy of a shared PTE table
+ * @vma: vma the table is used through
+ * @pmd: pmd pointing to the table
+ * @addr: any address covered by the table
+ *
+ * Must be called before changing any pte in a table that
+ * pte_table_shared() reports as shared, with mmap_sem held or, from an
+ * rmap walk, the anon_vma lock, which keeps the pmd's page table alive.
+ */
+int unshare_pte_table(struct vm_area_struct *vma, pmd_t *pmd,
+		      unsigned long addr)
+{
+	struct mm_struct *mm = vma->vm_mm;
+	unsigned long start = addr & PMD_MASK;
+	int rss[NR_MM_COUNTERS];
+	swp_entry_t entry;
+	struct page *table;
+	pte_t *src, *dst;
+	spinlock_t *ptl;
+	pgtable_t new;
+	int i = 0, ret = 0;
+
+	new = pte_alloc_one(mm);
+	if (!new)
+		return -ENOMEM;
+
+	/* copy_one_pte() would link the mm to itself */
+	if (unlikely(list_empty(&mm->mmlist))) {
+		spin_lock(&mmlist_lock);
+		if (list_empty(&mm->mmlist))
+			list_add(&mm->mmlist, &init_mm.mmlist);
+		spin_unlock(&mmlist_lock);
+	}
+
+	mutex_lock(&mm->pte_share_mutex);
+	/* another thread may have done it already */
+	if (pmd_trans_unstable(pmd) || !pte_table_shared(*pmd))
+		goto out;
+
+	table = pmd_page(*pmd);
+	src = pte_offset_map_lock(mm, pmd, start, &ptl);
+	if (atomic_read(&table->pt_share_count) == 1) {
+		adopt_pte_table(vma, table, src, start);
+		pte_unmap_unlock(src, ptl);
+		goto out;
+	}
+
+	init_rss_vec(rss);
+again:
+	dst = (pte_t *)kmap_atomic(new);
+	for (; i < PTRS_PER_PTE; i++) {
+		if (pte_none(src[i]))
+			continue;
+		entry.val = copy_one_pte(mm, mm, dst + i, src + i, vma,
+					 start + i * PAGE_SIZE, rss);
+		if (entry.val)
+			break;
+	}
+	kunmap_atomic(dst);
+	if (i < PTRS_PER_PTE) {
+		pte_unmap_unlock(src, ptl);
+		/*
+		 * Not under pte_share_mutex: the allocation may enter reclaim,
+		 * whose rmap walks unshare tables of this mm as well.  The ptes
+		 * of a shared table do not change, so the copy made so far
+		 * stays good as long as this pmd still points at the table.
+		 */
+		mutex_unlock(&mm->pte_share_mutex);
+		ret = add_swap_count_continuation(entry, GFP_KERNEL);
+		mutex_lock(&mm->pte_share_mutex);
+		if (ret || pmd_trans_unstable(pmd) || !pte_table_shared(*pmd) ||
+		    pmd_page(*pmd) != table) {
+			unshare_undo_copy(vma, new, start, i);
+			goto out;
+		}
+		src = pte_offset_map_lock(mm, pmd, start, &ptl);
+		/* the other sharers left meanwhile */
+		if (atomic_read(&table->pt_share_count) == 1) {
+			unshare_undo_copy(vma, new, start, i);
+			adopt_pte_table(vma, table, src, start);
+			pte_unmap_unlock(src, ptl);
+			goto out;
+		}
+		goto again;
+	}
+
+	/* the owner's rss already counts the pages */
+	if (table->pt_share_owner == mm)
+		table->pt_share_owner = NULL;
+	else
+		add_mm_rss_vec(mm, rss);
+	atomic_dec(&table->pt_share_count);
+
+	smp_wmb(); /* See comment in __pte_alloc() */
+	pmd_populate(mm, pmd, new);
+	new = NULL;
+	pte_unmap_unlock(src, ptl);
+	/* walk caches may still point at the shared table */
+	flush_tlb_range(vma, start, start + PMD_SIZE);
+out:
+	mutex_unlock(&mm->pte_share_mutex);
+	if (new)
+		pte_free(mm, new);
+	return ret ? -ENOMEM : 0;
+}
+
+/*
+ * zap_pmd_range() found a shared table: if the zap covers all of it, just
+ * drop this mm's pmd and return true.  Otherwise make the table private,
+ * so that the caller can zap it as usual, and return false.
+ *
+ * If no private copy can be made the pmd is dropped all the same, which
+ * also zaps the part of the table outside [addr, end).  The copy only
+ * needs order-0 allocations, and those only fail for an OOM victim,
+ * whose mm is on its way out.
+ */
+static bool zap_shared_pte_table(struct mmu_gather *tlb,
+		struct vm_area_struct *vma, pmd_t *pmd,
+		unsigned long addr, unsigned long end)
+{
+	struct mm_struct *mm = vma->vm_mm;
+	struct page *table;
+	spinlock_t *ptl;
+	pte_t *pte;
+
+	if (end - addr != PMD_SIZE) {
+		if (!unshare_pte_table(vma, pmd, addr))
+			return false;
+		addr &= PMD_MASK;
+		end = addr + PMD_SIZE;
+	}
+
+	mutex_lock(&mm->pte_share_mutex);
+	if (pmd_trans_unstable(pmd) || !pte_table_shared(*pmd)) {
+		mutex_unlock(&mm->pte_share_mutex);
+		return false;
+	}
+
+	table = pmd_page(*pmd);
+	pte = pte_offset_map_lock(mm, pmd, addr, &ptl);
+	if (atomic_read(&table->pt_share_count) == 1) {
+		adopt_pte_table(vma, table, pte, addr);
+		pte_unmap_unlock(pte, ptl);
+		mutex_unlock(&mm->pte_share_mutex);
+		return false;
+	}
+	if (table->pt_share_owner == mm) {
+		sub_pte_table_rss(vma, pte, addr);
+		table->pt_share_owner = NULL;
+	}
+	atomic_dec(&table->pt_share_count);
+	pmd_clear(pmd);
+	pte_unmap_unlock(pte, ptl);
+	mm_dec_nr_ptes(mm);
+	mutex_unlock(&mm->pte_share_mutex);
+
+	/* the table lives on: no walk cache may keep pointing at it */
+	if (!tlb->fullmm)
+		flush_tlb_range(vma, addr, end);
+	return true;
+}
+
 static inline int copy_pmd_range(struct mm_struct *dst_mm, struct mm_struct *src_mm,
 		pud_t *dst_pud, pud_t *src_pud, struct vm_area_struct *vma,
 		unsigned long addr, unsigned long end)
@@ -976,6 +1351,10 @@ static inline int copy_pmd_range(struct mm_struct *dst_mm, struct mm_struct *src
 		}
 		if (pmd_none_or_clear_bad(src_pmd))
 			continue;
+		if (can_share_pte_table(src_mm, vma, addr, next)) {
+			share_pte_table(dst_mm, src_mm, dst_pmd, src_pmd, addr);
+			continue;
+		}
 		if (copy_pte_range(dst_mm, src_mm, dst_pmd, src_pmd,
 						vma, addr, next))
 			return -ENOMEM;
@@ -1118,10 +1497,19 @@ int copy_page_range(struct mm_struct *dst_mm, struct mm_struct *src_mm,
 	return ret;
 }
 
+/*
+ * With a @batch (arm64, not for a whole-mm teardown) the cleared leaf
+ * entries go into it instead of widening tlb's single start/end span, so
+ * a sparse munmap does not invalidate every hole in between.  The batch
+ * is flushed wherever the gathered pages could be freed or the ptl of a
+ * dirty file page dropped: on force_flush here, ahead of zap_huge_pmd()
+ * and zap_huge_pud(), and at the end of unmap_page_range().
+ */
 static unsigned long zap_pte_range(struct mmu_gather *tlb,
 				struct vm_area_struct *vma, pmd_t *pmd,
 				unsigned long addr, unsigned long end,
-				struct zap_details *details)
+				struct zap_details *details,
+				struct tlb_batch *batch)
 {
 	struct mm_struct *mm = tlb->mm;
 	int force_flush = 0;
@@ -1159,7 +1547,11 @@ again:
 			}
 			ptent = ptep_get_and_clear_full(mm, addr, pte,
 							tlb->fullmm);
-			tlb_remove_tlb_entry(tlb, pte, addr);
+			if (batch)
+				tlb_batch_add(batch, addr, addr + PAGE_SIZE,
+					      PAGE_SIZE, true);
+			else
+				tlb_remove_tlb_entry(tlb, pte, addr);
 			if (unlikely(!page))
 				continue;
 
@@ -1228,8 +1620,11 @@ again:
 	arch_leave_lazy_mmu_mode();
 
 	/* Do the actual TLB flush before dropping ptl */
-	if (force_flush)
+	if (force_flush) {
+		if (batch)
+			tlb_batch_flush(batch);
 		tlb_flush_mmu_tlbonly(tlb);
+	}
 	pte_unmap_unlock(start_pte, ptl);
 
 	/*
@@ -1251,7 +1646,8 @@ again:
 static inline unsigned long zap_pmd_range(struct mmu_gather *tlb,
 				struct vm_area_struct *vma, pud_t *pud,
 				unsigned long addr, unsigned long end,
-				struct zap_details *details)
+				struct zap_details *details,
+				struct tlb_batch *batch)
 {
 	pmd_t *pmd;
 	unsigned long next;
@@ -1262,8 +1658,13 @@ static inline unsigned long zap_pmd_range(struct mmu_gather *tlb,
 		if (is_swap_pmd(*pmd) || pmd_trans_huge(*pmd) || pmd_devmap(*pmd)) {
 			if (next - addr != HPAGE_PMD_SIZE)
 				__split_huge_pmd(vma, pmd, addr, false, NULL);
-			else if (zap_huge_pmd(tlb, vma, pmd, addr))
-				goto next;
+			else {
+				/* it may free what the batch still maps */
+				if (batch)
+					tlb_batch_flush(batch);
+				if (zap_huge_pmd(tlb, vma, pmd, addr))
+					goto next;
+			}
 			/* fall through */
 		}
 		/*
@@ -1275,7 +1676,11 @@ static inline unsigned long zap_pmd_range(struct mmu_gather *tlb,
 		 */
 		if (pmd_none_or_trans_huge_or_clear_bad(pmd))
 			goto next;
-		next = zap_pte_range(tlb, vma, pmd, addr, next, details);
+		if (unlikely(pte_table_shared(*pmd)) &&
+		    zap_shared_pte_table(tlb, vma, pmd, addr, next))
+			goto next;
+		next = zap_pte_range(tlb, vma, pmd, addr, next, details,
+				     batch);
 next:
 		cond_resched();
 	} while (pmd++, addr = next, addr != end);
@@ -1286,7 +1691,8 @@ next:
 static inline unsigned long zap_pud_range(struct mmu_gather *tlb,
 				struct vm_area_struct *vma, p4d_t *p4d,
 				unsigned long addr, unsigned long end,
-				struct zap_details *details)
+				struct zap_details *details,
+				struct tlb_batch *batch)
 {
 	pud_t *pud;
 	unsigned long next;
@@ -1298,13 +1704,18 @@ static inline unsigned long zap_pud_range(struct mmu_gather *tlb,
 			if (next - addr != HPAGE_PUD_SIZE) {
 				VM_BUG_ON_VMA(!rwsem_is_locked(&tlb->mm->mmap_sem), vma);
 				split_huge_pud(vma, pud, addr);
-			} else if (zap_huge_pud(tlb, vma, pud, addr))
-				goto next;
+			} else {
+				if (batch)
+					tlb_batch_flush(batch);
+				if (zap_huge_pud(tlb, vma, pud, addr))
+					goto next;
+			}
 			/* fall through */
 		}
 		if (pud_none_or_clear_bad(pud))
 			continue;
-		next = zap_pmd_range(tlb, vma, pud, addr, next, details);
+		next = zap_pmd_range(tlb, vma, pud, addr, next, details,
+				     batch);
 next:
 		cond_resched();
 	} while (pud++, addr = next, addr != end);
@@ -1315,7 +1726,8 @@ next:
 static inline unsigned long zap_p4d_range(struct mmu_gather *tlb,
 				struct vm_area_struct *vma, pgd_t *pgd,
 				unsigned long addr, unsigned long end,
-				struct zap_details *details)
+				struct zap_details *details,
+				struct tlb_batch *batch)
 {
 	p4d_t *p4d;
 	unsigned long next;
@@ -1325,7 +1737,8 @@ static inline unsigned long zap_p4d_range(struct mmu_gather *tlb,
 		next = p4d_addr_end(addr, end);
 		if (p4d_none_or_clear_bad(p4d))
 			continue;
-		next = zap_pud_range(tlb, vma, p4d, addr, next, details);
+		next = zap_pud_range(tlb, vma, p4d, addr, next, details,
+				     batch);
 	} while (p4d++, addr = next, addr != end);
 
 	return addr;
@@ -1336,18 +1749,27 @@ void unmap_page_range(struct mmu_gather *tlb,
 			     unsigned long addr, unsigned long end,
 			     struct zap_details *details)
 {
+	struct tlb_batch b, *batch = NULL;
 	pgd_t *pgd;
 	unsigned long next;
 
 	BUG_ON(addr >= end);
+	/* a dying mm needs no leaf invalidation, see tlb->fullmm */
+	if (IS_ENABLED(CONFIG_ARM64) && !tlb->fullmm) {
+		tlb_batch_init(&b, vma->vm_mm);
+		batch = &b;
+	}
 	tlb_start_vma(tlb, vma);
 	pgd = pgd_offset(vma->vm_mm, addr);
 	do {
 		next = pgd_addr_end(addr, end);
 		if (pgd_none_or_clear_bad(pgd))
 			continue;
-		next = zap_p4d_range(tlb, vma, pgd, addr, next, details);
+		next = zap_p4d_range(tlb, vma, pgd, addr, next, details,
+				     batch);
 	} while (pgd++, addr = next, addr != end);
+	if (batch)
+		tlb_batch_flush(batch);
 	tlb_end_vma(tlb, vma);
 }
 
@@ -1426,6 +1848,149 @@ void unmap_vmas(struct mmu_gather *tlb,
 	mmu_notifier_invalidate_range_end(&range);
 }
 
+/*
+ * An asynchronous munmap (see mm/mmap.c) takes the PTE tables that lie
+ * wholly inside [start, end) out of @mm while it holds mmap_sem for write,
+ * and frees what they map later, without mmap_sem, with
+ * zap_detached_pte_table().  The caller flushes the TLB for the range.
+ * Returns the number of tables stored in @tables.
+ */
+unsigned long detach_pte_tables(struct mm_struct *mm, unsigned long start,
+				unsigned long end,
+				struct detached_pte_table *tables)
+{
+	unsigned long addr = ALIGN(start, PMD_SIZE), nr = 0;
+	pgd_t *pgd;
+	p4d_t *p4d;
+	pud_t *pud;
+	pmd_t *pmd;
+	spinlock_t *ptl;
+
+	if (addr < start)
+		return 0;
+
+	for (; addr < end && end - addr >= PMD_SIZE; addr += PMD_SIZE) {
+		pgd = pgd_offset(mm, addr);
+		if (pgd_none_or_clear_bad(pgd))
+			continue;
+		p4d = p4d_offset(pgd, addr);
+		if (p4d_none_or_clear_bad(p4d))
+			continue;
+		pud = pud_offset(p4d, addr);
+		if (pud_none_or_trans_huge_or_dev_or_clear_bad(pud))
+			continue;
+		pmd = pmd_offset(pud, addr);
+		/* huge pmds are cheap to zap, leave them to unmap_vmas() */
+		if (pmd_none_or_trans_huge_or_clear_bad(pmd) ||
+		    pte_table_shared(*pmd))
+			continue;
+
+		ptl = pmd_lock(mm, pmd);
+		tables[nr].addr = addr;
+		tables[nr].table = pmd_pgtable(*pmd);
+		pmd_clear(pmd);
+		spin_unlock(ptl);
+		nr++;
+	}
+	return nr;
+}
+
+static spinlock_t *detached_pte_lockptr(struct mm_struct *mm, pgtable_t table)
+{
+#if USE_SPLIT_PTE_PTLOCKS
+	return ptlock_ptr(table);
+#else
+	return &mm->page_table_lock;
+#endif
+}
+
+/*
+ * Zap a table that detach_pte_tables() took out of tlb->mm.  @vma is the
+ * first of the detached, anonymous vmas that it maps.  Nothing can reach
+ * the table through the page tables any more, but an rmap walker that read
+ * the pmd before it was cleared may still be in it: the ptl keeps it out,
+ * and the caller unlinks the vmas from their anon_vmas before it frees the
+ * table.  The table itself is left to the caller.
+ */
+void zap_detached_pte_table(struct mmu_gather *tlb,
+			    struct vm_area_struct *vma,
+			    struct detached_pte_table *dt)
+{
+	struct mm_struct *mm = tlb->mm;
+	spinlock_t *ptl = detached_pte_lockptr(mm, dt->table);
+	unsigned long addr = dt->addr, end = dt->addr + PMD_SIZE;
+	int force_flush = 0;
+	int rss[NR_MM_COUNTERS];
+	pte_t *start_pte;
+	pte_t *pte;
+	swp_entry_t entry;
+
+	tlb_remove_check_page_size_change(tlb, PAGE_SIZE);
+again:
+	init_rss_vec(rss);
+	start_pte = (pte_t *)kmap_atomic(dt->table);
+	spin_lock(ptl);
+	pte = start_pte + pte_index(addr);
+	do {
+		pte_t ptent = *pte;
+		struct page *page;
+
+		if (pte_none(ptent))
+			continue;
+
+		while (vma->vm_end <= addr && vma->vm_next)
+			vma = vma->vm_next;
+
+		if (pte_present(ptent)) {
+			/* the TLB was flushed when the table was detached */
+			ptent = ptep_get_and_clear(mm, addr, pte);
+			page = vm_normal_page(vma, addr, ptent);
+			if (unlikely(!page))
+				continue;
+
+			rss[mm_counter(page)]--;
+			page_remove_rmap(page, false);
+			if (unlikely(page_mapcount(page) < 0))
+				print_bad_pte(vma, addr, ptent, page);
+			if (unlikely(__tlb_remove_page(tlb, page))) {
+				force_flush = 1;
+				addr += PAGE_SIZE;
+				break;
+			}
+			continue;
+		}
+
+		entry = pte_to_swp_entry(ptent);
+		if (non_swap_entry(entry) && is_device_private_entry(entry)) {
+			page = device_private_entry_to_page(entry);
+			rss[mm_counter(page)]--;
+			page_remove_rmap(page, false);
+			put_page(page);
+		} else {
+			if (!non_swap_entry(entry))
+				rss[MM_SWAPENTS]--;
+			else if (is_migration_entry(entry)) {
+				page = migration_entry_to_page(entry);
+				rss[mm_counter(page)]--;
+			}
+			if (unlikely(!free_swap_and_cache(entry)))
+				print_bad_pte(vma, addr, ptent, NULL);
+		}
+		pte_clear_not_present_full(mm, addr, pte, tlb->fullmm);
+	} while (pte++, addr += PAGE_SIZE, addr != end);
+
+	add_mm_rss_vec(mm, rss);
+	spin_unlock(ptl);
+	kunmap_atomic(start_pte);
+
+	if (force_flush) {
+		force_flush = 0;
+		tlb_flush_mmu_free(tlb);
+		if (addr != end)
+			goto again;
+	}
+}
+
 /**
  * zap_page_range - remove user pages in a given range
  * @vma: vm_area_struct holding the applicable pages
@@ -3040,6 +3605,258 @@ out_release:
 	return ret;
 }
 
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+static bool vma_has_changed(struct vm_fault *vmf)
+{
+	return read_seqcount_retry(&vmf->vma->vm_sequence, vmf->sequence);
+}
+
+/*
+ * Map and lock the pte for @addr.  A speculative fault holds no mmap_sem,
+ * so the vma may have been changed and its page tables freed under it:
+ * check the vma sequence and the pmd with interrupts disabled, which
+ * holds off the freeing of the page table, and only trylock the ptl since
+ * its holder may be waiting for us to take that IPI.  Returns false if
+ * the fault has to be retried the classic way.
+ */
+static bool pte_map_lock_addr(struct vm_fault *vmf, unsigned long addr)
+{
+	struct mm_struct *mm = vmf->vma->vm_mm;
+	spinlock_t *ptl;
+	pte_t *pte;
+	bool ret = false;
+
+	if (!(vmf->flags & FAULT_FLAG_SPECULATIVE)) {
+		vmf->pte = pte_offset_map_lock(mm, vmf->pmd, addr, &vmf->ptl);
+		return true;
+	}
+
+	local_irq_disable();
+	if (vma_has_changed(vmf))
+		goto out;
+	if (!pmd_same(READ_ONCE(*vmf->pmd), vmf->orig_pmd))
+		goto out;
+
+	ptl = pte_lockptr(mm, vmf->pmd);
+	pte = pte_offset_map(vmf->pmd, addr);
+	if (unlikely(!spin_trylock(ptl))) {
+		pte_unmap(pte);
+		goto out;
+	}
+	/* the vma may have changed while we took the lock */
+	if (vma_has_changed(vmf)) {
+		pte_unmap_unlock(pte, ptl);
+		goto out;
+	}
+
+	vmf->pte = pte;
+	vmf->ptl = ptl;
+	ret = true;
+out:
+	local_irq_enable();
+	return ret;
+}
+#else
+static inline bool pte_map_lock_addr(struct vm_fault *vmf, unsigned long addr)
+{
+	vmf->pte = pte_offset_map_lock(vmf->vma->vm_mm, vmf->pmd, addr,
+				       &vmf->ptl);
+	return true;
+}
+#endif
+
+static inline bool pte_map_lock(struct vm_fault *vmf)
+{
+	return pte_map_lock_addr(vmf, vmf->address);
+}
+
+/*
+ * Anonymous fault-around.
+ *
+ * A write fault on a private anonymous vma maps a naturally aligned batch
+ * of zeroed pages around the faulting address instead of just one, so a
+ * heap touched sequentially takes one fault per batch.  The batch size is
+ * capped by anon_fault_around_bytes in debugfs, one page (off) by default,
+ * and adapted per vma, like swap readahead: when the next fault lands right
+ * behind the previous batch the window doubles, otherwise the pages mapped
+ * ahead of time are accounted as waste and the window halves.
+ *
+ * The per vma state is packed in vma->anon_fault_around_info:
+ *   address the next sequential fault is expected at | window
+ */
+#define ANON_FA_MAX_PAGES	16
+#define ANON_FA_WIN_MASK	0x1fUL
+
+#define ANON_FA_WIN(v)		((v) & ANON_FA_WIN_MASK)
+#define ANON_FA_ADDR(v)		((v) & PAGE_MASK)
+#define ANON_FA_VAL(addr, win)					\
+	(((addr) & PAGE_MASK) | ((unsigned long)(win) & ANON_FA_WIN_MASK))
+
+static unsigned long anon_fault_around_bytes __read_mostly = PAGE_SIZE;
+
+/* pages mapped besides the faulting one */
+static atomic_long_t anon_fault_around_mapped;
+/* estimate of those the following faults did not reach */
+static atomic_long_t anon_fault_around_wasted;
+
+/*
+ * Returns the number of pages to map for this fault, 1 if fault-around is
+ * off.  Racing faults from other threads may update the state under us
+ * (we only hold mmap_sem for read), which only costs accuracy.
+ */
+static unsigned int anon_fault_around_pages(struct vm_fault *vmf)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	unsigned long info, max;
+	unsigned int win;
+
+	max = READ_ONCE(anon_fault_around_bytes) >> PAGE_SHIFT;
+	if (max <= 1 || userfaultfd_missing(vma))
+		return 1;
+
+	info = atomic_long_read(&vma->anon_fault_around_info);
+
+	win = ANON_FA_WIN(info);
+	if (!win) {
+		/* first fault: start with the full window */
+		win = max;
+	} else if (ANON_FA_ADDR(info) == vmf->address) {
+		win = min_t(unsigned long, win * 2, max);
+	} else {
+		/*
+		 * The stream did not continue into the pages the last batch
+		 * mapped ahead of its fault: count them as wasted, at most
+		 * win - 1 of them, and shrink the window.
+		 */
+		atomic_long_add(win - 1, &anon_fault_around_wasted);
+		win = max(win / 2, 1U);
+	}
+
+	/*
+	 * do_anon_fault_around() records its own batch.  A single page
+	 * fault records itself here, or the window could never grow back
+	 * and each fault would count the last batch as wasted again.
+	 */
+	if (win == 1)
+		atomic_long_set(&vma->anon_fault_around_info,
+				ANON_FA_VAL(vmf->address + PAGE_SIZE, 1));
+	return win;
+}
+
+static void anon_fault_around_release(struct page **pages,
+				      struct mem_cgroup **memcgs,
+				      unsigned int nr)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr; i++) {
+		if (!pages[i])
+			continue;
+		mem_cgroup_cancel_charge(pages[i], memcgs[i], false);
+		put_page(pages[i]);
+	}
+}
+
+/*
+ * Map up to nr_pages zeroed pages in the aligned window around the fault.
+ * Only the page at the faulting address must succeed; the others are
+ * allocated without direct reclaim and skipped when memory is tight or
+ * their pte is already populated.  Called with anon_vma prepared.
+ */
+static vm_fault_t do_anon_fault_around(struct vm_fault *vmf,
+				       unsigned int nr_pages)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct page *pages[ANON_FA_MAX_PAGES];
+	struct mem_cgroup *memcgs[ANON_FA_MAX_PAGES];
+	unsigned long mask, start, end, addr;
+	unsigned int i, nr, fault_idx, mapped = 0;
+	vm_fault_t ret = 0;
+	pte_t entry;
+
+	mask = ~((unsigned long)nr_pages * PAGE_SIZE - 1);
+	start = max(vmf->address & mask, vma->vm_start);
+	end = min((vmf->address & mask) + nr_pages * PAGE_SIZE, vma->vm_end);
+	nr = (end - start) >> PAGE_SHIFT;
+	fault_idx = (vmf->address - start) >> PAGE_SHIFT;
+
+	for (i = 0, addr = start; i < nr; i++, addr += PAGE_SIZE) {
+		struct page *page;
+
+		if (i == fault_idx) {
+			page = alloc_zeroed_user_highpage_movable(vma, addr);
+			if (!page)
+				goto oom;
+			if (mem_cgroup_try_charge_delay(page, vma->vm_mm,
+					GFP_KERNEL, &memcgs[i], false)) {
+				put_page(page);
+				goto oom;
+			}
+		} else {
+			page = alloc_page_vma(GFP_HIGHUSER_MOVABLE |
+					      __GFP_NORETRY | __GFP_NOWARN,
+					      vma, addr);
+			if (page && mem_cgroup_try_charge(page, vma->vm_mm,
+					GFP_NOWAIT | __GFP_NOWARN,
+					&memcgs[i], false)) {
+				put_page(page);
+				page = NULL;
+			}
+			if (page)
+				clear_user_highpage(page, addr);
+		}
+		if (page)
+			__SetPageUptodate(page);
+		pages[i] = page;
+	}
+
+	if (!pte_map_lock_addr(vmf, start)) {
+		anon_fault_around_release(pages, memcgs, nr);
+		return VM_FAULT_RETRY;
+	}
+	/* someone else already handled our fault */
+	if (!pte_none(vmf->pte[fault_idx]))
+		goto unlock;
+	ret = check_stable_address_space(vma->vm_mm);
+	if (ret)
+		goto unlock;
+
+	for (i = 0, addr = start; i < nr; i++, addr += PAGE_SIZE) {
+		struct page *page = pages[i];
+
+		if (!page || !pte_none(vmf->pte[i]))
+			continue;
+
+		entry = mk_pte(page, vma->vm_page_prot);
+		if (vma->vm_flags & VM_WRITE)
+			entry = pte_mkwrite(pte_mkdirty(entry));
+
+		inc_mm_counter_fast(vma->vm_mm, MM_ANONPAGES);
+		page_add_new_anon_rmap(page, vma, addr, false);
+		mem_cgroup_commit_charge(page, memcgs[i], false, false);
+		lru_cache_add_active_or_unevictable(page, vma);
+		set_pte_at(vma->vm_mm, addr, vmf->pte + i, entry);
+		/* No need to invalidate - it was non-present before */
+		update_mmu_cache(vma, addr, vmf->pte + i);
+
+		pages[i] = NULL;
+		if (i != fault_idx)
+			mapped++;
+	}
+unlock:
+	pte_unmap_unlock(vmf->pte, vmf->ptl);
+	anon_fault_around_release(pages, memcgs, nr);
+
+	atomic_long_add(mapped, &anon_fault_around_mapped);
+	atomic_long_set(&vma->anon_fault_around_info,
+			ANON_FA_VAL(end, nr_pages));
+	return ret;
+
+oom:
+	anon_fault_around_release(pages, memcgs, i);
+	return VM_FAULT_OOM;
+}
+
 /*
  * We enter with non-exclusive mmap_sem (to exclude vma changes,
  * but allow concurrent faults), and pte mapped but not yet locked.
@@ -3055,6 +3872,7 @@ static vm_fault_t do_anonymous_page(struct vm_fault *vmf)
 	struct vm_area_struct *vma = vmf->vma;
 	struct mem_cgroup *memcg;
 	struct page *page;
+	unsigned int nr_pages;
 	vm_fault_t ret = 0;
 	pte_t entry;
 
@@ -3071,21 +3889,26 @@ static vm_fault_t do_anonymous_page(struct vm_fault *vmf)
 	 * parallel threads are excluded by other means.
 	 *
 	 * Here we only have down_read(mmap_sem).
+	 *
+	 * A speculative fault only gets here with a pte table already in
+	 * place, and pte_map_lock() rechecks the pmd.
 	 */
-	if (pte_alloc(vma->vm_mm, vmf->pmd))
-		return VM_FAULT_OOM;
+	if (!(vmf->flags & FAULT_FLAG_SPECULATIVE)) {
+		if (pte_alloc(vma->vm_mm, vmf->pmd))
+			return VM_FAULT_OOM;
 
-	/* See the comment in pte_alloc_one_map() */
-	if (unlikely(pmd_trans_unstable(vmf->pmd)))
-		return 0;
+		/* See the comment in pte_alloc_one_map() */
+		if (unlikely(pmd_trans_unstable(vmf->pmd)))
+			return 0;
+	}
 
 	/* Use the zero-page for reads */
 	if (!(vmf->flags & FAULT_FLAG_WRITE) &&
 			!mm_forbids_zeropage(vma->vm_mm)) {
 		entry = pte_mkspecial(pfn_pte(my_zero_pfn(vmf->address),
 						vma->vm_page_prot));
-		vmf->pte = pte_offset_map_lock(vma->vm_mm, vmf->pmd,
-				vmf->address, &vmf->ptl);
+		if (!pte_map_lock(vmf))
+			return VM_FAULT_RETRY;
 		if (!pte_none(*vmf->pte))
 			goto unlock;
 		ret = check_stable_address_space(vma->vm_mm);
@@ -3102,6 +3925,11 @@ static vm_fault_t do_anonymous_page(struct vm_fault *vmf)
 	/* Allocate our own private page. */
 	if (unlikely(anon_vma_prepare(vma)))
 		goto oom;
+
+	nr_pages = anon_fault_around_pages(vmf);
+	if (nr_pages > 1)
+		return do_anon_fault_around(vmf, nr_pages);
+
 	/* 这里强制分配了一个新页，而不是象老版本那样使用0页 */
 	page = alloc_zeroed_user_highpage_movable(vma, vmf->address);
 	if (!page)
@@ -3122,8 +3950,11 @@ static vm_fault_t do_anonymous_page(struct vm_fault *vmf)
 	if (vma->vm_flags & VM_WRITE)
 		entry = pte_mkwrite(pte_mkdirty(entry));
 
-	vmf->pte = pte_offset_map_lock(vma->vm_mm, vmf->pmd, vmf->address,
-			&vmf->ptl);
+	if (!pte_map_lock(vmf)) {
+		mem_cgroup_cancel_charge(page, memcg, false);
+		put_page(page);
+		return VM_FAULT_RETRY;
+	}
 	if (!pte_none(*vmf->pte))
 		goto release;
 
@@ -3236,6 +4067,10 @@ static vm_fault_t pte_alloc_one_map(struct vm_fault *vmf)
 {
 	struct vm_area_struct *vma = vmf->vma;
 
+	/* the pte table was checked by handle_speculative_fault() */
+	if (vmf->flags & FAULT_FLAG_SPECULATIVE)
+		return pte_map_lock(vmf) ? 0 : VM_FAULT_RETRY;
+
 	if (!pmd_none(*vmf->pmd))
 		goto map_pte;
 	if (vmf->prealloc_pte) {
@@ -3506,6 +4341,43 @@ static int fault_around_bytes_set(void *data, u64 val)
 DEFINE_DEBUGFS_ATTRIBUTE(fault_around_bytes_fops,
 		fault_around_bytes_get, fault_around_bytes_set, "%llu\n");
 
+static int anon_fault_around_bytes_get(void *data, u64 *val)
+{
+	*val = anon_fault_around_bytes;
+	return 0;
+}
+
+/* rounded down to a power of two pages like fault_around_bytes */
+static int anon_fault_around_bytes_set(void *data, u64 val)
+{
+	if (val / PAGE_SIZE > ANON_FA_MAX_PAGES)
+		return -EINVAL;
+	if (val > PAGE_SIZE)
+		anon_fault_around_bytes = rounddown_pow_of_two(val);
+	else
+		anon_fault_around_bytes = PAGE_SIZE;
+	return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(anon_fault_around_bytes_fops,
+		anon_fault_around_bytes_get, anon_fault_around_bytes_set,
+		"%llu\n");
+
+static int anon_fault_around_mapped_get(void *data, u64 *val)
+{
+	*val = atomic_long_read(&anon_fault_around_mapped);
+	return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(anon_fault_around_mapped_fops,
+		anon_fault_around_mapped_get, NULL, "%llu\n");
+
+static int anon_fault_around_wasted_get(void *data, u64 *val)
+{
+	*val = atomic_long_read(&anon_fault_around_wasted);
+	return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(anon_fault_around_wasted_fops,
+		anon_fault_around_wasted_get, NULL, "%llu\n");
+
 static int __init fault_around_debugfs(void)
 {
 	void *ret;
@@ -3514,6 +4386,12 @@ static int __init fault_around_debugfs(void)
 			&fault_around_bytes_fops);
 	if (!ret)
 		pr_warn("Failed to create fault_around_bytes in debugfs");
+	debugfs_create_file_unsafe("anon_fault_around_bytes", 0644, NULL,
+			NULL, &anon_fault_around_bytes_fops);
+	debugfs_create_file_unsafe("anon_fault_around_mapped", 0444, NULL,
+			NULL, &anon_fault_around_mapped_fops);
+	debugfs_create_file_unsafe("anon_fault_around_wasted", 0444, NULL,
+			NULL, &anon_fault_around_wasted_fops);
 	return 0;
 }
 late_initcall(fault_around_debugfs);
@@ -3568,7 +4446,8 @@ static vm_fault_t do_fault_around(struct vm_fault *vmf)
 	end_pgoff = min3(end_pgoff, vma_pages(vmf->vma) + vmf->vma->vm_pgoff - 1,
 			start_pgoff + nr_pages - 1);
 
-	if (pmd_none(*vmf->pmd)) {
+	/* a speculative fault never populates the pmd */
+	if (!(vmf->flags & FAULT_FLAG_SPECULATIVE) && pmd_none(*vmf->pmd)) {
 		vmf->prealloc_pte = pte_alloc_one(vmf->vma->vm_mm);
 		if (!vmf->prealloc_pte)
 			goto out;
@@ -3943,6 +4822,12 @@ static vm_fault_t handle_pte_fault(struct vm_fault *vmf)
 		/* See comment in pte_alloc_one_map() */
 		if (pmd_devmap_trans_unstable(vmf->pmd))
 			return 0;
+		if (unlikely(pte_table_shared(*vmf->pmd))) {
+			if (vmf->flags & FAULT_FLAG_SPECULATIVE)
+				return VM_FAULT_RETRY;
+			if (unshare_pte_table(vmf->vma, vmf->pmd, vmf->address))
+				return VM_FAULT_OOM;
+		}
 		/*
 		 * A regular pmd is established and it can't morph into a huge
 		 * pmd from under us anymore at this point because we hold the
@@ -4226,6 +5111,258 @@ vm_fault_t handle_mm_fault(struct vm_area_struct *vma, unsigned long address,
 }
 EXPORT_SYMBOL_GPL(handle_mm_fault);
 
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+/*
+ * Speculative page faults.
+ *
+ * The common faults, a first touch of anonymous memory and a read of file
+ * pages already in the page cache, are handled without mmap_sem so threads
+ * faulting do not queue up behind another one doing mmap()/munmap().  The
+ * vma is looked up under RCU and pinned with vm_ref_count, its vm_sequence
+ * is sampled and checked again under the ptl before the pte is set: any
+ * change to the vma in between makes the fault return VM_FAULT_RETRY and
+ * the caller falls back to handle_mm_fault() under mmap_sem.
+ */
+enum spf_stat_item {
+	SPF_ATTEMPT,
+	SPF_SUCCESS,
+	SPF_ABORT,
+	NR_SPF_STATS
+};
+
+static DEFINE_PER_CPU(unsigned long [NR_SPF_STATS], spf_stats);
+
+static inline void count_spf_event(enum spf_stat_item item)
+{
+	this_cpu_inc(spf_stats[item]);
+}
+
+/*
+ * Find the vma containing @addr without mmap_sem.  Tree nodes are freed
+ * by RCU, so the walk cannot fault, but it may see a tree that is being
+ * split or merged; mm_vt_seq tells us to give up.
+ *
+ * The vma's vm_sequence is sampled into @sequence before mm_vt_seq is
+ * checked again.  Unlinking a vma bumps both, so either the vma was
+ * still linked when it was sampled and a later unlink shows up in
+ * vma_has_changed(), or the unlink is seen here.
+ */
+static struct vm_area_struct *get_vma(struct mm_struct *mm, unsigned long addr,
+				      unsigned int *sequence)
+{
+	struct vm_area_struct *vma;
+	unsigned int seq;
+
+	rcu_read_lock();
+	seq = read_seqcount_begin(&mm->mm_vt_seq);
+	vma = vma_tree_find(&mm->mm_vt, addr);
+	if (vma && addr < READ_ONCE(vma->vm_start))
+		vma = NULL;
+	if (vma && !atomic_inc_not_zero(&vma->vm_ref_count))
+		vma = NULL;
+	if (vma)
+		*sequence = raw_read_seqcount(&vma->vm_sequence);
+	if (vma && read_seqcount_retry(&mm->mm_vt_seq, seq)) {
+		put_vma(vma);
+		vma = NULL;
+	}
+	rcu_read_unlock();
+
+	return vma;
+}
+
+/*
+ * Try to handle a user fault on @address without mmap_sem.  @access is
+ * the set of vm_flags one of which the vma must have for the access to be
+ * allowed.  Returns VM_FAULT_RETRY whenever the fault was not handled, in
+ * which case the caller must take mmap_sem and call handle_mm_fault().
+ *
+ * Only correct once every change of a linked vma's vm_flags, vm_page_prot
+ * or bounds is bracketed by vm_write_begin()/vm_write_end(), and page
+ * tables are freed after an IPI or an RCU grace period.  mprotect_fixup(),
+ * mremap and madvise are not there yet, and ARMv7 SMP frees tables with
+ * neither, so no architecture selects ARCH_SUPPORTS_SPECULATIVE_PAGE_FAULT
+ * and the fault handlers do not call this for now.
+ */
+vm_fault_t handle_speculative_fault(struct mm_struct *mm,
+				    unsigned long address, unsigned int flags,
+				    unsigned long access)
+{
+	struct vm_fault vmf = {
+		.address = address & PAGE_MASK,
+	};
+	struct vm_area_struct *vma;
+	pgd_t *pgd;
+	p4d_t *p4d;
+	pud_t pudval;
+	vm_fault_t ret = VM_FAULT_RETRY;
+
+	/* there is no mmap_sem to drop while waiting */
+	flags &= ~(FAULT_FLAG_ALLOW_RETRY | FAULT_FLAG_KILLABLE);
+	vmf.flags = flags | FAULT_FLAG_SPECULATIVE;
+
+	count_spf_event(SPF_ATTEMPT);
+
+	vma = get_vma(mm, address, &vmf.sequence);
+	if (!vma)
+		goto out;
+
+	vmf.vma = vma;
+	/* the vma is being modified right now */
+	if (vmf.sequence & 1)
+		goto out_put;
+
+	/* the checks the arch code does under mmap_sem */
+	if (address < vma->vm_start || address >= vma->vm_end)
+		goto out_put;
+	if (!(vma->vm_flags & access))
+		goto out_put;
+	if (!arch_vma_access_permitted(vma, flags & FAULT_FLAG_WRITE,
+				       flags & FAULT_FLAG_INSTRUCTION,
+				       flags & FAULT_FLAG_REMOTE))
+		goto out_put;
+
+	/*
+	 * Leave to the classic path what we cannot do without mmap_sem:
+	 * hugetlb, userfaultfd, a policy mbind() could free under us, and
+	 * an anon_vma still to be allocated.  Of the file faults only
+	 * reads that ->map_pages() can satisfy are handled.
+	 */
+	if (is_vm_hugetlb_page(vma) || userfaultfd_armed(vma) ||
+	    vma_policy(vma) || ((vma->vm_flags & VM_SHARED) && !vma->vm_ops))
+		goto out_put;
+	if (vma_is_anonymous(vma)) {
+		if (!vma->anon_vma)
+			goto out_put;
+	} else {
+		if ((flags & FAULT_FLAG_WRITE) || !vma->vm_ops->map_pages ||
+		    fault_around_bytes >> PAGE_SHIFT <= 1)
+			goto out_put;
+	}
+	vmf.pgoff = linear_page_index(vma, address);
+	vmf.gfp_mask = __get_fault_gfp_mask(vma);
+
+	/*
+	 * Walk the page table with interrupts disabled, see pte_map_lock().
+	 * Only a missing pte under a regular pmd is handled here, anything
+	 * else (allocating page tables, THP, swap, cow) needs mmap_sem.
+	 */
+	local_irq_disable();
+	pgd = pgd_offset(mm, address);
+	if (pgd_none(*pgd) || unlikely(pgd_bad(*pgd)))
+		goto out_walk;
+	p4d = p4d_offset(pgd, address);
+	if (p4d_none(*p4d) || unlikely(p4d_bad(*p4d)))
+		goto out_walk;
+	vmf.pud = pud_offset(p4d, address);
+	pudval = READ_ONCE(*vmf.pud);
+	if (pud_none(pudval) || unlikely(pud_bad(pudval)) ||
+	    pud_trans_huge(pudval) || pud_devmap(pudval))
+		goto out_walk;
+	vmf.pmd = pmd_offset(vmf.pud, address);
+	vmf.orig_pmd = READ_ONCE(*vmf.pmd);
+	if (pmd_none(vmf.orig_pmd) || is_swap_pmd(vmf.orig_pmd) ||
+	    pmd_trans_huge(vmf.orig_pmd) || pmd_devmap(vmf.orig_pmd) ||
+	    unlikely(pmd_bad(vmf.orig_pmd)) ||
+	    pte_table_shared(vmf.orig_pmd))
+		goto out_walk;
+	vmf.pte = pte_offset_map(vmf.pmd, address);
+	vmf.orig_pte = *vmf.pte;
+	barrier(); /* see handle_pte_fault() */
+	pte_unmap(vmf.pte);
+	vmf.pte = NULL;
+	local_irq_enable();
+
+	if (!pte_none(vmf.orig_pte))
+		goto out_put;
+
+	check_sync_rss_stat(current);
+	if (flags & FAULT_FLAG_USER)
+		mem_cgroup_enter_user_fault();
+
+	if (vma_is_anonymous(vma)) {
+		ret = do_anonymous_page(&vmf);
+	} else {
+		/* a cold page cache needs ->fault(), which may sleep on io */
+		ret = do_fault_around(&vmf);
+		if (!ret)
+			ret = VM_FAULT_RETRY;
+	}
+
+	if (flags & FAULT_FLAG_USER) {
+		mem_cgroup_exit_user_fault();
+		if (task_in_memcg_oom(current) && !(ret & VM_FAULT_OOM))
+			mem_cgroup_oom_synchronize(false);
+	}
+
+	if (ret != VM_FAULT_RETRY) {
+		count_vm_event(PGFAULT);
+		count_memcg_event_mm(mm, PGFAULT);
+		count_spf_event(SPF_SUCCESS);
+	}
+	goto out_put;
+
+out_walk:
+	local_irq_enable();
+out_put:
+	put_vma(vma);
+out:
+	if (ret == VM_FAULT_RETRY)
+		count_spf_event(SPF_ABORT);
+	return ret;
+}
+
+#ifdef CONFIG_DEBUG_FS
+static u64 spf_stat_sum(enum spf_stat_item item)
+{
+	u64 sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += per_cpu(spf_stats, cpu)[item];
+	return sum;
+}
+
+static int spf_attempt_get(void *data, u64 *val)
+{
+	*val = spf_stat_sum(SPF_ATTEMPT);
+	return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(spf_attempt_fops, spf_attempt_get, NULL, "%llu\n");
+
+static int spf_success_get(void *data, u64 *val)
+{
+	*val = spf_stat_sum(SPF_SUCCESS);
+	return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(spf_success_fops, spf_success_get, NULL, "%llu\n");
+
+static int spf_abort_get(void *data, u64 *val)
+{
+	*val = spf_stat_sum(SPF_ABORT);
+	return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(spf_abort_fops, spf_abort_get, NULL, "%llu\n");
+
+static int __init speculative_fault_debugfs(void)
+{
+	struct dentry *dir;
+
+	dir = debugfs_create_dir("speculative_fault", NULL);
+	if (!dir)
+		return 0;
+	debugfs_create_file_unsafe("attempt", 0444, dir, NULL,
+				   &spf_attempt_fops);
+	debugfs_create_file_unsafe("success", 0444, dir, NULL,
+				   &spf_success_fops);
+	debugfs_create_file_unsafe("abort", 0444, dir, NULL,
+				   &spf_abort_fops);
+	return 0;
+}
+late_initcall(speculative_fault_debugfs);
+#endif
+#endif /* CONFIG_SPECULATIVE_PAGE_FAULT */
+
 #ifndef __PAGETABLE_P4D_FOLDED
 /*
  * Allocate p4d page table.
@@ -4533,7 +5670,7 @@ int __access_remote_vm(struct task_struct *tsk, struct mm_struct *mm,
 			if (bytes > PAGE_SIZE-offset)
 				bytes = PAGE_SIZE-offset;
 
-			maddr = kmap(page);
+			maddr = kmap_local_page(page);
 			if (write) {
 				copy_to_user_page(vma, page, addr,
 						  maddr + offset, buf, bytes);
@@ -4542,7 +5679,7 @@ int __access_remote_vm(struct task_struct *tsk, struct mm_struct *mm,
 				copy_from_user_page(vma, page, addr,
 						    buf, maddr + offset, bytes);
 			}
-			kunmap(page);
+			kunmap_local(maddr);
 			put_page(page);
 		}
 		len -= bytes;
@@ -4802,14 +5939,14 @@ long copy_huge_page_from_user(struct page *dst_page,
 
 	for (i = 0; i < pages_per_huge_page; i++) {
 		if (allow_pagefault)
-			page_kaddr = kmap(dst_page + i);
+			page_kaddr = kmap_local_page(dst_page + i);
 		else
 			page_kaddr = kmap_atomic(dst_page + i);
 		rc = copy_from_user(page_kaddr,
 				(const void __user *)(src + i * PAGE_SIZE),
 				PAGE_SIZE);
 		if (allow_pagefault)
-			kunmap(dst_page + i);
+			kunmap_local(page_kaddr);
 		else
 			kunmap_atomic(page_kaddr);
 
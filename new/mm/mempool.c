@@ -17,8 +17,14 @@
 #include <linux/kmemleak.h>
 #include <linux/export.h>
 #include <linux/mempool.h>
+#include <linux/mempool_pcp.h>
 #include <linux/blkdev.h>
 #include <linux/writeback.h>
+#include <linux/cpuhotplug.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <linux/smp.h>
 #include "slab.h"
 
 #if defined(CONFIG_DEBUG_SLAB) || defined(CONFIG_SLUB_DEBUG_ON)
@@ -137,6 +143,13 @@ static void *remove_element(mempool_t *pool)
 	return element;
 }
 
+/* elements parked in a per-CPU cache are poisoned like reserved ones */
+static void unpoison_element(mempool_t *pool, void *element)
+{
+	kasan_unpoison_element(pool, element);
+	check_element(pool, element);
+}
+
 /**
  * mempool_exit - exit a mempool initialized with mempool_init()
  * @pool:      pointer to the memory pool which was initialized with
@@ -361,27 +374,229 @@ out:
 }
 EXPORT_SYMBOL(mempool_resize);
 
+static LIST_HEAD(mempool_pcp_list);
+static DEFINE_MUTEX(mempool_pcp_mutex);
+
+static inline void mempool_pcp_stat(struct mempool_pcp *pp,
+				    enum mempool_pcp_stat item, u64 nr)
+{
+	if (pp)
+		this_cpu_add(pp->pcp->stat[item], nr);
+}
+
+/* reserved elements, wherever they are kept */
+static inline int mempool_reserved(mempool_t *pool, struct mempool_pcp *pp)
+{
+	return pool->curr_nr + (pp ? atomic_read(&pp->cached) : 0);
+}
+
+/* a reserve element cached on this CPU, pool->lock is not taken */
+static void *mempool_pcp_take(struct mempool_pcp *pp)
+{
+	struct mempool_pcp_cpu *pcp;
+	unsigned long flags;
+	void *element = NULL;
+
+	local_irq_save(flags);
+	pcp = this_cpu_ptr(pp->pcp);
+	if (pcp->nr) {
+		element = pcp->elements[--pcp->nr];
+		atomic_dec(&pp->cached);
+		unpoison_element(&pp->pool, element);
+	}
+	local_irq_restore(flags);
+	return element;
+}
+
+/*
+ * Park a freed reserve element on this CPU.  Refused when someone sleeps
+ * on the pool: the element is published before the waitqueue is checked
+ * and the waiter queues itself before it looks at the caches, so either
+ * the waiter pulls the element back or we return it through the shared
+ * reserve and wake it up.
+ */
+static bool mempool_pcp_put(struct mempool_pcp *pp, void *element)
+{
+	struct mempool_pcp_cpu *pcp;
+	unsigned long flags;
+	bool cached = false;
+
+	if (atomic_read(&pp->cached) >= pp->max_cached)
+		return false;
+
+	local_irq_save(flags);
+	pcp = this_cpu_ptr(pp->pcp);
+	if (pcp->nr < MEMPOOL_PCP_BATCH) {
+		pcp->elements[pcp->nr++] = element;
+		atomic_inc(&pp->cached);
+		/* pairs with the barrier in prepare_to_wait() */
+		smp_mb__after_atomic();
+		if (likely(!waitqueue_active(&pp->pool.wait))) {
+			poison_element(&pp->pool, element);
+			kasan_poison_element(&pp->pool, element);
+			cached = true;
+		} else {
+			pcp->nr--;
+			atomic_dec(&pp->cached);
+		}
+	}
+	local_irq_restore(flags);
+	return cached;
+}
+
+/* IPI, or local with interrupts off: move this CPU's cache to the pool */
+static void mempool_pcp_drain_cpu(void *info)
+{
+	struct mempool_pcp *pp = info;
+	struct mempool_pcp_cpu *pcp = this_cpu_ptr(pp->pcp);
+	mempool_t *pool = &pp->pool;
+	unsigned int moved = 0;
+
+	spin_lock(&pool->lock);
+	while (pcp->nr && pool->curr_nr < pool->min_nr) {
+		/* already poisoned, goes straight into the array */
+		pool->elements[pool->curr_nr++] = pcp->elements[--pcp->nr];
+		atomic_dec(&pp->cached);
+		moved++;
+	}
+	spin_unlock(&pool->lock);
+	pcp->stat[MEMPOOL_PCP_DRAIN] += moved;
+}
+
+static bool mempool_pcp_has_cached(int cpu, void *info)
+{
+	struct mempool_pcp *pp = info;
+
+	return READ_ONCE(per_cpu_ptr(pp->pcp, cpu)->nr);
+}
+
+/* from the sleeping allocation path, with pool->lock dropped */
+static void mempool_pcp_drain(struct mempool_pcp *pp)
+{
+	if (!atomic_read(&pp->cached))
+		return;
+	on_each_cpu_cond(mempool_pcp_has_cached, mempool_pcp_drain_cpu, pp,
+			 true, GFP_ATOMIC);
+}
+
+/* hand back the elements of @cpu, which is offline or going away */
+static void mempool_pcp_release_cpu(struct mempool_pcp *pp, int cpu,
+				    bool to_pool)
+{
+	struct mempool_pcp_cpu *pcp = per_cpu_ptr(pp->pcp, cpu);
+	void *element;
+
+	while (pcp->nr) {
+		element = pcp->elements[--pcp->nr];
+		atomic_dec(&pp->cached);
+		unpoison_element(&pp->pool, element);
+		if (to_pool) {
+			mempool_free(element, &pp->pool);
+			pcp->stat[MEMPOOL_PCP_DRAIN]++;
+		} else {
+			pp->pool.free(element, pp->pool.pool_data);
+		}
+	}
+}
+
 /**
- * mempool_alloc - allocate an element from a specific memory pool
- * @pool:      pointer to the memory pool which was allocated via
- *             mempool_create().
- * @gfp_mask:  the usual allocation bitmask.
+ * mempool_pcp_init - initialize a memory pool with per-CPU element caches
+ * @pp:        pointer to the pool that should be initialized
+ * @name:      name shown in debugfs, must stay valid until mempool_pcp_exit()
+ * @min_nr:    the minimum number of elements guaranteed to be
+ *             allocated for this pool.
+ * @alloc_fn:  user-defined element-allocation function.
+ * @free_fn:   user-defined element-freeing function.
+ * @pool_data: optional private data available to the user-defined functions.
  *
- * this function only sleeps if the alloc_fn() function sleeps or
- * returns NULL. Note that due to preallocation, this function
- * *never* fails when called from process contexts. (it might
- * fail if called from an IRQ context.)
- * Note: using __GFP_ZERO is not supported.
+ * Like mempool_init().  Up to half of the @min_nr reserved elements may be
+ * cached per CPU, at most %MEMPOOL_PCP_BATCH on each; with @min_nr < 2 the
+ * pool behaves like a plain mempool.
  */
+int mempool_pcp_init(struct mempool_pcp *pp, const char *name, int min_nr,
+		     mempool_alloc_t *alloc_fn, mempool_free_t *free_fn,
+		     void *pool_data)
+{
+	int ret;
+
+	memset(pp, 0, sizeof(*pp));
+	pp->pcp = alloc_percpu(struct mempool_pcp_cpu);
+	if (!pp->pcp)
+		return -ENOMEM;
+
+	ret = mempool_init(&pp->pool, min_nr, alloc_fn, free_fn, pool_data);
+	if (ret) {
+		free_percpu(pp->pcp);
+		pp->pcp = NULL;
+		return ret;
+	}
+	pp->max_cached = min_nr / 2;
+	pp->name = name;
+
+	mutex_lock(&mempool_pcp_mutex);
+	list_add_tail(&pp->list, &mempool_pcp_list);
+	mutex_unlock(&mempool_pcp_mutex);
+	return 0;
+}
+EXPORT_SYMBOL(mempool_pcp_init);
+
 /**
- * 从内存池中分配一个元素
+ * mempool_pcp_exit - exit a pool initialized with mempool_pcp_init()
+ * @pp:        pointer to the pool.
+ *
+ * Free all reserved elements, cached or not.  No allocation or free may
+ * run concurrently.
  */
-void *mempool_alloc(mempool_t *pool, gfp_t gfp_mask)
+void mempool_pcp_exit(struct mempool_pcp *pp)
+{
+	int cpu;
+
+	if (!pp->pcp)
+		return;
+
+	mutex_lock(&mempool_pcp_mutex);
+	list_del(&pp->list);
+	mutex_unlock(&mempool_pcp_mutex);
+
+	for_each_possible_cpu(cpu)
+		mempool_pcp_release_cpu(pp, cpu, false);
+	free_percpu(pp->pcp);
+	pp->pcp = NULL;
+	mempool_exit(&pp->pool);
+}
+EXPORT_SYMBOL(mempool_pcp_exit);
+
+static int mempool_pcp_cpu_dead(unsigned int cpu)
+{
+	struct mempool_pcp *pp;
+
+	mutex_lock(&mempool_pcp_mutex);
+	list_for_each_entry(pp, &mempool_pcp_list, list)
+		mempool_pcp_release_cpu(pp, cpu, true);
+	mutex_unlock(&mempool_pcp_mutex);
+	return 0;
+}
+
+static int __init mempool_pcp_cpuhp_init(void)
+{
+	int ret;
+
+	ret = cpuhp_setup_state_nocalls(CPUHP_BP_PREPARE_DYN,
+					"mm/mempool_pcp:dead", NULL,
+					mempool_pcp_cpu_dead);
+	WARN_ON(ret < 0);
+	return 0;
+}
+subsys_initcall(mempool_pcp_cpuhp_init);
+
+static void *__mempool_alloc(mempool_t *pool, gfp_t gfp_mask,
+			     struct mempool_pcp *pp)
 {
 	void *element;
 	unsigned long flags;
 	wait_queue_entry_t wait;
 	gfp_t gfp_temp;
+	u64 start = 0;
 
 	VM_WARN_ON_ONCE(gfp_mask & __GFP_ZERO);
 	might_sleep_if(gfp_mask & __GFP_DIRECT_RECLAIM);
@@ -401,8 +616,21 @@ repeat_alloc:
 	/**
 	 * 如果从基本内存分配器中分配成功，就返回获得的内存元素而不涉及到内存池。
 	 */
-	if (likely(element != NULL))
+	if (likely(element != NULL)) {
+		mempool_pcp_stat(pp, MEMPOOL_PCP_ALLOC, 1);
 		return element;
+	}
+
+	if (pp) {
+		element = mempool_pcp_take(pp);
+		if (element) {
+			/* as below, for @pp->cached */
+			smp_wmb();
+			kmemleak_update_trace(element);
+			mempool_pcp_stat(pp, MEMPOOL_PCP_CACHE_HIT, 1);
+			return element;
+		}
+	}
 
 	/**
 	 * 从基本内存池中分配元素失败，从内存池中分配。
@@ -421,6 +649,7 @@ repeat_alloc:
 		 * for debugging.
 		 */
 		kmemleak_update_trace(element);
+		mempool_pcp_stat(pp, MEMPOOL_PCP_RESERVE_HIT, 1);
 		return element;
 	}
 
@@ -440,6 +669,7 @@ repeat_alloc:
 	 */
 	if (!(gfp_mask & __GFP_DIRECT_RECLAIM)) {
 		spin_unlock_irqrestore(&pool->lock, flags);
+		mempool_pcp_stat(pp, MEMPOOL_PCP_FAIL, 1);
 		return NULL;
 	}
 
@@ -453,6 +683,20 @@ repeat_alloc:
 
 	spin_unlock_irqrestore(&pool->lock, flags);
 
+	/*
+	 * Reserve elements may sit in other CPUs' caches.  We are on the
+	 * waitqueue now, so mempool_pcp_put() stops caching and whatever it
+	 * cached before is found here.
+	 */
+	if (pp) {
+		mempool_pcp_drain(pp);
+		if (READ_ONCE(pool->curr_nr)) {
+			finish_wait(&pool->wait, &wait);
+			goto repeat_alloc;
+		}
+		start = ktime_get_ns();
+	}
+
 	/*
 	 * FIXME: this should be io_schedule().  The timeout is there as a
 	 * workaround for some DM problems in 2.6.18.
@@ -464,22 +708,51 @@ repeat_alloc:
 	io_schedule_timeout(5*HZ);
 
 	finish_wait(&pool->wait, &wait);
+	if (pp) {
+		mempool_pcp_stat(pp, MEMPOOL_PCP_WAIT, 1);
+		mempool_pcp_stat(pp, MEMPOOL_PCP_WAIT_NS,
+				 ktime_get_ns() - start);
+	}
 	goto repeat_alloc;
 }
-EXPORT_SYMBOL(mempool_alloc);
 
 /**
- * mempool_free - return an element to the pool.
- * @element:   pool element pointer.
+ * mempool_alloc - allocate an element from a specific memory pool
  * @pool:      pointer to the memory pool which was allocated via
  *             mempool_create().
+ * @gfp_mask:  the usual allocation bitmask.
  *
- * this function only sleeps if the free_fn() function sleeps.
+ * this function only sleeps if the alloc_fn() function sleeps or
+ * returns NULL. Note that due to preallocation, this function
+ * *never* fails when called from process contexts. (it might
+ * fail if called from an IRQ context.)
+ * Note: using __GFP_ZERO is not supported.
  */
 /**
- * 释放一个元素到内存池。
+ * 从内存池中分配一个元素
  */
-void mempool_free(void *element, mempool_t *pool)
+void *mempool_alloc(mempool_t *pool, gfp_t gfp_mask)
+{
+	return __mempool_alloc(pool, gfp_mask, NULL);
+}
+EXPORT_SYMBOL(mempool_alloc);
+
+/**
+ * mempool_pcp_alloc - allocate an element from a pool with per-CPU caches
+ * @pp:        pointer to the pool initialized with mempool_pcp_init().
+ * @gfp_mask:  the usual allocation bitmask.
+ *
+ * Same guarantees as mempool_alloc().  When alloc_fn() fails, elements
+ * cached on this CPU are used before the shared reserve.
+ */
+void *mempool_pcp_alloc(struct mempool_pcp *pp, gfp_t gfp_mask)
+{
+	return __mempool_alloc(&pp->pool, gfp_mask, pp);
+}
+EXPORT_SYMBOL(mempool_pcp_alloc);
+
+static void __mempool_free(void *element, mempool_t *pool,
+			   struct mempool_pcp *pp)
 {
 	unsigned long flags;
 
@@ -518,11 +791,16 @@ void mempool_free(void *element, mempool_t *pool)
 	 * Waiters happen iff curr_nr is 0 and the above guarantee also
 	 * ensures that there will be frees which return elements to the
 	 * pool waking up the waiters.
+	 *
+	 * With per-CPU caches the same holds for curr_nr + @pp->cached,
+	 * mempool_pcp_put() keeps cached elements away from waiters.
 	 */
 	/**
 	 * 如果内存池未满，就将元素加入到内存池。
 	 */
-	if (unlikely(pool->curr_nr < pool->min_nr)) {
+	if (unlikely(mempool_reserved(pool, pp) < pool->min_nr)) {
+		if (pp && mempool_pcp_put(pp, element))
+			return;
 		spin_lock_irqsave(&pool->lock, flags);
 		if (likely(pool->curr_nr < pool->min_nr)) {
 			add_element(pool, element);
@@ -537,8 +815,84 @@ void mempool_free(void *element, mempool_t *pool)
 	 */
 	pool->free(element, pool->pool_data);
 }
+
+/**
+ * mempool_free - return an element to the pool.
+ * @element:   pool element pointer.
+ * @pool:      pointer to the memory pool which was allocated via
+ *             mempool_create().
+ *
+ * this function only sleeps if the free_fn() function sleeps.
+ */
+/**
+ * 释放一个元素到内存池。
+ */
+void mempool_free(void *element, mempool_t *pool)
+{
+	__mempool_free(element, pool, NULL);
+}
 EXPORT_SYMBOL(mempool_free);
 
+/**
+ * mempool_pcp_free - return an element to a pool with per-CPU caches
+ * @element:   pool element pointer.
+ * @pp:        pointer to the pool initialized with mempool_pcp_init().
+ *
+ * A short reserve is refilled through this CPU's cache when there is
+ * room and nobody waits, through the shared reserve otherwise.
+ */
+void mempool_pcp_free(void *element, struct mempool_pcp *pp)
+{
+	__mempool_free(element, &pp->pool, pp);
+}
+EXPORT_SYMBOL(mempool_pcp_free);
+
+#ifdef CONFIG_DEBUG_FS
+static const char * const mempool_pcp_stat_names[MEMPOOL_PCP_NR_STATS] = {
+	[MEMPOOL_PCP_ALLOC]		= "alloc_fn",
+	[MEMPOOL_PCP_CACHE_HIT]		= "cache_hit",
+	[MEMPOOL_PCP_RESERVE_HIT]	= "reserve_hit",
+	[MEMPOOL_PCP_FAIL]		= "fail",
+	[MEMPOOL_PCP_WAIT]		= "wait",
+	[MEMPOOL_PCP_WAIT_NS]		= "wait_ns",
+	[MEMPOOL_PCP_DRAIN]		= "drained",
+};
+
+static int mempool_pcp_show(struct seq_file *m, void *v)
+{
+	u64 sum[MEMPOOL_PCP_NR_STATS];
+	struct mempool_pcp *pp;
+	int cpu, i;
+
+	mutex_lock(&mempool_pcp_mutex);
+	list_for_each_entry(pp, &mempool_pcp_list, list) {
+		memset(sum, 0, sizeof(sum));
+		for_each_possible_cpu(cpu)
+			for (i = 0; i < MEMPOOL_PCP_NR_STATS; i++)
+				sum[i] += per_cpu_ptr(pp->pcp, cpu)->stat[i];
+
+		seq_printf(m, "%s: min_nr %d shared %d cached %d\n",
+			   pp->name, pp->pool.min_nr,
+			   READ_ONCE(pp->pool.curr_nr),
+			   atomic_read(&pp->cached));
+		for (i = 0; i < MEMPOOL_PCP_NR_STATS; i++)
+			seq_printf(m, "  %-16s %llu\n",
+				   mempool_pcp_stat_names[i], sum[i]);
+	}
+	mutex_unlock(&mempool_pcp_mutex);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(mempool_pcp);
+
+static int __init mempool_pcp_debugfs_init(void)
+{
+	debugfs_create_file("mempool_pcp", 0400, NULL, NULL,
+			    &mempool_pcp_fops);
+	return 0;
+}
+late_initcall(mempool_pcp_debugfs_init);
+#endif
+
 /*
  * A commonly used alloc and free fn.
  */
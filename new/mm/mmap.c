@@ -37,7 +37,6 @@
 #include <linux/audit.h>
 #include <linux/khugepaged.h>
 #include <linux/uprobes.h>
-#include <linux/rbtree_augmented.h>
 #include <linux/notifier.h>
 #include <linux/memory.h>
 #include <linux/printk.h>
@@ -45,6 +44,8 @@
 #include <linux/moduleparam.h>
 #include <linux/pkeys.h>
 #include <linux/oom.h>
+#include <linux/workqueue.h>
+#include <linux/sizes.h>
 
 #include <linux/uaccess.h>
 #include <asm/cacheflush.h>
@@ -170,6 +171,40 @@ void unlink_file_vma(struct vm_area_struct *vma)
 	}
 }
 
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+static void __free_vma_rcu(struct rcu_head *head)
+{
+	vm_area_free(container_of(head, struct vm_area_struct, vm_rcu));
+}
+#endif
+
+static void __free_vma(struct vm_area_struct *vma)
+{
+	if (vma->vm_file)
+		fput(vma->vm_file);
+	mpol_put(vma_policy(vma));
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+	/* lockless vma tree walkers may still be looking at it */
+	call_rcu(&vma->vm_rcu, __free_vma_rcu);
+#else
+	vm_area_free(vma);
+#endif
+}
+
+/*
+ * Drop a reference on a vma that is no longer linked in its mm.  With
+ * speculative page faults a fault running without mmap_sem may still be
+ * using it, and the last one out frees it.
+ */
+void put_vma(struct vm_area_struct *vma)
+{
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+	if (!atomic_dec_and_test(&vma->vm_ref_count))
+		return;
+#endif
+	__free_vma(vma);
+}
+
 /*
  * Close a vm structure and free it, returning the next.
  */
@@ -180,10 +215,7 @@ static struct vm_area_struct *remove_vma(struct vm_area_struct *vma)
 	might_sleep();
 	if (vma->vm_ops && vma->vm_ops->close)
 		vma->vm_ops->close(vma);
-	if (vma->vm_file)
-		fput(vma->vm_file);
-	mpol_put(vma_policy(vma));
-	vm_area_free(vma);
+	put_vma(vma);
 	return next;
 }
 
@@ -317,101 +349,7 @@ out:
 	return retval;
 }
 
-static long vma_compute_subtree_gap(struct vm_area_struct *vma)
-{
-	unsigned long max, prev_end, subtree_gap;
-
-	/*
-	 * Note: in the rare case of a VM_GROWSDOWN above a VM_GROWSUP, we
-	 * allow two stack_guard_gaps between them here, and when choosing
-	 * an unmapped area; whereas when expanding we only require one.
-	 * That's a little inconsistent, but keeps the code here simpler.
-	 */
-	max = vm_start_gap(vma);
-	if (vma->vm_prev) {
-		prev_end = vm_end_gap(vma->vm_prev);
-		if (max > prev_end)
-			max -= prev_end;
-		else
-			max = 0;
-	}
-	if (vma->vm_rb.rb_left) {
-		subtree_gap = rb_entry(vma->vm_rb.rb_left,
-				struct vm_area_struct, vm_rb)->rb_subtree_gap;
-		if (subtree_gap > max)
-			max = subtree_gap;
-	}
-	if (vma->vm_rb.rb_right) {
-		subtree_gap = rb_entry(vma->vm_rb.rb_right,
-				struct vm_area_struct, vm_rb)->rb_subtree_gap;
-		if (subtree_gap > max)
-			max = subtree_gap;
-	}
-	return max;
-}
-
 #ifdef CONFIG_DEBUG_VM_RB
-static int browse_rb(struct mm_struct *mm)
-{
-	struct rb_root *root = &mm->mm_rb;
-	int i = 0, j, bug = 0;
-	struct rb_node *nd, *pn = NULL;
-	unsigned long prev = 0, pend = 0;
-
-	for (nd = rb_first(root); nd; nd = rb_next(nd)) {
-		struct vm_area_struct *vma;
-		vma = rb_entry(nd, struct vm_area_struct, vm_rb);
-		if (vma->vm_start < prev) {
-			pr_emerg("vm_start %lx < prev %lx\n",
-				  vma->vm_start, prev);
-			bug = 1;
-		}
-		if (vma->vm_start < pend) {
-			pr_emerg("vm_start %lx < pend %lx\n",
-				  vma->vm_start, pend);
-			bug = 1;
-		}
-		if (vma->vm_start > vma->vm_end) {
-			pr_emerg("vm_start %lx > vm_end %lx\n",
-				  vma->vm_start, vma->vm_end);
-			bug = 1;
-		}
-		spin_lock(&mm->page_table_lock);
-		if (vma->rb_subtree_gap != vma_compute_subtree_gap(vma)) {
-			pr_emerg("free gap %lx, correct %lx\n",
-			       vma->rb_subtree_gap,
-			       vma_compute_subtree_gap(vma));
-			bug = 1;
-		}
-		spin_unlock(&mm->page_table_lock);
-		i++;
-		pn = nd;
-		prev = vma->vm_start;
-		pend = vma->vm_end;
-	}
-	j = 0;
-	for (nd = pn; nd; nd = rb_prev(nd))
-		j++;
-	if (i != j) {
-		pr_emerg("backwards %d, forwards %d\n", j, i);
-		bug = 1;
-	}
-	return bug ? -1 : i;
-}
-
-static void validate_mm_rb(struct rb_root *root, struct vm_area_struct *ignore)
-{
-	struct rb_node *nd;
-
-	for (nd = rb_first(root); nd; nd = rb_next(nd)) {
-		struct vm_area_struct *vma;
-		vma = rb_entry(nd, struct vm_area_struct, vm_rb);
-		VM_BUG_ON_VMA(vma != ignore &&
-			vma->rb_subtree_gap != vma_compute_subtree_gap(vma),
-			vma);
-	}
-}
-
 static void validate_mm(struct mm_struct *mm)
 {
 	int bug = 0;
@@ -443,79 +381,46 @@ static void validate_mm(struct mm_struct *mm)
 			  mm->highest_vm_end, highest_address);
 		bug = 1;
 	}
-	i = browse_rb(mm);
+	spin_lock(&mm->page_table_lock);
+	i = vma_tree_validate(&mm->mm_vt);
+	spin_unlock(&mm->page_table_lock);
 	if (i != mm->map_count) {
 		if (i != -1)
-			pr_emerg("map_count %d rb %d\n", mm->map_count, i);
+			pr_emerg("map_count %d tree %d\n", mm->map_count, i);
 		bug = 1;
 	}
 	VM_BUG_ON_MM(bug, mm);
 }
 #else
-#define validate_mm_rb(root, ignore) do { } while (0)
 #define validate_mm(mm) do { } while (0)
 #endif
 
-RB_DECLARE_CALLBACKS(static, vma_gap_callbacks, struct vm_area_struct, vm_rb,
-		     unsigned long, rb_subtree_gap, vma_compute_subtree_gap)
-
 /*
- * Update augmented rbtree rb_subtree_gap values after vma->vm_start or
- * vma->vm_prev->vm_end values changed, without modifying the vma's position
- * in the rbtree.
+ * Link vma into, or unlink it from, the mm's vma tree.  mm_vt_seq lets
+ * speculative page faults, which look vmas up without mmap_sem, notice
+ * that the tree changed under them.
  */
-static void vma_gap_update(struct vm_area_struct *vma)
+static void vma_tree_link(struct mm_struct *mm, struct vm_area_struct *vma,
+			  struct vm_area_struct *prev)
 {
-	/*
-	 * As it turns out, RB_DECLARE_CALLBACKS() already created a callback
-	 * function that does exacltly what we want.
-	 */
-	vma_gap_callbacks_propagate(&vma->vm_rb, NULL);
-}
-
-static inline void vma_rb_insert(struct vm_area_struct *vma,
-				 struct rb_root *root)
-{
-	/* All rb_subtree_gap values must be consistent prior to insertion */
-	validate_mm_rb(root, NULL);
-
-	rb_insert_augmented(&vma->vm_rb, root, &vma_gap_callbacks);
-}
-
-static void __vma_rb_erase(struct vm_area_struct *vma, struct rb_root *root)
-{
-	/*
-	 * Note rb_erase_augmented is a fairly large inline function,
-	 * so make sure we instantiate it only once with our desired
-	 * augmented rbtree callbacks.
-	 */
-	rb_erase_augmented(&vma->vm_rb, root, &vma_gap_callbacks);
-}
-
-static __always_inline void vma_rb_erase_ignore(struct vm_area_struct *vma,
-						struct rb_root *root,
-						struct vm_area_struct *ignore)
-{
-	/*
-	 * All rb_subtree_gap values must be consistent prior to erase,
-	 * with the possible exception of the "next" vma being erased if
-	 * next->vm_start was reduced.
-	 */
-	validate_mm_rb(root, ignore);
-
-	__vma_rb_erase(vma, root);
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+	write_seqcount_begin(&mm->mm_vt_seq);
+#endif
+	vma_tree_insert(&mm->mm_vt, vma, prev);
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+	write_seqcount_end(&mm->mm_vt_seq);
+#endif
 }
 
-static __always_inline void vma_rb_erase(struct vm_area_struct *vma,
-					 struct rb_root *root)
+static void vma_tree_unlink(struct mm_struct *mm, struct vm_area_struct *vma)
 {
-	/*
-	 * All rb_subtree_gap values must be consistent prior to erase,
-	 * with the possible exception of the vma being erased.
-	 */
-	validate_mm_rb(root, vma);
-
-	__vma_rb_erase(vma, root);
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+	write_seqcount_begin(&mm->mm_vt_seq);
+#endif
+	vma_tree_erase(&mm->mm_vt, vma);
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+	write_seqcount_end(&mm->mm_vt_seq);
+#endif
 }
 
 /*
@@ -556,36 +461,20 @@ anon_vma_interval_tree_post_update_vma(struct vm_area_struct *vma)
  遍历该进程中所有的VMAs. 当检查到当前要映射的区域和己有的VMA 有些许的重叠时，	该函数都返回-ENOMEM ，
  */
 static int find_vma_links(struct mm_struct *mm, unsigned long addr,
-		unsigned long end, struct vm_area_struct **pprev,
-		struct rb_node ***rb_link, struct rb_node **rb_parent)
+		unsigned long end, struct vm_area_struct **pprev)
 {
-	struct rb_node **__rb_link, *__rb_parent, *rb_prev;
-
-	__rb_link = &mm->mm_rb.rb_node;
-	rb_prev = __rb_parent = NULL;
-
-	while (*__rb_link) {
-		struct vm_area_struct *vma_tmp;
-
-		__rb_parent = *__rb_link;
-		vma_tmp = rb_entry(__rb_parent, struct vm_area_struct, vm_rb);
+	struct vm_area_struct *vma;
 
-		if (vma_tmp->vm_end > addr) {
-			/* Fail if an existing vma overlaps the area */
-			if (vma_tmp->vm_start < end)
-				return -ENOMEM;
-			__rb_link = &__rb_parent->rb_left;
-		} else {
-			rb_prev = __rb_parent;
-			__rb_link = &__rb_parent->rb_right;
-		}
+	/* the first vma ending above addr is the only one that can overlap */
+	vma = vma_tree_find(&mm->mm_vt, addr);
+	if (vma) {
+		/* Fail if an existing vma overlaps the area */
+		if (vma->vm_start < end)
+			return -ENOMEM;
+		*pprev = vma->vm_prev;
+	} else {
+		*pprev = vma_tree_last(&mm->mm_vt);
 	}
-
-	*pprev = NULL;
-	if (rb_prev)
-		*pprev = rb_entry(rb_prev, struct vm_area_struct, vm_rb);
-	*rb_link = __rb_link;
-	*rb_parent = __rb_parent;
 	return 0;
 }
 
@@ -617,28 +506,19 @@ static unsigned long count_vma_pages_range(struct mm_struct *mm,
 	return nr_pages;
 }
 
-void __vma_link_rb(struct mm_struct *mm, struct vm_area_struct *vma,
-		struct rb_node **rb_link, struct rb_node *rb_parent)
+/*
+ * Insert vma, already on the mm's list, into the vma tree.  The caller
+ * must have done vma_tree_preload().
+ */
+void __vma_link_tree(struct mm_struct *mm, struct vm_area_struct *vma)
 {
+	vma_tree_link(mm, vma, vma->vm_prev);
+
 	/* Update tracking information for the gap following the new vma. */
 	if (vma->vm_next)
-		vma_gap_update(vma->vm_next);
+		vma_tree_update(vma->vm_next);
 	else
 		mm->highest_vm_end = vm_end_gap(vma);
-
-	/*
-	 * vma->vm_prev wasn't known when we followed the rbtree to find the
-	 * correct insertion point for that vma. As a result, we could not
-	 * update the vma vm_rb parents rb_subtree_gap values on the way down.
-	 * So, we first insert the vma with a zero rb_subtree_gap value
-	 * (to be consistent with what we did on the way down), and then
-	 * immediately update the gap to the correct value. Finally we
-	 * rebalance the rbtree after all augmented values have been set.
-	 */
-	rb_link_node(&vma->vm_rb, rb_parent, rb_link);
-	vma->rb_subtree_gap = 0;
-	vma_gap_update(vma);
-	vma_rb_insert(vma, &mm->mm_rb);
 }
 
 static void __vma_link_file(struct vm_area_struct *vma)
@@ -662,24 +542,26 @@ static void __vma_link_file(struct vm_area_struct *vma)
 
 static void
 __vma_link(struct mm_struct *mm, struct vm_area_struct *vma,
-	struct vm_area_struct *prev, struct rb_node **rb_link,
-	struct rb_node *rb_parent)
+	struct vm_area_struct *prev)
 {
 	/*
 	 * __vma_link_list()将新区域放置到进程管理区域
 	 * 的线性链表上。完成该工作，只需提供
 	 * 使用find_vma_prepare()找到的前一个和后一个区域。
 	 */
-	__vma_link_list(mm, vma, prev, rb_parent);
+	__vma_link_list(mm, vma, prev);
 	/*
-	 * __vma_link_rb()将新区域连接到红黑树的数据结构中
+	 * __vma_link_tree()将新区域连接到B树的数据结构中
 	 */
-	__vma_link_rb(mm, vma, rb_link, rb_parent);
+	__vma_link_tree(mm, vma);
 }
 
+/*
+ * The caller must have done vma_tree_preload(), where failing with
+ * -ENOMEM is still easy to unwind.
+ */
 static void vma_link(struct mm_struct *mm, struct vm_area_struct *vma,
-			struct vm_area_struct *prev, struct rb_node **rb_link,
-			struct rb_node *rb_parent)
+			struct vm_area_struct *prev)
 {
 	struct address_space *mapping = NULL;
 
@@ -688,8 +570,8 @@ static void vma_link(struct mm_struct *mm, struct vm_area_struct *vma,
 		i_mmap_lock_write(mapping);
 	}
 
-    /* 将vma插入到相应的数据结构中--双向链表，红黑树和匿名映射链表*/
-	__vma_link(mm, vma, prev, rb_link, rb_parent);
+    /* 将vma插入到相应的数据结构中--双向链表，B树和匿名映射链表*/
+	__vma_link(mm, vma, prev);
 	/*
 	 * __vma_link_file()将相关的address_space和映射(
 	 * 如果是文件映射)管理起来，并使用
@@ -707,17 +589,15 @@ static void vma_link(struct mm_struct *mm, struct vm_area_struct *vma,
 
 /*
  * Helper for vma_adjust() in the split_vma insert case: insert a vma into the
- * mm's list and rbtree.  It has already been inserted into the interval tree.
+ * mm's list and vma tree.  It has already been inserted into the interval tree.
  */
 static void __insert_vm_struct(struct mm_struct *mm, struct vm_area_struct *vma)
 {
 	struct vm_area_struct *prev;
-	struct rb_node **rb_link, *rb_parent;
 
-	if (find_vma_links(mm, vma->vm_start, vma->vm_end,
-			   &prev, &rb_link, &rb_parent))
+	if (find_vma_links(mm, vma->vm_start, vma->vm_end, &prev))
 		BUG();
-	__vma_link(mm, vma, prev, rb_link, rb_parent);
+	__vma_link(mm, vma, prev);
 	mm->map_count++;
 }
 
@@ -729,12 +609,11 @@ static void __insert_vm_struct(struct mm_struct *mm, struct vm_area_struct *vma)
 static __always_inline void __vma_unlink_common(struct mm_struct *mm,
 						struct vm_area_struct *vma,
 						struct vm_area_struct *prev,
-						bool has_prev,
-						struct vm_area_struct *ignore)
+						bool has_prev)
 {
 	struct vm_area_struct *next;
 
-	vma_rb_erase_ignore(vma, &mm->mm_rb, ignore);
+	vma_tree_unlink(mm, vma);
 	next = vma->vm_next;
 	if (has_prev)
 		prev->vm_next = next;
@@ -756,7 +635,7 @@ static inline void __vma_unlink_prev(struct mm_struct *mm,
 				     struct vm_area_struct *vma,
 				     struct vm_area_struct *prev)
 {
-	__vma_unlink_common(mm, vma, prev, true, vma);
+	__vma_unlink_common(mm, vma, prev, true);
 }
 
 /*
@@ -773,6 +652,7 @@ int __vma_adjust(struct vm_area_struct *vma, unsigned long start,
 {
 	struct mm_struct *mm = vma->vm_mm;
 	struct vm_area_struct *next = vma->vm_next, *orig_vma = vma;
+	struct vm_area_struct *seq_next;
 	struct address_space *mapping = NULL;
 	struct rb_root_cached *root = NULL;
 	struct anon_vma *anon_vma = NULL;
@@ -781,6 +661,10 @@ int __vma_adjust(struct vm_area_struct *vma, unsigned long start,
 	long adjust_next = 0;
 	int remove_next = 0;
 
+	/* split_vma() inserts into the vma tree under the rmap locks */
+	if (insert && vma_tree_preload(&mm->mm_vt, GFP_KERNEL))
+		return -ENOMEM;
+
 	if (next && !insert) {
 		struct vm_area_struct *exporter = NULL, *importer = NULL;
 
@@ -866,6 +750,12 @@ int __vma_adjust(struct vm_area_struct *vma, unsigned long start,
 				return error;
 		}
 	}
+
+	/* let speculative faults on vma and next know they are changing */
+	vm_write_begin(vma);
+	seq_next = next;
+	if (seq_next)
+		vm_write_begin(seq_next);
 again:
 	vma_adjust_trans_huge(orig_vma, start, end, adjust_next);
 
@@ -923,6 +813,11 @@ again:
 		next->vm_start += adjust_next << PAGE_SHIFT;
 		next->vm_pgoff += adjust_next;
 	}
+	/* vm_end is the key in the vma tree, refresh it before linking insert */
+	if (start_changed || end_changed)
+		vma_tree_update(vma);
+	if (adjust_next)
+		vma_tree_update(next);
 
 	if (root) {
 		if (adjust_next) //如果后驱vma被调整了，则重新插入到优先树中
@@ -943,12 +838,11 @@ again:
 			 * vma is not before next if they've been
 			 * swapped.
 			 *
-			 * pre-swap() next->vm_start was reduced so
-			 * tell validate_mm_rb to ignore pre-swap()
-			 * "next" (which is stored in post-swap()
-			 * "vma").
+			 * pre-swap() next->vm_start was reduced, the
+			 * tree is told where to erase it from by the
+			 * vma itself rather than by its address.
 			 */
-			__vma_unlink_common(mm, next, NULL, false, vma);
+			__vma_unlink_common(mm, next, NULL, false);
 		if (file) //将后驱vma从文件对应的address space中删除
 			__remove_shared_vm_struct(next, file, mapping);
 	} else if (insert) {
@@ -959,13 +853,11 @@ again:
 		 */
 		__insert_vm_struct(mm, insert); //将待插入的vma插入mm的红黑树，双向链表以及匿名映射链表
 	} else {
-		if (start_changed)
-			vma_gap_update(vma);
 		if (end_changed) {
 			if (!next)
 				mm->highest_vm_end = vm_end_gap(vma);
 			else if (!adjust_next)
-				vma_gap_update(next);
+				vma_tree_update(next);
 		}
 	}
 
@@ -986,15 +878,14 @@ again:
 	}
 
 	if (remove_next) {
-		if (file) {
+		if (file)
 			uprobe_munmap(next, next->vm_start, next->vm_end);
-			fput(file);
-		}
 		if (next->anon_vma)
 			anon_vma_merge(vma, next);
 		mm->map_count--;
-		mpol_put(vma_policy(next));
-		vm_area_free(next);
+		vm_write_end(next);
+		seq_next = NULL;
+		put_vma(next);
 		/*
 		 * In mprotect's case 6 (see comments on vma_merge),
 		 * we must remove another next too. It would clutter
@@ -1024,10 +915,12 @@ again:
 		if (remove_next == 2) {
 			remove_next = 1;
 			end = next->vm_end;
+			seq_next = next;
+			vm_write_begin(seq_next);
 			goto again;
 		}
 		else if (next)
-			vma_gap_update(next);
+			vma_tree_update(next);
 		else {
 			/*
 			 * If remove_next == 2 we obviously can't
@@ -1054,6 +947,10 @@ again:
 	if (insert && file)
 		uprobe_mmap(insert);
 
+	if (seq_next)
+		vm_write_end(seq_next);
+	vm_write_end(vma);
+
 	validate_mm(mm);
 
 	return 0;
@@ -1920,7 +1817,6 @@ unsigned long mmap_region(struct file *file, unsigned long addr,
 	struct mm_struct *mm = current->mm;
 	struct vm_area_struct *vma, *prev;
 	int error;
-	struct rb_node **rb_link, *rb_parent;
 	unsigned long charged = 0;
 
 	/* Check against address space limit. */
@@ -1940,10 +1836,9 @@ unsigned long mmap_region(struct file *file, unsigned long addr,
 
 	/* Clear old maps */
 	/**
-	 * find_vma_links确定处于新区间前的线性区对象的位置，以及在红黑树中新线性区的位置。
+	 * find_vma_links确定处于新区间前的线性区对象的位置。
 	 */
-	while (find_vma_links(mm, addr, addr + len, &prev, &rb_link,
-			      &rb_parent)) {
+	while (find_vma_links(mm, addr, addr + len, &prev)) {
 /*
 		把这段将要映射区域先销毁，然后重新映射
 */
@@ -1977,6 +1872,12 @@ unsigned long mmap_region(struct file *file, unsigned long addr,
 	if (vma)
 		goto out;
 
+	/* nodes for vma_link() below, nothing to undo yet */
+	if (vma_tree_preload(&mm->mm_vt, GFP_KERNEL)) {
+		error = -ENOMEM;
+		goto unacct_error;
+	}
+
 	/*
 	 * Determine the object being mapped and call the appropriate
 	 * specific mapper. the address has already been validated, but
@@ -2044,7 +1945,7 @@ unsigned long mmap_region(struct file *file, unsigned long addr,
 		 *
 		 * Answer: Yes, several device drivers can do it in their
 		 *         f_op->mmap method. -DaveM
-		 * Bug: If addr is changed, prev, rb_link, rb_parent should
+		 * Bug: If addr is changed, prev should
 		 *      be updated for vma_link()
 		 */
 		WARN_ON_ONCE(addr != vma->vm_start);
@@ -2064,9 +1965,9 @@ unsigned long mmap_region(struct file *file, unsigned long addr,
 	}
 
 	/**
-	 * vma_link将新线性区插入到线性区链表和红黑树中。
+	 * vma_link将新线性区插入到线性区链表和B树中。
 	 */
-	vma_link(mm, vma, prev, rb_link, rb_parent);
+	vma_link(mm, vma, prev);
 	/* Once vma denies write, undo our temporary denial count */
 	if (file) {
 		if (vm_flags & VM_SHARED)
@@ -2134,7 +2035,7 @@ unacct_error:
 unsigned long unmapped_area(struct vm_unmapped_area_info *info)
 {
 	/*
-	 * We implement the search by looking for an rbtree node that
+	 * We implement the search by looking for a vma in the vma tree that
 	 * immediately follows a suitable gap. That is,
 	 * - gap_start = vma->vm_prev->vm_end <= info->high_limit - length;
 	 * - gap_end   = vma->vm_start        >= info->low_limit  + length;
@@ -2159,63 +2060,17 @@ unsigned long unmapped_area(struct vm_unmapped_area_info *info)
 		return -ENOMEM;
 	low_limit = info->low_limit + length;
 
-	/* Check if rbtree root looks promising */
-	if (RB_EMPTY_ROOT(&mm->mm_rb))
-		goto check_highest;
-	vma = rb_entry(mm->mm_rb.rb_node, struct vm_area_struct, vm_rb);
-	if (vma->rb_subtree_gap < length)
-		goto check_highest;
-
-	while (true) {
-		/* Visit left subtree if it looks promising */
-		gap_end = vm_start_gap(vma);
-		if (gap_end >= low_limit && vma->vm_rb.rb_left) {
-			struct vm_area_struct *left =
-				rb_entry(vma->vm_rb.rb_left,
-					 struct vm_area_struct, vm_rb);
-			if (left->rb_subtree_gap >= length) {
-				vma = left;
-				continue;
-			}
-		}
-
+	/* Find the lowest vma following a suitable gap */
+	vma = vma_tree_gap_up(&mm->mm_vt, length, low_limit, high_limit);
+	if (IS_ERR(vma))
+		return -ENOMEM;
+	if (vma) {
 		gap_start = vma->vm_prev ? vm_end_gap(vma->vm_prev) : 0;
-check_current:
-		/* Check if current node has a suitable gap */
-		if (gap_start > high_limit)
-			return -ENOMEM;
-		if (gap_end >= low_limit &&
-		    gap_end > gap_start && gap_end - gap_start >= length)
-			goto found;
-
-		/* Visit right subtree if it looks promising */
-		if (vma->vm_rb.rb_right) {
-			struct vm_area_struct *right =
-				rb_entry(vma->vm_rb.rb_right,
-					 struct vm_area_struct, vm_rb);
-			if (right->rb_subtree_gap >= length) {
-				vma = right;
-				continue;
-			}
-		}
-
-		/* Go back up the rbtree to find next candidate node */
-		while (true) {
-			struct rb_node *prev = &vma->vm_rb;
-			if (!rb_parent(prev))
-				goto check_highest;
-			vma = rb_entry(rb_parent(prev),
-				       struct vm_area_struct, vm_rb);
-			if (prev == vma->vm_rb.rb_left) {
-				gap_start = vm_end_gap(vma->vm_prev);
-				gap_end = vm_start_gap(vma);
-				goto check_current;
-			}
-		}
+		gap_end = vm_start_gap(vma);
+		goto found;
 	}
 
-check_highest:
-	/* Check highest gap, which does not precede any rbtree node */
+	/* Check highest gap, which does not precede any vma */
 	gap_start = mm->highest_vm_end;
 	gap_end = ULONG_MAX;  /* Only for VM_BUG_ON below */
 	if (gap_start > high_limit)
@@ -2258,65 +2113,17 @@ unsigned long unmapped_area_topdown(struct vm_unmapped_area_info *info)
 		return -ENOMEM;
 	low_limit = info->low_limit + length;
 
-	/* Check highest gap, which does not precede any rbtree node */
+	/* Check highest gap, which does not precede any vma */
 	gap_start = mm->highest_vm_end;
 	if (gap_start <= high_limit)
 		goto found_highest;
 
-	/* Check if rbtree root looks promising */
-	if (RB_EMPTY_ROOT(&mm->mm_rb))
+	/* Find the highest vma following a suitable gap */
+	vma = vma_tree_gap_down(&mm->mm_vt, length, low_limit, high_limit);
+	if (IS_ERR_OR_NULL(vma))
 		return -ENOMEM;
-	vma = rb_entry(mm->mm_rb.rb_node, struct vm_area_struct, vm_rb);
-	if (vma->rb_subtree_gap < length)
-		return -ENOMEM;
-
-	while (true) {
-		/* Visit right subtree if it looks promising */
-		gap_start = vma->vm_prev ? vm_end_gap(vma->vm_prev) : 0;
-		if (gap_start <= high_limit && vma->vm_rb.rb_right) {
-			struct vm_area_struct *right =
-				rb_entry(vma->vm_rb.rb_right,
-					 struct vm_area_struct, vm_rb);
-			if (right->rb_subtree_gap >= length) {
-				vma = right;
-				continue;
-			}
-		}
-
-check_current:
-		/* Check if current node has a suitable gap */
-		gap_end = vm_start_gap(vma);
-		if (gap_end < low_limit)
-			return -ENOMEM;
-		if (gap_start <= high_limit &&
-		    gap_end > gap_start && gap_end - gap_start >= length)
-			goto found;
-
-		/* Visit left subtree if it looks promising */
-		if (vma->vm_rb.rb_left) {
-			struct vm_area_struct *left =
-				rb_entry(vma->vm_rb.rb_left,
-					 struct vm_area_struct, vm_rb);
-			if (left->rb_subtree_gap >= length) {
-				vma = left;
-				continue;
-			}
-		}
-
-		/* Go back up the rbtree to find next candidate node */
-		while (true) {
-			struct rb_node *prev = &vma->vm_rb;
-			if (!rb_parent(prev))
-				return -ENOMEM;
-			vma = rb_entry(rb_parent(prev),
-				       struct vm_area_struct, vm_rb);
-			if (prev == vma->vm_rb.rb_right) {
-				gap_start = vma->vm_prev ?
-					vm_end_gap(vma->vm_prev) : 0;
-				goto check_current;
-			}
-		}
-	}
+	gap_start = vma->vm_prev ? vm_end_gap(vma->vm_prev) : 0;
+	gap_end = vm_start_gap(vma);
 
 found:
 	/* We found a suitable gap. Clip it with the original high_limit. */
@@ -2546,7 +2353,6 @@ EXPORT_SYMBOL(get_unmapped_area);
  */
 struct vm_area_struct *find_vma(struct mm_struct *mm, unsigned long addr)
 {
-	struct rb_node *rb_node;
 	struct vm_area_struct *vma;
 
 	/* Check the cache first. */
@@ -2557,35 +2363,8 @@ struct vm_area_struct *find_vma(struct mm_struct *mm, unsigned long addr)
 	if (likely(vma))
 		return vma;
 
-	rb_node = mm->mm_rb.rb_node;
-
-	/* 遍历红黑树 */
-	while (rb_node) {
-		struct vm_area_struct *tmp;
-
-		/* 从红黑树的节点找到对应的VMA结构 */
-		tmp = rb_entry(rb_node, struct vm_area_struct, vm_rb);
-
-		if (tmp->vm_end > addr) {
-/*
-		如果当前区域结束地址大于目标地址，则从左子结点开始
-*/
-			vma = tmp;
-
-			if (tmp->vm_start <= addr)
-			/**
-			 * 当前线性区包含addr,退出循环并返回vma.
-			 */
-				break;
-				
-			/* 节点所在区域太多，移动到左边继续查找, 在左子树中继续 */
-			rb_node = rb_node->rb_left;
-		} else
-/*
-		如果当前区域的结束地址小于等于目标地址，则从右子结点开始
-*/
-			rb_node = rb_node->rb_right;
-	}
+	/* 在B树中查找第一个结束地址大于addr的VMA */
+	vma = vma_tree_find(&mm->mm_vt, addr);
 
 	/**
 	 * 因为下一次find_vma()调用搜索同一个区域中临近地址的可能性很高
@@ -2611,16 +2390,10 @@ find_vma_prev(struct mm_struct *mm, unsigned long addr,
 	struct vm_area_struct *vma;
 
 	vma = find_vma(mm, addr);
-	if (vma) {
+	if (vma)
 		*pprev = vma->vm_prev;
-	} else {
-		struct rb_node *rb_node = mm->mm_rb.rb_node;
-		*pprev = NULL;
-		while (rb_node) {
-			*pprev = rb_entry(rb_node, struct vm_area_struct, vm_rb);
-			rb_node = rb_node->rb_right;
-		}
-	}
+	else
+		*pprev = vma_tree_last(&mm->mm_vt);
 	return vma;
 }
 
@@ -2729,7 +2502,7 @@ int expand_upwards(struct vm_area_struct *vma, unsigned long address)
 			error = acct_stack_growth(vma, size, grow);
 			if (!error) {
 				/*
-				 * vma_gap_update() doesn't support concurrent
+				 * vma_tree_update() doesn't support concurrent
 				 * updates, but we only hold a shared mmap_sem
 				 * lock here, so we need to protect against
 				 * concurrent vma expansions.
@@ -2744,10 +2517,13 @@ int expand_upwards(struct vm_area_struct *vma, unsigned long address)
 					mm->locked_vm += grow;
 				vm_stat_account(mm, vma->vm_flags, grow);
 				anon_vma_interval_tree_pre_update_vma(vma);
+				vm_write_begin(vma);
 				vma->vm_end = address;
+				vm_write_end(vma);
 				anon_vma_interval_tree_post_update_vma(vma);
+				vma_tree_update(vma);
 				if (vma->vm_next)
-					vma_gap_update(vma->vm_next);
+					vma_tree_update(vma->vm_next);
 				else
 					mm->highest_vm_end = vm_end_gap(vma);
 				spin_unlock(&mm->page_table_lock);
@@ -2809,7 +2585,7 @@ int expand_downwards(struct vm_area_struct *vma,
 			error = acct_stack_growth(vma, size, grow);
 			if (!error) {
 				/*
-				 * vma_gap_update() doesn't support concurrent
+				 * vma_tree_update() doesn't support concurrent
 				 * updates, but we only hold a shared mmap_sem
 				 * lock here, so we need to protect against
 				 * concurrent vma expansions.
@@ -2824,10 +2600,12 @@ int expand_downwards(struct vm_area_struct *vma,
 					mm->locked_vm += grow;
 				vm_stat_account(mm, vma->vm_flags, grow);
 				anon_vma_interval_tree_pre_update_vma(vma);
+				vm_write_begin(vma);
 				vma->vm_start = address;
 				vma->vm_pgoff -= grow;
+				vm_write_end(vma);
 				anon_vma_interval_tree_post_update_vma(vma);
-				vma_gap_update(vma);
+				vma_tree_update(vma);
 				spin_unlock(&mm->page_table_lock);
 
 				perf_event_mmap(vma);
@@ -2924,21 +2702,29 @@ EXPORT_SYMBOL_GPL(find_extend_vma);
  *
  * Called with the mm semaphore held.
  */
-static void remove_vma_list(struct mm_struct *mm, struct vm_area_struct *vma)
+static void unaccount_vma_list(struct mm_struct *mm,
+			       struct vm_area_struct *vma)
 {
 	unsigned long nr_accounted = 0;
 
 	/* Update high watermark before we lower total_vm */
 	update_hiwater_vm(mm);
-	do {
+	for (; vma; vma = vma->vm_next) {
 		long nrpages = vma_pages(vma);
 
 		if (vma->vm_flags & VM_ACCOUNT)
 			nr_accounted += nrpages;
 		vm_stat_account(mm, vma->vm_flags, -nrpages);
+	}
+	vm_unacct_memory(nr_accounted);
+}
+
+static void remove_vma_list(struct mm_struct *mm, struct vm_area_struct *vma)
+{
+	unaccount_vma_list(mm, vma);
+	do {
 		vma = remove_vma(vma);
 	} while (vma);
-	vm_unacct_memory(nr_accounted);
 	validate_mm(mm);
 }
 
@@ -3007,7 +2793,10 @@ detach_vmas_to_be_unmapped(struct mm_struct *mm, struct vm_area_struct *vma,
 	insertion_point = (prev ? &prev->vm_next : &mm->mmap);
 	vma->vm_prev = NULL;
 	do {
-		vma_rb_erase(vma, &mm->mm_rb);
+		/* invalidate speculative faults already past the lookup */
+		vm_write_begin(vma);
+		vma_tree_unlink(mm, vma);
+		vm_write_end(vma);
 		mm->map_count--;
 		tail_vma = vma;
 		vma = vma->vm_next;
@@ -3015,7 +2804,7 @@ detach_vmas_to_be_unmapped(struct mm_struct *mm, struct vm_area_struct *vma,
 	*insertion_point = vma;
 	if (vma) {
 		vma->vm_prev = prev;
-		vma_gap_update(vma);
+		vma_tree_update(vma);
 	} else
 		mm->highest_vm_end = prev ? vm_end_gap(prev) : 0;
 	tail_vma->vm_next = NULL;
@@ -3135,11 +2924,316 @@ int split_vma(struct mm_struct *mm, struct vm_area_struct *vma,
  * start-要删除的地址区间的起始地址。
  * len-要删除的长度。
  */
+/*
+ * Asynchronous teardown.
+ *
+ * Zapping the page tables of a large mapping, or of a whole address space
+ * on exit, can keep the caller busy for hundreds of milliseconds.  An mm
+ * that opted in with PR_SET_ASYNC_TEARDOWN hands the work to a per-node
+ * worker instead:
+ *  - munmap() and brk() detach the vmas and, with mmap_sem still held for
+ *    write, the PTE tables lying wholly inside the range.  The edges and
+ *    any huge pmds are zapped synchronously under the read lock as usual;
+ *    the worker frees the pages of the detached tables, the tables and
+ *    the vmas without mmap_sem.  Only anonymous ranges are deferred: the
+ *    pages of a file would stay mapped where truncation cannot find them.
+ *  - exit_mmap() pins the mm and leaves the unmap to the worker.
+ * Only teardowns freeing at least ASYNC_TEARDOWN_MIN_PAGES anonymous pages
+ * are deferred.  What is still waiting to be freed counts as available
+ * memory, and the page allocator waits for it before going for the OOM
+ * killer.
+ *
+ * Each node has one job list drained by one work item on an unbound
+ * workqueue, so the zapping runs on the CPUs next to the memory it frees
+ * and a burst of exits cannot occupy more than a worker per node.
+ */
+#define ASYNC_TEARDOWN_MIN_PAGES	(SZ_16M >> PAGE_SHIFT)
+
+struct teardown_job {
+	struct list_head list;			/* teardown_node->jobs */
+	struct mm_struct *mm;
+	struct vm_area_struct *vma;		/* detached by munmap */
+	unsigned long start, end;
+	struct detached_pte_table *tables;
+	unsigned long nr_tables;
+	unsigned long nr_pages;			/* anon pages to be freed */
+	int nid;				/* or NUMA_NO_NODE */
+};
+
+struct teardown_node {
+	spinlock_t lock;
+	struct list_head jobs;
+	struct work_struct work;
+};
+
+static struct workqueue_struct *teardown_wq __read_mostly;
+static struct teardown_node *teardown_nodes[MAX_NUMNODES] __read_mostly;
+static atomic_long_t teardown_pending = ATOMIC_LONG_INIT(0);
+static DECLARE_WAIT_QUEUE_HEAD(teardown_wait);
+
+static void exit_mmap_vmas(struct mm_struct *mm);
+
+/* prctl(PR_SET_ASYNC_TEARDOWN, enable) */
+int set_async_teardown(struct mm_struct *mm, bool enable)
+{
+	if (!teardown_wq)
+		return -ENOMEM;
+	WRITE_ONCE(mm->async_teardown, enable);
+	return 0;
+}
+
+unsigned long async_teardown_pending(void)
+{
+	return atomic_long_read(&teardown_pending);
+}
+
+/*
+ * Called by the page allocator before it declares OOM.  Returns true if
+ * some of the pending teardown completed in the meantime.
+ */
+bool wait_for_async_teardown(void)
+{
+	long pending = atomic_long_read(&teardown_pending);
+
+	/* a teardown worker must not wait for itself */
+	if (!pending || (current->flags & PF_WQ_WORKER))
+		return false;
+
+	return wait_event_timeout(teardown_wait,
+			atomic_long_read(&teardown_pending) < pending, HZ / 10);
+}
+
+/* The munmap side of a job, see teardown_detach_range() */
+static void teardown_job_unmap(struct teardown_job *job)
+{
+	struct mm_struct *mm = job->mm;
+	struct vm_area_struct *vma = job->vma;
+	struct mmu_gather tlb;
+	unsigned long i;
+
+	lru_add_drain();
+	tlb_gather_mmu(&tlb, mm, job->start, job->end);
+	for (i = 0; i < job->nr_tables; i++) {
+		while (vma->vm_end <= job->tables[i].addr && vma->vm_next)
+			vma = vma->vm_next;
+		zap_detached_pte_table(&tlb, vma, &job->tables[i]);
+		cond_resched();
+	}
+
+	/* waits for rmap walkers still looking at a detached table */
+	for (vma = job->vma; vma; vma = vma->vm_next)
+		unlink_anon_vmas(vma);
+
+	for (i = 0; i < job->nr_tables; i++) {
+		pte_free_tlb(&tlb, job->tables[i].table, job->tables[i].addr);
+		mm_dec_nr_ptes(mm);
+	}
+	tlb_finish_mmu(&tlb, job->start, job->end);
+
+	vma = job->vma;
+	do {
+		vma = remove_vma(vma);
+	} while (vma);
+	kvfree(job->tables);
+	mmput(mm);
+}
+
+static void teardown_job_run(struct teardown_job *job)
+{
+	struct mm_struct *mm = job->mm;
+
+	if (job->vma) {
+		teardown_job_unmap(job);
+	} else {
+		exit_mmap_vmas(mm);
+		mmdrop(mm);
+	}
+
+	atomic_long_sub(job->nr_pages, &teardown_pending);
+	wake_up_all(&teardown_wait);
+	kfree(job);
+}
+
+static void teardown_node_workfn(struct work_struct *work)
+{
+	struct teardown_node *tn = container_of(work, struct teardown_node, work);
+	struct teardown_job *job;
+
+	spin_lock(&tn->lock);
+	while (!list_empty(&tn->jobs)) {
+		job = list_first_entry(&tn->jobs, struct teardown_job, list);
+		list_del(&job->list);
+		spin_unlock(&tn->lock);
+
+		teardown_job_run(job);
+		cond_resched();
+
+		spin_lock(&tn->lock);
+	}
+	spin_unlock(&tn->lock);
+}
+
+static inline bool teardown_wanted(struct mm_struct *mm,
+				   unsigned long nr_pages)
+{
+	return READ_ONCE(mm->async_teardown) && teardown_wq &&
+	       nr_pages >= ASYNC_TEARDOWN_MIN_PAGES;
+}
+
+/*
+ * Returns a job if freeing @nr_pages of @mm is worth deferring, NULL if
+ * the caller should do the teardown synchronously.
+ */
+static struct teardown_job *teardown_job_alloc(struct mm_struct *mm,
+					       unsigned long nr_pages, int nid)
+{
+	struct teardown_job *job;
+
+	if (nr_pages < ASYNC_TEARDOWN_MIN_PAGES)
+		return NULL;
+
+	job = kmalloc(sizeof(*job), GFP_KERNEL | __GFP_NOWARN);
+	if (!job)
+		return NULL;
+	job->mm = mm;
+	job->vma = NULL;
+	job->tables = NULL;
+	job->nr_tables = 0;
+	job->nr_pages = nr_pages;
+	job->nid = nid;
+	return job;
+}
+
+/*
+ * Called with mmap_sem held for write and the range split off but still
+ * attached, @vma being its first vma.  The anonymous pages are estimated
+ * from the size of the vmas, capped by what the mm has mapped.
+ */
+static struct teardown_job *teardown_job_alloc_range(struct mm_struct *mm,
+						     struct vm_area_struct *vma,
+						     unsigned long start,
+						     unsigned long end)
+{
+	unsigned long nr_pages = 0, nr_tables;
+	struct teardown_job *job;
+
+	for (; vma && vma->vm_start < end; vma = vma->vm_next) {
+		if (!vma_is_anonymous(vma))
+			return NULL;
+		nr_pages += vma_pages(vma);
+	}
+	nr_pages = min_t(unsigned long, nr_pages,
+			 get_mm_counter(mm, MM_ANONPAGES));
+
+	/* the tables wholly inside the range, at most */
+	if (ALIGN(start, PMD_SIZE) >= end)
+		return NULL;
+	nr_tables = (end - ALIGN(start, PMD_SIZE)) >> PMD_SHIFT;
+	if (!nr_tables)
+		return NULL;
+
+	job = teardown_job_alloc(mm, nr_pages, NUMA_NO_NODE);
+	if (!job)
+		return NULL;
+	job->tables = kvmalloc_array(nr_tables, sizeof(*job->tables),
+				     GFP_KERNEL | __GFP_NOWARN);
+	if (!job->tables) {
+		kfree(job);
+		return NULL;
+	}
+	return job;
+}
+
+/*
+ * Takes the PTE tables wholly inside [start, end) out of the mm for the
+ * worker and zaps the rest of the range.  @vma is the list detached from
+ * the mm, and mmap_sem is held for write.  Leaves mmap_sem downgraded to
+ * read if @downgrade.
+ */
+static void teardown_detach_range(struct teardown_job *job,
+				  struct vm_area_struct *vma,
+				  struct vm_area_struct *prev,
+				  unsigned long start, unsigned long end,
+				  bool downgrade)
+{
+	struct mm_struct *mm = job->mm;
+	struct vm_area_struct *next = prev ? prev->vm_next : mm->mmap;
+	struct mmu_gather tlb;
+
+	job->vma = vma;
+	job->start = start;
+	job->end = end;
+	job->nr_tables = detach_pte_tables(mm, start, end, job->tables);
+	/* before anyone can map the range again */
+	flush_tlb_range(vma, start, end);
+	mmu_notifier_invalidate_range(mm, start, end);
+
+	if (downgrade)
+		downgrade_write(&mm->mmap_sem);
+
+	lru_add_drain();
+	tlb_gather_mmu(&tlb, mm, start, end);
+	update_hiwater_rss(mm);
+	unmap_vmas(&tlb, vma, start, end);
+	/* the vmas stay on their anon_vmas until the worker is done */
+	free_pgd_range(&tlb, start, end,
+		       prev ? prev->vm_end : FIRST_USER_ADDRESS,
+		       next ? next->vm_start : USER_PGTABLES_CEILING);
+	tlb_finish_mmu(&tlb, start, end);
+
+	unaccount_vma_list(mm, vma);
+	validate_mm(mm);
+}
+
+static void teardown_job_queue(struct teardown_job *job)
+{
+	struct teardown_node *tn;
+	int nid = job->nid;
+
+	if (nid == NUMA_NO_NODE || !node_online(nid))
+		nid = numa_node_id();
+	tn = teardown_nodes[nid];
+
+	atomic_long_add(job->nr_pages, &teardown_pending);
+	spin_lock(&tn->lock);
+	list_add_tail(&job->list, &tn->jobs);
+	spin_unlock(&tn->lock);
+	queue_work_node(nid, teardown_wq, &tn->work);
+}
+
+static int __init async_teardown_init(void)
+{
+	struct teardown_node *tn;
+	int nid;
+
+	for_each_node(nid) {
+		tn = kzalloc_node(sizeof(*tn), GFP_KERNEL,
+				  node_online(nid) ? nid : NUMA_NO_NODE);
+		if (!tn)
+			return 0;
+		spin_lock_init(&tn->lock);
+		INIT_LIST_HEAD(&tn->jobs);
+		INIT_WORK(&tn->work, teardown_node_workfn);
+		teardown_nodes[nid] = tn;
+	}
+
+	/* reclaim may wait on the workers, so they need a rescuer */
+	teardown_wq = alloc_workqueue("mm_teardown",
+				      WQ_UNBOUND | WQ_MEM_RECLAIM, 0);
+	return 0;
+}
+subsys_initcall(async_teardown_init);
+
+/*
+ * Returns 0 or an error with mmap_sem still held for write, or 1 if
+ * @downgrade was set and mmap_sem was downgraded to read.
+ */
 int __do_munmap(struct mm_struct *mm, unsigned long start, size_t len,
 		struct list_head *uf, bool downgrade)
 {
 	unsigned long end;
 	struct vm_area_struct *vma, *prev, *last;
+	struct teardown_job *job = NULL;
 
 	/**
 	 * 初步检查：线性区地址不能大于TASK_SIZE，start必须是4096的整数倍。
@@ -3268,7 +3362,12 @@ int __do_munmap(struct mm_struct *mm, unsigned long start, size_t len,
 		}
 	}
 
-	/* Detach vmas from rbtree */
+	/* userfaultfd expects the range gone once it reports the unmap */
+	if (downgrade && (!uf || list_empty(uf)) &&
+	    teardown_wanted(mm, len >> PAGE_SHIFT))
+		job = teardown_job_alloc_range(mm, vma, start, end);
+
+	/* Detach vmas from the vma tree */
 	/*
 	 * 调用detach_vmas_to_be_unmapped()，列出所有需要解除映射
 	 * 的区域。由于解除映射操作可能设计地址空间中的任何区域，
@@ -3283,8 +3382,16 @@ int __do_munmap(struct mm_struct *mm, unsigned long start, size_t len,
 	 */
 	arch_unmap(mm, vma, start, end);
 
+	if (job) {
+		teardown_detach_range(job, vma, prev, start, end, downgrade);
+		mmget(mm);
+		teardown_job_queue(job);
+		return 1;
+	}
+
 	if (downgrade)
 		downgrade_write(&mm->mmap_sem);
+
 	/*
 	 * 调用unmap_region()从页表删除与映射相关的所有项。
 	 * 完成后，内核还必须确保将相关的项从TLB移除或使之无效。
@@ -3460,7 +3567,6 @@ static int do_brk_flags(unsigned long addr, unsigned long len, unsigned long fla
 {
 	struct mm_struct *mm = current->mm;
 	struct vm_area_struct *vma, *prev;
-	struct rb_node **rb_link, *rb_parent;
 	pgoff_t pgoff = addr >> PAGE_SHIFT;
 	int error;
 
@@ -3486,13 +3592,11 @@ static int do_brk_flags(unsigned long addr, unsigned long len, unsigned long fla
 	 * Clear old maps.  this also does some error checking for us
 	 */
 /*
-	循环遍历用户进程红黑树中的VMAs，然后根据addr来查找最合适插入到红黑树的节点，
-	最终 rb_link 指针指向最合适节点的 rb_left 或 rb_right 指针本身的地址。
-	返回0 表示寻找到最合适插入的节点，
+	在用户进程的VMA B树中根据addr查找新区域的前一个VMA，
+	返回0 表示找到了插入的位置，
 	返回-ENOMEM 表示和现有的VMA 重叠，这时会调用do_munmap函数来释放这段重叠的空间。	 
 */
-	while (find_vma_links(mm, addr, addr + len, &prev, &rb_link,
-			      &rb_parent)) {
+	while (find_vma_links(mm, addr, addr + len, &prev)) {
 		if (do_munmap(mm, addr, len, uf))
 			return -ENOMEM;
 	}
@@ -3519,7 +3623,9 @@ static int do_brk_flags(unsigned long addr, unsigned long len, unsigned long fla
 	/*
 	 * create a vma struct for an anonymous mapping
 	 */
-	vma = vm_area_alloc(mm);
+	vma = NULL;
+	if (!vma_tree_preload(&mm->mm_vt, GFP_KERNEL))
+		vma = vm_area_alloc(mm);
 	if (!vma) {
 		vm_unacct_memory(len >> PAGE_SHIFT);
 		return -ENOMEM;
@@ -3535,7 +3641,7 @@ static int do_brk_flags(unsigned long addr, unsigned long len, unsigned long fla
 	新创建的VMA 需要加入到mm->mmap 链表和红黑树中, 
 	vma link 函数实现这个功能，该函数之前已经阅读过
 */
-	vma_link(mm, vma, prev, rb_link, rb_parent);
+	vma_link(mm, vma, prev);
 out:
 	perf_event_mmap(vma);
 	mm->total_vm += len >> PAGE_SHIFT;
@@ -3587,12 +3693,40 @@ int vm_brk(unsigned long addr, unsigned long len)
 }
 EXPORT_SYMBOL(vm_brk);
 
+/* Unmap and free all the vmas of a dead mm. */
+static void exit_mmap_vmas(struct mm_struct *mm)
+{
+	struct mmu_gather tlb;
+	struct vm_area_struct *vma = mm->mmap;
+	unsigned long nr_accounted = 0;
+
+	lru_add_drain();
+	flush_cache_mm(mm);
+	tlb_gather_mmu(&tlb, mm, 0, -1);
+	/* update_hiwater_rss(mm) here? but nobody should be looking */
+	/* Use -1 here to ensure all VMAs in the mm are unmapped */
+	unmap_vmas(&tlb, vma, 0, -1);
+	free_pgtables(&tlb, vma, FIRST_USER_ADDRESS, USER_PGTABLES_CEILING);
+	tlb_finish_mmu(&tlb, 0, -1);
+
+	/*
+	 * Walk the list again, actually closing and freeing it,
+	 * with preemption enabled, without holding any MM locks.
+	 */
+	while (vma) {
+		if (vma->vm_flags & VM_ACCOUNT)
+			nr_accounted += vma_pages(vma);
+		vma = remove_vma(vma);
+	}
+	vm_unacct_memory(nr_accounted);
+	vma_tree_destroy(&mm->mm_vt);
+}
+
 /* Release all mmaps. */
 void exit_mmap(struct mm_struct *mm)
 {
-	struct mmu_gather tlb;
 	struct vm_area_struct *vma;
-	unsigned long nr_accounted = 0;
+	struct teardown_job *job;
 
 	/* mm's last user has gone, and its about to be pulled down */
 	mmu_notifier_release(mm);
@@ -3633,28 +3767,24 @@ void exit_mmap(struct mm_struct *mm)
 	arch_exit_mmap(mm);
 
 	vma = mm->mmap;
-	if (!vma)	/* Can happen if dup_mmap() received an OOM */
+	if (!vma) {	/* Can happen if dup_mmap() received an OOM */
+		/* the nodes preloaded for inserts are still there */
+		vma_tree_destroy(&mm->mm_vt);
 		return;
+	}
 
-	lru_add_drain();
-	flush_cache_mm(mm);
-	tlb_gather_mmu(&tlb, mm, 0, -1);
-	/* update_hiwater_rss(mm) here? but nobody should be looking */
-	/* Use -1 here to ensure all VMAs in the mm are unmapped */
-	unmap_vmas(&tlb, vma, 0, -1);
-	free_pgtables(&tlb, vma, FIRST_USER_ADDRESS, USER_PGTABLES_CEILING);
-	tlb_finish_mmu(&tlb, 0, -1);
-
-	/*
-	 * Walk the list again, actually closing and freeing it,
-	 * with preemption enabled, without holding any MM locks.
-	 */
-	while (vma) {
-		if (vma->vm_flags & VM_ACCOUNT)
-			nr_accounted += vma_pages(vma);
-		vma = remove_vma(vma);
+	job = NULL;
+	if (teardown_wanted(mm, get_mm_counter(mm, MM_ANONPAGES)))
+		job = teardown_job_alloc(mm, get_mm_counter(mm, MM_ANONPAGES),
+					 numa_node_id());
+	if (job) {
+		/* the page tables go away with the last mmdrop() */
+		mmgrab(mm);
+		teardown_job_queue(job);
+		return;
 	}
-	vm_unacct_memory(nr_accounted);
+
+	exit_mmap_vmas(mm);
 }
 
 /* Insert vm structure into process list sorted by address
@@ -3669,13 +3799,13 @@ void exit_mmap(struct mm_struct *mm)
 int insert_vm_struct(struct mm_struct *mm, struct vm_area_struct *vma)
 {
 	struct vm_area_struct *prev;
-	struct rb_node **rb_link, *rb_parent;
 
 	/**
-	 * 根据待插入区域的起始地址，查找前一个区域，红黑树的父节点，叶节点
+	 * 根据待插入区域的起始地址，查找前一个区域
 	 */
-	if (find_vma_links(mm, vma->vm_start, vma->vm_end,
-			   &prev, &rb_link, &rb_parent))
+	if (find_vma_links(mm, vma->vm_start, vma->vm_end, &prev))
+		return -ENOMEM;
+	if (vma_tree_preload(&mm->mm_vt, GFP_KERNEL))
 		return -ENOMEM;
 	/* 此VMA需要接受审计 && 超过允许的空间范围了 */
 	if ((vma->vm_flags & VM_ACCOUNT) &&
@@ -3706,12 +3836,12 @@ int insert_vm_struct(struct mm_struct *mm, struct vm_area_struct *vma)
 	 *
 	 * 调用vma_link执行以下操作:
 	 *   在mm->mmap所指向的链表中插入线性区。
-	 *   在红黑树中插入线性区。
+	 *   在B树中插入线性区。
 	 *   如果线性区是匿名的，就把它插入相应的anon_vma数据结构作为头节点的链表中。
 	 *   递增mm->map_count计数器。
 	 *   如果线性区包含一个内存映射文件，则vma_link执行其他与内存映射文件相关的任务。
 	 */
-	vma_link(mm, vma, prev, rb_link, rb_parent);
+	vma_link(mm, vma, prev);
 	return 0;
 }
 
@@ -3727,7 +3857,6 @@ struct vm_area_struct *copy_vma(struct vm_area_struct **vmap,
 	unsigned long vma_start = vma->vm_start;
 	struct mm_struct *mm = vma->vm_mm;
 	struct vm_area_struct *new_vma, *prev;
-	struct rb_node **rb_link, *rb_parent;
 	bool faulted_in_anon_vma = true;
 
 	/*
@@ -3739,7 +3868,7 @@ struct vm_area_struct *copy_vma(struct vm_area_struct **vmap,
 		faulted_in_anon_vma = false;
 	}
 
-	if (find_vma_links(mm, addr, addr + len, &prev, &rb_link, &rb_parent))
+	if (find_vma_links(mm, addr, addr + len, &prev))
 		return NULL;	/* should never get here */
 	new_vma = vma_merge(mm, prev, addr, addr + len, vma->vm_flags,
 			    vma->anon_vma, vma->vm_file, pgoff, vma_policy(vma),
@@ -3767,6 +3896,8 @@ struct vm_area_struct *copy_vma(struct vm_area_struct **vmap,
 		}
 		*need_rmap_locks = (new_vma->vm_pgoff <= vma->vm_pgoff);
 	} else {
+		if (vma_tree_preload(&mm->mm_vt, GFP_KERNEL))
+			goto out;
 		new_vma = vm_area_dup(vma);
 		if (!new_vma)
 			goto out;
@@ -3781,7 +3912,7 @@ struct vm_area_struct *copy_vma(struct vm_area_struct **vmap,
 			get_file(new_vma->vm_file);
 		if (new_vma->vm_ops && new_vma->vm_ops->open)
 			new_vma->vm_ops->open(new_vma);
-		vma_link(mm, new_vma, prev, rb_link, rb_parent);
+		vma_link(mm, new_vma, prev);
 		*need_rmap_locks = false;
 	}
 	return new_vma;
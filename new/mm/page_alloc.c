@@ -4931,6 +4931,10 @@ retry:
 	if (check_retry_cpuset(cpuset_mems_cookie, ac))
 		goto retry_cpuset;
 
+	/* Address spaces still being torn down will give memory back */
+	if (wait_for_async_teardown())
+		goto retry;
+
 	/* Reclaim has failed us, start killing things */
 		/*
 	 * 如果内核可能执行影响VFS层的调用而又没有设置GFP_NORETRY，那么调用
@@ -5507,6 +5511,9 @@ long si_mem_available(void)
 			global_node_page_state(NR_KERNEL_MISC_RECLAIMABLE);
 	available += reclaimable - min(reclaimable / 2, wmark_low);
 
+	/* Unmapped memory that an async teardown has yet to free */
+	available += async_teardown_pending();
+
 	if (available < 0)
 		available = 0;
 	return available;
@@ -8771,7 +8778,7 @@ void *__init alloc_large_system_hash(const char *tablename,
 				table = memblock_alloc_raw(size,
 							   SMP_CACHE_BYTES);
 		} else if (hashdist) {
-			table = __vmalloc(size, gfp_flags, PAGE_KERNEL);
+			table = vmalloc_huge(size, gfp_flags);
 		} else {
 			/*
 			 * If bucketsize is not a power-of-two, we may free
@@ -8929,8 +8936,21 @@ static unsigned long pfn_max_align_up(unsigned long pfn)
 				pageblock_nr_pages));
 }
 
-/* [start, end) must belong to a single zone. */
-static int __alloc_contig_migrate_range(struct compact_control *cc,
+/*
+ * Upper bound on the CPUs one alloc_contig_range() migrates with, the
+ * caller included; 1 migrates everything from the caller as before.
+ */
+unsigned int contig_migrate_workers __read_mostly = 8;
+
+struct contig_migrate_work {
+	struct work_struct work;
+	struct compact_control *parent;
+	unsigned long start;
+	unsigned long end;
+	int ret;
+};
+
+static int __alloc_contig_migrate_chunk(struct compact_control *cc,
 					unsigned long start, unsigned long end)
 {
 	/* This function is based on compact_zone() from compaction.c. */
@@ -8939,10 +8959,9 @@ static int __alloc_contig_migrate_range(struct compact_control *cc,
 	unsigned int tries = 0;
 	int ret = 0;
 
-	migrate_prep();
-
 	while (pfn < end || !list_empty(&cc->migratepages)) {
-		if (fatal_signal_pending(current)) {
+		if (fatal_signal_pending(current) ||
+		    (cc->contig_stop && atomic_read(cc->contig_stop))) {
 			ret = -EINTR;
 			break;
 		}
@@ -8974,6 +8993,90 @@ static int __alloc_contig_migrate_range(struct compact_control *cc,
 	return 0;
 }
 
+static void contig_migrate_workfn(struct work_struct *work)
+{
+	struct contig_migrate_work *w =
+		container_of(work, struct contig_migrate_work, work);
+	struct compact_control *parent = w->parent;
+	struct compact_control cc = {
+		.nr_migratepages = 0,
+		.order = -1,
+		.zone = parent->zone,
+		.mode = parent->mode,
+		.ignore_skip_hint = true,
+		.no_set_skip_hint = true,
+		.gfp_mask = parent->gfp_mask,
+		.contig_stop = parent->contig_stop,
+	};
+
+	INIT_LIST_HEAD(&cc.migratepages);
+	w->ret = __alloc_contig_migrate_chunk(&cc, w->start, w->end);
+	/* -EBUSY may still sort itself out, see alloc_contig_range() */
+	if (w->ret && w->ret != -EBUSY)
+		atomic_set(cc.contig_stop, 1);
+}
+
+/*
+ * [start, end) must belong to a single zone.
+ *
+ * The range is cut into pageblock aligned chunks, so no compound page
+ * straddles two of them, and all but the first are handed to unbound
+ * workers.  The caller migrates the first chunk itself and is the one
+ * that notices fatal signals; the first hard error stops everybody.
+ * Pageblock isolation and the final checks stay with the caller.
+ */
+static int __alloc_contig_migrate_range(struct compact_control *cc,
+					unsigned long start, unsigned long end)
+{
+	struct contig_migrate_work *works;
+	unsigned long nr_blocks, chunk, base, pfn;
+	atomic_t stop = ATOMIC_INIT(0);
+	unsigned int nr, i;
+	int ret;
+
+	migrate_prep();
+
+	nr_blocks = DIV_ROUND_UP(end - start, pageblock_nr_pages);
+	nr = min3((unsigned long)READ_ONCE(contig_migrate_workers),
+		  (unsigned long)num_online_cpus(), nr_blocks);
+	if (nr <= 1)
+		return __alloc_contig_migrate_chunk(cc, start, end);
+
+	works = kcalloc(nr - 1, sizeof(*works), GFP_KERNEL | __GFP_NOWARN);
+	if (!works)
+		return __alloc_contig_migrate_chunk(cc, start, end);
+
+	base = round_down(start, pageblock_nr_pages);
+	chunk = roundup(DIV_ROUND_UP(end - base, nr), pageblock_nr_pages);
+	cc->contig_stop = &stop;
+
+	for (i = 0; i < nr - 1; i++) {
+		pfn = base + (i + 1) * chunk;
+		if (pfn >= end)
+			break;
+		works[i].parent = cc;
+		works[i].start = pfn;
+		works[i].end = min(pfn + chunk, end);
+		INIT_WORK(&works[i].work, contig_migrate_workfn);
+		queue_work(system_unbound_wq, &works[i].work);
+	}
+	nr = i;
+
+	ret = __alloc_contig_migrate_chunk(cc, start, min(base + chunk, end));
+	if (ret && ret != -EBUSY)
+		atomic_set(&stop, 1);
+
+	for (i = 0; i < nr; i++) {
+		flush_work(&works[i].work);
+		if (works[i].ret && (!ret || ret == -EBUSY))
+			ret = works[i].ret;
+	}
+
+	cc->contig_stop = NULL;
+	kfree(works);
+	return ret;
+}
+
 /**
  * alloc_contig_range() -- tries to allocate given range of pages
  * @start:	start PFN to allocate
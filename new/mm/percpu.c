@@ -106,6 +106,9 @@
 #include <linux/workqueue.h>
 #include <linux/kmemleak.h>
 #include <linux/sched.h>
+#include <linux/sched/clock.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
 #include <asm/cacheflush.h>
 #include <asm/sections.h>
@@ -122,6 +125,7 @@
 
 #define PCPU_EMPTY_POP_PAGES_LOW	2
 #define PCPU_EMPTY_POP_PAGES_HIGH	4
+#define PCPU_EMPTY_POP_PAGES_MAX	64
 
 #ifdef CONFIG_SMP
 /* default addr <-> pcpu_ptr mapping, override in asm/percpu.h if necessary */
@@ -213,12 +217,76 @@ static DECLARE_WORK(pcpu_balance_work, pcpu_balance_workfn);
 static bool pcpu_async_enabled __read_mostly;
 static bool pcpu_atomic_alloc_failed;
 
+/*
+ * Adaptive pre-population.  pcpu_alloc() counts the pages it had to
+ * populate itself; each balance run folds that count into a decaying
+ * average and keeps that many more empty populated pages around, so the
+ * next burst of allocations finds its pages already there instead of
+ * populating them one after the other under pcpu_alloc_mutex.  Both are
+ * protected by pcpu_lock.
+ */
+static int pcpu_nr_sync_pop_pages;
+static int pcpu_pop_demand;
+
+/* pages populated ahead of demand by the balance work, pcpu_alloc_mutex */
+static unsigned long pcpu_nr_async_pop_pages;
+
+static int pcpu_empty_pop_pages_high(void)
+{
+	return min(PCPU_EMPTY_POP_PAGES_HIGH + pcpu_pop_demand,
+		   PCPU_EMPTY_POP_PAGES_MAX);
+}
+
+static int pcpu_empty_pop_pages_low(void)
+{
+	return PCPU_EMPTY_POP_PAGES_LOW + pcpu_pop_demand / 2;
+}
+
 static void pcpu_schedule_balance_work(void)
 {
 	if (pcpu_async_enabled)
 		schedule_work(&pcpu_balance_work);
 }
 
+#ifdef CONFIG_DEBUG_FS
+#define PCPU_LAT_BUCKETS	16	/* < 256ns, then one per power of two */
+#define PCPU_POP_BUCKETS	8	/* 0, 1, 2-3, 4-7, ... pages */
+
+/* pcpu_alloc() latency and pages it populated itself, per allocation */
+struct pcpu_alloc_hist {
+	unsigned long lat[PCPU_LAT_BUCKETS];
+	unsigned long pop[PCPU_POP_BUCKETS];
+};
+
+static DEFINE_PER_CPU(struct pcpu_alloc_hist, pcpu_alloc_hist);
+
+static inline u64 pcpu_alloc_clock(void)
+{
+	return local_clock();
+}
+
+static void pcpu_account_alloc(u64 start, int nr_pop)
+{
+	u64 ns = local_clock() - start;
+	int b;
+
+	b = (ns >> 8) ? min_t(int, fls64(ns >> 8), PCPU_LAT_BUCKETS - 1) : 0;
+	this_cpu_inc(pcpu_alloc_hist.lat[b]);
+
+	b = nr_pop ? min(fls(nr_pop), PCPU_POP_BUCKETS - 1) : 0;
+	this_cpu_inc(pcpu_alloc_hist.pop[b]);
+}
+#else
+static inline u64 pcpu_alloc_clock(void)
+{
+	return 0;
+}
+
+static inline void pcpu_account_alloc(u64 start, int nr_pop)
+{
+}
+#endif
+
 /**
  * pcpu_addr_in_chunk - check if the address is served from this chunk
  * @chunk: chunk of interest
@@ -1397,9 +1465,11 @@ static void __percpu *pcpu_alloc(size_t size, size_t align, bool reserved,
 	struct pcpu_chunk *chunk;
 	const char *err;
 	int slot, off, cpu, ret;
+	int nr_pop = 0;
 	unsigned long flags;
 	void __percpu *ptr;
 	size_t bits, bit_align;
+	u64 start = pcpu_alloc_clock();
 
 	/*
 	 * There is now a minimum allocation size of PCPU_MIN_ALLOC_SIZE,
@@ -1531,13 +1601,16 @@ area_found:
 				goto fail_unlock;
 			}
 			pcpu_chunk_populated(chunk, rs, re, true);
+			pcpu_nr_sync_pop_pages += re - rs;
 			spin_unlock_irqrestore(&pcpu_lock, flags);
+			nr_pop += re - rs;
 		}
 
 		mutex_unlock(&pcpu_alloc_mutex);
 	}
 
-	if (pcpu_nr_empty_pop_pages < PCPU_EMPTY_POP_PAGES_LOW)
+	/* had to populate ourselves: let the balance work get ahead */
+	if (nr_pop || pcpu_nr_empty_pop_pages < pcpu_empty_pop_pages_low())
 		pcpu_schedule_balance_work();
 
 	/* clear the areas and return address relative to base address */
@@ -1561,6 +1634,7 @@ area_found:
 	trace_percpu_alloc_percpu(reserved, is_atomic, size, align,
 			chunk->base_addr, off, ptr);
 
+	pcpu_account_alloc(start, nr_pop);
 	return ptr;
 
 fail_unlock:
@@ -1658,7 +1732,7 @@ static void pcpu_balance_workfn(struct work_struct *work)
 	LIST_HEAD(to_free);
 	struct list_head *free_head = &pcpu_slot[pcpu_nr_slots - 1];
 	struct pcpu_chunk *chunk, *next;
-	int slot, nr_to_pop, ret;
+	int slot, nr_to_pop, nr_high, ret;
 
 	/*
 	 * There's no reason to keep around multiple unused chunks and VM
@@ -1702,16 +1776,25 @@ static void pcpu_balance_workfn(struct work_struct *work)
 	 * failing indefinitely; however, large atomic allocs are not
 	 * something we support properly and can be highly unreliable and
 	 * inefficient.
+	 *
+	 * The target grows with what pcpu_alloc() had to populate itself
+	 * since the last run.  New demand weighs half, so a burst is
+	 * followed right away and forgotten over a few quiet runs.
 	 */
+	spin_lock_irq(&pcpu_lock);
+	pcpu_pop_demand = (pcpu_pop_demand + pcpu_nr_sync_pop_pages) / 2;
+	pcpu_nr_sync_pop_pages = 0;
+	nr_high = pcpu_empty_pop_pages_high();
+	spin_unlock_irq(&pcpu_lock);
+
 retry_pop:
 	if (pcpu_atomic_alloc_failed) {
-		nr_to_pop = PCPU_EMPTY_POP_PAGES_HIGH;
+		nr_to_pop = nr_high;
 		/* best effort anyway, don't worry about synchronization */
 		pcpu_atomic_alloc_failed = false;
 	} else {
-		nr_to_pop = clamp(PCPU_EMPTY_POP_PAGES_HIGH -
-				  pcpu_nr_empty_pop_pages,
-				  0, PCPU_EMPTY_POP_PAGES_HIGH);
+		nr_to_pop = clamp(nr_high - pcpu_nr_empty_pop_pages,
+				  0, nr_high);
 	}
 
 	for (slot = pcpu_size_to_slot(PAGE_SIZE); slot < pcpu_nr_slots; slot++) {
@@ -1739,6 +1822,7 @@ retry_pop:
 			ret = pcpu_populate_chunk(chunk, rs, rs + nr, gfp);
 			if (!ret) {
 				nr_to_pop -= nr;
+				pcpu_nr_async_pop_pages += nr;
 				spin_lock_irq(&pcpu_lock);
 				pcpu_chunk_populated(chunk, rs, rs + nr, false);
 				spin_unlock_irq(&pcpu_lock);
@@ -2969,3 +3053,54 @@ static int __init percpu_enable_async(void)
 	return 0;
 }
 subsys_initcall(percpu_enable_async);
+
+#ifdef CONFIG_DEBUG_FS
+static int pcpu_alloc_hist_show(struct seq_file *m, void *v)
+{
+	unsigned long lat[PCPU_LAT_BUCKETS] = { 0 };
+	unsigned long pop[PCPU_POP_BUCKETS] = { 0 };
+	int cpu, i;
+
+	for_each_possible_cpu(cpu) {
+		struct pcpu_alloc_hist *h = per_cpu_ptr(&pcpu_alloc_hist, cpu);
+
+		for (i = 0; i < PCPU_LAT_BUCKETS; i++)
+			lat[i] += h->lat[i];
+		for (i = 0; i < PCPU_POP_BUCKETS; i++)
+			pop[i] += h->pop[i];
+	}
+
+	seq_puts(m, "latency(ns)    allocs\n");
+	for (i = 0; i < PCPU_LAT_BUCKETS - 1; i++)
+		seq_printf(m, "< %-11llu %lu\n", 1ULL << (8 + i), lat[i]);
+	seq_printf(m, ">= %-10llu %lu\n", 1ULL << (8 + i - 1), lat[i]);
+
+	seq_puts(m, "\npopulated      allocs\n");
+	seq_printf(m, "%-14s %lu\n", "0", pop[0]);
+	for (i = 1; i < PCPU_POP_BUCKETS - 1; i++) {
+		if (i == 1)
+			seq_printf(m, "%-14s %lu\n", "1", pop[i]);
+		else
+			seq_printf(m, "%d-%-12d %lu\n", 1 << (i - 1),
+				   (1 << i) - 1, pop[i]);
+	}
+	seq_printf(m, ">=%-12d %lu\n", 1 << (i - 1), pop[i]);
+
+	spin_lock_irq(&pcpu_lock);
+	seq_printf(m, "\nempty_pop_pages %d target %d demand %d\n",
+		   pcpu_nr_empty_pop_pages, pcpu_empty_pop_pages_high(),
+		   pcpu_pop_demand);
+	spin_unlock_irq(&pcpu_lock);
+	seq_printf(m, "async_pop_pages %lu\n", READ_ONCE(pcpu_nr_async_pop_pages));
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(pcpu_alloc_hist);
+
+static int __init pcpu_debugfs_init(void)
+{
+	debugfs_create_file("percpu_alloc_hist", 0400, NULL, NULL,
+			    &pcpu_alloc_hist_fops);
+	return 0;
+}
+late_initcall(pcpu_debugfs_init);
+#endif /* CONFIG_DEBUG_FS */
@@ -745,6 +745,26 @@ out:
 	return pmd;
 }
 
+/*
+ * @pvmw found the page in a PTE table shared by fork, where one mapcount
+ * stands for all the sharers (see unshare_pte_table()).  Give this mm its
+ * own copy and restart the walk at the same address, in the new table.
+ * Returns false, with the walk finished, if the copy could not be made.
+ */
+static bool rmap_unshare_pte_table(struct page_vma_mapped_walk *pvmw)
+{
+	pmd_t *pmd = pvmw->pmd;
+
+	page_vma_mapped_walk_done(pvmw);
+	if (unshare_pte_table(pvmw->vma, pmd, pvmw->address))
+		return false;
+
+	pvmw->pmd = NULL;
+	pvmw->pte = NULL;
+	pvmw->ptl = NULL;
+	return true;
+}
+
 struct page_referenced_arg {
 	int mapcount;
 	int referenced;
@@ -774,6 +794,10 @@ static bool page_referenced_one(struct page *page, struct vm_area_struct *vma,
 			return false; /* To break the loop */
 		}
 
+		/* aging is not worth a copy of the table */
+		if (pvmw.pte && pte_table_shared(*pvmw.pmd))
+			continue;
+
 		if (pvmw.pte) {
 			if (ptep_clear_flush_young_notify(vma, address,
 						pvmw.pte)) {
@@ -1452,6 +1476,14 @@ static bool try_to_unmap_one(struct page *page, struct vm_area_struct *vma,
 		/* Unexpected PMD-mapped THP? */
 		VM_BUG_ON_PAGE(!pvmw.pte, page);
 
+		if (pte_table_shared(*pvmw.pmd)) {
+			if (!rmap_unshare_pte_table(&pvmw)) {
+				ret = false;
+				break;
+			}
+			continue;
+		}
+
 		subpage = page - page_to_pfn(page) + pte_pfn(*pvmw.pte);
 		address = pvmw.address;
 
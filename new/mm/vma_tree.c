@@ -0,0 +1,600 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ *  linux/mm/vma_tree.c
+ *
+ *  B-tree index of the vmas of an mm.
+ *
+ *  The vmas are kept in the leaves in address order, up to VMT_SLOTS per
+ *  node.  Every slot carries the highest vm_end below it (its pivot) and
+ *  the largest free gap in front of a vma below it, so find_vma() is a
+ *  scan of a few contiguous pivots per level and get_unmapped_area() can
+ *  skip every subtree that has no gap large enough.  Compared with the
+ *  augmented rbtree this touches a handful of cache lines per lookup
+ *  instead of one per level of a much deeper tree.
+ *
+ *  Position in the tree follows vm_prev, not the keys, so a vma can be
+ *  inserted while its neighbours are being resized by __vma_adjust().
+ *  Each vma points back at its leaf, which makes erase and the pivot and
+ *  gap refresh after vm_start/vm_end changes (vma_tree_update()) O(height).
+ *
+ *  Writers hold mmap_sem for write, except for vma_tree_update() from the
+ *  stack expansion paths which are serialized by page_table_lock.  Nodes
+ *  are freed after a grace period and never change level, so a lockless
+ *  vma_tree_find() under rcu_read_lock() may return a stale answer but
+ *  never crashes or loops; such readers validate it with mm->mm_vt_seq.
+ *
+ *  Nodes are allocated from a per-tree reserve filled by vma_tree_preload()
+ *  before the caller takes i_mmap_rwsem and the anon_vma lock, so reclaim
+ *  never has to wait for the rmap locks held across an insert.
+ */
+
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/rcupdate.h>
+#include <linux/vma_tree.h>
+
+#define VMT_SLOTS	16
+
+struct vmt_node {
+	unsigned long pivot[VMT_SLOTS];	/* highest vm_end below each slot */
+	unsigned long gap[VMT_SLOTS];	/* largest gap before a vma below */
+	void *slot[VMT_SLOTS];		/* child nodes, or vmas in a leaf */
+	struct vmt_node *parent;	/* also links the reserve */
+	unsigned char nr;		/* slots in use */
+	bool leaf;
+	struct rcu_head rcu;
+};
+
+static struct kmem_cache *vmt_node_cachep __read_mostly;
+
+void __init vma_tree_cache_init(void)
+{
+	vmt_node_cachep = KMEM_CACHE(vmt_node, SLAB_PANIC|SLAB_ACCOUNT);
+}
+
+/*
+ * Make sure the next insert can't fail: it splits at most every level and
+ * adds a new root on top.
+ */
+int vma_tree_preload(struct vma_tree *vt, gfp_t gfp)
+{
+	while (vt->nr_reserve < vt->height + 1) {
+		struct vmt_node *node = kmem_cache_alloc(vmt_node_cachep, gfp);
+
+		if (!node)
+			return -ENOMEM;
+		node->parent = vt->reserve;
+		vt->reserve = node;
+		vt->nr_reserve++;
+	}
+	return 0;
+}
+
+static struct vmt_node *vmt_alloc(struct vma_tree *vt, bool leaf)
+{
+	struct vmt_node *node = vt->reserve;
+
+	/* the caller forgot vma_tree_preload() */
+	BUG_ON(!node);
+	vt->reserve = node->parent;
+	vt->nr_reserve--;
+
+	memset(node, 0, sizeof(*node));
+	node->leaf = leaf;
+	return node;
+}
+
+static void vmt_free_rcu(struct rcu_head *head)
+{
+	kmem_cache_free(vmt_node_cachep,
+			container_of(head, struct vmt_node, rcu));
+}
+
+static void vmt_free(struct vmt_node *node)
+{
+	call_rcu(&node->rcu, vmt_free_rcu);
+}
+
+static void vmt_destroy_node(struct vmt_node *node)
+{
+	unsigned int i;
+
+	if (!node->leaf) {
+		for (i = 0; i < node->nr; i++)
+			vmt_destroy_node(node->slot[i]);
+	}
+	kmem_cache_free(vmt_node_cachep, node);
+}
+
+/*
+ * Free the whole tree, the mm is going away and nobody can look it up
+ * anymore.  The vmas themselves are freed by the caller.
+ */
+void vma_tree_destroy(struct vma_tree *vt)
+{
+	struct vmt_node *node;
+
+	if (vt->root)
+		vmt_destroy_node(vt->root);
+	while ((node = vt->reserve)) {
+		vt->reserve = node->parent;
+		kmem_cache_free(vmt_node_cachep, node);
+	}
+	vma_tree_init(vt);
+}
+
+/*
+ * The free gap between vma and its predecessor.
+ *
+ * Note: in the rare case of a VM_GROWSDOWN above a VM_GROWSUP, we
+ * allow two stack_guard_gaps between them here, and when choosing
+ * an unmapped area; whereas when expanding we only require one.
+ * That's a little inconsistent, but keeps the code here simpler.
+ */
+static unsigned long vma_gap(struct vm_area_struct *vma)
+{
+	unsigned long gap = vm_start_gap(vma), prev_end;
+
+	if (vma->vm_prev) {
+		prev_end = vm_end_gap(vma->vm_prev);
+		if (gap > prev_end)
+			gap -= prev_end;
+		else
+			gap = 0;
+	}
+	return gap;
+}
+
+static unsigned long vmt_max_gap(struct vmt_node *node)
+{
+	unsigned long max = 0;
+	unsigned int i;
+
+	for (i = 0; i < node->nr; i++)
+		if (node->gap[i] > max)
+			max = node->gap[i];
+	return max;
+}
+
+static unsigned int vmt_slot_of(struct vmt_node *node, void *entry)
+{
+	unsigned int i;
+
+	for (i = 0; i < node->nr; i++)
+		if (node->slot[i] == entry)
+			return i;
+	BUG();
+}
+
+/* Point @entry back at @node, where it now lives. */
+static inline void vmt_adopt(struct vmt_node *node, void *entry)
+{
+	if (node->leaf)
+		((struct vm_area_struct *)entry)->vm_tree_node = node;
+	else
+		((struct vmt_node *)entry)->parent = node;
+}
+
+/* Store @entry in slot @i of @node with a freshly computed summary. */
+static void vmt_set(struct vmt_node *node, unsigned int i, void *entry)
+{
+	if (node->leaf) {
+		struct vm_area_struct *vma = entry;
+
+		WRITE_ONCE(node->pivot[i], vma->vm_end);
+		node->gap[i] = vma_gap(vma);
+	} else {
+		struct vmt_node *child = entry;
+
+		WRITE_ONCE(node->pivot[i], child->pivot[child->nr - 1]);
+		node->gap[i] = vmt_max_gap(child);
+	}
+	vmt_adopt(node, entry);
+	/* publish the contents of a new child before the pointer to it */
+	smp_wmb();
+	WRITE_ONCE(node->slot[i], entry);
+}
+
+/* Copy slot @si of @src, summary included, to slot @di of @dst. */
+static void vmt_move(struct vmt_node *dst, unsigned int di,
+		     struct vmt_node *src, unsigned int si)
+{
+	WRITE_ONCE(dst->pivot[di], src->pivot[si]);
+	dst->gap[di] = src->gap[si];
+	WRITE_ONCE(dst->slot[di], src->slot[si]);
+	vmt_adopt(dst, src->slot[si]);
+}
+
+/*
+ * Refresh the summaries of @node in its ancestors, stopping as soon as
+ * one is unchanged.
+ */
+static void vmt_fixup(struct vmt_node *node)
+{
+	struct vmt_node *parent;
+
+	while ((parent = node->parent)) {
+		unsigned int i = vmt_slot_of(parent, node);
+		unsigned long pivot = node->pivot[node->nr - 1];
+		unsigned long gap = vmt_max_gap(node);
+
+		if (parent->pivot[i] == pivot && parent->gap[i] == gap)
+			break;
+		WRITE_ONCE(parent->pivot[i], pivot);
+		parent->gap[i] = gap;
+		node = parent;
+	}
+}
+
+/* Open slot @i of a non-full @node and store @entry there. */
+static void vmt_place(struct vmt_node *node, unsigned int i, void *entry)
+{
+	unsigned int j;
+
+	for (j = node->nr; j > i; j--)
+		vmt_move(node, j, node, j - 1);
+	node->nr++;
+	vmt_set(node, i, entry);
+}
+
+static void vmt_insert_entry(struct vma_tree *vt, struct vmt_node *node,
+			     unsigned int i, void *entry)
+{
+	struct vmt_node *new, *parent;
+	unsigned int half = VMT_SLOTS / 2, j;
+
+	if (node->nr < VMT_SLOTS) {
+		vmt_place(node, i, entry);
+		vmt_fixup(node);
+		return;
+	}
+
+	/* full: move the upper half to a new right sibling */
+	new = vmt_alloc(vt, node->leaf);
+	for (j = half; j < VMT_SLOTS; j++)
+		vmt_move(new, j - half, node, j);
+	new->nr = VMT_SLOTS - half;
+	node->nr = half;
+
+	if (i <= half)
+		vmt_place(node, i, entry);
+	else
+		vmt_place(new, i - half, entry);
+
+	parent = node->parent;
+	if (!parent) {
+		parent = vmt_alloc(vt, false);
+		vmt_set(parent, 0, node);
+		vmt_set(parent, 1, new);
+		parent->nr = 2;
+		smp_wmb();
+		WRITE_ONCE(vt->root, parent);
+		vt->height++;
+		return;
+	}
+	vmt_insert_entry(vt, parent, vmt_slot_of(parent, node) + 1, new);
+	vmt_fixup(node);
+}
+
+/*
+ * Insert @vma right after @prev, or first if @prev is NULL.  vm_prev and
+ * vm_next of @vma must already be set up.
+ */
+void vma_tree_insert(struct vma_tree *vt, struct vm_area_struct *vma,
+		     struct vm_area_struct *prev)
+{
+	struct vmt_node *node;
+
+	if (!vt->root) {
+		node = vmt_alloc(vt, true);
+		vmt_set(node, 0, vma);
+		node->nr = 1;
+		smp_wmb();
+		WRITE_ONCE(vt->root, node);
+		vt->height = 1;
+		return;
+	}
+
+	if (prev) {
+		node = prev->vm_tree_node;
+		vmt_insert_entry(vt, node, vmt_slot_of(node, prev) + 1, vma);
+		return;
+	}
+
+	for (node = vt->root; !node->leaf; node = node->slot[0])
+		;
+	vmt_insert_entry(vt, node, 0, vma);
+}
+
+static bool vmt_merge(struct vma_tree *vt, struct vmt_node *node);
+
+static void vmt_remove_entry(struct vma_tree *vt, struct vmt_node *node,
+			     unsigned int i)
+{
+	struct vmt_node *parent = node->parent;
+	unsigned int j;
+
+	for (j = i + 1; j < node->nr; j++)
+		vmt_move(node, j - 1, node, j);
+	node->nr--;
+
+	if (!parent) {
+		if (!node->nr) {
+			WRITE_ONCE(vt->root, NULL);
+			vt->height = 0;
+			vmt_free(node);
+		} else if (!node->leaf && node->nr == 1) {
+			/* a root with a single child is one level too many */
+			struct vmt_node *child = node->slot[0];
+
+			child->parent = NULL;
+			WRITE_ONCE(vt->root, child);
+			vt->height--;
+			vmt_free(node);
+		}
+		return;
+	}
+
+	if (!node->nr) {
+		vmt_remove_entry(vt, parent, vmt_slot_of(parent, node));
+		vmt_free(node);
+		return;
+	}
+
+	if (node->nr < VMT_SLOTS / 4 && vmt_merge(vt, node))
+		return;
+	vmt_fixup(node);
+}
+
+/*
+ * Fold an underfull @node and a sibling into one node, if the result
+ * leaves room for a few inserts.  Returns true if @node was freed.
+ */
+static bool vmt_merge(struct vma_tree *vt, struct vmt_node *node)
+{
+	struct vmt_node *parent = node->parent, *left, *right;
+	unsigned int i = vmt_slot_of(parent, node), j;
+
+	if (i > 0) {
+		left = parent->slot[i - 1];
+		right = node;
+	} else if (i + 1 < parent->nr) {
+		left = node;
+		right = parent->slot[i + 1];
+	} else {
+		return false;
+	}
+	if (left->nr + right->nr > VMT_SLOTS - VMT_SLOTS / 4)
+		return false;
+
+	for (j = 0; j < right->nr; j++)
+		vmt_move(left, left->nr + j, right, j);
+	left->nr += right->nr;
+	vmt_fixup(left);
+
+	vmt_remove_entry(vt, parent, vmt_slot_of(parent, right));
+	vmt_free(right);
+	return right == node;
+}
+
+void vma_tree_erase(struct vma_tree *vt, struct vm_area_struct *vma)
+{
+	struct vmt_node *node = vma->vm_tree_node;
+
+	vmt_remove_entry(vt, node, vmt_slot_of(node, vma));
+	vma->vm_tree_node = NULL;
+}
+
+/*
+ * Refresh the pivot and gap of @vma after vma->vm_start, vma->vm_end or
+ * vma->vm_prev->vm_end changed, without moving it in the tree.
+ */
+void vma_tree_update(struct vm_area_struct *vma)
+{
+	struct vmt_node *node = vma->vm_tree_node;
+
+	vmt_set(node, vmt_slot_of(node, vma), vma);
+	vmt_fixup(node);
+}
+
+/*
+ * Look up the first vma with vm_end > addr.  May be called without
+ * mmap_sem under rcu_read_lock(), see the comment at the top.
+ */
+struct vm_area_struct *vma_tree_find(struct vma_tree *vt, unsigned long addr)
+{
+	struct vmt_node *node = READ_ONCE(vt->root);
+
+	while (node) {
+		unsigned int i, nr;
+		void *entry;
+
+		nr = min_t(unsigned int, READ_ONCE(node->nr), VMT_SLOTS);
+		for (i = 0; i < nr; i++)
+			if (addr < READ_ONCE(node->pivot[i]))
+				break;
+		if (i == nr)
+			return NULL;
+		entry = READ_ONCE(node->slot[i]);
+		if (node->leaf)
+			return entry;
+		node = entry;
+	}
+	return NULL;
+}
+
+struct vm_area_struct *vma_tree_last(struct vma_tree *vt)
+{
+	struct vmt_node *node = vt->root;
+
+	if (!node)
+		return NULL;
+	while (!node->leaf)
+		node = node->slot[node->nr - 1];
+	return node->slot[node->nr - 1];
+}
+
+/*
+ * The lowest vma with a gap of at least @length in front of it that ends
+ * at or above @low_limit.  Returns NULL if there is none below the last
+ * vma, ERR_PTR(-ENOMEM) once the gaps start above @high_limit.
+ */
+static struct vm_area_struct *vmt_gap_up(struct vmt_node *node,
+		unsigned long length, unsigned long low_limit,
+		unsigned long high_limit)
+{
+	struct vm_area_struct *vma;
+	unsigned long gap_start, gap_end;
+	unsigned int i;
+
+	for (i = 0; i < node->nr; i++) {
+		/* everything below here starts past the last vma of slot i - 1 */
+		if (i && node->pivot[i - 1] > high_limit)
+			return ERR_PTR(-ENOMEM);
+		/* all the gaps below here end under low_limit */
+		if (node->pivot[i] < low_limit)
+			continue;
+		if (node->gap[i] < length)
+			continue;
+
+		if (!node->leaf) {
+			vma = vmt_gap_up(node->slot[i], length, low_limit,
+					 high_limit);
+			if (vma)
+				return vma;
+			continue;
+		}
+
+		vma = node->slot[i];
+		gap_start = vma->vm_prev ? vm_end_gap(vma->vm_prev) : 0;
+		if (gap_start > high_limit)
+			return ERR_PTR(-ENOMEM);
+		gap_end = vm_start_gap(vma);
+		if (gap_end >= low_limit && gap_end > gap_start &&
+		    gap_end - gap_start >= length)
+			return vma;
+	}
+	return NULL;
+}
+
+struct vm_area_struct *vma_tree_gap_up(struct vma_tree *vt,
+		unsigned long length, unsigned long low_limit,
+		unsigned long high_limit)
+{
+	if (!vt->root)
+		return NULL;
+	return vmt_gap_up(vt->root, length, low_limit, high_limit);
+}
+
+/*
+ * The highest vma with a gap of at least @length in front of it that
+ * starts at or below @high_limit.  Returns NULL if there is none, or
+ * ERR_PTR(-ENOMEM) once the gaps end below @low_limit.
+ */
+static struct vm_area_struct *vmt_gap_down(struct vmt_node *node,
+		unsigned long length, unsigned long low_limit,
+		unsigned long high_limit)
+{
+	struct vm_area_struct *vma;
+	unsigned long gap_start, gap_end;
+	int i;
+
+	for (i = node->nr - 1; i >= 0; i--) {
+		if (node->gap[i] < length)
+			continue;
+		/* all the gaps below here and to the left end under low_limit */
+		if (node->pivot[i] < low_limit)
+			return ERR_PTR(-ENOMEM);
+		/* all the gaps below here start above high_limit */
+		if (i && node->pivot[i - 1] > high_limit)
+			continue;
+
+		if (!node->leaf) {
+			vma = vmt_gap_down(node->slot[i], length, low_limit,
+					   high_limit);
+			if (vma)
+				return vma;
+			continue;
+		}
+
+		vma = node->slot[i];
+		gap_start = vma->vm_prev ? vm_end_gap(vma->vm_prev) : 0;
+		gap_end = vm_start_gap(vma);
+		if (gap_end < low_limit)
+			return ERR_PTR(-ENOMEM);
+		if (gap_start <= high_limit && gap_end > gap_start &&
+		    gap_end - gap_start >= length)
+			return vma;
+	}
+	return NULL;
+}
+
+struct vm_area_struct *vma_tree_gap_down(struct vma_tree *vt,
+		unsigned long length, unsigned long low_limit,
+		unsigned long high_limit)
+{
+	if (!vt->root)
+		return NULL;
+	return vmt_gap_down(vt->root, length, low_limit, high_limit);
+}
+
+#ifdef CONFIG_DEBUG_VM_RB
+static int vmt_validate_node(struct vmt_node *node, struct vmt_node *parent,
+			     unsigned int depth, unsigned int height)
+{
+	unsigned int i;
+	int nr = 0, ret;
+	bool bug = false;
+
+	if (node->parent != parent || !node->nr || node->nr > VMT_SLOTS ||
+	    node->leaf != (depth == height)) {
+		pr_emerg("vma_tree: bad node %p nr %u leaf %d depth %u/%u\n",
+			 node, node->nr, node->leaf, depth, height);
+		return -1;
+	}
+
+	for (i = 0; i < node->nr; i++) {
+		if (i && node->pivot[i] < node->pivot[i - 1]) {
+			pr_emerg("vma_tree: pivot %lx < previous %lx\n",
+				 node->pivot[i], node->pivot[i - 1]);
+			bug = true;
+		}
+		if (node->leaf) {
+			struct vm_area_struct *vma = node->slot[i];
+
+			if (vma->vm_tree_node != node ||
+			    node->pivot[i] != vma->vm_end ||
+			    node->gap[i] != vma_gap(vma)) {
+				pr_emerg("vma_tree: stale vma %lx-%lx pivot %lx gap %lx, correct %lx\n",
+					 vma->vm_start, vma->vm_end,
+					 node->pivot[i], node->gap[i],
+					 vma_gap(vma));
+				bug = true;
+			}
+			nr++;
+		} else {
+			struct vmt_node *child = node->slot[i];
+
+			ret = vmt_validate_node(child, node, depth + 1, height);
+			if (ret < 0)
+				return ret;
+			if (node->pivot[i] != child->pivot[child->nr - 1] ||
+			    node->gap[i] != vmt_max_gap(child)) {
+				pr_emerg("vma_tree: stale summary pivot %lx gap %lx\n",
+					 node->pivot[i], node->gap[i]);
+				bug = true;
+			}
+			nr += ret;
+		}
+	}
+	return bug ? -1 : nr;
+}
+
+/* Returns the number of vmas in the tree, or -1 if it is corrupted. */
+int vma_tree_validate(struct vma_tree *vt)
+{
+	if (!vt->root)
+		return vt->height ? -1 : 0;
+	return vmt_validate_node(vt->root, NULL, 1, vt->height);
+}
+#endif
@@ -0,0 +1,173 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2014 Davidlohr Bueso.
+ */
+#include <linux/sched/signal.h>
+#include <linux/sched/task.h>
+#include <linux/mm.h>
+#include <linux/seq_file.h>
+#include <linux/vmacache.h>
+#include <asm/pgtable.h>
+
+/*
+ * Hash based on the pmd of addr if configured with MMU, which provides a good
+ * hit rate for workloads with spatial locality.  Otherwise, use pages.
+ */
+#ifdef CONFIG_MMU
+#define VMACACHE_SHIFT	PMD_SHIFT
+#else
+#define VMACACHE_SHIFT	PAGE_SHIFT
+#endif
+#define VMACACHE_HASH(addr) ((addr >> VMACACHE_SHIFT) & VMACACHE_MASK)
+
+/*
+ * This task may be accessing a foreign mm via (for example)
+ * get_user_pages()->find_vma().  The vmacache is task-local and this
+ * task's vmacache pertains to a different mm (ie, its own).  There is
+ * nothing we can do here.
+ *
+ * Also handle the case where a kernel thread has adopted this mm via use_mm().
+ * That kernel thread's vmacache is not applicable to this mm.
+ */
+static inline bool vmacache_valid_mm(struct mm_struct *mm)
+{
+	return current->mm == mm && !(current->flags & PF_KTHREAD);
+}
+
+void vmacache_update(unsigned long addr, struct vm_area_struct *newvma)
+{
+	if (vmacache_valid_mm(newvma->vm_mm))
+		current->vmacache.vmas[VMACACHE_HASH(addr)] = newvma;
+}
+
+/* like TASK_RSS_EVENTS_THRESH, fold into the mm every so many lookups */
+#define VMACACHE_STAT_THRESH	64
+
+/*
+ * Fold the lookups @tsk made in @mm, its own mm, into the mm's totals.
+ * Called every VMACACHE_STAT_THRESH lookups and where sync_mm_rss() is,
+ * before the task lets go of the mm.
+ */
+void vmacache_sync_stats(struct task_struct *tsk, struct mm_struct *mm)
+{
+	if (tsk->vmacache_hits) {
+		atomic_long_add(tsk->vmacache_hits, &mm->vmacache_hits);
+		tsk->vmacache_hits = 0;
+	}
+	if (tsk->vmacache_misses) {
+		atomic_long_add(tsk->vmacache_misses, &mm->vmacache_misses);
+		tsk->vmacache_misses = 0;
+	}
+}
+
+static inline void vmacache_count(struct mm_struct *mm, bool hit)
+{
+	struct task_struct *curr = current;
+
+	if (hit)
+		curr->vmacache_hits++;
+	else
+		curr->vmacache_misses++;
+	if (curr->vmacache_hits + curr->vmacache_misses >=
+	    VMACACHE_STAT_THRESH)
+		vmacache_sync_stats(curr, mm);
+}
+
+static bool vmacache_valid(struct mm_struct *mm)
+{
+	struct task_struct *curr = current;
+
+	if (mm->vmacache_seqnum != curr->vmacache.seqnum) {
+		/*
+		 * First attempt will always be invalid, initialize
+		 * the new cache for this task here.
+		 */
+		curr->vmacache.seqnum = mm->vmacache_seqnum;
+		vmacache_flush(curr);
+		return false;
+	}
+	return true;
+}
+
+struct vm_area_struct *vmacache_find(struct mm_struct *mm, unsigned long addr)
+{
+	int idx = VMACACHE_HASH(addr);
+	int i;
+
+	count_vm_vmacache_event(VMACACHE_FIND_CALLS);
+
+	if (!vmacache_valid_mm(mm))
+		return NULL;
+
+	if (!vmacache_valid(mm))
+		goto miss;
+
+	for (i = 0; i < VMACACHE_SIZE; i++) {
+		struct vm_area_struct *vma = current->vmacache.vmas[idx];
+
+		if (vma) {
+#ifdef CONFIG_DEBUG_VM_VMACACHE
+			if (WARN_ON_ONCE(vma->vm_mm != mm))
+				break;
+#endif
+			if (vma->vm_start <= addr && vma->vm_end > addr) {
+				count_vm_vmacache_event(VMACACHE_FIND_HITS);
+				vmacache_count(mm, true);
+				return vma;
+			}
+		}
+		if (++idx == VMACACHE_SIZE)
+			idx = 0;
+	}
+miss:
+	vmacache_count(mm, false);
+	return NULL;
+}
+
+#ifndef CONFIG_MMU
+struct vm_area_struct *vmacache_find_exact(struct mm_struct *mm,
+					   unsigned long start,
+					   unsigned long end)
+{
+	int idx = VMACACHE_HASH(start);
+	int i;
+
+	count_vm_vmacache_event(VMACACHE_FIND_CALLS);
+
+	if (!vmacache_valid_mm(mm))
+		return NULL;
+
+	if (!vmacache_valid(mm))
+		goto miss;
+
+	for (i = 0; i < VMACACHE_SIZE; i++) {
+		struct vm_area_struct *vma = current->vmacache.vmas[idx];
+
+		if (vma && vma->vm_start == start && vma->vm_end == end) {
+			count_vm_vmacache_event(VMACACHE_FIND_HITS);
+			vmacache_count(mm, true);
+			return vma;
+		}
+		if (++idx == VMACACHE_SIZE)
+			idx = 0;
+	}
+miss:
+	vmacache_count(mm, false);
+	return NULL;
+}
+#endif
+
+#ifdef CONFIG_PROC_FS
+/*
+ * Lookups the threads of @mm made in it, for /proc/<pid>/status.  Each
+ * thread may hold back up to VMACACHE_STAT_THRESH not yet folded in.
+ */
+void vmacache_report_usage(struct seq_file *m, struct mm_struct *mm)
+{
+	seq_put_decimal_ull(m, "VmaCacheHits:\t",
+			    atomic_long_read(&mm->vmacache_hits));
+	seq_put_decimal_ull(m, "\nVmaCacheMisses:\t",
+			    atomic_long_read(&mm->vmacache_misses));
+	seq_putc(m, '\n');
+}
+#endif
@@ -22,7 +22,7 @@
 #include <linux/kallsyms.h>
 #include <linux/list.h>
 #include <linux/notifier.h>
-#include <linux/rbtree.h>
+#include <linux/rbtree_augmented.h>
 #include <linux/radix-tree.h>
 #include <linux/rcupdate.h>
 #include <linux/pfn.h>
@@ -57,6 +57,21 @@ static void free_work(struct work_struct *w)
 
 /*** Page table manipulation functions ***/
 
+/*
+ * Architectures that can cover a naturally aligned run of ptes mapping
+ * physically contiguous memory with a single TLB entry (the arm64
+ * contiguous bit) override these.
+ */
+unsigned int __weak arch_vmap_pte_cont_shift(void)
+{
+	return PAGE_SHIFT;
+}
+
+pgprot_t __weak arch_vmap_pte_cont_prot(pgprot_t prot)
+{
+	return prot;
+}
+
 static void vunmap_pte_range(pmd_t *pmd, unsigned long addr, unsigned long end)
 {
 	pte_t *pte;
@@ -132,7 +147,8 @@ static void vunmap_page_range(unsigned long addr, unsigned long end)
 }
 
 static int vmap_pte_range(pmd_t *pmd, unsigned long addr,
-		unsigned long end, pgprot_t prot, struct page **pages, int *nr)
+		unsigned long end, pgprot_t prot, struct page **pages, int *nr,
+		unsigned int page_shift)
 {
 	pte_t *pte;
 
@@ -141,6 +157,10 @@ static int vmap_pte_range(pmd_t *pmd, unsigned long addr,
 	 * callers keep track of where we're up to.
 	 */
 
+	/* naturally aligned, physically contiguous blocks: one TLB entry each */
+	if (page_shift >= arch_vmap_pte_cont_shift())
+		prot = arch_vmap_pte_cont_prot(prot);
+
 	pte = pte_alloc_kernel(pmd, addr);
 	if (!pte)
 		return -ENOMEM;
@@ -157,8 +177,29 @@ static int vmap_pte_range(pmd_t *pmd, unsigned long addr,
 	return 0;
 }
 
+/*
+ * Map a whole PMD_SIZE block of a huge vmalloc area with a single pmd.  A
+ * pte table left behind by an earlier, since purged, user of the range
+ * is empty and gets freed first.
+ */
+static int vmap_try_huge_pmd(pmd_t *pmd, unsigned long addr,
+			     unsigned long end, pgprot_t prot, struct page *page)
+{
+	phys_addr_t phys = PFN_PHYS(page_to_pfn(page));
+
+	if (end - addr != PMD_SIZE)
+		return 0;
+	if (!IS_ALIGNED(addr, PMD_SIZE) || !IS_ALIGNED(phys, PMD_SIZE))
+		return 0;
+	if (pmd_present(*pmd) && !pmd_free_pte_page(pmd, addr))
+		return 0;
+
+	return pmd_set_huge(pmd, phys, prot);
+}
+
 static int vmap_pmd_range(pud_t *pud, unsigned long addr,
-		unsigned long end, pgprot_t prot, struct page **pages, int *nr)
+		unsigned long end, pgprot_t prot, struct page **pages, int *nr,
+		unsigned int page_shift)
 {
 	pmd_t *pmd;
 	unsigned long next;
@@ -168,14 +209,21 @@ static int vmap_pmd_range(pud_t *pud, unsigned long addr,
 		return -ENOMEM;
 	do {
 		next = pmd_addr_end(addr, end);
-		if (vmap_pte_range(pmd, addr, next, prot, pages, nr))
+		if (page_shift == PMD_SHIFT &&
+		    vmap_try_huge_pmd(pmd, addr, next, prot, pages[*nr])) {
+			*nr += 1 << (PMD_SHIFT - PAGE_SHIFT);
+			continue;
+		}
+		if (vmap_pte_range(pmd, addr, next, prot, pages, nr,
+				   page_shift))
 			return -ENOMEM;
 	} while (pmd++, addr = next, addr != end);
 	return 0;
 }
 
 static int vmap_pud_range(p4d_t *p4d, unsigned long addr,
-		unsigned long end, pgprot_t prot, struct page **pages, int *nr)
+		unsigned long end, pgprot_t prot, struct page **pages, int *nr,
+		unsigned int page_shift)
 {
 	pud_t *pud;
 	unsigned long next;
@@ -185,14 +233,16 @@ static int vmap_pud_range(p4d_t *p4d, unsigned long addr,
 		return -ENOMEM;
 	do {
 		next = pud_addr_end(addr, end);
-		if (vmap_pmd_range(pud, addr, next, prot, pages, nr))
+		if (vmap_pmd_range(pud, addr, next, prot, pages, nr,
+				   page_shift))
 			return -ENOMEM;
 	} while (pud++, addr = next, addr != end);
 	return 0;
 }
 
 static int vmap_p4d_range(pgd_t *pgd, unsigned long addr,
-		unsigned long end, pgprot_t prot, struct page **pages, int *nr)
+		unsigned long end, pgprot_t prot, struct page **pages, int *nr,
+		unsigned int page_shift)
 {
 	p4d_t *p4d;
 	unsigned long next;
@@ -202,7 +252,8 @@ static int vmap_p4d_range(pgd_t *pgd, unsigned long addr,
 		return -ENOMEM;
 	do {
 		next = p4d_addr_end(addr, end);
-		if (vmap_pud_range(p4d, addr, next, prot, pages, nr))
+		if (vmap_pud_range(p4d, addr, next, prot, pages, nr,
+				   page_shift))
 			return -ENOMEM;
 	} while (p4d++, addr = next, addr != end);
 	return 0;
@@ -213,9 +264,14 @@ static int vmap_p4d_range(pgd_t *pgd, unsigned long addr,
  * will have pfns corresponding to the "pages" array.
  *
  * Ie. pte at addr+N*PAGE_SIZE shall point to pfn corresponding to pages[N]
+ *
+ * With @page_shift above PAGE_SHIFT, every 1 << page_shift block of @pages
+ * is physically contiguous and naturally aligned, and may be mapped with
+ * a huge pmd or contiguous ptes.
  */
 static int vmap_page_range_noflush(unsigned long start, unsigned long end,
-				   pgprot_t prot, struct page **pages)
+				   pgprot_t prot, struct page **pages,
+				   unsigned int page_shift)
 {
 	pgd_t *pgd;
 	/**
@@ -236,7 +292,8 @@ static int vmap_page_range_noflush(unsigned long start, unsigned long end,
 	 */
 	do {
 		next = pgd_addr_end(addr, end);
-		err = vmap_p4d_range(pgd, addr, next, prot, pages, &nr);
+		err = vmap_p4d_range(pgd, addr, next, prot, pages, &nr,
+				     page_shift);
 		if (err)
 			return err;
 	} while (pgd++, addr = next, addr != end);
@@ -245,11 +302,12 @@ static int vmap_page_range_noflush(unsigned long start, unsigned long end,
 }
 
 static int vmap_page_range(unsigned long start, unsigned long end,
-			   pgprot_t prot, struct page **pages)
+			   pgprot_t prot, struct page **pages,
+			   unsigned int page_shift)
 {
 	int ret;
 
-	ret = vmap_page_range_noflush(start, end, prot, pages);
+	ret = vmap_page_range_noflush(start, end, prot, pages, page_shift);
 	/*
 	 * 有些体系结构在修改页表后需要刷出CPU高速缓存。因此内核调用了
 	 * flush_cache_vmap()，其定义是特定于体系结构的。取决于不同的CPU类型，
@@ -314,6 +372,13 @@ struct page *vmalloc_to_page(const void *vmalloc_addr)
 	if (pud_none(*pud) || pud_bad(*pud))
 		return NULL;
 	pmd = pmd_offset(pud, addr);
+	/*
+	 * A block of a huge vmalloc area, see vmap_try_huge_pmd().  Its high
+	 * order pages were split, so each small page stands on its own.
+	 */
+	if (IS_ENABLED(CONFIG_HAVE_ARCH_HUGE_VMAP) &&
+	    pmd_present(*pmd) && pmd_bad(*pmd))
+		return pmd_page(*pmd) + ((addr & ~PMD_MASK) >> PAGE_SHIFT);
 	WARN_ON_ONCE(pmd_bad(*pmd));
 	if (pmd_none(*pmd) || pmd_bad(*pmd))
 		return NULL;
@@ -342,19 +407,40 @@ EXPORT_SYMBOL(vmalloc_to_pfn);
 #define VM_LAZY_FREE	0x02
 #define VM_VM_AREA	0x04
 
+/*
+ * Allocated areas live in the busy tree (vmap_area_root, vmap_area_list)
+ * under vmap_area_lock.  Unallocated address space lives in the free tree
+ * under free_vmap_area_lock: one vmap_area per free range, augmented with
+ * the largest free range in each subtree so that a fitting range is found
+ * in O(log n).  The two locks never nest.
+ */
 static DEFINE_SPINLOCK(vmap_area_lock);
+static DEFINE_SPINLOCK(free_vmap_area_lock);
 /* Export for kexec only */
 LIST_HEAD(vmap_area_list);
 static LLIST_HEAD(vmap_purge_list);
 static struct rb_root vmap_area_root = RB_ROOT;
 
-/* The vmap cache globals are protected by vmap_area_lock */
-static struct rb_node *free_vmap_cache;
-static unsigned long cached_hole_size;
-static unsigned long cached_vstart;
-static unsigned long cached_align;
+static LIST_HEAD(free_vmap_area_list);
+static struct rb_root free_vmap_area_root = RB_ROOT;
+
+/*
+ * Per-CPU caches of free ranges of the common small sizes (thread stacks,
+ * small vmalloc()s, including the guard page), so that those allocations
+ * normally touch neither the free tree nor its lock.  A cached range is a
+ * vmap_area on no tree, already unmapped and flushed from the TLB.
+ */
+#define VMAP_CACHE_CLASSES	8	/* one class per size, 1..8 pages */
+#define VMAP_CACHE_BATCH	8	/* ranges carved per refill */
+#define VMAP_CACHE_HIGH		(2 * VMAP_CACHE_BATCH)
+
+struct vmap_cache {
+	spinlock_t lock;
+	unsigned int nr[VMAP_CACHE_CLASSES];
+	struct list_head free[VMAP_CACHE_CLASSES];
+};
 
-static unsigned long vmap_area_pcpu_hole;
+static DEFINE_PER_CPU(struct vmap_cache, vmap_cache);
 
 static struct vmap_area *__find_vmap_area(unsigned long addr)
 {
@@ -402,9 +488,502 @@ static void __insert_vmap_area(struct vmap_area *va)
 	if (tmp) {
 		struct vmap_area *prev;
 		prev = rb_entry(tmp, struct vmap_area, rb_node);
-		list_add_rcu(&va->list, &prev->list);
+		list_add(&va->list, &prev->list);
 	} else
-		list_add_rcu(&va->list, &vmap_area_list);
+		list_add(&va->list, &vmap_area_list);
+}
+
+/* Take @va off the busy tree, the caller decides where the range goes */
+static void __unlink_vmap_area(struct vmap_area *va)
+{
+	BUG_ON(RB_EMPTY_NODE(&va->rb_node));
+
+	rb_erase(&va->rb_node, &vmap_area_root);
+	RB_CLEAR_NODE(&va->rb_node);
+	list_del(&va->list);
+}
+
+/*** Free space tree ***/
+
+static inline unsigned long va_size(struct vmap_area *va)
+{
+	return va->va_end - va->va_start;
+}
+
+static inline unsigned long get_subtree_max_size(struct rb_node *node)
+{
+	struct vmap_area *va;
+
+	va = rb_entry_safe(node, struct vmap_area, rb_node);
+	return va ? va->subtree_max_size : 0;
+}
+
+static inline unsigned long compute_subtree_max_size(struct vmap_area *va)
+{
+	return max3(va_size(va),
+		    get_subtree_max_size(va->rb_node.rb_left),
+		    get_subtree_max_size(va->rb_node.rb_right));
+}
+
+RB_DECLARE_CALLBACKS(static, free_vmap_area_rb_augment_cb,
+		     struct vmap_area, rb_node, unsigned long,
+		     subtree_max_size, compute_subtree_max_size)
+
+/* @va changed size, fix up subtree_max_size on the way to the root */
+static inline void free_vmap_area_propagate(struct vmap_area *va)
+{
+	free_vmap_area_rb_augment_cb_propagate(&va->rb_node, NULL);
+}
+
+static struct rb_node **find_free_vmap_area_link(struct vmap_area *va,
+						 struct rb_node **parent)
+{
+	struct rb_node **link = &free_vmap_area_root.rb_node;
+	struct vmap_area *tmp_va;
+
+	*parent = NULL;
+	while (*link) {
+		*parent = *link;
+		tmp_va = rb_entry(*parent, struct vmap_area, rb_node);
+		if (va->va_end <= tmp_va->va_start)
+			link = &(*link)->rb_left;
+		else if (va->va_start >= tmp_va->va_end)
+			link = &(*link)->rb_right;
+		else
+			/* the same range freed twice */
+			BUG();
+	}
+
+	return link;
+}
+
+static void link_free_vmap_area(struct vmap_area *va, struct rb_node *parent,
+				struct rb_node **link)
+{
+	unsigned long size = va_size(va);
+	struct rb_node *p;
+
+	/* a new leaf is the neighbour of its parent in address order */
+	if (parent) {
+		struct vmap_area *pva = rb_entry(parent, struct vmap_area, rb_node);
+
+		if (link == &parent->rb_right)
+			list_add(&va->list, &pva->list);
+		else
+			list_add_tail(&va->list, &pva->list);
+	} else
+		list_add(&va->list, &free_vmap_area_list);
+
+	/*
+	 * Make the ancestors account for the new range before rebalancing,
+	 * the rotate callback relies on the subtree values being right.
+	 */
+	va->subtree_max_size = size;
+	rb_link_node(&va->rb_node, parent, link);
+	for (p = parent; p; p = rb_parent(p)) {
+		struct vmap_area *tmp_va = rb_entry(p, struct vmap_area, rb_node);
+
+		if (tmp_va->subtree_max_size >= size)
+			break;
+		tmp_va->subtree_max_size = size;
+	}
+	rb_insert_augmented(&va->rb_node, &free_vmap_area_root,
+			    &free_vmap_area_rb_augment_cb);
+}
+
+static void unlink_free_vmap_area(struct vmap_area *va)
+{
+	rb_erase_augmented(&va->rb_node, &free_vmap_area_root,
+			   &free_vmap_area_rb_augment_cb);
+	RB_CLEAR_NODE(&va->rb_node);
+	list_del(&va->list);
+}
+
+/*
+ * Give a range back to the free tree, merging it with the free ranges on
+ * either side.  @va is freed if it was merged.
+ */
+static void merge_or_add_free_vmap_area(struct vmap_area *va)
+{
+	struct rb_node *parent;
+	struct rb_node **link;
+	struct list_head *next;
+	struct vmap_area *sibling;
+	bool merged = false;
+
+	lockdep_assert_held(&free_vmap_area_lock);
+
+	link = find_free_vmap_area_link(va, &parent);
+
+	/* the free range that would follow @va in address order */
+	if (!parent)
+		next = &free_vmap_area_list;
+	else if (link == &parent->rb_right)
+		next = rb_entry(parent, struct vmap_area, rb_node)->list.next;
+	else
+		next = &rb_entry(parent, struct vmap_area, rb_node)->list;
+
+	if (next != &free_vmap_area_list) {
+		sibling = list_entry(next, struct vmap_area, list);
+		if (sibling->va_start == va->va_end) {
+			sibling->va_start = va->va_start;
+			free_vmap_area_propagate(sibling);
+			kfree(va);
+			va = sibling;
+			merged = true;
+		}
+	}
+
+	if (next->prev != &free_vmap_area_list) {
+		sibling = list_entry(next->prev, struct vmap_area, list);
+		if (sibling->va_end == va->va_start) {
+			sibling->va_end = va->va_end;
+			free_vmap_area_propagate(sibling);
+			if (merged)
+				unlink_free_vmap_area(va);
+			kfree(va);
+			return;
+		}
+	}
+
+	if (!merged)
+		link_free_vmap_area(va, parent, link);
+}
+
+static inline bool is_within_this_va(struct vmap_area *va, unsigned long size,
+				     unsigned long align, unsigned long vstart)
+{
+	unsigned long nva_start_addr;
+
+	if (va->va_start > vstart)
+		nva_start_addr = ALIGN(va->va_start, align);
+	else
+		nva_start_addr = ALIGN(vstart, align);
+
+	/* Can be overflowed due to big size or alignment. */
+	if (nva_start_addr + size < nva_start_addr ||
+			nva_start_addr < vstart)
+		return false;
+
+	return nva_start_addr + size <= va->va_end;
+}
+
+/*
+ * Find the lowest free range at or above @vstart that can hold @size bytes
+ * aligned to @align.  Subtrees whose largest range cannot hold the request
+ * even in the worst alignment case are skipped.
+ */
+static struct vmap_area *find_vmap_lowest_match(unsigned long size,
+		unsigned long align, unsigned long vstart)
+{
+	struct vmap_area *va;
+	struct rb_node *node;
+	unsigned long length;
+
+	node = free_vmap_area_root.rb_node;
+
+	/* Adjust the search size for alignment overhead. */
+	length = size + align - 1;
+
+	while (node) {
+		va = rb_entry(node, struct vmap_area, rb_node);
+
+		if (get_subtree_max_size(node->rb_left) >= length &&
+				vstart < va->va_start) {
+			node = node->rb_left;
+		} else {
+			if (is_within_this_va(va, size, align, vstart))
+				return va;
+
+			if (get_subtree_max_size(node->rb_right) >= length) {
+				node = node->rb_right;
+				continue;
+			}
+
+			/*
+			 * Nothing on the right, climb back up to the first
+			 * ancestor with a fitting right subtree we have not
+			 * been into yet.  Moving vstart past the ancestor
+			 * keeps us from going down the same subtree again.
+			 */
+			while ((node = rb_parent(node))) {
+				va = rb_entry(node, struct vmap_area, rb_node);
+				if (is_within_this_va(va, size, align, vstart))
+					return va;
+
+				if (get_subtree_max_size(node->rb_right) >= length &&
+						vstart <= va->va_start) {
+					vstart = va->va_start + 1;
+					node = node->rb_right;
+					break;
+				}
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Carve [@nva_start_addr, +@size) out of the free range @va.  Cutting
+ * from the middle leaves two free ranges and needs a second vmap_area:
+ * *@spare if the caller preallocated one, else an atomic allocation.
+ * Returns -ENOMEM if neither worked, so the caller can preallocate with
+ * its own gfp mask and retry.
+ */
+static int adjust_va_to_fit(struct vmap_area *va, unsigned long nva_start_addr,
+			    unsigned long size, struct vmap_area **spare)
+{
+	unsigned long nva_end_addr = nva_start_addr + size;
+	struct vmap_area *lva;
+
+	if (WARN_ON_ONCE(nva_start_addr < va->va_start ||
+			 nva_end_addr > va->va_end))
+		return -EBUSY;
+
+	if (va->va_start == nva_start_addr) {
+		if (va->va_end == nva_end_addr) {
+			/* used up */
+			unlink_free_vmap_area(va);
+			kfree(va);
+			return 0;
+		}
+		/* cut off the left edge */
+		va->va_start = nva_end_addr;
+	} else if (va->va_end == nva_end_addr) {
+		/* cut off the right edge */
+		va->va_end = nva_start_addr;
+	} else {
+		/* cut out of the middle, the left part becomes a new range */
+		lva = *spare;
+		if (lva)
+			*spare = NULL;
+		else
+			lva = kmalloc(sizeof(struct vmap_area),
+				      GFP_NOWAIT | __GFP_NOWARN);
+		if (!lva)
+			return -ENOMEM;
+
+		lva->va_start = va->va_start;
+		lva->va_end = nva_start_addr;
+		va->va_start = nva_end_addr;
+		free_vmap_area_propagate(va);
+		merge_or_add_free_vmap_area(lva);
+		return 0;
+	}
+
+	free_vmap_area_propagate(va);
+	return 0;
+}
+
+/*
+ * Take the lowest fitting range out of the free tree.  Returns 0 and the
+ * start address in *@addr, -EBUSY if there is no room, or -ENOMEM, see
+ * adjust_va_to_fit().
+ */
+static int __alloc_vmap_range(unsigned long size, unsigned long align,
+			      unsigned long vstart, unsigned long vend,
+			      struct vmap_area **spare, unsigned long *addr)
+{
+	unsigned long nva_start_addr;
+	struct vmap_area *va;
+	int ret;
+
+	lockdep_assert_held(&free_vmap_area_lock);
+
+	va = find_vmap_lowest_match(size, align, vstart);
+	if (unlikely(!va))
+		return -EBUSY;
+
+	if (va->va_start > vstart)
+		nva_start_addr = ALIGN(va->va_start, align);
+	else
+		nva_start_addr = ALIGN(vstart, align);
+
+	/* this is the lowest fit, nothing higher will end below vend */
+	if (nva_start_addr + size > vend)
+		return -EBUSY;
+
+	ret = adjust_va_to_fit(va, nva_start_addr, size, spare);
+	if (ret)
+		return ret;
+
+	*addr = nva_start_addr;
+	return 0;
+}
+
+/*
+ * Free space is everything in [1, ULONG_MAX] that the early vmlist
+ * entries, already in the busy tree, do not cover.
+ */
+static void __init vmap_init_free_space(void)
+{
+	unsigned long vmap_start = 1;
+	const unsigned long vmap_end = ULONG_MAX;
+	struct vmap_area *busy, *free;
+
+	list_for_each_entry(busy, &vmap_area_list, list) {
+		if (busy->va_start - vmap_start > 0) {
+			free = kzalloc(sizeof(struct vmap_area), GFP_NOWAIT);
+			if (!WARN_ON_ONCE(!free)) {
+				free->va_start = vmap_start;
+				free->va_end = busy->va_start;
+				merge_or_add_free_vmap_area(free);
+			}
+		}
+
+		vmap_start = busy->va_end;
+	}
+
+	if (vmap_end - vmap_start > 0) {
+		free = kzalloc(sizeof(struct vmap_area), GFP_NOWAIT);
+		if (!WARN_ON_ONCE(!free)) {
+			free->va_start = vmap_start;
+			free->va_end = vmap_end;
+			merge_or_add_free_vmap_area(free);
+		}
+	}
+}
+
+/*** Per-CPU free range caches ***/
+
+/*
+ * Only plain vmalloc space is cached, module and other special ranges
+ * always go to the free tree.
+ */
+static inline int vmap_cache_class(unsigned long size)
+{
+	unsigned long nr = size >> PAGE_SHIFT;
+
+	return nr <= VMAP_CACHE_CLASSES ? nr - 1 : -1;
+}
+
+/*
+ * Look for a cached range with the requested alignment.  *@refill is set
+ * if this CPU has nothing of this size left, so the caller should take a
+ * batch from the free tree.
+ */
+static struct vmap_area *vmap_cache_get(int cls, unsigned long align,
+					bool *refill)
+{
+	struct vmap_cache *vc;
+	struct vmap_area *va, *found = NULL;
+
+	vc = get_cpu_ptr(&vmap_cache);
+	spin_lock(&vc->lock);
+	list_for_each_entry(va, &vc->free[cls], list) {
+		if (IS_ALIGNED(va->va_start, align)) {
+			list_del(&va->list);
+			vc->nr[cls]--;
+			found = va;
+			break;
+		}
+	}
+	*refill = !vc->nr[cls];
+	spin_unlock(&vc->lock);
+	put_cpu_ptr(&vmap_cache);
+
+	return found;
+}
+
+/* Returns false if @cpu's cache for this size is full or there is none */
+static bool vmap_cache_put(struct vmap_area *va, int cpu)
+{
+	int cls = vmap_cache_class(va_size(va));
+	struct vmap_cache *vc;
+	bool cached = false;
+
+	if (cls < 0 || va->va_start < VMALLOC_START || va->va_end > VMALLOC_END)
+		return false;
+
+	vc = &per_cpu(vmap_cache, cpu);
+	spin_lock(&vc->lock);
+	if (vc->nr[cls] < VMAP_CACHE_HIGH) {
+		list_add(&va->list, &vc->free[cls]);
+		vc->nr[cls]++;
+		cached = true;
+	}
+	spin_unlock(&vc->lock);
+
+	return cached;
+}
+
+/*
+ * Carve a batch of ranges like the one just allocated in a single trip to
+ * the free tree and park them in this CPU's cache.  Best effort.
+ */
+static void vmap_cache_refill(unsigned long size, unsigned long align,
+			      unsigned long vstart, unsigned long vend,
+			      int node, gfp_t gfp_mask)
+{
+	struct vmap_area *vas[VMAP_CACHE_BATCH];
+	struct vmap_area *spare = NULL;
+	int cpu, i, nr, carved;
+
+	for (nr = 0; nr < VMAP_CACHE_BATCH; nr++) {
+		vas[nr] = kmalloc_node(sizeof(struct vmap_area),
+				(gfp_mask & GFP_RECLAIM_MASK) | __GFP_NOWARN,
+				node);
+		if (!vas[nr])
+			break;
+		kmemleak_scan_area(&vas[nr]->rb_node, SIZE_MAX,
+				   gfp_mask & GFP_RECLAIM_MASK);
+	}
+
+	spin_lock(&free_vmap_area_lock);
+	for (carved = 0; carved < nr; carved++) {
+		struct vmap_area *va = vas[carved];
+
+		if (__alloc_vmap_range(size, align, vstart, vend, &spare,
+				       &va->va_start))
+			break;
+		va->va_end = va->va_start + size;
+	}
+	spin_unlock(&free_vmap_area_lock);
+
+	cpu = get_cpu();
+	for (i = 0; i < carved; i++)
+		if (!vmap_cache_put(vas[i], cpu))
+			break;
+	put_cpu();
+
+	/* somebody else filled the cache meanwhile */
+	if (i < carved) {
+		spin_lock(&free_vmap_area_lock);
+		for (; i < carved; i++)
+			merge_or_add_free_vmap_area(vas[i]);
+		spin_unlock(&free_vmap_area_lock);
+	}
+
+	for (i = carved; i < nr; i++)
+		kfree(vas[i]);
+}
+
+/* Hand every cached range back to the free tree */
+static void vmap_cache_drain_all(void)
+{
+	struct vmap_area *va, *n_va;
+	LIST_HEAD(list);
+	int cpu, cls;
+
+	for_each_possible_cpu(cpu) {
+		struct vmap_cache *vc = &per_cpu(vmap_cache, cpu);
+
+		spin_lock(&vc->lock);
+		for (cls = 0; cls < VMAP_CACHE_CLASSES; cls++) {
+			list_splice_init(&vc->free[cls], &list);
+			vc->nr[cls] = 0;
+		}
+		spin_unlock(&vc->lock);
+	}
+
+	spin_lock(&free_vmap_area_lock);
+	list_for_each_entry_safe(va, n_va, &list, list) {
+		list_del(&va->list);
+		merge_or_add_free_vmap_area(va);
+		cond_resched_lock(&free_vmap_area_lock);
+	}
+	spin_unlock(&free_vmap_area_lock);
 }
 
 static void purge_vmap_area_lazy(void);
@@ -421,11 +1000,11 @@ static struct vmap_area *alloc_vmap_area(unsigned long size,
 				unsigned long vstart, unsigned long vend,
 				int node, gfp_t gfp_mask)
 {
-	struct vmap_area *va;
-	struct rb_node *n;
+	struct vmap_area *va, *spare = NULL;
 	unsigned long addr;
+	bool refill = false;
 	int purged = 0;
-	struct vmap_area *first;
+	int cls, ret;
     /**
          * 这几种情况都是不可饶恕的错误:
          *        长度为0
@@ -438,6 +1017,17 @@ static struct vmap_area *alloc_vmap_area(unsigned long size,
 	BUG_ON(!is_power_of_2(align));
 
 	might_sleep();
+
+	/* 小块的分配先看本CPU有没有缓存的空闲区间 */
+	cls = -1;
+	if (vstart == VMALLOC_START && vend == VMALLOC_END)
+		cls = vmap_cache_class(size);
+	if (cls >= 0) {
+		va = vmap_cache_get(cls, align, &refill);
+		if (va)
+			goto insert;
+	}
+
     /* KVA地址空间通过vmap_area结构进行管理，
     这里分配一个vmap_area描述符。
     与vm_struct不同，vm_struct仅仅代表一个与vmalloc对应的地址空间 */
@@ -453,114 +1043,38 @@ static struct vmap_area *alloc_vmap_area(unsigned long size,
 	kmemleak_scan_area(&va->rb_node, SIZE_MAX, gfp_mask & GFP_RECLAIM_MASK);
 
 retry:
-    /* 获得保护KVA红黑树的自旋锁 */
-	spin_lock(&vmap_area_lock);
-	/*
-	 * Invalidate cache if we have more permissive parameters.
-	 * cached_hole_size notes the largest hole noticed _below_
-	 * the vmap_area cached in free_vmap_cache: if size fits
-	 * into that hole, we want to scan from vstart to reuse
-	 * the hole instead of allocating above free_vmap_cache.
-	 * Note that __free_vmap_area may update free_vmap_cache
-	 * without updating cached_hole_size or cached_align.
-	 */
-	if (!free_vmap_cache ||
-			size < cached_hole_size ||
-			vstart < cached_vstart ||
-			align < cached_align) {
-nocache:
-		cached_hole_size = 0;
-		free_vmap_cache = NULL;
-	}
-	/* record if we encounter less permissive parameters */
-	cached_vstart = vstart;
-	cached_align = align;
-
-	/* find starting point for our search */
-	/* 从上次分配的区域开始向后查找 */
-	if (free_vmap_cache) {
-	/* 得到上次分配的KVA描述符 */
-		first = rb_entry(free_vmap_cache, struct vmap_area, rb_node);
-    /* 上次分配的结束地址向上对齐，得到本次可用的地址 */
-		addr = ALIGN(first->va_end, align);
-		/* 可用地址小于我们的起始地址，缓存失效 */
-		if (addr < vstart)
-			goto nocache;
-	 /**
-         * 溢出，说明地址空间不足。 
-         * 初看似乎这里有点问题，因为从上次分配的结点开始向后查找可用空间，即使后面的可用空间不足，也不能表示真的没有可用空间了。
-         * 因为前面已经分配的空间之间应该还有空洞。
-         * 实际上内核这样处理是没有问题。请阅读时注意。
-         */
-		if (addr + size < addr)
-			goto overflow;
-
-	} else {
-	/* 将虚拟地址向上对齐，对vmalloc来说，vstart表示可以使用的虚拟地址空间起始地址 */
-		addr = ALIGN(vstart, align);
-		/* 长度太长，造成整形溢出，退出。这类检查可以防止安全方面的问题 */
-		if (addr + size < addr)
-			goto overflow;
-        /* 获取KVA(应该是指kernel vitural address)红黑树的根，从根开始遍历树 */
-		n = vmap_area_root.rb_node;
-		first = NULL;
-        /* 遍历红黑树 */
-		while (n) {
-			struct vmap_area *tmp;
-			/* 获取当前红黑树节点对应的vmap_area描述符 */
-			tmp = rb_entry(n, struct vmap_area, rb_node);
-			if (tmp->va_end >= addr) {
-			/* 该区域结束地址大于我们要搜索的起始地址 */
-				first = tmp;
-				if (tmp->va_start <= addr)
-				/* 该区域起始地址小于我们要搜索的起始地址 */
-                /* 这种情况下，说明我们可以从当前节点开始查找地址空间了 */
-					break;
-				/* 否则，说明该节点还位于较高端，我们移动到树的左节点上，查找更小的区域 */
-				n = n->rb_left;
-			} else
-			/* 否则说明该节点代表的区域还比较小，我们需要移动到右节点上，查找更大的区域 */
-				n = n->rb_right;
+	/* 在空闲区间树中找满足对齐要求的最低地址的空闲区间 */
+	spin_lock(&free_vmap_area_lock);
+	ret = __alloc_vmap_range(size, align, vstart, vend, &spare, &addr);
+	spin_unlock(&free_vmap_area_lock);
+
+	if (unlikely(ret == -ENOMEM)) {
+		spare = kmalloc_node(sizeof(struct vmap_area),
+				gfp_mask & GFP_RECLAIM_MASK, node);
+		if (!spare) {
+			kfree(va);
+			return ERR_PTR(-ENOMEM);
 		}
-        /* 我们要查找的区域大于当前树中所有的区域，说明我们的地址区间还没有被占用 */
-		if (!first)
-			goto found;
-	}
-
-	/* from the starting point, walk areas until a suitable hole is found */
-    /* 运行到这里，说明我们要查找的区间位于红黑树的区域范围内，从当前节点开始，搜索合适大小的区间空洞 */
-	while (addr + size > first->va_start && addr + size <= vend) {
-	/* 要求的地址空间与当前节点重叠，说明需要向后移动节点，查找更高范围的地址空间 */
-		if (addr + cached_hole_size < first->va_start)
-		/* 根据当前地址到当前区间的起始地址之间有距离，计算空洞大小 */
-			cached_hole_size = first->va_start - addr;
-        /* 可用地址是当前区间结束地址向上对齐的地址 */
-		addr = ALIGN(first->va_end, align);
-		/* 整形溢出了，退出。说明空间不足。 */
-		if (addr + size < addr)
-			goto overflow;
-
-		if (list_is_last(&first->list, &vmap_area_list))
-			goto found;
-
-		first = list_next_entry(first, list);
+		goto retry;
 	}
-
-found:
-    /* 可用地址加上分配长度超过了分配范围，说明地址空间不足了，退出 */
-	if (addr + size > vend)
+	if (ret)
 		goto overflow;
-    /* 运行到这里，说明找到合适的地址区间，初始化KVA数据结构 */
+
 	va->va_start = addr;
 	va->va_end = addr + size;
+
+	if (refill)
+		vmap_cache_refill(size, align, vstart, vend, node, gfp_mask);
+
+insert:
 	va->flags = 0;
 	/* 将分配的vmap_area插入到红黑树中，代表这一段地址空间已经从KVA中分配出去了 */
+	spin_lock(&vmap_area_lock);
 	__insert_vmap_area(va);
-	/* 记录下本次分配的空间，下次分配可从该节点开始搜索，提高搜索速度用 */
-	free_vmap_cache = &va->rb_node;
-	/* 释放KVA红黑树的自旋锁 */
 	spin_unlock(&vmap_area_lock);
 
+	kfree(spare);
+
 	BUG_ON(!IS_ALIGNED(va->va_start, align));
 	BUG_ON(va->va_start < vstart);
 	BUG_ON(va->va_end > vend);
@@ -568,8 +1082,6 @@ found:
 	return va;
     /* 运行到这里，说明地址空间不足 */
 overflow:
-    /* 首先释放自旋锁 */
-	spin_unlock(&vmap_area_lock);
 	/* 如果我们还没有进行KVA地址空间清理(如果幸运的话，我们可以清理出一些可用空间) */
 	if (!purged) {
 	/* 清理懒模式下没有及时释放的KVA空间，内核中经常用到懒模式，性能方面的原因 */
@@ -594,6 +1106,7 @@ overflow:
 			size);
     /* 没有分配到可用空间，释放临时分配的KVA描述符 */
 	kfree(va);
+	kfree(spare);
 	return ERR_PTR(-EBUSY);
 }
 
@@ -609,49 +1122,18 @@ int unregister_vmap_purge_notifier(struct notifier_block *nb)
 }
 EXPORT_SYMBOL_GPL(unregister_vmap_purge_notifier);
 
-static void __free_vmap_area(struct vmap_area *va)
-{
-	BUG_ON(RB_EMPTY_NODE(&va->rb_node));
-
-	if (free_vmap_cache) {
-		if (va->va_end < cached_vstart) {
-			free_vmap_cache = NULL;
-		} else {
-			struct vmap_area *cache;
-			cache = rb_entry(free_vmap_cache, struct vmap_area, rb_node);
-			if (va->va_start <= cache->va_start) {
-				free_vmap_cache = rb_prev(&va->rb_node);
-				/*
-				 * We don't try to update cached_hole_size or
-				 * cached_align, but it won't go very wrong.
-				 */
-			}
-		}
-	}
-	rb_erase(&va->rb_node, &vmap_area_root);
-	RB_CLEAR_NODE(&va->rb_node);
-	list_del_rcu(&va->list);
-
-	/*
-	 * Track the highest possible candidate for pcpu area
-	 * allocation.  Areas outside of vmalloc area can be returned
-	 * here too, consider only end addresses which fall inside
-	 * vmalloc area proper.
-	 */
-	if (va->va_end > VMALLOC_START && va->va_end <= VMALLOC_END)
-		vmap_area_pcpu_hole = max(vmap_area_pcpu_hole, va->va_end);
-
-	kfree_rcu(va, rcu_head);
-}
-
 /*
  * Free a region of KVA allocated by alloc_vmap_area
  */
 static void free_vmap_area(struct vmap_area *va)
 {
 	spin_lock(&vmap_area_lock);
-	__free_vmap_area(va);
+	__unlink_vmap_area(va);
 	spin_unlock(&vmap_area_lock);
+
+	spin_lock(&free_vmap_area_lock);
+	merge_or_add_free_vmap_area(va);
+	spin_unlock(&free_vmap_area_lock);
 }
 
 /*
@@ -688,6 +1170,8 @@ static unsigned long lazy_max_pages(void)
 }
 
 static atomic_t vmap_lazy_nr = ATOMIC_INIT(0);
+/* the next free purges synchronously, see set_iounmap_nonlazy() */
+static atomic_t vmap_purge_nonlazy = ATOMIC_INIT(0);
 
 /*
  * Serialize vmap purging.  There is no actual criticial section protected
@@ -706,17 +1190,56 @@ static void purge_fragmented_blocks_allcpus(void);
 void set_iounmap_nonlazy(void)
 {
 	atomic_set(&vmap_lazy_nr, lazy_max_pages()+1);
+	atomic_set(&vmap_purge_nonlazy, 1);
+}
+
+/* purged areas handed back per trip to the vmap locks */
+#define VMAP_PURGE_BATCH	32
+
+/*
+ * Move flushed areas from the busy tree back to the cache of the CPU that
+ * freed them, or to the free tree when that cache is full.
+ */
+static void release_purged_vmap_areas(struct vmap_area **vas, int nr)
+{
+	unsigned long nr_pages = 0;
+	int i;
+
+	spin_lock(&vmap_area_lock);
+	for (i = 0; i < nr; i++) {
+		__unlink_vmap_area(vas[i]);
+		nr_pages += va_size(vas[i]) >> PAGE_SHIFT;
+	}
+	spin_unlock(&vmap_area_lock);
+
+	for (i = 0; i < nr; i++)
+		if (vmap_cache_put(vas[i], vas[i]->free_cpu))
+			vas[i] = NULL;
+
+	spin_lock(&free_vmap_area_lock);
+	for (i = 0; i < nr; i++)
+		if (vas[i])
+			merge_or_add_free_vmap_area(vas[i]);
+	spin_unlock(&free_vmap_area_lock);
+
+	atomic_sub(nr_pages, &vmap_lazy_nr);
 }
 
 /*
  * Purges all lazily-freed vmap areas.
+ *
+ * One TLB flush covers the whole list, the areas are then released a
+ * batch at a time so allocators are not held off the trees for the length
+ * of a large purge.
  */
 static bool __purge_vmap_area_lazy(unsigned long start, unsigned long end)
 {
+	struct vmap_area *batch[VMAP_PURGE_BATCH];
 	struct llist_node *valist;
 	struct vmap_area *va;
 	struct vmap_area *n_va;
 	bool do_free = false;
+	int nr = 0;
 
 	lockdep_assert_held(&vmap_purge_lock);
 
@@ -734,38 +1257,48 @@ static bool __purge_vmap_area_lazy(unsigned long start, unsigned long end)
 
 	flush_tlb_kernel_range(start, end);
 
-	spin_lock(&vmap_area_lock);
 	llist_for_each_entry_safe(va, n_va, valist, purge_list) {
-		int nr = (va->va_end - va->va_start) >> PAGE_SHIFT;
-
-		__free_vmap_area(va);
-		atomic_sub(nr, &vmap_lazy_nr);
-		cond_resched_lock(&vmap_area_lock);
+		batch[nr++] = va;
+		if (nr == VMAP_PURGE_BATCH) {
+			release_purged_vmap_areas(batch, nr);
+			nr = 0;
+			cond_resched();
+		}
 	}
-	spin_unlock(&vmap_area_lock);
+	if (nr)
+		release_purged_vmap_areas(batch, nr);
 	return true;
 }
 
 /*
- * Kick off a purge of the outstanding lazy areas. Don't bother if somebody
- * is already purging.
+ * Past this many times lazy_max_pages() the worker is evidently not
+ * keeping up, and the freeing side purges itself.
+ */
+#define VMAP_LAZY_HARD_FACTOR	2
+
+/*
+ * Purge in the background once enough lazy areas have built up, instead
+ * of making whoever crossed the limit pay for the flush.
  */
-static void try_purge_vmap_area_lazy(void)
+static void drain_vmap_area_work(struct work_struct *work)
 {
-	if (mutex_trylock(&vmap_purge_lock)) {
-		__purge_vmap_area_lazy(ULONG_MAX, 0);
-		mutex_unlock(&vmap_purge_lock);
-	}
+	mutex_lock(&vmap_purge_lock);
+	__purge_vmap_area_lazy(ULONG_MAX, 0);
+	mutex_unlock(&vmap_purge_lock);
 }
 
+static DECLARE_WORK(drain_vmap_work, drain_vmap_area_work);
+
 /*
- * Kick off a purge of the outstanding lazy areas.
+ * Kick off a purge of the outstanding lazy areas, and take back whatever
+ * the per-CPU caches are sitting on.
  */
 static void purge_vmap_area_lazy(void)
 {
 	mutex_lock(&vmap_purge_lock);
 	purge_fragmented_blocks_allcpus();
 	__purge_vmap_area_lazy(ULONG_MAX, 0);
+	vmap_cache_drain_all();
 	mutex_unlock(&vmap_purge_lock);
 }
 
@@ -781,11 +1314,25 @@ static void free_vmap_area_noflush(struct vmap_area *va)
 	nr_lazy = atomic_add_return((va->va_end - va->va_start) >> PAGE_SHIFT,
 				    &vmap_lazy_nr);
 
+	/* the purge returns the range to this CPU's cache */
+	va->free_cpu = raw_smp_processor_id();
+
 	/* After this point, we may free va at any time */
 	llist_add(&va->purge_list, &vmap_purge_list);
 
-	if (unlikely(nr_lazy > lazy_max_pages()))
-		try_purge_vmap_area_lazy();
+	if (unlikely(atomic_xchg(&vmap_purge_nonlazy, 0))) {
+		mutex_lock(&vmap_purge_lock);
+		__purge_vmap_area_lazy(ULONG_MAX, 0);
+		mutex_unlock(&vmap_purge_lock);
+	} else if (unlikely(nr_lazy > VMAP_LAZY_HARD_FACTOR * lazy_max_pages())) {
+		/* failing the trylock means a purge is running already */
+		if (mutex_trylock(&vmap_purge_lock)) {
+			__purge_vmap_area_lazy(ULONG_MAX, 0);
+			mutex_unlock(&vmap_purge_lock);
+		}
+	} else if (unlikely(nr_lazy > lazy_max_pages())) {
+		schedule_work(&drain_vmap_work);
+	}
 }
 
 /*
@@ -1237,7 +1784,7 @@ void *vm_map_ram(struct page **pages, unsigned int count, int node, pgprot_t pro
 		addr = va->va_start;
 		mem = (void *)addr;
 	}
-	if (vmap_page_range(addr, addr + size, prot, pages) < 0) {
+	if (vmap_page_range(addr, addr + size, prot, pages, PAGE_SHIFT) < 0) {
 		vm_unmap_ram(mem, count);
 		return NULL;
 	}
@@ -1308,6 +1855,8 @@ void __init vmalloc_init(void)
 	for_each_possible_cpu(i) {
 		struct vmap_block_queue *vbq;
 		struct vfree_deferred *p;
+		struct vmap_cache *vc;
+		int cls;
 
 		vbq = &per_cpu(vmap_block_queue, i);
 		spin_lock_init(&vbq->lock);
@@ -1315,6 +1864,10 @@ void __init vmalloc_init(void)
 		p = &per_cpu(vfree_deferred, i);
 		init_llist_head(&p->list);
 		INIT_WORK(&p->wq, free_work);
+		vc = &per_cpu(vmap_cache, i);
+		spin_lock_init(&vc->lock);
+		for (cls = 0; cls < VMAP_CACHE_CLASSES; cls++)
+			INIT_LIST_HEAD(&vc->free[cls]);
 	}
 
 	/* Import existing vmlist entries. */
@@ -1329,7 +1882,8 @@ void __init vmalloc_init(void)
 		__insert_vmap_area(va);
 	}
 
-	vmap_area_pcpu_hole = VMALLOC_END;
+	/* 其余的地址空间都放进空闲区间树 */
+	vmap_init_free_space();
 
 	vmap_initialized = true;
 }
@@ -1356,7 +1910,8 @@ void __init vmalloc_init(void)
 int map_kernel_range_noflush(unsigned long addr, unsigned long size,
 			     pgprot_t prot, struct page **pages)
 {
-	return vmap_page_range_noflush(addr, addr + size, prot, pages);
+	return vmap_page_range_noflush(addr, addr + size, prot, pages,
+				       PAGE_SHIFT);
 }
 
 /**
@@ -1408,7 +1963,8 @@ int map_vm_area(struct vm_struct *area, pgprot_t prot, struct page **pages)
 	unsigned long end = addr + get_vm_area_size(area);
 	int err;
 
-	err = vmap_page_range(addr, end, prot, pages);
+	err = vmap_page_range(addr, end, prot, pages,
+			      PAGE_SHIFT + area->page_order);
 
 	return err > 0 ? 0 : err;
 }
@@ -1816,6 +2372,38 @@ void *vmap(struct page **pages, unsigned int count,
 }
 EXPORT_SYMBOL(vmap);
 
+static bool vmap_allow_huge __ro_after_init = true;
+
+static int __init set_nohugevmalloc(char *str)
+{
+	vmap_allow_huge = false;
+	return 0;
+}
+early_param("nohugevmalloc", set_nohugevmalloc);
+
+/*
+ * Mapping granularity for a VM_ALLOW_HUGE_VMAP area of @size bytes.
+ * Without a node the pages are spread over the online nodes, so size the
+ * blocks by what each node ends up with.
+ */
+static unsigned int vmap_huge_shift(unsigned long size, int node)
+{
+	unsigned int cont_shift = arch_vmap_pte_cont_shift();
+
+	if (!vmap_allow_huge || debug_pagealloc_enabled())
+		return PAGE_SHIFT;
+
+	if (node == NUMA_NO_NODE)
+		size /= num_online_nodes();
+
+	if (IS_ENABLED(CONFIG_HAVE_ARCH_HUGE_VMAP) &&
+	    PMD_SHIFT - PAGE_SHIFT < MAX_ORDER && size >= PMD_SIZE)
+		return PMD_SHIFT;
+	if (cont_shift > PAGE_SHIFT && size >= (1UL << cont_shift))
+		return cont_shift;
+	return PAGE_SHIFT;
+}
+
 static void *__vmalloc_node(unsigned long size, unsigned long align,
 			    gfp_t gfp_mask, pgprot_t prot,
 			    int node, const void *caller);
@@ -1824,9 +2412,10 @@ static void *__vmalloc_area_node(struct vm_struct *area, gfp_t gfp_mask,
 				 pgprot_t prot, int node)
 {
 	struct page **pages;
-	unsigned int nr_pages, array_size, i;
+	unsigned int nr_pages, array_size, i, j;
+	const unsigned int page_order = area->page_order;
 	const gfp_t nested_gfp = (gfp_mask & GFP_RECLAIM_MASK) | __GFP_ZERO;
-	const gfp_t alloc_mask = gfp_mask | __GFP_NOWARN;
+	gfp_t alloc_mask = gfp_mask | __GFP_NOWARN;
 	const gfp_t highmem_mask = (gfp_mask & (GFP_DMA | GFP_DMA32)) ?
 					0 :
 					__GFP_HIGHMEM;
@@ -1877,20 +2466,25 @@ static void *__vmalloc_area_node(struct vm_struct *area, gfp_t gfp_mask,
 	 * 放到area->pages中。必须使用area->pages数组是因为:页框可能属于
 	 * ZONE_HIGHMEM内存管理区，此时它们不一定映射到一个线性地址上。
 	 */
-	for (i = 0; i < area->nr_pages; i++) {
+	/* 大块映射要的高阶页面分配不到就算了，调用者会退回到0阶页面 */
+	if (page_order)
+		alloc_mask |= __GFP_NORETRY;
+
+	for (i = 0; i < area->nr_pages; i += 1U << page_order) {
 		struct page *page;
 
 		/*
 		 * 如果显示指定了分配页帧的结点，则内核调用alloc_pages_node()。
-		 * 否则，使用alloc_page()从当前结点分配页帧。
+		 * 否则，使用alloc_pages()从当前结点分配页帧。
 		 */
 		if (node == NUMA_NO_NODE)
         /* 没有指定在哪个NUMA节点中分配页面 */
         /* 随便分配一个页面 */
-			page = alloc_page(alloc_mask|highmem_mask);
+			page = alloc_pages(alloc_mask|highmem_mask, page_order);
 		else
         /* 在指定NUMA节点中分配页面 */
-			page = alloc_pages_node(node, alloc_mask|highmem_mask, 0);
+			page = alloc_pages_node(node, alloc_mask|highmem_mask,
+						page_order);
 
 		if (unlikely(!page)) {
 /*
@@ -1901,8 +2495,15 @@ static void *__vmalloc_area_node(struct vm_struct *area, gfp_t gfp_mask,
 			area->nr_pages = i;
 			goto fail;
 		}
+		/*
+		 * 高阶页面拆成独立的0阶页面，这样释放、vmalloc_to_page()
+		 * 和remap_vmalloc_range()都可以照旧按单个页面处理
+		 */
+		if (page_order)
+			split_page(page, page_order);
 		/* 记录下分配的页面描述符 */
-		area->pages[i] = page;
+		for (j = 0; j < (1U << page_order); j++)
+			area->pages[i + j] = page + j;
 		if (gfpflags_allow_blocking(gfp_mask|highmem_mask))
 			cond_resched();
 	}
@@ -1920,7 +2521,8 @@ static void *__vmalloc_area_node(struct vm_struct *area, gfp_t gfp_mask,
 	return area->addr;
 /* 分配物理内存失败，或者虚实映射失败 */
 fail:
-	warn_alloc(gfp_mask, NULL,
+	if (!page_order)
+		warn_alloc(gfp_mask, NULL,
 			  "vmalloc: allocation failure, allocated %ld of %ld bytes",
 			  (area->nr_pages*PAGE_SIZE), area->size);
     /* 释放已经分配的页面并解除虚实映射 */
@@ -1956,6 +2558,8 @@ void *__vmalloc_node_range(unsigned long size, unsigned long align,
 	struct vm_struct *area;
 	void *addr;
 	unsigned long real_size = size;
+	unsigned long real_align = align;
+	unsigned int shift = PAGE_SHIFT;
 
 /*
 vmalloc分配的大小必须是页面的整数倍，这里将长度对齐到页面
@@ -1966,6 +2570,14 @@ vmalloc分配的大小必须是页面的整数倍，这里将长度对齐到页
 */
 	if (!size || (size >> PAGE_SHIFT) > totalram_pages())
 		goto fail;
+
+	/* 允许大块映射时，长度和对齐都按映射粒度取整 */
+	if (vm_flags & VM_ALLOW_HUGE_VMAP) {
+		shift = vmap_huge_shift(size, node);
+		align = max(real_align, 1UL << shift);
+		size = ALIGN(size, 1UL << shift);
+	}
+again:
 /*
     在vmalloc地址区间中找到合适的区域，    这是通过遍历vmlist链表来实现的  
 */
@@ -1976,10 +2588,14 @@ vmalloc分配的大小必须是页面的整数倍，这里将长度对齐到页
 */
 	if (!area)
 		goto fail;
+	area->page_order = shift - PAGE_SHIFT;
     /* 这里分配物理页面，并进行pte页表项映射 */
 	addr = __vmalloc_area_node(area, gfp_mask, prot, node);
-	if (!addr)
+	if (!addr) {
+		if (shift > PAGE_SHIFT)
+			goto fallback;
 		return NULL;
+	}
 
 	/*
 	 * In this function, newly allocated vm_struct has VM_UNINITIALIZED
@@ -1999,11 +2615,38 @@ vmalloc分配的大小必须是页面的整数倍，这里将长度对齐到页
 	return addr;
 
 fail:
+	if (shift > PAGE_SHIFT)
+		goto fallback;
 	warn_alloc(gfp_mask, NULL,
 			  "vmalloc: allocation failure: %lu bytes", real_size);
 	return NULL;
+
+fallback:
+	/* 高阶页面或对齐的地址空间不够，退回到普通页面再试一次 */
+	shift = PAGE_SHIFT;
+	align = real_align;
+	size = PAGE_ALIGN(real_size);
+	goto again;
 }
 
+/**
+ *	vmalloc_huge  -  allocate virtually contiguous memory, allow huge pages
+ *	@size:		allocation size
+ *	@gfp_mask:	flags for the page level allocator
+ *
+ *	Like __vmalloc() with PAGE_KERNEL, but a large enough area is backed
+ *	by high order pages and mapped with PMD sized (or contiguous pte)
+ *	blocks, saving TLB entries.  The area must not be passed to
+ *	set_memory_*(), which cannot split those blocks.
+ */
+void *vmalloc_huge(unsigned long size, gfp_t gfp_mask)
+{
+	return __vmalloc_node_range(size, 1, VMALLOC_START, VMALLOC_END,
+				    gfp_mask, PAGE_KERNEL, VM_ALLOW_HUGE_VMAP,
+				    NUMA_NO_NODE, __builtin_return_address(0));
+}
+EXPORT_SYMBOL_GPL(vmalloc_huge);
+
 /**
  *	__vmalloc_node  -  allocate virtually contiguous memory
  *	@size:		allocation size
@@ -2637,81 +3280,61 @@ static struct vmap_area *node_to_va(struct rb_node *n)
 }
 
 /**
- * pvm_find_next_prev - find the next and prev vmap_area surrounding @end
- * @end: target address
- * @pnext: out arg for the next vmap_area
- * @pprev: out arg for the previous vmap_area
- *
- * Returns: %true if either or both of next and prev are found,
- *	    %false if no vmap_area exists
+ * pvm_find_va_enclose_addr - find the free range @addr belongs to
+ * @addr: target address
  *
- * Find vmap_areas end addresses of which enclose @end.  ie. if not
- * NULL, *pnext->va_end > @end and *pprev->va_end <= @end.
+ * Returns: the free vmap_area containing @addr, or failing that the
+ *	    highest one below @addr, or %NULL if there is none
  */
-static bool pvm_find_next_prev(unsigned long end,
-			       struct vmap_area **pnext,
-			       struct vmap_area **pprev)
+static struct vmap_area *pvm_find_va_enclose_addr(unsigned long addr)
 {
-	struct rb_node *n = vmap_area_root.rb_node;
-	struct vmap_area *va = NULL;
+	struct vmap_area *va, *tmp;
+	struct rb_node *n;
+
+	n = free_vmap_area_root.rb_node;
+	va = NULL;
 
 	while (n) {
-		va = rb_entry(n, struct vmap_area, rb_node);
-		if (end < va->va_end)
-			n = n->rb_left;
-		else if (end > va->va_end)
+		tmp = rb_entry(n, struct vmap_area, rb_node);
+		if (tmp->va_start <= addr) {
+			va = tmp;
+			if (tmp->va_end >= addr)
+				break;
+
 			n = n->rb_right;
-		else
-			break;
+		} else {
+			n = n->rb_left;
+		}
 	}
 
-	if (!va)
-		return false;
-
-	if (va->va_end > end) {
-		*pnext = va;
-		*pprev = node_to_va(rb_prev(&(*pnext)->rb_node));
-	} else {
-		*pprev = va;
-		*pnext = node_to_va(rb_next(&(*pprev)->rb_node));
-	}
-	return true;
+	return va;
 }
 
 /**
- * pvm_determine_end - find the highest aligned address between two vmap_areas
- * @pnext: in/out arg for the next vmap_area
- * @pprev: in/out arg for the previous vmap_area
+ * pvm_determine_end_from_reverse - find the highest aligned end address
+ * of a free range below VMALLOC_END
+ * @va: in - the free range to start from, walking down;
+ *	out - the free range the returned address belongs to
  * @align: alignment
  *
- * Returns: determined end address
- *
- * Find the highest aligned address between *@pnext and *@pprev below
- * VMALLOC_END.  *@pnext and *@pprev are adjusted so that the aligned
- * down address is between the end addresses of the two vmap_areas.
- *
- * Please note that the address returned by this function may fall
- * inside *@pnext vmap_area.  The caller is responsible for checking
- * that.
+ * Returns: determined end address, or 0 if there is none
  */
-static unsigned long pvm_determine_end(struct vmap_area **pnext,
-				       struct vmap_area **pprev,
-				       unsigned long align)
+static unsigned long pvm_determine_end_from_reverse(struct vmap_area **va,
+						    unsigned long align)
 {
-	const unsigned long vmalloc_end = VMALLOC_END & ~(align - 1);
+	unsigned long vmalloc_end = VMALLOC_END & ~(align - 1);
 	unsigned long addr;
 
-	if (*pnext)
-		addr = min((*pnext)->va_start & ~(align - 1), vmalloc_end);
-	else
-		addr = vmalloc_end;
-
-	while (*pprev && (*pprev)->va_end > addr) {
-		*pnext = *pprev;
-		*pprev = node_to_va(rb_prev(&(*pnext)->rb_node));
+	if (likely(*va)) {
+		list_for_each_entry_from_reverse((*va),
+				&free_vmap_area_list, list) {
+			addr = min((*va)->va_end & ~(align - 1), vmalloc_end);
+			if ((*va)->va_start < addr)
+				return addr;
+		}
 	}
 
-	return addr;
+	return 0;
 }
 
 /**
@@ -2732,11 +3355,11 @@ static unsigned long pvm_determine_end(struct vmap_area **pnext,
  * areas are allocated from top.
  *
  * Despite its complicated look, this allocator is rather simple.  It
- * does everything top-down and scans areas from the end looking for
- * matching slot.  While scanning, if any of the areas overlaps with
- * existing vmap_area, the base address is pulled down to fit the
- * area.  Scanning is repeated till all the areas fit and then all
- * necessary data structures are inserted and the result is returned.
+ * does everything top-down and scans the free ranges from the end
+ * looking for a matching slot.  While scanning, if any of the areas does
+ * not fit in the free range under it, the base address is pulled down
+ * to fit the area.  Scanning is repeated till all the areas fit and then
+ * they are carved out of the free tree and the result is returned.
  */
 struct vm_struct **pcpu_get_vm_areas(const unsigned long *offsets,
 				     const size_t *sizes, int nr_vms,
@@ -2744,10 +3367,10 @@ struct vm_struct **pcpu_get_vm_areas(const unsigned long *offsets,
 {
 	const unsigned long vmalloc_start = ALIGN(VMALLOC_START, align);
 	const unsigned long vmalloc_end = VMALLOC_END & ~(align - 1);
-	struct vmap_area **vas, *prev, *next;
+	struct vmap_area **vas, *va, *spare = NULL;
 	struct vm_struct **vms;
 	int area, area2, last_area, term_area;
-	unsigned long base, start, end, last_end;
+	unsigned long base, start, end, last_end, size;
 	bool purged = false;
 
 	/* verify parameters and allocate data structures */
@@ -2790,56 +3413,47 @@ struct vm_struct **pcpu_get_vm_areas(const unsigned long *offsets,
 			goto err_free;
 	}
 retry:
-	spin_lock(&vmap_area_lock);
+	spin_lock(&free_vmap_area_lock);
 
 	/* start scanning - we scan from the top, begin with the last area */
 	area = term_area = last_area;
 	start = offsets[area];
 	end = start + sizes[area];
 
-	if (!pvm_find_next_prev(vmap_area_pcpu_hole, &next, &prev)) {
-		base = vmalloc_end - last_end;
-		goto found;
-	}
-	base = pvm_determine_end(&next, &prev, align) - end;
+	va = pvm_find_va_enclose_addr(vmalloc_end);
+	base = pvm_determine_end_from_reverse(&va, align) - end;
 
 	while (true) {
-		BUG_ON(next && next->va_end <= base + end);
-		BUG_ON(prev && prev->va_end > base + end);
-
 		/*
 		 * base might have underflowed, add last_end before
 		 * comparing.
 		 */
-		if (base + last_end < vmalloc_start + last_end) {
-			spin_unlock(&vmap_area_lock);
-			if (!purged) {
-				purge_vmap_area_lazy();
-				purged = true;
-				goto retry;
-			}
-			goto err_free;
-		}
+		if (base + last_end < vmalloc_start + last_end)
+			goto overflow;
 
 		/*
-		 * If next overlaps, move base downwards so that it's
-		 * right below next and then recheck.
+		 * Fitting base has not been found.
 		 */
-		if (next && next->va_start < base + end) {
-			base = pvm_determine_end(&next, &prev, align) - end;
+		if (va == NULL)
+			goto overflow;
+
+		/*
+		 * If this area sticks out of the top of the free range,
+		 * move base downwards and then recheck.
+		 */
+		if (base + end > va->va_end) {
+			base = pvm_determine_end_from_reverse(&va, align) - end;
 			term_area = area;
 			continue;
 		}
 
 		/*
-		 * If prev overlaps, shift down next and prev and move
-		 * base so that it's right below new next and then
-		 * recheck.
+		 * If it starts below the free range, go down to the
+		 * previous free range and recheck.
 		 */
-		if (prev && prev->va_end > base + start)  {
-			next = prev;
-			prev = node_to_va(rb_prev(&next->rb_node));
-			base = pvm_determine_end(&next, &prev, align) - end;
+		if (base + start < va->va_start) {
+			va = node_to_va(rb_prev(&va->rb_node));
+			base = pvm_determine_end_from_reverse(&va, align) - end;
 			term_area = area;
 			continue;
 		}
@@ -2851,22 +3465,34 @@ retry:
 		area = (area + nr_vms - 1) % nr_vms;
 		if (area == term_area)
 			break;
+
 		start = offsets[area];
 		end = start + sizes[area];
-		pvm_find_next_prev(base + end, &next, &prev);
+		va = pvm_find_va_enclose_addr(base + end);
 	}
-found:
-	/* we've found a fitting base, insert all va's */
+
+	/* we've found a fitting base, carve all the areas out */
 	for (area = 0; area < nr_vms; area++) {
-		struct vmap_area *va = vas[area];
+		start = base + offsets[area];
+		size = sizes[area];
 
-		va->va_start = base + offsets[area];
-		va->va_end = va->va_start + sizes[area];
-		__insert_vmap_area(va);
+		va = pvm_find_va_enclose_addr(start);
+		/* It is a BUG(), but trigger recovery instead. */
+		if (WARN_ON_ONCE(va == NULL))
+			goto recovery;
+
+		if (adjust_va_to_fit(va, start, size, &spare))
+			goto recovery;
+
+		vas[area]->va_start = start;
+		vas[area]->va_end = start + size;
 	}
 
-	vmap_area_pcpu_hole = base + offsets[last_area];
+	spin_unlock(&free_vmap_area_lock);
 
+	spin_lock(&vmap_area_lock);
+	for (area = 0; area < nr_vms; area++)
+		__insert_vmap_area(vas[area]);
 	spin_unlock(&vmap_area_lock);
 
 	/* insert all vm's */
@@ -2875,8 +3501,36 @@ found:
 				 pcpu_get_vm_areas);
 
 	kfree(vas);
+	kfree(spare);
 	return vms;
 
+recovery:
+	/* Give back the areas carved so far. */
+	while (area--) {
+		merge_or_add_free_vmap_area(vas[area]);
+		vas[area] = NULL;
+	}
+
+overflow:
+	spin_unlock(&free_vmap_area_lock);
+	if (!purged) {
+		purge_vmap_area_lazy();
+		purged = true;
+
+		/* Before "retry", check if we recover. */
+		for (area = 0; area < nr_vms; area++) {
+			if (vas[area])
+				continue;
+
+			vas[area] = kzalloc(sizeof(struct vmap_area),
+					    GFP_KERNEL);
+			if (!vas[area])
+				goto err_free;
+		}
+
+		goto retry;
+	}
+
 err_free:
 	for (area = 0; area < nr_vms; area++) {
 		kfree(vas[area]);
@@ -2885,6 +3539,7 @@ err_free:
 err_free2:
 	kfree(vas);
 	kfree(vms);
+	kfree(spare);
 	return NULL;
 }
 
@@ -2979,6 +3634,10 @@ static int s_show(struct seq_file *m, void *p)
 	if (v->nr_pages)
 		seq_printf(m, " pages=%d", v->nr_pages);
 
+	if (v->page_order)
+		seq_printf(m, " pagesize=%luK",
+			   (PAGE_SIZE << v->page_order) >> 10);
+
 	if (v->phys_addr)
 		seq_printf(m, " phys=%pa", &v->phys_addr);
 
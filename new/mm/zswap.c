@@ -36,7 +36,8 @@
 #include <linux/types.h>
 #include <linux/atomic.h>
 #include <linux/frontswap.h>
-#include <linux/rbtree.h>
+#include <linux/radix-tree.h>
+#include <linux/rcupdate.h>
 #include <linux/swap.h>
 #include <linux/crypto.h>
 #include <linux/mempool.h>
@@ -47,6 +48,8 @@
 #include <linux/swapops.h>
 #include <linux/writeback.h>
 #include <linux/pagemap.h>
+#include <linux/shrinker.h>
+#include <linux/workqueue.h>
 
 /*********************************
 * statistics
@@ -69,6 +72,10 @@ static atomic_t zswap_same_filled_pages = ATOMIC_INIT(0);
 static u64 zswap_pool_limit_hit;
 /* Pages written back when pool limit was reached */
 static u64 zswap_written_back_pages;
+/* Pages written back by the background worker above the high watermark */
+static u64 zswap_proactive_written_back_pages;
+/* Pages written back by the memory shrinker */
+static u64 zswap_shrinker_written_back_pages;
 /* Store failed due to a reclaim failure after pool limit was reached */
 static u64 zswap_reject_reclaim_fail;
 /* Compressed page was too big for the allocator to (optimally) store */
@@ -80,6 +87,27 @@ static u64 zswap_reject_kmemcache_fail;
 /* Duplicate store was encountered (rare) */
 static u64 zswap_duplicate_entry;
 
+/*
+ * Tree statistics, bumped on every store/load from many CPUs at once, so
+ * they are kept per CPU and summed when read.
+ */
+enum zswap_tree_stat {
+	/* Tree lock acquisitions on the store/invalidate/writeback paths */
+	ZSWAP_TREE_LOCK_ACQUIRED,
+	/* Tree lock acquisitions that found the lock already held */
+	ZSWAP_TREE_LOCK_CONTENDED,
+	/* Lockless loads that raced with the final put of the entry */
+	ZSWAP_LOAD_LOOKUP_RACE,
+	ZSWAP_TREE_NR_STATS,
+};
+
+static DEFINE_PER_CPU(u64 [ZSWAP_TREE_NR_STATS], zswap_tree_stats);
+
+static inline void zswap_tree_stat_inc(enum zswap_tree_stat item)
+{
+	this_cpu_inc(zswap_tree_stats[item]);
+}
+
 /*********************************
 * tunables
 **********************************/
@@ -124,6 +152,19 @@ module_param_cb(zpool, &zswap_zpool_param_ops, &zswap_zpool_type, 0644);
 static unsigned int zswap_max_pool_percent = 20;
 module_param_named(max_pool_percent, zswap_max_pool_percent, uint, 0644);
 
+/*
+ * Once the pool grows past writeback_high_percent of its maximum size, the
+ * coldest entries are written back to the swap device in the background
+ * until it drops under writeback_low_percent, so stores rarely hit the
+ * hard limit.
+ */
+static unsigned int zswap_writeback_high_percent = 90;
+module_param_named(writeback_high_percent, zswap_writeback_high_percent,
+		   uint, 0644);
+static unsigned int zswap_writeback_low_percent = 80;
+module_param_named(writeback_low_percent, zswap_writeback_low_percent,
+		   uint, 0644);
+
 /* Enable/disable handling same-value filled pages (enabled by default) */
 static bool zswap_same_filled_pages_enabled = true;
 module_param_named(same_filled_pages_enabled, zswap_same_filled_pages_enabled,
@@ -149,14 +190,16 @@ struct zswap_pool {
  * This structure contains the metadata for tracking a single compressed
  * page within zswap.
  *
- * rbnode - links the entry into red-black tree for the appropriate swap type
- * offset - the swap offset for the entry.  Index into the red-black tree.
+ * rcu - frees the entry after a grace period, lockless loads may still
+ *       be looking at it after the final put
+ * lru - links the entry into the global LRU, coldest entry first
+ * type - the swap type of the entry, needed to write it back from the LRU
+ * offset - the swap offset for the entry.  Index into the radix tree.
  * refcount - the number of outstanding reference to the entry. This is needed
  *            to protect against premature freeing of the entry by code
- *            concurrent calls to load, invalidate, and writeback.  The lock
- *            for the zswap_tree structure that contains the entry must
- *            be held while changing the refcount.  Since the lock must
- *            be held, there is no reason to also make refcount atomic.
+ *            concurrent calls to load, invalidate, and writeback.  Loads
+ *            take their reference under rcu_read_lock() only, so it is
+ *            atomic and a zero count means the entry is already dead.
  * length - the length in bytes of the compressed page data.  Needed during
  *          decompression. For a same value filled page length is 0.
  * pool - the zswap_pool the entry's data is in
@@ -164,9 +207,11 @@ struct zswap_pool {
  * value - value of the same-value filled pages which have same content
  */
 struct zswap_entry {
-	struct rb_node rbnode;
+	struct rcu_head rcu;
+	struct list_head lru;
+	unsigned int type;
 	pgoff_t offset;
-	int refcount;
+	atomic_t refcount;
 	unsigned int length;
 	struct zswap_pool *pool;
 	union {
@@ -180,17 +225,63 @@ struct zswap_header {
 };
 
 /*
- * The tree lock in the zswap_tree struct protects a few things:
- * - the rbtree
- * - the refcount field of each entry in the tree
+ * Each swap type is split into ZSWAP_NR_TREES radix trees, selected by
+ * the swap cluster the offset falls in, so stores to different clusters
+ * (which is what different CPUs usually allocate from) do not serialize
+ * on one lock.
+ *
+ * The tree lock in the zswap_tree struct only serializes modification of
+ * the radix tree.  Lookups walk the tree under rcu_read_lock() and pin
+ * the entry with atomic_inc_not_zero() on its refcount.  An entry is
+ * always deleted from the tree before its initial reference is dropped.
  */
 struct zswap_tree {
-	struct rb_root rbroot;
+	struct radix_tree_root root;
 	spinlock_t lock;
 };
 
+#define ZSWAP_TREE_SHIFT	9	/* SWAPFILE_CLUSTER pages per shard step */
+#define ZSWAP_NR_TREES		16
+
 static struct zswap_tree *zswap_trees[MAX_SWAPFILES];
 
+static inline struct zswap_tree *zswap_tree_of(unsigned type, pgoff_t offset)
+{
+	struct zswap_tree *trees = zswap_trees[type];
+
+	if (!trees)
+		return NULL;
+	return &trees[(offset >> ZSWAP_TREE_SHIFT) & (ZSWAP_NR_TREES - 1)];
+}
+
+static inline void zswap_tree_lock(struct zswap_tree *tree)
+{
+	if (!spin_trylock(&tree->lock)) {
+		zswap_tree_stat_inc(ZSWAP_TREE_LOCK_CONTENDED);
+		spin_lock(&tree->lock);
+	}
+	zswap_tree_stat_inc(ZSWAP_TREE_LOCK_ACQUIRED);
+}
+
+static inline void zswap_tree_unlock(struct zswap_tree *tree)
+{
+	spin_unlock(&tree->lock);
+}
+
+/*
+ * All entries that are in a tree are also on zswap_lru, oldest store at
+ * the head.  An entry is added and removed under its tree lock, so being
+ * on the LRU implies the tree still holds the initial reference.
+ * Lock order: tree->lock, then zswap_lru_lock.
+ */
+static LIST_HEAD(zswap_lru);
+static DEFINE_SPINLOCK(zswap_lru_lock);
+static atomic_t zswap_lru_nr = ATOMIC_INIT(0);
+
+static struct workqueue_struct *zswap_writeback_wq;
+static void zswap_writeback_workfn(struct work_struct *work);
+static DECLARE_WORK(zswap_writeback_work, zswap_writeback_workfn);
+
 /* RCU-protected iteration */
 static LIST_HEAD(zswap_pools);
 /* protects zswap_pools list modification */
@@ -223,9 +314,20 @@ static const struct zpool_ops zswap_zpool_ops = {
 	.evict = zswap_writeback_entry
 };
 
+static unsigned long zswap_max_pool_pages(void)
+{
+	return totalram_pages() * zswap_max_pool_percent / 100;
+}
+
 static bool zswap_is_full(void)
 {
-	return totalram_pages() * zswap_max_pool_percent / 100 <
+	return zswap_max_pool_pages() <
+			DIV_ROUND_UP(zswap_pool_total_size, PAGE_SIZE);
+}
+
+static bool zswap_above_watermark(unsigned int percent)
+{
+	return zswap_max_pool_pages() * percent / 100 <
 			DIV_ROUND_UP(zswap_pool_total_size, PAGE_SIZE);
 }
 
@@ -266,8 +368,8 @@ static struct zswap_entry *zswap_entry_cache_alloc(gfp_t gfp)
 	entry = kmem_cache_alloc(zswap_entry_cache, gfp);
 	if (!entry)
 		return NULL;
-	entry->refcount = 1;
-	RB_CLEAR_NODE(&entry->rbnode);
+	atomic_set(&entry->refcount, 1);
+	INIT_LIST_HEAD(&entry->lru);
 	return entry;
 }
 
@@ -276,59 +378,62 @@ static void zswap_entry_cache_free(struct zswap_entry *entry)
 	kmem_cache_free(zswap_entry_cache, entry);
 }
 
+static void zswap_entry_free_rcu(struct rcu_head *head)
+{
+	zswap_entry_cache_free(container_of(head, struct zswap_entry, rcu));
+}
+
 /*********************************
-* rbtree functions
+* radix tree functions
 **********************************/
-static struct zswap_entry *zswap_rb_search(struct rb_root *root, pgoff_t offset)
+/* caller must hold rcu_read_lock() or the tree lock */
+static struct zswap_entry *zswap_tree_search(struct zswap_tree *tree,
+					     pgoff_t offset)
 {
-	struct rb_node *node = root->rb_node;
-	struct zswap_entry *entry;
-
-	while (node) {
-		entry = rb_entry(node, struct zswap_entry, rbnode);
-		if (entry->offset > offset)
-			node = node->rb_left;
-		else if (entry->offset < offset)
-			node = node->rb_right;
-		else
-			return entry;
-	}
-	return NULL;
+	return radix_tree_lookup(&tree->root, offset);
 }
 
 /*
  * In the case that a entry with the same offset is found, a pointer to
- * the existing entry is stored in dupentry and the function returns -EEXIST
+ * the existing entry is stored in dupentry and the function returns -EEXIST.
+ * Caller must hold the tree lock and have preloaded the radix tree.
  */
-static int zswap_rb_insert(struct rb_root *root, struct zswap_entry *entry,
-			struct zswap_entry **dupentry)
+static int zswap_tree_insert(struct zswap_tree *tree, struct zswap_entry *entry,
+			     struct zswap_entry **dupentry)
 {
-	struct rb_node **link = &root->rb_node, *parent = NULL;
-	struct zswap_entry *myentry;
-
-	while (*link) {
-		parent = *link;
-		myentry = rb_entry(parent, struct zswap_entry, rbnode);
-		if (myentry->offset > entry->offset)
-			link = &(*link)->rb_left;
-		else if (myentry->offset < entry->offset)
-			link = &(*link)->rb_right;
-		else {
-			*dupentry = myentry;
-			return -EEXIST;
-		}
-	}
-	rb_link_node(&entry->rbnode, parent, link);
-	rb_insert_color(&entry->rbnode, root);
-	return 0;
+	int ret;
+
+	ret = radix_tree_insert(&tree->root, entry->offset, entry);
+	if (ret == -EEXIST)
+		*dupentry = radix_tree_lookup(&tree->root, entry->offset);
+	return ret;
+}
+
+/* caller must hold the tree lock */
+static void zswap_lru_add(struct zswap_entry *entry)
+{
+	spin_lock(&zswap_lru_lock);
+	list_add_tail(&entry->lru, &zswap_lru);
+	spin_unlock(&zswap_lru_lock);
+	atomic_inc(&zswap_lru_nr);
 }
 
-static void zswap_rb_erase(struct rb_root *root, struct zswap_entry *entry)
+/* caller must hold the tree lock */
+static void zswap_lru_del(struct zswap_entry *entry)
 {
-	if (!RB_EMPTY_NODE(&entry->rbnode)) {
-		rb_erase(&entry->rbnode, root);
-		RB_CLEAR_NODE(&entry->rbnode);
+	spin_lock(&zswap_lru_lock);
+	if (!list_empty(&entry->lru)) {
+		list_del_init(&entry->lru);
+		atomic_dec(&zswap_lru_nr);
 	}
+	spin_unlock(&zswap_lru_lock);
+}
+
+/* caller must hold the tree lock */
+static void zswap_tree_erase(struct zswap_tree *tree, struct zswap_entry *entry)
+{
+	radix_tree_delete_item(&tree->root, entry->offset, entry);
+	zswap_lru_del(entry);
 }
 
 /*
@@ -343,41 +448,38 @@ static void zswap_free_entry(struct zswap_entry *entry)
 		zpool_free(entry->pool->zpool, entry->handle);
 		zswap_pool_put(entry->pool);
 	}
-	zswap_entry_cache_free(entry);
+	call_rcu(&entry->rcu, zswap_entry_free_rcu);
 	atomic_dec(&zswap_stored_pages);
 	zswap_update_total_size();
 }
 
-/* caller must hold the tree lock */
-static void zswap_entry_get(struct zswap_entry *entry)
-{
-	entry->refcount++;
-}
-
-/* caller must hold the tree lock
-* remove from the tree and free it, if nobody reference the entry
-*/
-static void zswap_entry_put(struct zswap_tree *tree,
-			struct zswap_entry *entry)
+/*
+ * free the entry if nobody references it anymore; the entry must
+ * already have been erased from its tree before the last put
+ */
+static void zswap_entry_put(struct zswap_entry *entry)
 {
-	int refcount = --entry->refcount;
+	int refcount = atomic_dec_return(&entry->refcount);
 
 	BUG_ON(refcount < 0);
-	if (refcount == 0) {
-		zswap_rb_erase(&tree->rbroot, entry);
+	if (refcount == 0)
 		zswap_free_entry(entry);
-	}
 }
 
-/* caller must hold the tree lock */
-static struct zswap_entry *zswap_entry_find_get(struct rb_root *root,
+/* lockless lookup, returns the entry with a reference held */
+static struct zswap_entry *zswap_entry_find_get(struct zswap_tree *tree,
 				pgoff_t offset)
 {
 	struct zswap_entry *entry;
 
-	entry = zswap_rb_search(root, offset);
-	if (entry)
-		zswap_entry_get(entry);
+	rcu_read_lock();
+	entry = zswap_tree_search(tree, offset);
+	if (entry && !atomic_inc_not_zero(&entry->refcount)) {
+		/* lost the race against the final put */
+		zswap_tree_stat_inc(ZSWAP_LOAD_LOOKUP_RACE);
+		entry = NULL;
+	}
+	rcu_read_unlock();
 
 	return entry;
 }
@@ -477,24 +579,6 @@ static struct zswap_pool *zswap_pool_current_get(void)
 	return pool;
 }
 
-static struct zswap_pool *zswap_pool_last_get(void)
-{
-	struct zswap_pool *pool, *last = NULL;
-
-	rcu_read_lock();
-
-	list_for_each_entry_rcu(pool, &zswap_pools, list)
-		last = pool;
-	WARN_ONCE(!last && zswap_has_pool,
-		  "%s: no page storage pool!\n", __func__);
-	if (!zswap_pool_get(last))
-		last = NULL;
-
-	rcu_read_unlock();
-
-	return last;
-}
-
 /* type and compressor must be null-terminated */
 static struct zswap_pool *zswap_pool_find_get(char *type, char *compressor)
 {
@@ -840,6 +924,8 @@ static int zswap_get_swap_cache_page(swp_entry_t entry,
 	return ZSWAP_SWAPCACHE_EXIST;
 }
 
+static void zswap_fill_page(void *ptr, unsigned long value);
+
 /*
  * Attempts to free an entry by adding a page to the swap cache,
  * decompressing the entry data into the page, and issuing a
@@ -851,14 +937,13 @@ static int zswap_get_swap_cache_page(swp_entry_t entry,
  * in the first place.  After the page has been decompressed into
  * the swap cache, the compressed version stored by zswap can be
  * freed.
+ *
+ * The caller must hold a reference on entry, which is dropped here.
  */
-static int zswap_writeback_entry(struct zpool *pool, unsigned long handle)
+static int __zswap_writeback_entry(struct zswap_tree *tree,
+				   struct zswap_entry *entry)
 {
-	struct zswap_header *zhdr;
-	swp_entry_t swpentry;
-	struct zswap_tree *tree;
-	pgoff_t offset;
-	struct zswap_entry *entry;
+	swp_entry_t swpentry = swp_entry(entry->type, entry->offset);
 	struct page *page;
 	struct crypto_comp *tfm;
 	u8 *src, *dst;
@@ -868,24 +953,6 @@ static int zswap_writeback_entry(struct zpool *pool, unsigned long handle)
 		.sync_mode = WB_SYNC_NONE,
 	};
 
-	/* extract swpentry from data */
-	zhdr = zpool_map_handle(pool, handle, ZPOOL_MM_RO);
-	swpentry = zhdr->swpentry; /* here */
-	zpool_unmap_handle(pool, handle);
-	tree = zswap_trees[swp_type(swpentry)];
-	offset = swp_offset(swpentry);
-
-	/* find and ref zswap entry */
-	spin_lock(&tree->lock);
-	entry = zswap_entry_find_get(&tree->rbroot, offset);
-	if (!entry) {
-		/* entry was invalidated */
-		spin_unlock(&tree->lock);
-		return 0;
-	}
-	spin_unlock(&tree->lock);
-	BUG_ON(offset != entry->offset);
-
 	/* try to allocate swap cache page */
 	switch (zswap_get_swap_cache_page(swpentry, &page)) {
 	case ZSWAP_SWAPCACHE_FAIL: /* no memory or invalidate happened */
@@ -899,19 +966,28 @@ static int zswap_writeback_entry(struct zpool *pool, unsigned long handle)
 		goto fail;
 
 	case ZSWAP_SWAPCACHE_NEW: /* page is locked */
-		/* decompress */
-		dlen = PAGE_SIZE;
-		src = (u8 *)zpool_map_handle(entry->pool->zpool, entry->handle,
-				ZPOOL_MM_RO) + sizeof(struct zswap_header);
-		dst = kmap_atomic(page);
-		tfm = *get_cpu_ptr(entry->pool->tfm);
-		ret = crypto_comp_decompress(tfm, src, entry->length,
-					     dst, &dlen);
-		put_cpu_ptr(entry->pool->tfm);
-		kunmap_atomic(dst);
-		zpool_unmap_handle(entry->pool->zpool, entry->handle);
-		BUG_ON(ret);
-		BUG_ON(dlen != PAGE_SIZE);
+		if (!entry->length) {
+			dst = kmap_atomic(page);
+			zswap_fill_page(dst, entry->value);
+			kunmap_atomic(dst);
+			ret = 0;
+		} else {
+			/* decompress */
+			dlen = PAGE_SIZE;
+			src = zpool_map_handle(entry->pool->zpool,
+					       entry->handle, ZPOOL_MM_RO);
+			if (zpool_evictable(entry->pool->zpool))
+				src += sizeof(struct zswap_header);
+			dst = kmap_atomic(page);
+			tfm = *get_cpu_ptr(entry->pool->tfm);
+			ret = crypto_comp_decompress(tfm, src, entry->length,
+						     dst, &dlen);
+			put_cpu_ptr(entry->pool->tfm);
+			kunmap_atomic(dst);
+			zpool_unmap_handle(entry->pool->zpool, entry->handle);
+			BUG_ON(ret);
+			BUG_ON(dlen != PAGE_SIZE);
+		}
 
 		/* page is up to date */
 		SetPageUptodate(page);
@@ -925,20 +1001,22 @@ static int zswap_writeback_entry(struct zpool *pool, unsigned long handle)
 	put_page(page);
 	zswap_written_back_pages++;
 
-	spin_lock(&tree->lock);
-	/* drop local reference */
-	zswap_entry_put(tree, entry);
-
 	/*
 	* There are two possible situations for entry here:
-	* (1) refcount is 1(normal case),  entry is valid and on the tree
-	* (2) refcount is 0, entry is freed and not on the tree
-	*     because invalidate happened during writeback
-	*  search the tree and free the entry if find entry
+	* (1) entry is valid and on the tree(normal case), erase it and
+	*     drop the initial reference along with our local one
+	* (2) entry is not on the tree because invalidate happened during
+	*     writeback, only our local reference is left
 	*/
-	if (entry == zswap_rb_search(&tree->rbroot, offset))
-		zswap_entry_put(tree, entry);
-	spin_unlock(&tree->lock);
+	zswap_tree_lock(tree);
+	if (entry == zswap_tree_search(tree, entry->offset)) {
+		zswap_tree_erase(tree, entry);
+		zswap_entry_put(entry);
+	}
+	zswap_tree_unlock(tree);
+
+	/* drop local reference */
+	zswap_entry_put(entry);
 
 	goto end;
 
@@ -950,30 +1028,121 @@ static int zswap_writeback_entry(struct zpool *pool, unsigned long handle)
 	* it it either okay to return !0
 	*/
 fail:
-	spin_lock(&tree->lock);
-	zswap_entry_put(tree, entry);
-	spin_unlock(&tree->lock);
+	zswap_entry_put(entry);
 
 end:
 	return ret;
 }
 
-static int zswap_shrink(void)
+/* zpool evict callback, finds the entry from the header in front of data */
+static int zswap_writeback_entry(struct zpool *pool, unsigned long handle)
 {
-	struct zswap_pool *pool;
-	int ret;
+	struct zswap_header *zhdr;
+	swp_entry_t swpentry;
+	struct zswap_tree *tree;
+	pgoff_t offset;
+	struct zswap_entry *entry;
 
-	pool = zswap_pool_last_get();
-	if (!pool)
+	/* extract swpentry from data */
+	zhdr = zpool_map_handle(pool, handle, ZPOOL_MM_RO);
+	swpentry = zhdr->swpentry; /* here */
+	zpool_unmap_handle(pool, handle);
+	offset = swp_offset(swpentry);
+	tree = zswap_tree_of(swp_type(swpentry), offset);
+
+	/* find and ref zswap entry */
+	entry = zswap_entry_find_get(tree, offset);
+	if (!entry) {
+		/* entry was invalidated */
+		return 0;
+	}
+	BUG_ON(offset != entry->offset);
+
+	return __zswap_writeback_entry(tree, entry);
+}
+
+/*
+ * Write back the coldest entry on the LRU.  The entry is rotated to the
+ * tail while it is being written, so concurrent callers pick different
+ * entries.
+ */
+static int zswap_writeback_lru_one(void)
+{
+	struct zswap_entry *entry;
+
+	spin_lock(&zswap_lru_lock);
+	entry = list_first_entry_or_null(&zswap_lru, struct zswap_entry, lru);
+	if (!entry) {
+		spin_unlock(&zswap_lru_lock);
 		return -ENOENT;
+	}
+	/* on the LRU means the tree still holds its reference */
+	atomic_inc(&entry->refcount);
+	list_move_tail(&entry->lru, &zswap_lru);
+	spin_unlock(&zswap_lru_lock);
 
-	ret = zpool_shrink(pool->zpool, 1, NULL);
+	return __zswap_writeback_entry(zswap_tree_of(entry->type,
+						     entry->offset), entry);
+}
 
-	zswap_pool_put(pool);
+/* reclaim space by writing back the coldest entry */
+static int zswap_shrink(void)
+{
+	return zswap_writeback_lru_one();
+}
 
-	return ret;
+/*
+ * Proactive writeback: runs once the pool crosses the high watermark and
+ * stops at the low one.  Entries that fail to write back (page busy in
+ * the swap cache, no memory) were rotated, so give up after one lap.
+ */
+static void zswap_writeback_workfn(struct work_struct *work)
+{
+	int failures = 0;
+
+	while (zswap_above_watermark(zswap_writeback_low_percent)) {
+		if (zswap_writeback_lru_one()) {
+			if (++failures > atomic_read(&zswap_lru_nr))
+				break;
+		} else
+			zswap_proactive_written_back_pages++;
+		cond_resched();
+	}
+}
+
+static unsigned long zswap_shrinker_count(struct shrinker *shrinker,
+					  struct shrink_control *sc)
+{
+	if (!zswap_enabled)
+		return 0;
+	return atomic_read(&zswap_lru_nr);
 }
 
+static unsigned long zswap_shrinker_scan(struct shrinker *shrinker,
+					 struct shrink_control *sc)
+{
+	unsigned long freed = 0;
+
+	/* writeback needs to allocate a page and issue swap io */
+	if (!(sc->gfp_mask & __GFP_IO))
+		return SHRINK_STOP;
+
+	while (freed < sc->nr_to_scan) {
+		if (zswap_writeback_lru_one())
+			break;
+		freed++;
+	}
+	zswap_shrinker_written_back_pages += freed;
+
+	return freed ? freed : SHRINK_STOP;
+}
+
+static struct shrinker zswap_shrinker = {
+	.count_objects = zswap_shrinker_count,
+	.scan_objects = zswap_shrinker_scan,
+	.seeks = DEFAULT_SEEKS,
+};
+
 static int zswap_is_page_same_filled(void *ptr, unsigned long *value)
 {
 	unsigned int pos;
@@ -1003,7 +1172,7 @@ static void zswap_fill_page(void *ptr, unsigned long value)
 static int zswap_frontswap_store(unsigned type, pgoff_t offset,
 				struct page *page)
 {
-	struct zswap_tree *tree = zswap_trees[type];
+	struct zswap_tree *tree = zswap_tree_of(type, offset);
 	struct zswap_entry *entry, *dupentry;
 	struct crypto_comp *tfm;
 	int ret;
@@ -1055,6 +1224,7 @@ static int zswap_frontswap_store(unsigned type, pgoff_t offset,
 		src = kmap_atomic(page);
 		if (zswap_is_page_same_filled(src, &value)) {
 			kunmap_atomic(src);
+			entry->type = type;
 			entry->offset = offset;
 			entry->length = 0;
 			entry->value = value;
@@ -1103,30 +1273,50 @@ static int zswap_frontswap_store(unsigned type, pgoff_t offset,
 	put_cpu_var(zswap_dstmem);
 
 	/* populate entry */
+	entry->type = type;
 	entry->offset = offset;
 	entry->handle = handle;
 	entry->length = dlen;
 
 insert_entry:
 	/* map */
-	spin_lock(&tree->lock);
+	if (radix_tree_preload(GFP_KERNEL)) {
+		zswap_reject_kmemcache_fail++;
+		ret = -ENOMEM;
+		goto freedata;
+	}
+	zswap_tree_lock(tree);
 	do {
-		ret = zswap_rb_insert(&tree->rbroot, entry, &dupentry);
+		ret = zswap_tree_insert(tree, entry, &dupentry);
 		if (ret == -EEXIST) {
 			zswap_duplicate_entry++;
-			/* remove from rbtree */
-			zswap_rb_erase(&tree->rbroot, dupentry);
-			zswap_entry_put(tree, dupentry);
+			/* remove from radix tree */
+			zswap_tree_erase(tree, dupentry);
+			zswap_entry_put(dupentry);
 		}
 	} while (ret == -EEXIST);
-	spin_unlock(&tree->lock);
+	zswap_lru_add(entry);
+	zswap_tree_unlock(tree);
+	radix_tree_preload_end();
 
 	/* update stats */
 	atomic_inc(&zswap_stored_pages);
 	zswap_update_total_size();
 
+	/* start writing back cold entries before the pool fills up */
+	if (zswap_above_watermark(zswap_writeback_high_percent))
+		queue_work(zswap_writeback_wq, &zswap_writeback_work);
+
 	return 0;
 
+freedata:
+	if (!entry->length) {
+		atomic_dec(&zswap_same_filled_pages);
+		goto freepage;
+	}
+	zpool_free(entry->pool->zpool, entry->handle);
+	zswap_pool_put(entry->pool);
+	goto freepage;
 put_dstmem:
 	put_cpu_var(zswap_dstmem);
 	zswap_pool_put(entry->pool);
@@ -1143,22 +1333,19 @@ reject:
 static int zswap_frontswap_load(unsigned type, pgoff_t offset,
 				struct page *page)
 {
-	struct zswap_tree *tree = zswap_trees[type];
+	struct zswap_tree *tree = zswap_tree_of(type, offset);
 	struct zswap_entry *entry;
 	struct crypto_comp *tfm;
 	u8 *src, *dst;
 	unsigned int dlen;
 	int ret;
 
-	/* find */
-	spin_lock(&tree->lock);
-	entry = zswap_entry_find_get(&tree->rbroot, offset);
+	/* find, without taking the tree lock */
+	entry = zswap_entry_find_get(tree, offset);
 	if (!entry) {
 		/* entry was written back */
-		spin_unlock(&tree->lock);
 		return -1;
 	}
-	spin_unlock(&tree->lock);
 
 	if (!entry->length) {
 		dst = kmap_atomic(page);
@@ -1181,9 +1368,7 @@ static int zswap_frontswap_load(unsigned type, pgoff_t offset,
 	BUG_ON(ret);
 
 freeentry:
-	spin_lock(&tree->lock);
-	zswap_entry_put(tree, entry);
-	spin_unlock(&tree->lock);
+	zswap_entry_put(entry);
 
 	return 0;
 }
@@ -1191,59 +1376,74 @@ freeentry:
 /* frees an entry in zswap */
 static void zswap_frontswap_invalidate_page(unsigned type, pgoff_t offset)
 {
-	struct zswap_tree *tree = zswap_trees[type];
+	struct zswap_tree *tree = zswap_tree_of(type, offset);
 	struct zswap_entry *entry;
 
 	/* find */
-	spin_lock(&tree->lock);
-	entry = zswap_rb_search(&tree->rbroot, offset);
+	zswap_tree_lock(tree);
+	entry = zswap_tree_search(tree, offset);
 	if (!entry) {
 		/* entry was written back */
-		spin_unlock(&tree->lock);
+		zswap_tree_unlock(tree);
 		return;
 	}
 
-	/* remove from rbtree */
-	zswap_rb_erase(&tree->rbroot, entry);
+	/* remove from radix tree */
+	zswap_tree_erase(tree, entry);
 
-	/* drop the initial reference from entry creation */
-	zswap_entry_put(tree, entry);
+	zswap_tree_unlock(tree);
 
-	spin_unlock(&tree->lock);
+	/* drop the initial reference from entry creation */
+	zswap_entry_put(entry);
 }
 
 /* frees all zswap entries for the given swap type */
 static void zswap_frontswap_invalidate_area(unsigned type)
 {
-	struct zswap_tree *tree = zswap_trees[type];
-	struct zswap_entry *entry, *n;
+	struct zswap_tree *trees = zswap_trees[type], *tree;
+	struct zswap_entry *entry;
+	struct radix_tree_iter iter;
+	void __rcu **slot;
+	int i;
 
-	if (!tree)
+	if (!trees)
 		return;
 
-	/* walk the tree and free everything */
-	spin_lock(&tree->lock);
-	rbtree_postorder_for_each_entry_safe(entry, n, &tree->rbroot, rbnode)
-		zswap_free_entry(entry);
-	tree->rbroot = RB_ROOT;
-	spin_unlock(&tree->lock);
-	kfree(tree);
+	/* walk the trees and free everything */
+	for (i = 0; i < ZSWAP_NR_TREES; i++) {
+		tree = &trees[i];
+		zswap_tree_lock(tree);
+		radix_tree_for_each_slot(slot, &tree->root, &iter, 0) {
+			entry = radix_tree_deref_slot_protected(slot,
+								&tree->lock);
+			radix_tree_iter_delete(&tree->root, &iter, slot);
+			zswap_lru_del(entry);
+			zswap_free_entry(entry);
+		}
+		zswap_tree_unlock(tree);
+	}
 	zswap_trees[type] = NULL;
+	/* lockless lookups may still be walking the trees */
+	synchronize_rcu();
+	kfree(trees);
 }
 
 static void zswap_frontswap_init(unsigned type)
 {
-	struct zswap_tree *tree;
+	struct zswap_tree *trees;
+	int i;
 
-	tree = kzalloc(sizeof(*tree), GFP_KERNEL);
-	if (!tree) {
+	trees = kcalloc(ZSWAP_NR_TREES, sizeof(*trees), GFP_KERNEL);
+	if (!trees) {
 		pr_err("alloc failed, zswap disabled for swap type %d\n", type);
 		return;
 	}
 
-	tree->rbroot = RB_ROOT;
-	spin_lock_init(&tree->lock);
-	zswap_trees[type] = tree;
+	for (i = 0; i < ZSWAP_NR_TREES; i++) {
+		INIT_RADIX_TREE(&trees[i].root, GFP_ATOMIC);
+		spin_lock_init(&trees[i].lock);
+	}
+	zswap_trees[type] = trees;
 }
 
 static struct frontswap_ops zswap_frontswap_ops = {
@@ -1262,8 +1462,30 @@ static struct frontswap_ops zswap_frontswap_ops = {
 
 static struct dentry *zswap_debugfs_root;
 
+static int zswap_tree_stat_get(void *data, u64 *val)
+{
+	enum zswap_tree_stat item = (unsigned long)data;
+	u64 sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += per_cpu(zswap_tree_stats, cpu)[item];
+	*val = sum;
+	return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(zswap_tree_stat_fops, zswap_tree_stat_get, NULL,
+			 "%llu\n");
+
+static const char * const zswap_tree_stat_names[ZSWAP_TREE_NR_STATS] = {
+	[ZSWAP_TREE_LOCK_ACQUIRED]	= "tree_lock_acquired",
+	[ZSWAP_TREE_LOCK_CONTENDED]	= "tree_lock_contended",
+	[ZSWAP_LOAD_LOOKUP_RACE]	= "load_lookup_race",
+};
+
 static int __init zswap_debugfs_init(void)
 {
+	int i;
+
 	if (!debugfs_initialized())
 		return -ENODEV;
 
@@ -1283,8 +1505,20 @@ static int __init zswap_debugfs_init(void)
 			   zswap_debugfs_root, &zswap_reject_compress_poor);
 	debugfs_create_u64("written_back_pages", 0444,
 			   zswap_debugfs_root, &zswap_written_back_pages);
+	debugfs_create_u64("proactive_written_back_pages", 0444,
+			   zswap_debugfs_root,
+			   &zswap_proactive_written_back_pages);
+	debugfs_create_u64("shrinker_written_back_pages", 0444,
+			   zswap_debugfs_root, &zswap_shrinker_written_back_pages);
+	debugfs_create_atomic_t("lru_pages", 0444,
+				zswap_debugfs_root, &zswap_lru_nr);
 	debugfs_create_u64("duplicate_entry", 0444,
 			   zswap_debugfs_root, &zswap_duplicate_entry);
+	for (i = 0; i < ZSWAP_TREE_NR_STATS; i++)
+		debugfs_create_file_unsafe(zswap_tree_stat_names[i], 0444,
+					   zswap_debugfs_root,
+					   (void *)(unsigned long)i,
+					   &zswap_tree_stat_fops);
 	debugfs_create_u64("pool_total_size", 0444,
 			   zswap_debugfs_root, &zswap_pool_total_size);
 	debugfs_create_atomic_t("stored_pages", 0444,
@@ -1337,6 +1571,14 @@ static int __init init_zswap(void)
 	if (ret)
 		goto hp_fail;
 
+	zswap_writeback_wq = alloc_workqueue("zswap-writeback",
+					     WQ_UNBOUND | WQ_MEM_RECLAIM, 1);
+	if (!zswap_writeback_wq)
+		goto wq_fail;
+
+	if (register_shrinker(&zswap_shrinker))
+		goto shrinker_fail;
+
 	pool = __zswap_pool_create_fallback();
 	if (pool) {
 		pr_info("loaded using pool %s/%s\n", pool->tfm_name,
@@ -1353,6 +1595,10 @@ static int __init init_zswap(void)
 		pr_warn("debugfs initialization failed\n");
 	return 0;
 
+shrinker_fail:
+	destroy_workqueue(zswap_writeback_wq);
+wq_fail:
+	cpuhp_remove_state_multi(CPUHP_MM_ZSWP_POOL_PREPARE);
 hp_fail:
 	cpuhp_remove_state(CPUHP_MM_ZSWP_MEM_PREPARE);
 dstmem_fail: